@@ -37,154 +37,194 @@
 #ifdef INCLUDE_CMD_ATTRIB
 
 
-static VOID
-PrintAttribute (LPTSTR pszPath, LPTSTR pszFile, BOOL bRecurse)
+/* Output is collected in a buffer this big and written once per directory */
+#define ATTRIB_BUFFER_SIZE 8192
+
+typedef struct _ATTRIB_WALK
 {
-	WIN32_FIND_DATA findData;
-	HANDLE hFind;
-	TCHAR  szFullName[MAX_PATH];
-	LPTSTR pszFileName;
+	LPTSTR pszFile;			/* Name or wildcard to look for */
+	DWORD  dwMask;			/* Attributes to change, 0 to display them */
+	DWORD  dwAttrib;
+	BOOL   bRecurse;
+	BOOL   bDirectories;
+	BOOL   bFound;
+	DWORD  dwUsed;
+	TCHAR  szOut[ATTRIB_BUFFER_SIZE];
+} ATTRIB_WALK, *PATTRIB_WALK;
 
-	/* prepare full file name buffer */
-	_tcscpy (szFullName, pszPath);
-	pszFileName = szFullName + _tcslen (szFullName);
 
-	/* display all subdirectories */
-	if (bRecurse)
+static VOID
+AttribFlush (PATTRIB_WALK Walk)
+{
+	if (Walk->dwUsed > 0)
 	{
-		/* append file name */
-		_tcscpy (pszFileName, pszFile);
-
-		hFind = FindFirstFile (szFullName, &findData);
-		if (hFind == INVALID_HANDLE_VALUE)
-		{
-			ErrorMessage (GetLastError (), pszFile);
-			return;
-		}
-
-		do
-		{
-			if (!(findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
-				continue;
-
-			if (!_tcscmp (findData.cFileName, _T(".")) ||
-				!_tcscmp (findData.cFileName, _T("..")))
-				continue;
-
-			_tcscpy (pszFileName, findData.cFileName);
-			_tcscat (pszFileName, _T("\\"));
-			PrintAttribute (szFullName, pszFile, bRecurse);
-		}
-		while (FindNextFile (hFind, &findData));
-		FindClose (hFind);
+		ConOutWrite (Walk->szOut, Walk->dwUsed);
+		Walk->dwUsed = 0;
 	}
+}
 
-	/* append file name */
-	_tcscpy (pszFileName, pszFile);
 
-	/* display current directory */
-	hFind = FindFirstFile (szFullName, &findData);
-	if (hFind == INVALID_HANDLE_VALUE)
+static VOID
+AttribEntry (PATTRIB_WALK Walk, LPTSTR pszFullName, DWORD dwAttribute)
+{
+	DWORD dwNew;
+
+	if (Walk->dwMask == 0)
 	{
-		ErrorMessage (GetLastError (), pszFile);
+		if (Walk->dwUsed + _tcslen (pszFullName) + 16 > ATTRIB_BUFFER_SIZE)
+			AttribFlush (Walk);
+
+		Walk->dwUsed += _stprintf (&Walk->szOut[Walk->dwUsed], _T("%c  %c%c%c     %s\n"),
+		                           (dwAttribute & FILE_ATTRIBUTE_ARCHIVE) ? _T('A') : _T(' '),
+		                           (dwAttribute & FILE_ATTRIBUTE_SYSTEM) ? _T('S') : _T(' '),
+		                           (dwAttribute & FILE_ATTRIBUTE_HIDDEN) ? _T('H') : _T(' '),
+		                           (dwAttribute & FILE_ATTRIBUTE_READONLY) ? _T('R') : _T(' '),
+		                           pszFullName);
 		return;
 	}
 
-	do
-	{
-		if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-			continue;
-
-		_tcscpy (pszFileName, findData.cFileName);
+	/* The directory listing has the attributes already; leave alone
+	   whatever would not change */
+	dwAttribute &= ~FILE_ATTRIBUTE_NORMAL;
+	dwNew = (dwAttribute & ~Walk->dwMask) | Walk->dwAttrib;
+	if (dwNew == dwAttribute)
+		return;
 
-		ConOutPrintf (_T("%c  %c%c%c     %s\n"),
-		              (findData.dwFileAttributes & FILE_ATTRIBUTE_ARCHIVE) ? _T('A') : _T(' '),
-		              (findData.dwFileAttributes & FILE_ATTRIBUTE_SYSTEM) ? _T('S') : _T(' '),
-		              (findData.dwFileAttributes & FILE_ATTRIBUTE_HIDDEN) ? _T('H') : _T(' '),
-		              (findData.dwFileAttributes & FILE_ATTRIBUTE_READONLY) ? _T('R') : _T(' '),
-		              szFullName);
+	if (!SetFileAttributes (pszFullName, dwNew ? dwNew : FILE_ATTRIBUTE_NORMAL))
+	{
+		AttribFlush (Walk);
+		ErrorMessage (GetLastError (), _T("%s"), pszFullName);
+		nErrorLevel = 1;
 	}
-	while (FindNextFile (hFind, &findData));
-	FindClose (hFind);
 }
 
 
+/*
+ * Handles one directory and, with /S, everything below it. When
+ * recursing, the directory is listed once and names are matched here;
+ * its own files come first, then each subdirectory in turn.
+ */
 static VOID
-ChangeAttribute (LPTSTR pszPath, LPTSTR pszFile, DWORD dwMask,
-		 DWORD dwAttrib, BOOL bRecurse, BOOL bDirectories)
+AttribWalk (PATTRIB_WALK Walk, LPTSTR pszPath)
 {
 	WIN32_FIND_DATA findData;
 	HANDLE hFind;
-	DWORD  dwAttribute;
 	TCHAR  szFullName[MAX_PATH];
 	LPTSTR pszFileName;
-
+	LPTSTR pszDirs = NULL;	/* Subdirectories, one after the other */
+	LPTSTR pszNew;
+	SIZE_T cchDirs = 0;
+	SIZE_T cchAlloc = 0;
+	SIZE_T cchPath;
+	SIZE_T cch;
+	LPTSTR p;
 
 	/* prepare full file name buffer */
 	_tcscpy (szFullName, pszPath);
-	pszFileName = szFullName + _tcslen (szFullName);
+	cchPath = _tcslen (szFullName);
+	pszFileName = szFullName + cchPath;
 
-	/* change all subdirectories */
-	if (bRecurse)
+	_tcscpy (pszFileName, Walk->bRecurse ? _T("*") : Walk->pszFile);
+	hFind = FindFirstFile (szFullName, &findData);
+	if (hFind == INVALID_HANDLE_VALUE)
 	{
-		/* append file name */
-		_tcscpy (pszFileName, _T("*.*"));
-
-		hFind = FindFirstFile (szFullName, &findData);
-		if (hFind == INVALID_HANDLE_VALUE)
+		if (GetLastError () != ERROR_FILE_NOT_FOUND)
 		{
-			ErrorMessage (GetLastError (), pszFile);
-      nErrorLevel = 1;
-			return;
+			ErrorMessage (GetLastError (), _T("%s"), pszPath);
+			nErrorLevel = 1;
 		}
+		return;
+	}
 
-		do
-		{
-			if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-			{
-				if (!_tcscmp (findData.cFileName, _T(".")) ||
-				    !_tcscmp (findData.cFileName, _T("..")))
-					continue;
+	do
+	{
+		cch = _tcslen (findData.cFileName);
+		if (cchPath + cch + 2 > MAX_PATH)
+			continue;
 
-				_tcscpy (pszFileName, findData.cFileName);
-				_tcscat (pszFileName, _T("\\"));
+		if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+		{
+			if (!_tcscmp (findData.cFileName, _T(".")) ||
+			    !_tcscmp (findData.cFileName, _T("..")))
+				continue;
 
-				ChangeAttribute (szFullName, pszFile, dwMask,
-								 dwAttrib, bRecurse, bDirectories);
+			if (Walk->bRecurse)
+			{
+				if (cchDirs + cch + 1 > cchAlloc)
+				{
+					cchAlloc = max (cchAlloc * 2, cchDirs + cch + 1 + MAX_PATH);
+					pszNew = cmd_realloc (pszDirs, cchAlloc * sizeof(TCHAR));
+					if (pszNew == NULL)
+					{
+						error_out_of_memory ();
+						break;
+					}
+					pszDirs = pszNew;
+				}
+				_tcscpy (&pszDirs[cchDirs], findData.cFileName);
+				cchDirs += cch + 1;
 			}
+
+			if (!Walk->bDirectories)
+				continue;
 		}
-		while (FindNextFile (hFind, &findData));
-		FindClose (hFind);
-	}
 
-	/* append file name */
-	_tcscpy (pszFileName, pszFile);
+		if (Walk->bRecurse &&
+		    !MatchWildcard (Walk->pszFile, findData.cFileName, cch) &&
+		    !(findData.cAlternateFileName[0] &&
+		      MatchWildcard (Walk->pszFile, findData.cAlternateFileName,
+		                     _tcslen (findData.cAlternateFileName))))
+			continue;
 
-	hFind = FindFirstFile (szFullName, &findData);
-	if (hFind == INVALID_HANDLE_VALUE)
+		Walk->bFound = TRUE;
+		_tcscpy (pszFileName, findData.cFileName);
+		AttribEntry (Walk, szFullName, findData.dwFileAttributes);
+	}
+	while (FindNextFile (hFind, &findData));
+	FindClose (hFind);
+	AttribFlush (Walk);
+
+	for (p = pszDirs; p != NULL && p < pszDirs + cchDirs && !bCtrlBreak; p += _tcslen (p) + 1)
 	{
-		ErrorMessage (GetLastError (), pszFile);
-    nErrorLevel = 1;
-		return;
+		_tcscpy (pszFileName, p);
+		_tcscat (pszFileName, _T("\\"));
+		AttribWalk (Walk, szFullName);
 	}
 
-	do
+	if (pszDirs != NULL)
+		cmd_free (pszDirs);
+}
+
+
+static VOID
+ProcessAttrib (LPTSTR pszPath, LPTSTR pszFile, DWORD dwMask,
+               DWORD dwAttrib, BOOL bRecurse, BOOL bDirectories)
+{
+	PATTRIB_WALK Walk;
+
+	Walk = cmd_alloc (sizeof(ATTRIB_WALK));
+	if (Walk == NULL)
 	{
-		if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-			continue;
+		error_out_of_memory ();
+		return;
+	}
 
-		_tcscpy (pszFileName, findData.cFileName);
+	Walk->pszFile = pszFile;
+	Walk->dwMask = dwMask;
+	Walk->dwAttrib = dwAttrib;
+	Walk->bRecurse = bRecurse;
+	Walk->bDirectories = bDirectories;
+	Walk->bFound = FALSE;
+	Walk->dwUsed = 0;
 
-		dwAttribute = GetFileAttributes (szFullName);
+	AttribWalk (Walk, pszPath);
 
-		if (dwAttribute != 0xFFFFFFFF)
-		{
-			dwAttribute = (dwAttribute & ~dwMask) | dwAttrib;
-			SetFileAttributes (szFullName, dwAttribute);
-		}
+	if (!Walk->bFound)
+	{
+		ErrorMessage (ERROR_FILE_NOT_FOUND, _T("%s"), pszFile);
+		nErrorLevel = 1;
 	}
-	while (FindNextFile (hFind, &findData));
-	FindClose (hFind);
+	cmd_free (Walk);
 }
 
 
@@ -314,9 +354,9 @@ INT CommandAttrib (LPTSTR param)
 			szPath[len + 1] = 0;
 		}
 		_tcscpy (szFileName, _T("*.*"));
-		PrintAttribute (szPath, szFileName, bRecurse);
+		ProcessAttrib (szPath, szFileName, 0, 0, bRecurse, bDirectories);
 		freep (arg);
-		return 0;
+		return nErrorLevel;
 	}
 
 	/* get full file name */
@@ -330,16 +370,13 @@ INT CommandAttrib (LPTSTR param)
 			_tcscpy (szFileName, p);
 			*p = _T('\0');
 
-			if (dwMask == 0)
-				PrintAttribute (szPath, szFileName, bRecurse);
-			else
-				ChangeAttribute (szPath, szFileName, dwMask,
-						 dwAttrib, bRecurse, bDirectories);
+			ProcessAttrib (szPath, szFileName, dwMask,
+			               dwAttrib, bRecurse, bDirectories);
 		}
 	}
 
 	freep (arg);
-	return 0;
+	return nErrorLevel;
 }
 
 #endif /* INCLUDE_CMD_ATTRIB */
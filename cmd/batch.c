@@ -169,7 +169,7 @@ LPTSTR BatchParams (LPTSTR s1, LPTSTR s2)
 
 VOID ExitBatch()
 {
-	TRACE ("ExitBatch\n");
+	TRACE ("ExitBatch: command cache %lu hits, %lu misses\n", CmdCacheHits, CmdCacheMisses);
 
 	if (bc->hBatchFile)
 	{
@@ -177,6 +177,11 @@ VOID ExitBatch()
 		bc->hBatchFile = INVALID_HANDLE_VALUE;
 	}
 
+	if (bc->ReadBuf)
+		cmd_free(bc->ReadBuf);
+
+	ReleaseLabelIndex(bc->Labels);
+
 	if (bc->raw_params)
 		cmd_free(bc->raw_params);
 
@@ -193,6 +198,10 @@ VOID ExitBatch()
 		cmd_endlocal(_T(""));
 
 	bc = bc->prev;
+
+	/* The batch file that was called may have changed this one */
+	if (bc)
+		bc->bCheckModified = TRUE;
 }
 
 
@@ -234,6 +243,10 @@ INT Batch (LPTSTR fullname, LPTSTR firstword, LPTSTR param, PARSED_COMMAND *Cmd)
 			cmd_free (bc->params);
 		if (bc->raw_params)
 			cmd_free (bc->raw_params);
+		ReleaseLabelIndex(bc->Labels);
+		bc->Labels = NULL;
+		/* The redirections are taken out of the command */
+		UncacheCommand(Cmd);
 		AddBatchRedirection(&Cmd->Redirections);
 	}
 	else
@@ -264,12 +277,37 @@ INT Batch (LPTSTR fullname, LPTSTR firstword, LPTSTR param, PARSED_COMMAND *Cmd)
 		bc = &new;
 		bc->RedirList = NULL;
 		bc->setlocal = setlocal;
+		bc->ReadBuf = NULL;
+		bc->Labels = NULL;
+
+		/* A CALL :label runs the same file again, so it can
+		 * use the labels its caller has already indexed */
+		if (Cmd == NULL && *firstword == _T(':') && new.prev &&
+		    new.prev->Labels && !_tcsicmp(fullname, new.prev->BatchFilePath))
+		{
+			bc->Labels = new.prev->Labels;
+			bc->Labels->RefCount++;
+		}
 	}
 
 	GetFullPathName(fullname, sizeof(bc->BatchFilePath) / sizeof(TCHAR), bc->BatchFilePath, NULL);
 
 	bc->hBatchFile = hFile;
-	SetFilePointer (bc->hBatchFile, 0, NULL, FILE_BEGIN);
+	if (bc->ReadBuf == NULL)
+	{
+		bc->ReadBuf = cmd_alloc(BATCH_READAHEAD);
+		if (bc->ReadBuf == NULL)
+		{
+			error_out_of_memory();
+			return 1;
+		}
+	}
+	bc->ReadBufStart = 0;
+	bc->ReadBufLen = 0;
+	bc->FilePos = 0;
+	bc->FileSize = GetFileSize(hFile, NULL);
+	GetFileTime(hFile, NULL, NULL, &bc->ftLastWrite);
+	bc->bCheckModified = FALSE;
 	bc->bEcho = bEcho; /* Preserve echo across batch calls */
 	for (i = 0; i < 10; i++)
 		bc->shiftlevel[i] = i;
@@ -314,7 +352,7 @@ INT Batch (LPTSTR fullname, LPTSTR firstword, LPTSTR param, PARSED_COMMAND *Cmd)
 
 		bc->current = Cmd;
 		ret = ExecuteCommand(Cmd);
-		FreeCommand(Cmd);
+		ReleaseCommand(Cmd);
 	}
 
 	TRACE ("Batch: returns TRUE\n");
@@ -339,6 +377,107 @@ VOID AddBatchRedirection(REDIRECTION **RedirList)
 	*RedirList = NULL;
 }
 
+/*
+ * Throw away the read-ahead data if the batch file has been modified
+ * since it was read, so that edits made while the script is running
+ * are picked up once the next read goes back to the file.
+ */
+
+VOID BatchCheckModified(VOID)
+{
+	FILETIME ftLastWrite;
+	DWORD dwSize;
+
+	dwSize = GetFileSize(bc->hBatchFile, NULL);
+	if (!GetFileTime(bc->hBatchFile, NULL, NULL, &ftLastWrite))
+		return;
+
+	if (dwSize != bc->FileSize ||
+	    CompareFileTime(&ftLastWrite, &bc->ftLastWrite) != 0)
+	{
+		TRACE ("BatchCheckModified: batch file changed, discarding buffer\n");
+		bc->FileSize = dwSize;
+		bc->ftLastWrite = ftLastWrite;
+		bc->ReadBufLen = 0;
+	}
+}
+
+/*
+ * Set the logical position from which the next line of the
+ * current batch file will be read.
+ */
+
+VOID BatchSeek(DWORD dwOffset)
+{
+	bc->FilePos = dwOffset;
+}
+
+/*
+ * Read the next line of the current batch file into lpBuffer.
+ * Lines are served from a per-context read-ahead buffer, which is
+ * refilled from the logical file position only when the rest of
+ * the buffer does not hold a whole line. The file is only looked at
+ * for changes when the buffer is refilled, or when reading resumes
+ * after a CALL; GOTO looks for itself before it searches for a label.
+ */
+
+BOOL BatchGetString(LPTSTR lpBuffer, INT nBufferLength)
+{
+	LPSTR lpString;
+	CHAR *end;
+	DWORD dwOffset, dwAvail, dwRead;
+	INT len;
+
+	if (bc->bCheckModified)
+	{
+		bc->bCheckModified = FALSE;
+		BatchCheckModified();
+	}
+
+	dwOffset = bc->FilePos - bc->ReadBufStart;
+	if (bc->FilePos < bc->ReadBufStart || dwOffset > bc->ReadBufLen)
+	{
+		dwOffset = 0;
+		bc->ReadBufLen = 0;
+	}
+	dwAvail = bc->ReadBufLen - dwOffset;
+	lpString = bc->ReadBuf + dwOffset;
+
+	end = memchr(lpString, '\n', min(dwAvail, (DWORD)nBufferLength - 1));
+	if (!end && dwAvail < (DWORD)nBufferLength - 1)
+	{
+		/* Not a whole line left in the buffer, read ahead from the file */
+		BatchCheckModified();
+		if (SetFilePointer(bc->hBatchFile, bc->FilePos, NULL, FILE_BEGIN) == INVALID_SET_FILE_POINTER ||
+		    !ReadFile(bc->hBatchFile, bc->ReadBuf, BATCH_READAHEAD, &dwRead, NULL))
+		{
+			dwRead = 0;
+		}
+		bc->ReadBufStart = bc->FilePos;
+		bc->ReadBufLen = dwRead;
+		dwAvail = dwRead;
+		lpString = bc->ReadBuf;
+		end = memchr(lpString, '\n', min(dwAvail, (DWORD)nBufferLength - 1));
+	}
+
+	/* break at new line */
+	len = min(dwAvail, (DWORD)nBufferLength - 1);
+	if (end)
+		len = (end - lpString) + 1;
+
+	if (!len)
+		return FALSE;
+
+	bc->FilePos += len;
+#ifdef _UNICODE
+	len = MultiByteToWideChar(OutputCodePage, 0, lpString, len, lpBuffer, nBufferLength - 1);
+#else
+	memcpy(lpBuffer, lpString, len);
+#endif
+	lpBuffer[len] = _T('\0');
+	return TRUE;
+}
+
 /*
  * Read and return the next executable line form the current batch file
  *
@@ -360,7 +499,7 @@ LPTSTR ReadBatchLine ()
 		return NULL;
 	}
 
-	if (!FileGetString (bc->hBatchFile, textline, sizeof (textline) / sizeof (textline[0]) - 1))
+	if (!BatchGetString (textline, sizeof (textline) / sizeof (textline[0]) - 1))
 	{
 		TRACE ("ReadBatchLine(): Reached EOF!\n");
 		/* End of file.... */
@@ -6,11 +6,39 @@
 
 #pragma once
 
+/* Index of the labels in a batch file, built lazily by GOTO */
+#define LABEL_HASH_SIZE 64
+
+typedef struct _BATCH_LABEL
+{
+	struct _BATCH_LABEL *Next;
+	DWORD  Offset;       /* Offset of the line following the label */
+	TCHAR  Name[];
+} BATCH_LABEL;
+
+typedef struct _LABEL_INDEX
+{
+	INT    RefCount;     /* CALL :label contexts share their parent's index */
+	DWORD  FileSize;     /* Size and time of the file the index was built from */
+	FILETIME ftLastWrite;
+	DWORD  ScanPos;      /* All labels before this offset are in the index */
+	BOOL   bComplete;    /* The whole file has been scanned */
+	BATCH_LABEL *Buckets[LABEL_HASH_SIZE];
+} LABEL_INDEX;
+
 typedef struct tagBATCHCONTEXT
 {
 	struct tagBATCHCONTEXT *prev;
 	HANDLE hBatchFile;
 	TCHAR BatchFilePath[MAX_PATH];
+	LPSTR  ReadBuf;      /* Read-ahead buffer for the batch file */
+	DWORD  ReadBufStart; /* File offset of the first byte in ReadBuf */
+	DWORD  ReadBufLen;   /* Number of valid bytes in ReadBuf */
+	DWORD  FilePos;      /* Logical file offset of the next line */
+	DWORD  FileSize;     /* Size and time the buffered data belongs to */
+	FILETIME ftLastWrite;
+	BOOL   bCheckModified; /* Look at the file again before the next line */
+	LABEL_INDEX *Labels;
 	LPTSTR params;
 	LPTSTR raw_params;   /* Holds the raw params given by the input */
 	INT    shiftlevel[10];
@@ -40,6 +68,9 @@ extern BOOL bEcho;       /* The echo flag */
 
 #define BATCH_BUFFSIZE  8192
 
+/* Size of the per-context read-ahead buffer, must hold at least one full line */
+#define BATCH_READAHEAD 65536
+
 extern TCHAR textline[BATCH_BUFFSIZE]; /* Buffer for reading Batch file lines */
 
 
@@ -48,4 +79,7 @@ LPTSTR BatchParams (LPTSTR, LPTSTR);
 VOID   ExitBatch ();
 INT    Batch (LPTSTR, LPTSTR, LPTSTR, PARSED_COMMAND *);
 LPTSTR ReadBatchLine();
+BOOL   BatchGetString (LPTSTR, INT);
+VOID   BatchCheckModified (VOID);
+VOID   BatchSeek (DWORD);
 VOID AddBatchRedirection(REDIRECTION **);
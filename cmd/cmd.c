@@ -170,6 +170,12 @@ HANDLE CMD_ModuleHandle;
 static NtQueryInformationProcessProc NtQueryInformationProcessPtr = NULL;
 static NtReadVirtualMemoryProc       NtReadVirtualMemoryPtr = NULL;
 
+NtOpenFileProc            NtOpenFilePtr = NULL;
+NtQueryDirectoryFileProc  NtQueryDirectoryFilePtr = NULL;
+NtSetInformationFileProc  NtSetInformationFilePtr = NULL;
+NtCloseProc               NtClosePtr = NULL;
+RtlNtStatusToDosErrorProc RtlNtStatusToDosErrorPtr = NULL;
+
 #ifdef INCLUDE_CMD_COLOR
 WORD wDefColor;           /* default color */
 #endif
@@ -266,6 +272,7 @@ HANDLE RunFile(DWORD flags, LPTSTR filename, LPTSTR params,
 	BOOL        ret;
 
 	TRACE ("RunFile(%s)\n", debugstr_aw(filename));
+	ConFlush();
 	hShell32 = LoadLibrary(_T("SHELL32.DLL"));
 	if (!hShell32)
 	{
@@ -414,6 +421,9 @@ Execute (LPTSTR Full, LPTSTR First, LPTSTR Rest, PARSED_COMMAND *Cmd)
 		SetConsoleMode (GetStdHandle(STD_INPUT_HANDLE),
 		                ENABLE_LINE_INPUT | ENABLE_PROCESSED_INPUT | ENABLE_ECHO_INPUT );
 
+		/* the child writes to the same handles */
+		ConFlush();
+
 		if (CreateProcess (szFullName,
 		                   szFullCmdLine,
 		                   NULL,
@@ -510,39 +520,38 @@ DoCommand(LPTSTR first, LPTSTR rest, PARSED_COMMAND *Cmd)
 	 * internal command and become the beginning of its parameters. */
 	cp = first + _tcscspn(first, _T("\t +,/;=[]"));
 
-	for (cl = 0; cl < (cp - first); cl++)
+	/* These characters do it too, but if one of them is present,
+	 * then we check to see if the word is a file name and skip
+	 * checking for internal commands if so.
+	 * This allows running programs with names like "echo.exe" */
+	cl = _tcscspn(first, _T(".:\\"));
+	if (cl > (cp - first))
+		cl = cp - first;
+
+	/* Look up the internal command table. The file system is only
+	 * probed when the name would otherwise run an internal command. */
+	cmdptr = FindCommand(first, cl);
+	if (cmdptr && cl < (cp - first))
 	{
-		/* These characters do it too, but if one of them is present,
-		 * then we check to see if the word is a file name and skip
-		 * checking for internal commands if so.
-		 * This allows running programs with names like "echo.exe" */
-		if (_tcschr(_T(".:\\"), first[cl]))
-		{
-			TCHAR tmp = *cp;
-			*cp = _T('\0');
-			nointernal = IsExistingFile(first);
-			*cp = tmp;
-			break;
-		}
+		TCHAR tmp = *cp;
+		*cp = _T('\0');
+		nointernal = IsExistingFile(first);
+		*cp = tmp;
 	}
 
-	/* Scan internal command table */
-	for (cmdptr = cmds; !nointernal && cmdptr->name; cmdptr++)
+	if (cmdptr && !nointernal)
 	{
-		if (!_tcsnicmp(first, cmdptr->name, cl) && cmdptr->name[cl] == _T('\0'))
-		{
-			_tcscpy(com, first);
-			_tcscat(com, rest);
-			param = &com[cl];
-
-			/* Skip over whitespace to rest of line, exclude 'echo' command */
-			if (_tcsicmp(cmdptr->name, _T("echo")) != 0)
-				while (_istspace(*param))
-					param++;
-			ret = cmdptr->func(param);
-			cmd_free(com);
-			return ret;
-		}
+		_tcscpy(com, first);
+		_tcscat(com, rest);
+		param = &com[cl];
+
+		/* Skip over whitespace to rest of line, exclude 'echo' command */
+		if (_tcsicmp(cmdptr->name, _T("echo")) != 0)
+			while (_istspace(*param))
+				param++;
+		ret = cmdptr->func(param);
+		cmd_free(com);
+		return ret;
 	}
 
 	ret = Execute(com, first, rest, Cmd);
@@ -596,6 +605,7 @@ ExecuteAsync(PARSED_COMMAND *Cmd)
 
 	memset(&stui, 0, sizeof stui);
 	stui.cb = sizeof(STARTUPINFO);
+	ConFlush();
 	if (!CreateProcess(CmdPath, CmdParams, NULL, NULL, TRUE, 0,
 	                   NULL, NULL, &stui, &prci))
 	{
@@ -618,6 +628,9 @@ ExecutePipeline(PARSED_COMMAND *Cmd)
 	INT nProcesses = 0;
 	DWORD dwExitCode;
 
+	/* Our output so far must not end up in the pipe */
+	ConFlush();
+
 	/* Do all but the last pipe command */
 	do
 	{
@@ -682,6 +695,7 @@ ExecutePipeline(PARSED_COMMAND *Cmd)
 	return;
 
 failed:
+	ConFlush();
 	if (hInput)
 		CloseHandle(hInput);
 	while (--nProcesses >= 0)
@@ -694,6 +708,111 @@ failed:
 #endif
 }
 
+/*
+ * The expanded text of a command only lives while the command runs,
+ * and commands run nested inside each other, so it is allocated from
+ * a stack of blocks that are kept for reuse. That way running the body
+ * of a FOR over and over only allocates the first time it reaches a new
+ * depth of nesting.
+ */
+#define EXPAND_ARENA_SIZE (4 * CMDLINE_LENGTH)
+
+typedef struct _EXPAND_ARENA
+{
+	struct _EXPAND_ARENA *Next;
+	UINT Used;
+	TCHAR Data[EXPAND_ARENA_SIZE];
+} EXPAND_ARENA;
+
+static EXPAND_ARENA *ArenaFirst = NULL;
+static EXPAND_ARENA *ArenaTop = NULL;
+
+/* Returns space for Length characters at the top of the arena. The
+ * space is only taken once ArenaCommit has been called. */
+static TCHAR *
+ArenaReserve(UINT Length)
+{
+	EXPAND_ARENA *Block;
+
+	if (ArenaTop && ArenaTop->Used + Length <= EXPAND_ARENA_SIZE)
+		return &ArenaTop->Data[ArenaTop->Used];
+
+	Block = ArenaTop ? ArenaTop->Next : ArenaFirst;
+	if (!Block)
+	{
+		Block = cmd_alloc(sizeof(EXPAND_ARENA));
+		if (!Block)
+			return NULL;
+		Block->Next = NULL;
+		if (ArenaTop)
+			ArenaTop->Next = Block;
+		else
+			ArenaFirst = Block;
+	}
+	Block->Used = 0;
+	ArenaTop = Block;
+	return Block->Data;
+}
+
+static VOID
+ArenaCommit(UINT Length)
+{
+	ArenaTop->Used += Length;
+}
+
+static VOID
+FreeExpandArena(VOID)
+{
+	EXPAND_ARENA *Block;
+
+	while ((Block = ArenaFirst) != NULL)
+	{
+		ArenaFirst = Block->Next;
+		cmd_free(Block);
+	}
+	ArenaTop = NULL;
+}
+
+/* Expand a part of a command onto the arena */
+static LPTSTR
+ExpandCommandPart(LPTSTR Line)
+{
+	TCHAR *Buf = ArenaReserve(2 * CMDLINE_LENGTH);
+	LPTSTR Result;
+	UINT Length;
+
+	if (!Buf)
+	{
+		error_out_of_memory();
+		return NULL;
+	}
+	Result = ExpandLine(Line, Buf);
+	if (!Result)
+		return NULL;
+	Length = _tcslen(Result) + 1;
+	if (Result != Buf)
+		memcpy(Buf, Result, Length * sizeof(TCHAR));
+	ArenaCommit(Length);
+	return Buf;
+}
+
+/* Copy a part of a command onto the arena as it is */
+static LPTSTR
+CopyCommandPart(LPCTSTR Line)
+{
+	UINT Length = _tcslen(Line) + 1;
+	TCHAR *Buf = ArenaReserve(Length);
+
+	if (!Buf)
+	{
+		error_out_of_memory();
+		return NULL;
+	}
+	memcpy(Buf, Line, Length * sizeof(TCHAR));
+	ArenaCommit(Length);
+	return Buf;
+}
+
 INT
 ExecuteCommand(PARSED_COMMAND *Cmd)
 {
@@ -707,19 +826,33 @@ ExecuteCommand(PARSED_COMMAND *Cmd)
 	switch (Cmd->Type)
 	{
 	case C_COMMAND:
+	{
+		EXPAND_ARENA *MarkBlock = ArenaTop;
+		UINT MarkUsed = ArenaTop ? ArenaTop->Used : 0;
+
+		/* Parts without any references are used as they are, except
+		 * that the first word is cut up by Execute, and the parsed
+		 * command may be cached or run again */
 		Ret = 1;
-		First = DoDelayedExpansion(Cmd->Command.First);
-		if (First)
-		{
-			Rest = DoDelayedExpansion(Cmd->Command.Rest);
-			if (Rest)
-			{
-				Ret = DoCommand(First, Rest, Cmd);
-				cmd_free(Rest);
-			}
-			cmd_free(First);
-		}
+		First = Cmd->Command.First;
+		Rest = Cmd->Command.Rest;
+		if (Cmd->Command.Expand & CMDEXPAND_FIRST)
+			First = ExpandCommandPart(First);
+		else
+			First = CopyCommandPart(First);
+		if (!First)
+			Rest = NULL;
+		if (Rest && (Cmd->Command.Expand & CMDEXPAND_REST))
+			Rest = ExpandCommandPart(Rest);
+		if (First && Rest)
+			Ret = DoCommand(First, Rest, Cmd);
+
+		/* Give back what was taken from the arena */
+		ArenaTop = MarkBlock;
+		if (ArenaTop)
+			ArenaTop->Used = MarkUsed;
 		break;
+	}
 	case C_QUIET:
 	case C_BLOCK:
 	case C_MULTI:
@@ -756,22 +889,175 @@ ExecuteCommand(PARSED_COMMAND *Cmd)
 	return Ret;
 }
 
+/*
+ * Environment lookups are served from a case-insensitive hash of the
+ * variables that have been read so far, so that %VAR% doesn't have to
+ * scan the whole environment block twice. Variables are loaded into the
+ * cache the first time they are looked up (including ones that don't
+ * exist), and cmd changes the environment only through SetEnvVar, which
+ * writes through to the process environment and updates the cache. The
+ * process environment therefore stays current for child processes.
+ */
+#define ENV_CACHE_SIZE 256
+#define ENV_CACHE_MAX_ENTRIES 2048
+
+typedef struct _ENV_CACHE_ENTRY
+{
+	struct _ENV_CACHE_ENTRY *Next;
+	LPTSTR Value;           /* NULL if the variable is not defined */
+	TCHAR  Name[];
+} ENV_CACHE_ENTRY;
+
+static ENV_CACHE_ENTRY *EnvCache[ENV_CACHE_SIZE];
+static UINT EnvCacheEntries = 0;
+
+static UINT
+HashEnvName(LPCTSTR Name)
+{
+	UINT Hash = 2166136261u;
+	while (*Name)
+		Hash = (Hash ^ (TCHAR)_totupper(*Name++)) * 16777619u;
+	return Hash % ENV_CACHE_SIZE;
+}
+
+static VOID
+FlushEnvCache(VOID)
+{
+	ENV_CACHE_ENTRY *Entry;
+	UINT i;
+
+	for (i = 0; i < ENV_CACHE_SIZE; i++)
+	{
+		while ((Entry = EnvCache[i]) != NULL)
+		{
+			EnvCache[i] = Entry->Next;
+			cmd_free(Entry->Value);
+			cmd_free(Entry);
+		}
+	}
+	EnvCacheEntries = 0;
+}
+
+static ENV_CACHE_ENTRY *
+FindEnvCacheEntry(LPCTSTR varName, UINT Hash)
+{
+	ENV_CACHE_ENTRY *Entry;
+
+	for (Entry = EnvCache[Hash]; Entry; Entry = Entry->Next)
+		if (!_tcsicmp(Entry->Name, varName))
+			return Entry;
+	return NULL;
+}
+
+/* Read a variable from the process environment into a new buffer */
+static LPTSTR
+QueryEnvVar(LPCTSTR varName, BOOL *pbError)
+{
+	LPTSTR Value = NULL;
+	UINT size, len;
+
+	*pbError = FALSE;
+	size = GetEnvironmentVariable(varName, NULL, 0);
+	while (size > 0)
+	{
+		LPTSTR NewValue = cmd_realloc(Value, size * sizeof(TCHAR));
+		if (NewValue == NULL)
+		{
+			cmd_free(Value);
+			*pbError = TRUE;
+			return NULL;
+		}
+		Value = NewValue;
+		len = GetEnvironmentVariable(varName, Value, size);
+		if (len < size)
+			break;
+		size = len;
+	}
+	if (size == 0)
+	{
+		cmd_free(Value);
+		Value = NULL;
+	}
+	return Value;
+}
+
+/* Returns the value of an environment variable, or NULL if it is not
+ * defined. The string is valid until the variable is changed.
+ * GetEnvVar(NULL) frees the cache. */
 LPTSTR
 GetEnvVar(LPCTSTR varName)
 {
 	static LPTSTR ret = NULL;
-	UINT size;
+	ENV_CACHE_ENTRY *Entry;
+	UINT Hash;
+	BOOL bError;
 
 	cmd_free(ret);
 	ret = NULL;
-	size = GetEnvironmentVariable(varName, NULL, 0);
-	if (size > 0)
+	if (varName == NULL)
 	{
-		ret = cmd_alloc(size * sizeof(TCHAR));
-		if (ret != NULL)
-			GetEnvironmentVariable(varName, ret, size + 1);
+		FlushEnvCache();
+		return NULL;
 	}
-	return ret;
+
+	Hash = HashEnvName(varName);
+	Entry = FindEnvCacheEntry(varName, Hash);
+	if (Entry)
+		return Entry->Value;
+
+	if (EnvCacheEntries >= ENV_CACHE_MAX_ENTRIES)
+		FlushEnvCache();
+
+	Entry = cmd_alloc(FIELD_OFFSET(ENV_CACHE_ENTRY, Name[_tcslen(varName) + 1]));
+	if (Entry == NULL)
+	{
+		/* Can't cache it; return it in a temporary buffer instead */
+		return ret = QueryEnvVar(varName, &bError);
+	}
+	Entry->Value = QueryEnvVar(varName, &bError);
+	if (bError)
+	{
+		cmd_free(Entry);
+		return NULL;
+	}
+	_tcscpy(Entry->Name, varName);
+	Entry->Next = EnvCache[Hash];
+	EnvCache[Hash] = Entry;
+	EnvCacheEntries++;
+	return Entry->Value;
+}
+
+/* Set (or delete, if varValue is NULL) an environment variable */
+BOOL
+SetEnvVar(LPCTSTR varName, LPCTSTR varValue)
+{
+	ENV_CACHE_ENTRY *Entry, **Prev;
+	LPTSTR NewValue = NULL;
+	BOOL bSuccess;
+
+	SaveSetlocalVar(varName);
+	bSuccess = SetEnvironmentVariable(varName, varValue);
+
+	for (Prev = &EnvCache[HashEnvName(varName)]; (Entry = *Prev) != NULL; Prev = &Entry->Next)
+		if (!_tcsicmp(Entry->Name, varName))
+			break;
+	if (Entry == NULL)
+		return bSuccess;
+
+	if (bSuccess && (varValue == NULL || (NewValue = cmd_dup(varValue)) != NULL))
+	{
+		cmd_free(Entry->Value);
+		Entry->Value = NewValue;
+	}
+	else
+	{
+		/* Don't know what the environment holds now; forget the variable */
+		*Prev = Entry->Next;
+		cmd_free(Entry->Value);
+		cmd_free(Entry);
+		EnvCacheEntries--;
+	}
+	return bSuccess;
 }
 
 LPCTSTR
@@ -1128,20 +1414,94 @@ GetBatchVar(TCHAR *varName, UINT *varNameLen)
 	return NULL;
 }
 
-BOOL
-SubstituteVars(TCHAR *Src, TCHAR *Dest, TCHAR Delim)
+/*
+ * Case-insensitive search for Old in Var, starting at Var[Pos], using the
+ * Boyer-Moore-Horspool bad character rule so that no position is looked
+ * at twice. Skip holds the shift for each (lowercased) character, folded
+ * into 256 slots; see BuildSkipTable. Returns the match position, or -1.
+ */
+static INT
+FindReplaceString(const TCHAR *Var, INT VarLength, INT Pos,
+                  const TCHAR *Old, INT OldLength, const USHORT *Skip)
+{
+	INT j;
+
+	while (Pos <= VarLength - OldLength)
+	{
+		TCHAR Last = (TCHAR)_totlower(Var[Pos + OldLength - 1]);
+		if (Last == (TCHAR)_totlower(Old[OldLength - 1]))
+		{
+			for (j = OldLength - 2; j >= 0; j--)
+				if (_totlower(Var[Pos + j]) != _totlower(Old[j]))
+					break;
+			if (j < 0)
+				return Pos;
+		}
+		Pos += Skip[Last & 0xFF];
+	}
+	return -1;
+}
+
+static VOID
+BuildSkipTable(const TCHAR *Old, INT OldLength, USHORT *Skip)
+{
+	INT i;
+
+	for (i = 0; i < 256; i++)
+		Skip[i] = (USHORT)OldLength;
+	/* Characters that share a slot get the smallest shift of any of them */
+	for (i = 0; i < OldLength - 1; i++)
+		Skip[_totlower(Old[i]) & 0xFF] = (USHORT)(OldLength - 1 - i);
+}
+
+/* %VAR:old=new% and %VAR:*old=new%. Returns the new end of Dest,
+ * or NULL if the result doesn't fit. */
+static TCHAR *
+ReplaceVar(TCHAR *Dest, TCHAR *DestEnd, const TCHAR *Var, INT VarLength,
+           const TCHAR *Old, INT OldLength, const TCHAR *New, INT NewLength,
+           BOOL Star, const USHORT *Skip)
+{
+	INT LastMatch = 0, i = 0;
+
+	while ((i = FindReplaceString(Var, VarLength, i, Old, OldLength, Skip)) >= 0)
+	{
+		if (!Star)
+		{
+			if (Dest + (i - LastMatch) > DestEnd)
+				return NULL;
+			memcpy(Dest, &Var[LastMatch], (i - LastMatch) * sizeof(TCHAR));
+			Dest += i - LastMatch;
+		}
+		if (Dest + NewLength > DestEnd)
+			return NULL;
+		memcpy(Dest, New, NewLength * sizeof(TCHAR));
+		Dest += NewLength;
+		i += OldLength;
+		LastMatch = i;
+		if (Star)
+			break;
+	}
+	if (Dest + (VarLength - LastMatch) > DestEnd)
+		return NULL;
+	memcpy(Dest, &Var[LastMatch], (VarLength - LastMatch) * sizeof(TCHAR));
+	return Dest + (VarLength - LastMatch);
+}
+
+/* Expand the variables in Src. Returns the new end of Dest,
+ * or NULL if the result doesn't fit. */
+static TCHAR *
+ExpandVars(TCHAR *Src, TCHAR *Dest, TCHAR *DestEnd, TCHAR Delim)
 {
 #define APPEND(From, Length) { \
 	if (Dest + (Length) > DestEnd) \
-		goto too_long; \
+		return NULL; \
 	memcpy(Dest, From, (Length) * sizeof(TCHAR)); \
 	Dest += Length; }
 #define APPEND1(Char) { \
 	if (Dest >= DestEnd) \
-		goto too_long; \
+		return NULL; \
 	*Dest++ = Char; }
 
-	TCHAR *DestEnd = Dest + CMDLINE_LENGTH - 1;
 	const TCHAR *Var;
 	int VarLength;
 	TCHAR *SubstStart;
@@ -1226,7 +1586,7 @@ SubstituteVars(TCHAR *Src, TCHAR *Dest, TCHAR Delim)
 			TCHAR *Old, *New;
 			DWORD OldLength, NewLength;
 			BOOL Star = FALSE;
-			int LastMatch = 0, i = 0;
+			USHORT Skip[256];
 
 			if (*Src == _T('*'))
 			{
@@ -1247,22 +1607,11 @@ SubstituteVars(TCHAR *Src, TCHAR *Dest, TCHAR Delim)
 				goto bad_subst;
 			NewLength = Src++ - New;
 
-			while (i < VarLength)
-			{
-				if (_tcsnicmp(&Var[i], Old, OldLength) == 0)
-				{
-					if (!Star)
-						APPEND(&Var[LastMatch], i - LastMatch)
-					APPEND(New, NewLength)
-					i += OldLength;
-					LastMatch = i;
-					if (Star)
-						break;
-					continue;
-				}
-				i++;
-			}
-			APPEND(&Var[LastMatch], VarLength - LastMatch)
+			BuildSkipTable(Old, OldLength, Skip);
+			Dest = ReplaceVar(Dest, DestEnd, Var, VarLength,
+			                  Old, OldLength, New, NewLength, Star, Skip);
+			if (Dest == NULL)
+				return NULL;
 		}
 		continue;
 
@@ -1271,16 +1620,363 @@ SubstituteVars(TCHAR *Src, TCHAR *Dest, TCHAR Delim)
 		if (!bc)
 			APPEND1(Delim)
 	}
-	*Dest = _T('\0');
-	return TRUE;
-too_long:
-	ConOutResPrintf(STRING_ALIAS_ERROR);
-	nErrorLevel = 9023;
-	return FALSE;
+	return Dest;
 #undef APPEND
 #undef APPEND1
 }
 
+/*
+ * Lines that are expanded over and over again (loops built with GOTO,
+ * delayed expansion of the same command) are compiled into a list of
+ * operations, so that the variable names and modifiers don't have to be
+ * parsed again every time. The list depends only on the text and the
+ * delimiter, given that we are in a batch file; things that would make
+ * the parse depend on the values themselves (%~ batch variables and
+ * malformed modifiers) make the line fall back to ExpandVars.
+ */
+#define EXPAND_CACHE_SIZE 256
+#define EXPAND_CACHE_MAX_ENTRIES 512
+
+enum { EXP_LITERAL, EXP_BATCHVAR, EXP_VAR, EXP_SUBSTR, EXP_REPLACE };
+
+typedef struct _EXPAND_OP
+{
+	BYTE Type;
+	BOOL Star;            /* EXP_REPLACE: %VAR:*old=new% */
+	BOOL HasLength;       /* EXP_SUBSTR: length was given */
+	USHORT Text;          /* Literal text, or the batch variable */
+	USHORT Length;
+	USHORT Name;          /* Variable name, in the template's NameBuf */
+	USHORT Resume;        /* Where to carry on if the variable is undefined */
+	INT Start;            /* EXP_SUBSTR: start, and length if HasLength */
+	INT SubLength;
+	USHORT Old, OldLength, New, NewLength;  /* EXP_REPLACE */
+	USHORT *Skip;
+} EXPAND_OP;
+
+typedef struct _EXPAND_TEMPLATE
+{
+	struct _EXPAND_TEMPLATE *Next;
+	UINT Hash;
+	TCHAR Delim;
+	UINT OpCount;
+	EXPAND_OP *Ops;
+	TCHAR *NameBuf;       /* Copy of Text with the variable names terminated */
+	TCHAR Text[];
+} EXPAND_TEMPLATE;
+
+static EXPAND_TEMPLATE *ExpandCache[EXPAND_CACHE_SIZE];
+static UINT ExpandCacheEntries = 0;
+
+static VOID
+FreeExpandTemplate(EXPAND_TEMPLATE *Template)
+{
+	UINT i;
+
+	for (i = 0; i < Template->OpCount; i++)
+		cmd_free(Template->Ops[i].Skip);
+	cmd_free(Template->Ops);
+	cmd_free(Template);
+}
+
+VOID
+FreeExpandCache(VOID)
+{
+	EXPAND_TEMPLATE *Template;
+	UINT i;
+
+	for (i = 0; i < EXPAND_CACHE_SIZE; i++)
+	{
+		while ((Template = ExpandCache[i]) != NULL)
+		{
+			ExpandCache[i] = Template->Next;
+			FreeExpandTemplate(Template);
+		}
+	}
+	ExpandCacheEntries = 0;
+}
+
+static EXPAND_OP *
+AddExpandOp(EXPAND_TEMPLATE *Template, UINT *OpsSize, BYTE Type)
+{
+	EXPAND_OP *Op;
+
+	if (Template->OpCount == *OpsSize)
+	{
+		EXPAND_OP *NewOps = cmd_realloc(Template->Ops, *OpsSize * 2 * sizeof(EXPAND_OP));
+		if (!NewOps)
+			return NULL;
+		Template->Ops = NewOps;
+		*OpsSize *= 2;
+	}
+	Op = &Template->Ops[Template->OpCount++];
+	memset(Op, 0, sizeof(EXPAND_OP));
+	Op->Type = Type;
+	return Op;
+}
+
+/* Compile a line the same way ExpandVars would expand it inside a batch
+ * file. Returns FALSE if the line can't be compiled. */
+static BOOL
+CompileExpandTemplate(EXPAND_TEMPLATE *Template)
+{
+	TCHAR *Text = Template->Text;
+	TCHAR Delim = Template->Delim;
+	TCHAR *Src = Text, *SubstStart, *End;
+	EXPAND_OP *Op, *Literal = NULL;
+	UINT OpsSize = 8;
+
+	Template->Ops = cmd_alloc(OpsSize * sizeof(EXPAND_OP));
+	if (!Template->Ops)
+		return FALSE;
+
+	while (*Src)
+	{
+		if (*Src != Delim)
+		{
+			if (!Literal)
+			{
+				if (!(Literal = AddExpandOp(Template, &OpsSize, EXP_LITERAL)))
+					return FALSE;
+				Literal->Text = Src - Text;
+			}
+			Literal->Length++;
+			Src++;
+			continue;
+		}
+		Literal = NULL;
+
+		Src++;
+		if (Delim == _T('%'))
+		{
+			if (*Src == _T('~'))
+				return FALSE;
+			if ((*Src >= _T('0') && *Src <= _T('9')) || *Src == _T('*') || *Src == _T('%'))
+			{
+				if (!(Op = AddExpandOp(Template, &OpsSize, EXP_BATCHVAR)))
+					return FALSE;
+				Op->Text = Src++ - Text;
+				continue;
+			}
+		}
+
+		SubstStart = Src;
+		while (*Src != Delim && !(*Src == _T(':') && Src[1] != Delim))
+		{
+			if (!*Src)
+				break;
+			Src++;
+		}
+		if (!*Src)
+		{
+			/* Unterminated; the rest of the line is copied as it is */
+			Src = SubstStart;
+			continue;
+		}
+
+		if (!(Op = AddExpandOp(Template, &OpsSize, EXP_VAR)))
+			return FALSE;
+		Op->Name = SubstStart - Text;
+		Template->NameBuf[Src - Text] = _T('\0');
+		Op->Resume = ++Src - Text;
+		if (Src[-1] == Delim)
+			continue;
+
+		if (*Src == _T('~'))
+		{
+			Op->Type = EXP_SUBSTR;
+			Op->Start = _tcstol(Src + 1, &End, 0);
+			if (*End == _T(','))
+			{
+				Op->HasLength = TRUE;
+				Op->SubLength = _tcstol(End + 1, &End, 0);
+			}
+			if (*End != Delim)
+				return FALSE;
+			Src = End + 1;
+		}
+		else
+		{
+			Op->Type = EXP_REPLACE;
+			if (*Src == _T('*'))
+			{
+				Op->Star = TRUE;
+				Src++;
+			}
+			End = _tcschr(Src, _T('='));
+			if (!End || End == Src)
+				return FALSE;
+			Op->Old = Src - Text;
+			Op->OldLength = End - Src;
+			Src = End + 1;
+			End = _tcschr(Src, Delim);
+			if (!End)
+				return FALSE;
+			Op->New = Src - Text;
+			Op->NewLength = End - Src;
+			Src = End + 1;
+
+			Op->Skip = cmd_alloc(256 * sizeof(USHORT));
+			if (!Op->Skip)
+				return FALSE;
+			BuildSkipTable(&Text[Op->Old], Op->OldLength, Op->Skip);
+		}
+	}
+	return TRUE;
+}
+
+static EXPAND_TEMPLATE *
+GetExpandTemplate(LPCTSTR Src, TCHAR Delim)
+{
+	EXPAND_TEMPLATE *Template;
+	UINT Hash = 2166136261u;
+	SIZE_T Length;
+	LPCTSTR p;
+
+	for (p = Src; *p; p++)
+		Hash = (Hash ^ *p) * 16777619u;
+	Hash ^= Delim;
+	Length = p - Src;
+
+	for (Template = ExpandCache[Hash % EXPAND_CACHE_SIZE]; Template; Template = Template->Next)
+	{
+		if (Template->Hash == Hash && Template->Delim == Delim &&
+		    !_tcscmp(Template->Text, Src))
+		{
+			return Template;
+		}
+	}
+
+	if (Length >= CMDLINE_LENGTH)
+		return NULL;
+	if (ExpandCacheEntries >= EXPAND_CACHE_MAX_ENTRIES)
+		FreeExpandCache();
+
+	Template = cmd_alloc(FIELD_OFFSET(EXPAND_TEMPLATE, Text[2 * (Length + 1)]));
+	if (!Template)
+		return NULL;
+	memset(Template, 0, sizeof(EXPAND_TEMPLATE));
+	Template->Hash = Hash;
+	Template->Delim = Delim;
+	Template->NameBuf = &Template->Text[Length + 1];
+	memcpy(Template->Text, Src, (Length + 1) * sizeof(TCHAR));
+	memcpy(Template->NameBuf, Src, (Length + 1) * sizeof(TCHAR));
+	if (!CompileExpandTemplate(Template))
+	{
+		FreeExpandTemplate(Template);
+		return NULL;
+	}
+
+	Template->Next = ExpandCache[Hash % EXPAND_CACHE_SIZE];
+	ExpandCache[Hash % EXPAND_CACHE_SIZE] = Template;
+	ExpandCacheEntries++;
+	return Template;
+}
+
+/* Returns the new end of Dest, or NULL if the result doesn't fit */
+static TCHAR *
+ExpandTemplate(EXPAND_TEMPLATE *Template, TCHAR *Dest, TCHAR *DestEnd)
+{
+	EXPAND_OP *Op;
+	const TCHAR *Var;
+	INT VarLength, Start, End;
+	UINT NameLen, i;
+
+	for (i = 0; i < Template->OpCount; i++)
+	{
+		Op = &Template->Ops[i];
+		switch (Op->Type)
+		{
+		case EXP_LITERAL:
+			Var = &Template->Text[Op->Text];
+			VarLength = Op->Length;
+			break;
+		case EXP_BATCHVAR:
+			Var = GetBatchVar(&Template->Text[Op->Text], &NameLen);
+			if (Var == NULL)
+			{
+				/* %* without parameters: from the '%' on, the line is
+				 * expanded the way it always was */
+				return ExpandVars(&Template->Text[Op->Text - 1], Dest, DestEnd, Template->Delim);
+			}
+			VarLength = _tcslen(Var);
+			break;
+		default:
+			Var = GetEnvVarOrSpecial(&Template->NameBuf[Op->Name]);
+			if (Var == NULL)
+			{
+				/* Undefined variables expand to nothing, and what
+				 * looked like a modifier is expanded as ordinary text */
+				if (Op->Type == EXP_VAR)
+					continue;
+				return ExpandVars(&Template->Text[Op->Resume], Dest, DestEnd, Template->Delim);
+			}
+			VarLength = _tcslen(Var);
+			if (Op->Type == EXP_SUBSTR)
+			{
+				Start = Op->Start;
+				End = VarLength;
+				if (Start < 0)
+					Start += VarLength;
+				Start = max(Start, 0);
+				Start = min(Start, VarLength);
+				if (Op->HasLength)
+				{
+					End = Op->SubLength;
+					End += (End < 0) ? VarLength : Start;
+					End = max(End, Start);
+					End = min(End, VarLength);
+				}
+				Var += Start;
+				VarLength = End - Start;
+			}
+			else if (Op->Type == EXP_REPLACE)
+			{
+				Dest = ReplaceVar(Dest, DestEnd, Var, VarLength,
+				                  &Template->Text[Op->Old], Op->OldLength,
+				                  &Template->Text[Op->New], Op->NewLength,
+				                  Op->Star, Op->Skip);
+				if (Dest == NULL)
+					return NULL;
+				continue;
+			}
+			break;
+		}
+
+		if (Dest + VarLength > DestEnd)
+			return NULL;
+		memcpy(Dest, Var, VarLength * sizeof(TCHAR));
+		Dest += VarLength;
+	}
+	return Dest;
+}
+
+BOOL
+SubstituteVars(TCHAR *Src, TCHAR *Dest, TCHAR Delim)
+{
+	TCHAR *DestEnd = Dest + CMDLINE_LENGTH - 1;
+	EXPAND_TEMPLATE *Template = NULL;
+
+	/* Templates are only built for batch files, where undefined
+	 * variables don't change how the rest of the line is parsed */
+	if (bc && _tcschr(Src, Delim))
+		Template = GetExpandTemplate(Src, Delim);
+
+	if (Template)
+		Dest = ExpandTemplate(Template, Dest, DestEnd);
+	else
+		Dest = ExpandVars(Src, Dest, DestEnd, Delim);
+
+	if (Dest == NULL)
+	{
+		ConOutResPrintf(STRING_ALIAS_ERROR);
+		nErrorLevel = 9023;
+		return FALSE;
+	}
+	*Dest = _T('\0');
+	return TRUE;
+}
+
 /* Search the list of FOR contexts for a variable */
 static LPTSTR FindForVar(TCHAR Var, BOOL *IsParam0)
 {
@@ -1328,25 +2024,36 @@ SubstituteForVars(TCHAR *Src, TCHAR *Dest)
 	return TRUE;
 }
 
+/* Expand Line into Buf, which has room for 2 * CMDLINE_LENGTH characters.
+ * Returns a pointer to the result, somewhere in Buf, or NULL on error. */
 LPTSTR
-DoDelayedExpansion(LPTSTR Line)
+ExpandLine(LPTSTR Line, TCHAR *Buf)
 {
-	TCHAR Buf1[CMDLINE_LENGTH];
-	TCHAR Buf2[CMDLINE_LENGTH];
+	TCHAR *Buf1 = Buf;
+	TCHAR *Buf2 = Buf + CMDLINE_LENGTH;
 
 	/* First, substitute FOR variables */
 	if (!SubstituteForVars(Line, Buf1))
 		return NULL;
 
 	if (!bDelayedExpansion || !_tcschr(Buf1, _T('!')))
-		return cmd_dup(Buf1);
+		return Buf1;
 
 	/* FIXME: Delayed substitutions actually aren't quite the same as
 	 * immediate substitutions. In particular, it's possible to escape
 	 * the exclamation point using ^. */
 	if (!SubstituteVars(Buf1, Buf2, _T('!')))
 		return NULL;
-	return cmd_dup(Buf2);
+	return Buf2;
+}
+
+LPTSTR
+DoDelayedExpansion(LPTSTR Line)
+{
+	TCHAR Buf[2 * CMDLINE_LENGTH];
+	LPTSTR Result = ExpandLine(Line, Buf);
+
+	return Result ? cmd_dup(Result) : NULL;
 }
 
 
@@ -1379,6 +2086,7 @@ ReadLine (TCHAR *commandline, BOOL bMore)
 			}
 		}
 
+		ConFlush();
 		if (!ReadCommand(readline, CMDLINE_LENGTH - 1))
 		{
 			bExit = TRUE;
@@ -1414,7 +2122,7 @@ ProcessInput()
 			continue;
 
 		ExecuteCommand(Cmd);
-		FreeCommand(Cmd);
+		ReleaseCommand(Cmd);
 	}
 }
 
@@ -1634,6 +2342,13 @@ Initialize()
 	{
 		NtQueryInformationProcessPtr = (NtQueryInformationProcessProc)GetProcAddress(NtDllModule, "NtQueryInformationProcess");
 		NtReadVirtualMemoryPtr = (NtReadVirtualMemoryProc)GetProcAddress(NtDllModule, "NtReadVirtualMemory");
+
+		/* For working on files relative to an open directory */
+		NtOpenFilePtr = (NtOpenFileProc)GetProcAddress(NtDllModule, "NtOpenFile");
+		NtQueryDirectoryFilePtr = (NtQueryDirectoryFileProc)GetProcAddress(NtDllModule, "NtQueryDirectoryFile");
+		NtSetInformationFilePtr = (NtSetInformationFileProc)GetProcAddress(NtDllModule, "NtSetInformationFile");
+		NtClosePtr = (NtCloseProc)GetProcAddress(NtDllModule, "NtClose");
+		RtlNtStatusToDosErrorPtr = (RtlNtStatusToDosErrorProc)GetProcAddress(NtDllModule, "RtlNtStatusToDosError");
 	}
 
 	InitLocale ();
@@ -1647,7 +2362,7 @@ Initialize()
 	   this patch are not 100% right, if it does not exists a PROMPT value cmd should use
 	   $P$G as defualt not set EnvirommentVariable PROMPT to $P$G if it does not exists */
 	if (GetEnvironmentVariable(_T("PROMPT"),lpBuffer, sizeof(lpBuffer) / sizeof(lpBuffer[0])) == 0)
-	    SetEnvironmentVariable (_T("PROMPT"), _T("$P$G"));
+	    SetEnvVar (_T("PROMPT"), _T("$P$G"));
 
 #ifdef FEATURE_DIR_STACK
 	/* initialize directory stack */
@@ -1665,11 +2380,11 @@ Initialize()
 		ModuleName[_MAX_PATH] = _T('\0');
 		if (_tcsncmp(_T("\\??\\"), ModuleName, 4))
 		{
-			SetEnvironmentVariable (_T("COMSPEC"), ModuleName);
+			SetEnvVar (_T("COMSPEC"), ModuleName);
 		}
 		else
 		{
-			SetEnvironmentVariable (_T("COMSPEC"), &ModuleName[4]);
+			SetEnvVar (_T("COMSPEC"), &ModuleName[4]);
 		}
 	}
 
@@ -1804,14 +2519,22 @@ static VOID Cleanup()
 	CleanHistory();
 #endif
 
-	/* free GetEnvVar's buffer */
+	/* free the environment cache */
 	GetEnvVar(NULL);
 
+	FreeCommandCache();
+	FreeExecCache();
+	FreeExpandCache();
+	FreeExpandArena();
+	ConFreeScratch();
+
 	/* remove ctrl break handler */
 	RemoveBreakHandler ();
 	SetConsoleMode( GetStdHandle( STD_INPUT_HANDLE ),
 			ENABLE_LINE_INPUT | ENABLE_PROCESSED_INPUT | ENABLE_ECHO_INPUT );
 	DeleteCriticalSection(&ChildProcessRunningLock);
+
+	ConFlush();
 }
 
 /*
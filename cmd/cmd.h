@@ -104,11 +104,15 @@ HANDLE RunFile(DWORD, LPTSTR, LPTSTR, LPTSTR, INT);
 INT ParseCommandLine(LPTSTR);
 struct _PARSED_COMMAND;
 INT ExecuteCommand(struct _PARSED_COMMAND *Cmd);
+LPTSTR GetEnvVar(LPCTSTR varName);
+BOOL SetEnvVar(LPCTSTR varName, LPCTSTR varValue);
 LPCTSTR GetEnvVarOrSpecial ( LPCTSTR varName );
 VOID AddBreakHandler (VOID);
 VOID RemoveBreakHandler (VOID);
 BOOL SubstituteVars(TCHAR *Src, TCHAR *Dest, TCHAR Delim);
+VOID FreeExpandCache(VOID);
 BOOL SubstituteForVars(TCHAR *Src, TCHAR *Dest);
+LPTSTR ExpandLine(LPTSTR Line, TCHAR *Buf);
 LPTSTR DoDelayedExpansion(LPTSTR Line);
 INT DoCommand(LPTSTR first, LPTSTR rest, struct _PARSED_COMMAND *Cmd);
 BOOL ReadLine(TCHAR *commandline, BOOL bMore);
@@ -116,6 +120,24 @@ int cmd_main (int argc, const TCHAR *argv[]);
 
 extern HANDLE CMD_ModuleHandle;
 
+/* File functions of ntdll.dll, NULL unless Initialize found them */
+typedef NTSTATUS (NTAPI *NtOpenFileProc)(PHANDLE, ACCESS_MASK, POBJECT_ATTRIBUTES,
+                                         PIO_STATUS_BLOCK, ULONG, ULONG);
+typedef NTSTATUS (NTAPI *NtQueryDirectoryFileProc)(HANDLE, HANDLE, PIO_APC_ROUTINE, PVOID,
+                                                   PIO_STATUS_BLOCK, PVOID, ULONG,
+                                                   FILE_INFORMATION_CLASS, BOOLEAN,
+                                                   PUNICODE_STRING, BOOLEAN);
+typedef NTSTATUS (NTAPI *NtSetInformationFileProc)(HANDLE, PIO_STATUS_BLOCK, PVOID, ULONG,
+                                                   FILE_INFORMATION_CLASS);
+typedef NTSTATUS (NTAPI *NtCloseProc)(HANDLE);
+typedef ULONG (NTAPI *RtlNtStatusToDosErrorProc)(NTSTATUS);
+
+extern NtOpenFileProc            NtOpenFilePtr;
+extern NtQueryDirectoryFileProc  NtQueryDirectoryFilePtr;
+extern NtSetInformationFileProc  NtSetInformationFilePtr;
+extern NtCloseProc               NtClosePtr;
+extern RtlNtStatusToDosErrorProc RtlNtStatusToDosErrorPtr;
+
 
 /* Prototypes for CMDINPUT.C */
 BOOL ReadCommand (LPTSTR, INT);
@@ -135,6 +157,8 @@ typedef struct tagCOMMAND
 
 extern COMMAND cmds[];		/* The internal command table */
 
+LPCOMMAND FindCommand (LPCTSTR, INT);
+
 VOID PrintCommandList (VOID);
 VOID PrintCommandListDetail (VOID);
 
@@ -152,8 +176,11 @@ VOID ConInFlush (VOID);
 VOID ConInKey (PINPUT_RECORD);
 VOID ConInString (LPTSTR, DWORD);
 
+VOID ConFlush (VOID);
+VOID ConFreeScratch (VOID);
 VOID ConOutChar (TCHAR);
 VOID ConOutPuts (LPTSTR);
+VOID ConOutWrite (LPTSTR, DWORD);
 VOID ConPrintf(LPTSTR, va_list, DWORD);
 INT ConPrintfPaging(BOOL NewPage, LPTSTR, va_list, DWORD);
 VOID ConOutPrintf (LPTSTR, ...);
@@ -262,6 +289,8 @@ INT CommandFree (LPTSTR);
 
 /* Prototypes for GOTO.C */
 INT cmd_goto (LPTSTR);
+struct _LABEL_INDEX;
+VOID ReleaseLabelIndex (struct _LABEL_INDEX *);
 
 
 /* Prototypes for HISTORY.C */
@@ -291,11 +320,38 @@ VOID FreeLastPath (VOID);
 INT  cmd_chdir (LPTSTR);
 INT  cmd_mkdir (LPTSTR);
 INT  cmd_rmdir (LPTSTR);
+BOOL DeleteFolder (LPTSTR);
 INT  CommandExit (LPTSTR);
 INT  CommandRem (LPTSTR);
 INT  CommandShowCommands (LPTSTR);
 INT  CommandShowCommandsDetail (LPTSTR);
 
+
+/* Prototypes for JOBS.C */
+#define JOB_POOL_DEFAULT_THREADS 4
+#define JOB_POOL_MAX_THREADS     16
+
+typedef struct _FILE_JOB *PFILE_JOB;
+typedef VOID (*PFILE_JOB_ROUTINE)(PFILE_JOB);
+
+/* Embedded at the start of a command's own job structure */
+typedef struct _FILE_JOB
+{
+	PFILE_JOB Next;             /* Submission order */
+	PFILE_JOB NextQueued;
+	PFILE_JOB_ROUTINE Run;      /* Called on a worker thread */
+	PFILE_JOB_ROUTINE Retire;   /* Called on the submitting thread, in order; frees the job */
+	BOOL bDone;
+} FILE_JOB;
+
+typedef struct _JOB_POOL JOB_POOL, *PJOB_POOL;
+
+PJOB_POOL CreateJobPool (DWORD);
+VOID  SubmitJob (PJOB_POOL, PFILE_JOB);
+VOID  DrainJobPool (PJOB_POOL);
+VOID  DestroyJobPool (PJOB_POOL);
+DWORD ParseJobThreads (LPCTSTR);
+
 /* Prototypes for LABEL.C */
 INT cmd_label (LPTSTR);
 
@@ -340,6 +396,7 @@ VOID   StripQuotes(LPTSTR);
 BOOL   IsValidPathName (LPCTSTR);
 BOOL   IsExistingFile (LPCTSTR);
 BOOL   IsExistingDirectory (LPCTSTR);
+BOOL   MatchWildcard (LPCTSTR, LPCTSTR, SIZE_T);
 BOOL   FileGetString (HANDLE, LPTSTR, INT);
 VOID   GetPathCase(TCHAR *, TCHAR *);
 
@@ -363,6 +420,9 @@ INT CommandMsgbox (LPTSTR);
 
 /* Prototypes from PARSER.C */
 enum { C_COMMAND, C_QUIET, C_BLOCK, C_MULTI, C_IFFAILURE, C_IFSUCCESS, C_PIPE, C_IF, C_FOR };
+/* Command.Expand: which parts may contain %x or ! references */
+#define CMDEXPAND_FIRST 1
+#define CMDEXPAND_REST  2
 typedef struct _PARSED_COMMAND
 {
 	struct _PARSED_COMMAND *Subcommands;
@@ -373,6 +433,7 @@ typedef struct _PARSED_COMMAND
 	{
 		struct
 		{
+			BYTE Expand;
 			TCHAR *Rest;
 			TCHAR First[];
 		} Command;
@@ -394,6 +455,11 @@ typedef struct _PARSED_COMMAND
 	};
 } PARSED_COMMAND;
 PARSED_COMMAND *ParseCommand(LPTSTR Line);
+VOID ReleaseCommand(PARSED_COMMAND *Cmd);
+VOID UncacheCommand(PARSED_COMMAND *Cmd);
+VOID FreeCommandCache(VOID);
+extern ULONG CmdCacheHits;
+extern ULONG CmdCacheMisses;
 VOID EchoCommand(PARSED_COMMAND *Cmd);
 TCHAR *Unparse(PARSED_COMMAND *Cmd, TCHAR *Out, TCHAR *OutEnd);
 VOID FreeCommand(PARSED_COMMAND *Cmd);
@@ -430,6 +496,34 @@ INT cmd_rename (LPTSTR);
 /* Prototypes for REN.C */
 INT cmd_replace (LPTSTR);
 
+/* Prototypes for RMTREE.C */
+typedef struct _TREE_DELETE TREE_DELETE, *PTREE_DELETE;
+typedef BOOL (*PTREE_DELETE_ROUTINE)(PTREE_DELETE, LPCTSTR, DWORD);
+
+struct _TREE_DELETE
+{
+	LPCTSTR pszMask;               /* Files to delete, NULL for all of them */
+	DWORD dwAttrMask;              /* Only files whose attributes masked with this */
+	DWORD dwAttrValue;             /* are this */
+	LPCTSTR pszKeep;               /* Full name of a file never to delete */
+	BOOL bSubDirs;                 /* Walk the subdirectories too */
+	BOOL bRemoveDirs;              /* Remove every directory once emptied */
+	BOOL bForce;                   /* Delete read-only files as well */
+	DWORD dwThreads;               /* Worker threads, 0 walks on the calling thread */
+	PTREE_DELETE_ROUTINE Confirm;  /* Gets each file and its attributes first, FALSE keeps it */
+	PTREE_DELETE_ROUTINE Failed;   /* Gets each name not deleted and the error, FALSE stops;
+	                                  may run on a worker thread, never two at a time */
+	PVOID Context;
+	/* Set by DeleteTree */
+	DWORD dwFiles;                 /* Files deleted */
+	DWORD dwError;                 /* First error, 0 if none */
+	BOOL bFound;                   /* Something matched pszMask */
+	BOOL bAbort;                   /* Stopped by Ctrl-C or a routine */
+};
+
+BOOL IsTreeDeleteAvailable (VOID);
+BOOL DeleteTree (LPCTSTR, PTREE_DELETE);
+
 /* Prototypes for SCREEN.C */
 INT CommandScreen (LPTSTR);
 
@@ -439,6 +533,7 @@ INT cmd_set (LPTSTR);
 
 /* Prototypes for SETLOCAL.C */
 LPTSTR DuplicateEnvironment(VOID);
+VOID SaveSetlocalVar(LPCTSTR);
 INT cmd_setlocal (LPTSTR);
 INT cmd_endlocal (LPTSTR);
 
@@ -481,6 +576,7 @@ INT cmd_vol (LPTSTR);
 
 /* Prototypes for WHERE.C */
 BOOL SearchForExecutable (LPCTSTR, LPTSTR);
+VOID FreeExecCache (VOID);
 
 /* Prototypes for WINDOW.C */
 INT CommandActivate (LPTSTR);
@@ -244,6 +244,66 @@ COMMAND cmds[] =
 };
 
 
+/* Hash index over the command table, built on first use */
+#define CMD_HASH_SIZE 256
+
+static LPCOMMAND CommandHash[CMD_HASH_SIZE];
+static BOOL bCommandHashBuilt = FALSE;
+
+static UINT HashCommandName(LPCTSTR name, INT len)
+{
+	UINT hash = 2166136261u;
+	while (len-- > 0)
+		hash = (hash ^ _totlower(*name++)) * 16777619u;
+	return hash;
+}
+
+static VOID BuildCommandHash (VOID)
+{
+	LPCOMMAND cmdptr;
+	UINT i;
+
+	for (cmdptr = cmds; cmdptr->name; cmdptr++)
+	{
+		INT len = _tcslen(cmdptr->name);
+
+		/* Linear probing; the first entry of a name wins, like the old table scan */
+		for (i = HashCommandName(cmdptr->name, len) % CMD_HASH_SIZE;
+		     CommandHash[i];
+		     i = (i + 1) % CMD_HASH_SIZE)
+		{
+			if (!_tcsicmp(CommandHash[i]->name, cmdptr->name))
+				break;
+		}
+		if (!CommandHash[i])
+			CommandHash[i] = cmdptr;
+	}
+	bCommandHashBuilt = TRUE;
+}
+
+/*
+ * Look up the first len characters of name in the internal command table.
+ * Returns NULL if it is not an internal command.
+ */
+LPCOMMAND FindCommand (LPCTSTR name, INT len)
+{
+	LPCOMMAND cmdptr;
+	UINT i;
+
+	if (!bCommandHashBuilt)
+		BuildCommandHash();
+
+	for (i = HashCommandName(name, len) % CMD_HASH_SIZE;
+	     (cmdptr = CommandHash[i]) != NULL;
+	     i = (i + 1) % CMD_HASH_SIZE)
+	{
+		if (!_tcsnicmp(name, cmdptr->name, len) && cmdptr->name[len] == _T('\0'))
+			return cmdptr;
+	}
+	return NULL;
+}
+
+
 VOID PrintCommandList (VOID)
 {
 	LPCOMMAND cmdptr;
@@ -63,6 +63,8 @@ VOID ConInKey (PINPUT_RECORD lpBuffer)
 	if (hInput == INVALID_HANDLE_VALUE)
 		WARN ("Invalid input handle!!!\n");
 
+	ConFlush();
+
 	do
 	{
 		ReadConsoleInput (hInput, lpBuffer, 1, &dwRead);
@@ -88,6 +90,7 @@ VOID ConInString (LPTSTR lpInput, DWORD dwLength)
 #else
 	pBuf = lpInput;
 #endif
+	ConFlush();
 	ZeroMemory (lpInput, dwLength * sizeof(TCHAR));
 	hFile = GetStdHandle (STD_INPUT_HANDLE);
 	GetConsoleMode (hFile, &dwOldMode);
@@ -112,50 +115,173 @@ VOID ConInString (LPTSTR lpInput, DWORD dwLength)
 	SetConsoleMode (hFile, dwOldMode);
 }
 
-static VOID ConWrite(TCHAR *str, DWORD len, DWORD nStdHandle)
+/*
+ * Output to files and pipes is collected in a buffer for each of stdout
+ * and stderr, already converted to the output format, and written when
+ * the buffer fills up or ConFlush is called. ConFlush must be called
+ * before anything else can write to the same place: before a standard
+ * handle is changed, a child process is started, or input is read.
+ * Output to the console is still written straight away, since the
+ * cursor positioning code depends on it.
+ */
+#define CON_BUFFER_SIZE  8192
+
+typedef struct _CON_STREAM
+{
+	HANDLE hOutput;      /* handle the buffer belongs to, NULL if not known */
+	BOOL   bConsole;
+	DWORD  dwUsed;
+	BYTE   Buffer[CON_BUFFER_SIZE];
+} CON_STREAM;
+
+static CON_STREAM ConStreams[2];     /* stdout, stderr */
+
+/* Used for conversions that don't fit in the stream buffer */
+static PBYTE ConScratch = NULL;
+static DWORD ConScratchSize = 0;
+
+static VOID ConFlushStream(CON_STREAM *Stream)
 {
 	DWORD dwWritten;
+
+	if (Stream->dwUsed)
+		WriteFile(Stream->hOutput, Stream->Buffer, Stream->dwUsed, &dwWritten, NULL);
+	Stream->dwUsed = 0;
+}
+
+VOID ConFlush (VOID)
+{
+	INT i;
+
+	for (i = 0; i < 2; i++)
+	{
+		ConFlushStream(&ConStreams[i]);
+		/* The handle may be about to change */
+		ConStreams[i].hOutput = NULL;
+	}
+}
+
+VOID ConFreeScratch (VOID)
+{
+	if (ConScratch)
+		cmd_free(ConScratch);
+	ConScratch = NULL;
+	ConScratchSize = 0;
+}
+
+/* Returns space for up to dwMax bytes of output, NULL if there is no
+ * memory for it. No error is printed here, it would come back here. */
+static PBYTE ConReserve(CON_STREAM *Stream, DWORD dwMax)
+{
+	if (Stream->dwUsed + dwMax > CON_BUFFER_SIZE)
+		ConFlushStream(Stream);
+	if (dwMax <= CON_BUFFER_SIZE)
+		return &Stream->Buffer[Stream->dwUsed];
+
+	if (dwMax > ConScratchSize)
+	{
+		PBYTE NewScratch = cmd_realloc(ConScratch, dwMax);
+		if (!NewScratch)
+			return NULL;
+		ConScratch = NewScratch;
+		ConScratchSize = dwMax;
+	}
+	return ConScratch;
+}
+
+/* Add output put in the space returned by ConReserve */
+static VOID ConCommit(CON_STREAM *Stream, PBYTE pOut, DWORD dwBytes)
+{
+	DWORD dwWritten;
+
+	if (pOut == &Stream->Buffer[Stream->dwUsed])
+		Stream->dwUsed += dwBytes;
+	else
+		WriteFile(Stream->hOutput, pOut, dwBytes, &dwWritten, NULL);
+}
+
+static VOID ConWrite(TCHAR *str, DWORD len, DWORD nStdHandle);
+
+/* Writes a string too long for the stream buffer in pieces that fit it,
+ * when there is no memory to convert it in one go */
+static VOID ConWritePieces(TCHAR *str, DWORD len, DWORD nStdHandle)
+{
+	DWORD dwPiece;
+
+	while (len > 0)
+	{
+		dwPiece = min(len, CON_BUFFER_SIZE / MB_LEN_MAX);
+#ifdef _UNICODE
+		/* Keep surrogate pairs together */
+		if (dwPiece < len && dwPiece > 1 &&
+		    str[dwPiece - 1] >= 0xD800 && str[dwPiece - 1] <= 0xDBFF)
+			dwPiece--;
+#endif
+		ConWrite(str, dwPiece, nStdHandle);
+		str += dwPiece;
+		len -= dwPiece;
+	}
+}
+
+static VOID ConWrite(TCHAR *str, DWORD len, DWORD nStdHandle)
+{
+	CON_STREAM *Stream = &ConStreams[nStdHandle == STD_ERROR_HANDLE];
 	HANDLE hOutput = GetStdHandle(nStdHandle);
+	DWORD dwWritten, dwMode, dwBytes;
+	PBYTE pOut;
+
+	/* Keep stdout and stderr in order in case they go to the same place */
+	ConFlushStream(&ConStreams[nStdHandle != STD_ERROR_HANDLE]);
+
+	if (Stream->hOutput != hOutput)
+	{
+		ConFlushStream(Stream);
+		Stream->hOutput = hOutput;
+		Stream->bConsole = GetConsoleMode(hOutput, &dwMode);
+	}
 
-	if (WriteConsole(hOutput, str, len, &dwWritten, NULL))
+	if (Stream->bConsole && WriteConsole(hOutput, str, len, &dwWritten, NULL))
 		return;
 
 	/* We're writing to a file or pipe instead of the console. Convert the
 	 * string from TCHARs to the desired output format, if the two differ */
 	if (bUnicodeOutput)
 	{
-#ifndef _UNICODE
-		WCHAR *buffer = cmd_alloc(len * sizeof(WCHAR));
-		if (!buffer)
+		pOut = ConReserve(Stream, len * sizeof(WCHAR));
+		if (!pOut)
 		{
-			error_out_of_memory();
+			ConWritePieces(str, len, nStdHandle);
 			return;
 		}
-		len = MultiByteToWideChar(OutputCodePage, 0, str, len, buffer, len);
-		str = (PVOID)buffer;
-#endif
-		WriteFile(hOutput, str, len * sizeof(WCHAR), &dwWritten, NULL);
-#ifndef _UNICODE
-		cmd_free(buffer);
+#ifdef _UNICODE
+		memcpy(pOut, str, len * sizeof(WCHAR));
+#else
+		len = MultiByteToWideChar(OutputCodePage, 0, str, len, (LPWSTR)pOut, len);
 #endif
+		dwBytes = len * sizeof(WCHAR);
 	}
 	else
 	{
 #ifdef _UNICODE
-		CHAR *buffer = cmd_alloc(len * MB_LEN_MAX * sizeof(CHAR));
-		if (!buffer)
+		pOut = ConReserve(Stream, len * MB_LEN_MAX);
+		if (!pOut)
 		{
-			error_out_of_memory();
+			ConWritePieces(str, len, nStdHandle);
 			return;
 		}
-		len = WideCharToMultiByte(OutputCodePage, 0, str, len, buffer, len * MB_LEN_MAX, NULL, NULL);
-		str = (PVOID)buffer;
-#endif
-		WriteFile(hOutput, str, len, &dwWritten, NULL);
-#ifdef _UNICODE
-		cmd_free(buffer);
+		dwBytes = WideCharToMultiByte(OutputCodePage, 0, str, len, (LPSTR)pOut, len * MB_LEN_MAX, NULL, NULL);
+#else
+		pOut = ConReserve(Stream, len);
+		if (!pOut)
+		{
+			ConWritePieces(str, len, nStdHandle);
+			return;
+		}
+		memcpy(pOut, str, len);
+		dwBytes = len;
 #endif
 	}
+	ConCommit(Stream, pOut, dwBytes);
 }
 
 VOID ConOutChar (TCHAR c)
@@ -189,6 +315,12 @@ VOID ConOutPuts (LPTSTR szText)
 	ConPuts(szText, STD_OUTPUT_HANDLE);
 }
 
+/* Writes dwLength characters as they are, without a line break */
+VOID ConOutWrite (LPTSTR szText, DWORD dwLength)
+{
+	ConWrite(szText, dwLength, STD_OUTPUT_HANDLE);
+}
+
 
 VOID ConPrintf(LPTSTR szFormat, va_list arg_ptr, DWORD nStdHandle)
 {
@@ -241,6 +373,9 @@ INT ConPrintfPaging(BOOL NewPage, LPTSTR szFormat, va_list arg_ptr, DWORD nStdHa
 		return 0;
 	}
 
+	/* The rest is written straight to the console */
+	ConFlush();
+
 	len = _vstprintf (szOut, szFormat, arg_ptr);
 
 	while (i < len)
@@ -47,28 +47,257 @@ enum
     COPY_BINARY      = 0x100,   /* /B  */
 };
 
+/* Buffer sizes picked by CopyBufferSize */
+#define COPY_MIN_BUFFER     0x10000         /* 64K */
+#define COPY_BUFFER         0x100000        /* 1M  */
+#define COPY_MAX_BUFFER     0x400000        /* 4M, for files of COPY_LARGE_FILE or more */
+#define COPY_LARGE_FILE     0x4000000       /* 64M */
+
+/* Number of buffers a pipelined copy cycles through */
+#define COPY_BUFFERS        2
+
+/* Attributes the destination is created with */
+#define COPY_ATTRIBUTES     (FILE_ATTRIBUTE_READONLY | FILE_ATTRIBUTE_HIDDEN | \
+                             FILE_ATTRIBUTE_SYSTEM | FILE_ATTRIBUTE_ARCHIVE | \
+                             FILE_ATTRIBUTE_NOT_CONTENT_INDEXED)
+
+/* A reader thread filling buffers while the caller writes them out */
+typedef struct _COPY_PIPE
+{
+    HANDLE hFile;                       /* The source */
+    DWORD  dwBufferSize;
+    LPBYTE Buffer[COPY_BUFFERS];
+    DWORD  dwRead[COPY_BUFFERS];        /* 0 at the end of the file or on error */
+    HANDLE hFull;                       /* Counts the buffers ready to be written */
+    HANDLE hEmpty;                      /* Counts the buffers ready to be read into */
+    volatile BOOL bStop;
+} COPY_PIPE, *PCOPY_PIPE;
+
+/* One file of a COPY /MT, copied on a worker of the job pool */
+typedef struct _COPY_JOB
+{
+    FILE_JOB Job;
+    DWORD dwFlags;
+    BOOL  bPrintName;
+    INT  *pnFiles;
+    BOOL  bSuccess;
+    DWORD dwError;
+    UINT  uMsg;                         /* Message copy() would have printed, or 0 */
+    TCHAR szSource[MAX_PATH];
+    TCHAR szDest[MAX_PATH];
+    TCHAR szName[MAX_PATH];             /* Name printed once the file is copied */
+    TCHAR szSrcPath[MAX_PATH];          /* Folder named in a failure message */
+} COPY_JOB, *PCOPY_JOB;
+
+/*
+ * Only the main thread may read the console, a worker just
+ * looks at the flag the main thread sets.
+ */
+static BOOL
+CopyBreak (PCOPY_JOB Job)
+{
+    return Job ? bCtrlBreak : CheckCtrlBreak(BREAK_INPUT);
+}
+
+/*
+ * Sets the error level for a failed copy. A worker leaves that to
+ * CopyJobRetire, on the thread that owns nErrorLevel.
+ */
+static VOID
+CopyFailed (PCOPY_JOB Job)
+{
+    if (Job == NULL)
+        nErrorLevel = 1;
+}
+
+/*
+ * Reports a failed copy. A job keeps the message until it is retired
+ * so the output stays in the order the files were given.
+ */
+static VOID
+CopyError (PCOPY_JOB Job, UINT uMsg, LPCTSTR source)
+{
+    if (Job != NULL)
+    {
+        Job->uMsg = uMsg;
+        return;
+    }
+
+    ConOutResPrintf(uMsg, source);
+    CopyFailed(NULL);
+}
+
+/*
+ * Picks the buffer size from the size of the file and the cluster
+ * size of the destination volume.
+ */
+static DWORD
+CopyBufferSize (ULONGLONG u64Size, LPCTSTR dest)
+{
+    TCHAR szRoot[MAX_PATH];
+    DWORD dwSecPerCl, dwBytPerSec, dwFreeCl, dwTotCl;
+    DWORD dwCluster;
+    DWORD dwSize;
+
+    if (u64Size <= COPY_MIN_BUFFER)
+        return COPY_MIN_BUFFER;
+
+    if (u64Size >= COPY_LARGE_FILE)
+        dwSize = COPY_MAX_BUFFER;
+    else if (u64Size < COPY_BUFFER)
+        dwSize = (DWORD)u64Size;
+    else
+        dwSize = COPY_BUFFER;
+
+    /* Write whole clusters */
+    dwCluster = 0;
+    if (GetVolumePathName (dest, szRoot, MAX_PATH) &&
+        GetDiskFreeSpace (szRoot, &dwSecPerCl, &dwBytPerSec, &dwFreeCl, &dwTotCl))
+    {
+        dwCluster = dwSecPerCl * dwBytPerSec;
+    }
+    if (dwCluster == 0 || dwCluster > COPY_MAX_BUFFER)
+        dwCluster = COPY_MIN_BUFFER;
+
+    return (dwSize + dwCluster - 1) / dwCluster * dwCluster;
+}
+
+/*
+ * Writes out one buffer. An ASCII copy stops at the first ^Z and, as it
+ * always has, leaves out the whole BUFF_SIZE buffer that holds it. So a
+ * 20000 byte file with its ^Z at offset 17000 copies as its first 16384
+ * bytes, with no ^Z after them, and "abc^Z" copies as an empty file.
+ */
+static BOOL
+CopyWrite (HANDLE hFileDest, LPBYTE buffer, DWORD dwRead, DWORD lpdwFlags, BOOL *bEof)
+{
+    DWORD dwWritten;
+
+    if ((lpdwFlags & COPY_ASCII) && memchr(buffer, 0x1A, dwRead) != NULL)
+    {
+        *bEof = TRUE;
+        return TRUE;
+    }
+
+    return WriteFile (hFileDest, buffer, dwRead, &dwWritten, NULL) && dwWritten == dwRead;
+}
+
+static DWORD WINAPI
+CopyReader (LPVOID lpParameter)
+{
+    PCOPY_PIPE Pipe = lpParameter;
+    INT i;
+
+    for (i = 0; ; i = (i + 1) % COPY_BUFFERS)
+    {
+        WaitForSingleObject (Pipe->hEmpty, INFINITE);
+        if (Pipe->bStop)
+            break;
+
+        if (!ReadFile (Pipe->hFile, Pipe->Buffer[i], Pipe->dwBufferSize, &Pipe->dwRead[i], NULL))
+            Pipe->dwRead[i] = 0;
+        ReleaseSemaphore (Pipe->hFull, 1, NULL);
+
+        if (Pipe->dwRead[i] == 0)
+            break;
+    }
+
+    return 0;
+}
+
+/*
+ * Copies the rest of the source with a reader thread keeping the next
+ * buffer coming in while the current one is written out. Returns FALSE
+ * if the data could not be copied, and -1 if the pipe could not be set
+ * up so the caller can copy the plain way.
+ */
+static INT
+CopyPipelined (HANDLE hFileSrc, HANDLE hFileDest, LPBYTE buffer, DWORD dwBufferSize,
+               DWORD lpdwFlags, BOOL *bEof, PCOPY_JOB Job)
+{
+    COPY_PIPE Pipe;
+    HANDLE hThread = NULL;
+    INT ret = -1;
+    INT i;
+
+    Pipe.hFile = hFileSrc;
+    Pipe.dwBufferSize = dwBufferSize;
+    Pipe.Buffer[0] = buffer;
+    Pipe.Buffer[1] = (LPBYTE)VirtualAlloc(NULL, dwBufferSize, MEM_COMMIT, PAGE_READWRITE);
+    Pipe.hFull = CreateSemaphore (NULL, 0, COPY_BUFFERS, NULL);
+    Pipe.hEmpty = CreateSemaphore (NULL, COPY_BUFFERS, 2 * COPY_BUFFERS, NULL);
+    Pipe.bStop = FALSE;
+
+    if (Pipe.Buffer[1] != NULL && Pipe.hFull != NULL && Pipe.hEmpty != NULL)
+        hThread = CreateThread (NULL, 0, CopyReader, &Pipe, 0, NULL);
+
+    if (hThread != NULL)
+    {
+        ret = TRUE;
+        for (i = 0; ; i = (i + 1) % COPY_BUFFERS)
+        {
+            WaitForSingleObject (Pipe.hFull, INFINITE);
+            if (Pipe.dwRead[i] == 0)
+                break;
+
+            if (!CopyWrite (hFileDest, Pipe.Buffer[i], Pipe.dwRead[i], lpdwFlags, bEof) ||
+                CopyBreak(Job))
+            {
+                ret = FALSE;
+                break;
+            }
+            if (*bEof)
+                break;
+
+            ReleaseSemaphore (Pipe.hEmpty, 1, NULL);
+        }
+
+        /* Wake the reader up in case it is waiting for a buffer */
+        Pipe.bStop = TRUE;
+        ReleaseSemaphore (Pipe.hEmpty, COPY_BUFFERS, NULL);
+        WaitForSingleObject (hThread, INFINITE);
+        CloseHandle (hThread);
+    }
+
+    if (Pipe.hEmpty != NULL)
+        CloseHandle (Pipe.hEmpty);
+    if (Pipe.hFull != NULL)
+        CloseHandle (Pipe.hFull);
+    if (Pipe.Buffer[1] != NULL)
+        VirtualFree (Pipe.Buffer[1], 0, MEM_RELEASE);
+
+    return ret;
+}
+
 INT
 copy (TCHAR source[MAX_PATH],
       TCHAR dest[MAX_PATH],
       INT append,
       DWORD lpdwFlags,
-      BOOL bTouch)
+      BOOL bTouch,
+      PCOPY_JOB Job)
 {
     FILETIME srctime,NewFileTime;
     HANDLE hFileSrc;
     HANDLE hFileDest;
     LPBYTE buffer;
     DWORD  dwAttrib;
+    DWORD  dwCreateAttrib;
     DWORD  dwRead;
     DWORD  dwWritten;
+    DWORD  dwBufferSize;
+    LARGE_INTEGER liSize;
     BOOL   bEof = FALSE;
+    BOOL   bAppend = FALSE;
+    BOOL   bPrealloc = FALSE;
+    INT    ret;
     TCHAR TrueDest[MAX_PATH];
     TCHAR TempSrc[MAX_PATH];
     TCHAR * FileName;
     SYSTEMTIME CurrentTime;
 
     /* Check Breaker */
-    if(CheckCtrlBreak(BREAK_INPUT))
+    if(CopyBreak(Job))
         return 0;
 
     TRACE ("checking mode\n");
@@ -79,8 +308,7 @@ copy (TCHAR source[MAX_PATH],
             NULL, OPEN_EXISTING, 0, NULL);
         if (hFileSrc == INVALID_HANDLE_VALUE)
         {
-            ConOutResPrintf(STRING_COPY_ERROR1, source);
-            nErrorLevel = 1;
+            CopyError(Job, STRING_COPY_ERROR1, source);
             return 0;
         }
 
@@ -89,7 +317,7 @@ copy (TCHAR source[MAX_PATH],
         if(SetFileTime(hFileSrc,(LPFILETIME) NULL, (LPFILETIME) NULL, &NewFileTime))
         {
             CloseHandle(hFileSrc);
-            nErrorLevel = 1;
+            CopyFailed(Job);
             return 1;
 
         }
@@ -106,8 +334,7 @@ copy (TCHAR source[MAX_PATH],
         NULL, OPEN_EXISTING, 0, NULL);
     if (hFileSrc == INVALID_HANDLE_VALUE)
     {
-        ConOutResPrintf(STRING_COPY_ERROR1, source);
-        nErrorLevel = 1;
+        CopyError(Job, STRING_COPY_ERROR1, source);
         return 0;
     }
 
@@ -115,6 +342,15 @@ copy (TCHAR source[MAX_PATH],
 
     GetFileTime (hFileSrc, &srctime, NULL, NULL);
 
+    /* Devices have no size, they are copied until they run dry */
+    if (!GetFileSizeEx (hFileSrc, &liSize))
+        liSize.QuadPart = 0;
+
+    /* The destination is created with the attributes of the source */
+    dwCreateAttrib = (dwAttrib != INVALID_FILE_ATTRIBUTES) ? (dwAttrib & COPY_ATTRIBUTES) : 0;
+    if (dwCreateAttrib == 0)
+        dwCreateAttrib = FILE_ATTRIBUTE_NORMAL;
+
     TRACE ("copy: flags has %s\n",
         lpdwFlags & COPY_ASCII ? "ASCII" : "BINARY");
 
@@ -136,7 +372,7 @@ copy (TCHAR source[MAX_PATH],
         _tcscat(TempSrc,_T(".decrypt"));
         if(!CopyFileEx(source, TempSrc, NULL, NULL, FALSE, COPY_FILE_ALLOW_DECRYPTED_DESTINATION))
         {
-            nErrorLevel = 1;
+            CopyFailed(Job);
             return 0;
         }
         _tcscpy(source, TempSrc);
@@ -158,17 +394,15 @@ copy (TCHAR source[MAX_PATH],
     {
         TRACE ("opening/creating\n");
         hFileDest =
-            CreateFile (dest, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+            CreateFile (dest, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, dwCreateAttrib, NULL);
     }
     else if (!append)
     {
+        /* Overwrite it in place, once its attributes allow that */
         TRACE ("SetFileAttributes (%s, FILE_ATTRIBUTE_NORMAL);\n", debugstr_aw(dest));
         SetFileAttributes (dest, FILE_ATTRIBUTE_NORMAL);
 
-        TRACE ("DeleteFile (%s);\n", debugstr_aw(dest));
-        DeleteFile (dest);
-
-        hFileDest =	CreateFile (dest, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+        hFileDest =	CreateFile (dest, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, dwCreateAttrib, NULL);
     }
     else
     {
@@ -182,6 +416,7 @@ copy (TCHAR source[MAX_PATH],
 
         TRACE ("opening/appending\n");
         SetFileAttributes (dest, FILE_ATTRIBUTE_NORMAL);
+        bAppend = TRUE;
 
         hFileDest =
             CreateFile (dest, GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
@@ -194,52 +429,69 @@ copy (TCHAR source[MAX_PATH],
     if (hFileDest == INVALID_HANDLE_VALUE)
     {
         CloseHandle (hFileSrc);
-        ConOutResPuts(STRING_ERROR_PATH_NOT_FOUND);
-        nErrorLevel = 1;
+        CopyError(Job, STRING_ERROR_PATH_NOT_FOUND, source);
         return 0;
     }
 
-    /* A page-aligned buffer usually give more speed */
-    buffer = (LPBYTE)VirtualAlloc(NULL, BUFF_SIZE, MEM_COMMIT, PAGE_READWRITE);
+    /* Reserve the whole length up front, an ASCII copy may stop early at ^Z */
+    if (!bAppend && !(lpdwFlags & COPY_ASCII) && liSize.QuadPart > COPY_MIN_BUFFER &&
+        GetFileType (hFileDest) == FILE_TYPE_DISK &&
+        SetFilePointerEx (hFileDest, liSize, NULL, FILE_BEGIN))
+    {
+        bPrealloc = SetEndOfFile (hFileDest);
+        SetFilePointer (hFileDest, 0, NULL, FILE_BEGIN);
+    }
+
+    /* A page-aligned buffer usually give more speed. ASCII copies keep
+       the buffer size that decides where a ^Z cuts them off */
+    if (lpdwFlags & COPY_ASCII)
+        dwBufferSize = BUFF_SIZE;
+    else
+        dwBufferSize = CopyBufferSize (liSize.QuadPart, dest);
+    buffer = (LPBYTE)VirtualAlloc(NULL, dwBufferSize, MEM_COMMIT, PAGE_READWRITE);
     if (buffer == NULL)
     {
         CloseHandle (hFileDest);
         CloseHandle (hFileSrc);
-        ConOutResPuts(STRING_ERROR_OUT_OF_MEMORY);
-        nErrorLevel = 1;
+        CopyError(Job, STRING_ERROR_OUT_OF_MEMORY, source);
         return 0;
     }
 
-    do
+    /* Files that take more than one buffer are read ahead on a thread */
+    ret = -1;
+    if (!(lpdwFlags & COPY_ASCII) && (ULONGLONG)liSize.QuadPart > dwBufferSize)
+        ret = CopyPipelined (hFileSrc, hFileDest, buffer, dwBufferSize, lpdwFlags, &bEof, Job);
+
+    if (ret == -1)
     {
-        ReadFile (hFileSrc, buffer, BUFF_SIZE, &dwRead, NULL);
-        if (lpdwFlags & COPY_ASCII)
+        ret = TRUE;
+        do
         {
-            LPBYTE pEof = memchr(buffer, 0x1A, dwRead);
-            if (pEof != NULL)
+            if (!ReadFile (hFileSrc, buffer, dwBufferSize, &dwRead, NULL) || dwRead == 0)
+                break;
+
+            if (!CopyWrite (hFileDest, buffer, dwRead, lpdwFlags, &bEof) ||
+                CopyBreak(Job))
             {
-                bEof = TRUE;
-                dwRead = pEof-buffer+1;
+                ret = FALSE;
                 break;
             }
         }
+        while (!bEof);
+    }
 
-        if (dwRead == 0)
-            break;
-
-        WriteFile (hFileDest, buffer, dwRead, &dwWritten, NULL);
-        if (dwWritten != dwRead || CheckCtrlBreak(BREAK_INPUT))
-        {
-            ConOutResPuts(STRING_COPY_ERROR3);
-
-            VirtualFree (buffer, 0, MEM_RELEASE);
-            CloseHandle (hFileDest);
-            CloseHandle (hFileSrc);
-            nErrorLevel = 1;
-            return 0;
-        }
+    if (!ret)
+    {
+        VirtualFree (buffer, 0, MEM_RELEASE);
+        CloseHandle (hFileDest);
+        CloseHandle (hFileSrc);
+        CopyError(Job, STRING_COPY_ERROR3, source);
+        return 0;
     }
-    while (!bEof);
+
+    /* The source may have been shorter than it claimed */
+    if (bPrealloc)
+        SetEndOfFile (hFileDest);
 
     TRACE ("setting time\n");
     SetFileTime (hFileDest, &srctime, NULL, NULL);
@@ -256,15 +508,19 @@ copy (TCHAR source[MAX_PATH],
     CloseHandle (hFileDest);
     CloseHandle (hFileSrc);
 
-    TRACE ("setting mode\n");
-    SetFileAttributes (dest, dwAttrib);
+    /* A new file got its attributes when it was created */
+    if (bAppend)
+    {
+        TRACE ("setting mode\n");
+        SetFileAttributes (dest, dwAttrib);
+    }
 
     /* Now finish off the copy if needed with CopyFileEx */
     if(lpdwFlags & COPY_RESTART)
     {
         if(!CopyFileEx(dest, TrueDest, NULL, NULL, FALSE, COPY_FILE_RESTARTABLE))
         {
-            nErrorLevel = 1;
+            CopyFailed(Job);
             DeleteFile(dest);
             return 0;
         }
@@ -279,6 +535,69 @@ copy (TCHAR source[MAX_PATH],
     return 1;
 }
 
+static VOID
+CopyJobRun (PFILE_JOB Job)
+{
+    PCOPY_JOB CopyJob = (PCOPY_JOB)Job;
+
+    CopyJob->bSuccess = copy (CopyJob->szSource, CopyJob->szDest, FALSE,
+                              CopyJob->dwFlags, FALSE, CopyJob);
+    CopyJob->dwError = GetLastError ();
+}
+
+/* Prints what the sequential loop would have printed for the file */
+static VOID
+CopyJobRetire (PFILE_JOB Job)
+{
+    PCOPY_JOB CopyJob = (PCOPY_JOB)Job;
+
+    if (CopyJob->bSuccess)
+    {
+        (*CopyJob->pnFiles)++;
+        if (CopyJob->bPrintName)
+            ConOutPrintf(_T("%s\n"), CopyJob->szName);
+    }
+    else
+    {
+        if (CopyJob->uMsg != 0)
+            ConOutResPrintf(CopyJob->uMsg, CopyJob->szSource);
+        ConOutResPrintf(STRING_COPY_ERROR3);
+        ConOutFormatMessage (CopyJob->dwError, CopyJob->szSrcPath);
+        nErrorLevel = 1;
+    }
+
+    cmd_free(CopyJob);
+}
+
+/*
+ * Hands one file to the job pool. Returns FALSE if there was no memory
+ * for the job, the caller then copies the file itself.
+ */
+static BOOL
+CopySubmit (PJOB_POOL Pool, LPCTSTR source, LPCTSTR dest, LPCTSTR name,
+            LPCTSTR srcpath, DWORD dwFlags, BOOL bPrintName, INT *pnFiles)
+{
+    PCOPY_JOB CopyJob;
+
+    CopyJob = cmd_alloc(sizeof(COPY_JOB));
+    if (CopyJob == NULL)
+        return FALSE;
+
+    CopyJob->Job.Run = CopyJobRun;
+    CopyJob->Job.Retire = CopyJobRetire;
+    CopyJob->dwFlags = dwFlags;
+    CopyJob->bPrintName = bPrintName;
+    CopyJob->pnFiles = pnFiles;
+    CopyJob->uMsg = 0;
+    _tcscpy(CopyJob->szSource, source);
+    _tcscpy(CopyJob->szDest, dest);
+    _tcscpy(CopyJob->szName, name);
+    _tcscpy(CopyJob->szSrcPath, srcpath);
+
+    SubmitJob(Pool, &CopyJob->Job);
+    return TRUE;
+}
+
 
 static INT CopyOverwrite (LPTSTR fn)
 {
@@ -322,6 +641,9 @@ INT cmd_copy (LPTSTR param)
     int size;
     TCHAR * szTouch;
     BOOL bDone = FALSE;
+    /* Worker threads asked for with /MT, 0 to copy one file at a time */
+    DWORD dwThreads = 0;
+    PJOB_POOL Pool = NULL;
 
 
     /* Show help/usage info */
@@ -396,6 +718,11 @@ INT cmd_copy (LPTSTR param)
                 dwFlags |= COPY_PROMPT;
                 t++;
             }
+            else if (_tcsncicmp(_T("/MT"),&evar[t],3) == 0)
+            {
+                dwThreads = ParseJobThreads(&evar[t]);
+                t+=2;
+            }
         }
     }
     cmd_free(evar);
@@ -454,6 +781,12 @@ INT cmd_copy (LPTSTR param)
                         dwFlags |= COPY_RESTART;
                         break;
 
+                    case _T('M'):
+                        dwThreads = ParseJobThreads(arg[i]);
+                        if (dwThreads != 0)
+                            break;
+                        /* Fall through */
+
                     default:
                         /* Invalid switch */
                         ConOutResPrintf(STRING_ERROR_INVALID_SWITCH, _totupper(arg[i][1]));
@@ -526,19 +859,24 @@ INT cmd_copy (LPTSTR param)
     if (nDes != -1) /* you can only append files when there is a destination */
     {
         if(((_tcschr (arg[nSrc], _T('+')) != NULL) ||
-            (_tcschr (arg[nSrc], _T('*')) != NULL && _tcschr (arg[nDes], _T('*')) == NULL) ||
-            (IsExistingDirectory (arg[nSrc]) && (_tcschr (arg[nDes], _T('*')) == NULL && !IsExistingDirectory (arg[nDes])))
+            ((_tcschr (arg[nSrc], _T('*')) != NULL || IsExistingDirectory (arg[nSrc])) &&
+             _tcschr (arg[nDes], _T('*')) == NULL && !IsExistingDirectory (arg[nDes]))
             ))
         {
-            /* There is a + in the source filename, this means
-            that there is more then one file being put into
-            one file. */
+            /* There is a + in the source filename, or several files
+            go to a single file name, this means that there is more
+            then one file being put into one file. Into a folder
+            each file keeps a name of its own. */
             bAppend = TRUE;
             if(_tcschr (arg[nSrc], _T('+')) != NULL)
                 appendPointer = arg[nSrc];
         }
     }
 
+    /* Appending and the /D and /Z copies go through one file at a time */
+    if (dwThreads != 0 && !bAppend && !(dwFlags & (COPY_DECRYPT | COPY_RESTART)))
+        Pool = CreateJobPool(dwThreads);
+
     /* Reusing the number of files variable */
     nFiles = 0;
 
@@ -596,6 +934,7 @@ INT cmd_copy (LPTSTR param)
                 szTouch = _tcsstr (arg[nSrc], _T("+"));
                 if(_tcsncmp (szTouch,_T("+,,\0"),4) || nDes != -1)
                 {
+                    DestroyJobPool(Pool);
                     ConErrResPrintf(STRING_ERROR_INVALID_PARAM_FORMAT,arg[nSrc]);
                     nErrorLevel = 1;
                     freep (arg);
@@ -691,6 +1030,7 @@ INT cmd_copy (LPTSTR param)
             /* Check Breaker */
             if(CheckCtrlBreak(BREAK_INPUT))
             {
+                DestroyJobPool(Pool);
                 freep(arg);
                 return 1;
             }
@@ -700,7 +1040,9 @@ INT cmd_copy (LPTSTR param)
             /* If it couldnt open the file handle, print out the error */
             if(hFile == INVALID_HANDLE_VALUE)
             {
-                ConOutFormatMessage (GetLastError(), szSrcPath);
+                DWORD dwError = GetLastError();
+                DestroyJobPool(Pool);
+                ConOutFormatMessage (dwError, szSrcPath);
                 freep (arg);
                 nErrorLevel = 1;
                 return 1;
@@ -718,7 +1060,9 @@ INT cmd_copy (LPTSTR param)
             /* Can't put a file into a folder that isnt there */
             if(_tcscmp (szDestPath, _T("\\\\.\\")) && !IsExistingDirectory(szDestPath))
             {
-                ConOutFormatMessage (GetLastError (), szSrcPath);
+                DWORD dwError = GetLastError();
+                DestroyJobPool(Pool);
+                ConOutFormatMessage (dwError, szSrcPath);
                 freep (arg);
                 nErrorLevel = 1;
                 return 1;
@@ -787,6 +1131,7 @@ INT cmd_copy (LPTSTR param)
             /* Check to see if the file is the same file */
             if(!bTouch && !_tcscmp (tmpSrcPath, tmpDestPath))
             {
+                DrainJobPool(Pool);
                 ConOutResPrintf(STRING_COPY_ERROR2);
 
                 nErrorLevel = 1;
@@ -795,14 +1140,25 @@ INT cmd_copy (LPTSTR param)
 
             /* Handle any overriding / prompting that needs to be done */
             if(((!(dwFlags & COPY_NO_PROMPT) && IsExistingFile (tmpDestPath)) || dwFlags & COPY_PROMPT) && !bTouch)
+            {
+                /* Let the files before this one finish first */
+                DrainJobPool(Pool);
                 nOverwrite = CopyOverwrite(tmpDestPath);
+            }
             if(nOverwrite == PROMPT_NO || nOverwrite == PROMPT_BREAK)
                 continue;
             if(nOverwrite == PROMPT_ALL || (nOverwrite == PROMPT_YES && bAppend))
                 dwFlags |= COPY_NO_PROMPT;
 
+            /* With /MT the result is printed when the job is retired */
+            if(Pool != NULL && !bTouch &&
+               CopySubmit(Pool, tmpSrcPath, tmpDestPath, findBuffer.cFileName, szSrcPath, dwFlags,
+                          _tcschr (arg[nSrc], _T('+')) != NULL || _tcschr (arg[nSrc], _T('*')) != NULL,
+                          &nFiles))
+                continue;
+
             /* Tell weather the copy was successful or not */
-            if(copy(tmpSrcPath,tmpDestPath, bAppend, dwFlags, bTouch))
+            if(copy(tmpSrcPath,tmpDestPath, bAppend, dwFlags, bTouch, NULL))
             {
                 nFiles++;
                 /* only print source name when more then one file */
@@ -824,6 +1180,9 @@ INT cmd_copy (LPTSTR param)
     /* Loop through all files in src string with a + */
     } while(!bDone);
 
+    /* Wait for the last files of a /MT copy */
+    DestroyJobPool(Pool);
+
     /* print out the number of files copied */
     ConOutResPrintf(STRING_COPY_FILE, nFiles);
 
@@ -76,8 +76,19 @@ enum
 	ATTR_N_READ_ONLY = 0x080    /* /A:-R */
 };
 
+/* Wiping writes buffers this big, this many at the same time */
+#define WIPE_BUFFER_SIZE (1024 * 1024)
+#define WIPE_IN_FLIGHT   4
+
+/* Unbuffered writes have to cover whole sectors */
+#define WIPE_ALIGN       4096
+
+/* Least time between two progress lines, in milliseconds */
+#define WIPE_PROGRESS_MS 250
+
 static TCHAR szDeleteWipe[RC_STRING_MAX_SIZE];
 static TCHAR CMDPath[MAX_PATH];
+static DWORD dwWipePasses = 1;   /* /W:n */
 
 static BOOLEAN StringsLoaded = FALSE;
 
@@ -88,6 +99,214 @@ static VOID LoadStrings(VOID)
         StringsLoaded = TRUE;
 }
 
+/* Fills a whole buffer from a xorshift64* generator */
+static VOID
+WipeRandom(PULONGLONG pSeed, LPBYTE Buffer, DWORD dwLength)
+{
+        PULONGLONG p = (PULONGLONG)Buffer;
+        ULONGLONG x = *pSeed;
+        DWORD i;
+
+        for (i = 0; i < dwLength / sizeof(ULONGLONG); i++)
+        {
+                x ^= x >> 12;
+                x ^= x << 25;
+                x ^= x >> 27;
+                p[i] = x * 0x2545F4914F6CDD1DULL;
+        }
+        *pSeed = x;
+}
+
+/* Waits for the write in one slot, if there is one */
+static BOOL
+WipeWait(HANDLE hFile, OVERLAPPED* Overlapped, DWORD* dwIssued)
+{
+        DWORD dwWritten;
+        BOOL bRet = TRUE;
+
+        if (*dwIssued != 0)
+        {
+                bRet = GetOverlappedResult(hFile, Overlapped, &dwWritten, TRUE) &&
+                       dwWritten == *dwIssued;
+                *dwIssued = 0;
+        }
+        return bRet;
+}
+
+/*
+ * Overwrites an open file with random data dwWipePasses times, keeping
+ * WIPE_IN_FLIGHT buffers of Buffer in flight. Each pass is on the disk
+ * before the next one starts. Returns the first error.
+ */
+static DWORD
+WipePasses (HANDLE hFile, BOOL bUnbuffered, LPBYTE Buffer, OVERLAPPED* Overlapped,
+            LARGE_INTEGER FileSize, PULONGLONG pSeed)
+{
+        DWORD dwIssued[WIPE_IN_FLIGHT];
+        ULONGLONG Offset, Total, Done = 0;
+        DWORD dwPass, dwSlot, dwLength, dwWritten, dwTick;
+        DWORD dwError = ERROR_SUCCESS;
+        LONG lHigh;
+
+        ZeroMemory(dwIssued, sizeof(dwIssued));
+        Total = (ULONGLONG)FileSize.QuadPart * dwWipePasses;
+        dwTick = GetTickCount();
+        dwSlot = 0;
+
+        for (dwPass = 0; dwPass < dwWipePasses && dwError == ERROR_SUCCESS; dwPass++)
+        {
+                for (Offset = 0; Offset < (ULONGLONG)FileSize.QuadPart; Offset += WIPE_BUFFER_SIZE)
+                {
+                        if (!WipeWait(hFile, &Overlapped[dwSlot], &dwIssued[dwSlot]))
+                        {
+                                dwError = GetLastError();
+                                break;
+                        }
+
+                        dwLength = (DWORD)min((ULONGLONG)WIPE_BUFFER_SIZE, FileSize.QuadPart - Offset);
+                        Done += dwLength;
+                        if (bUnbuffered)
+                                dwLength = (dwLength + WIPE_ALIGN - 1) & ~(WIPE_ALIGN - 1);
+
+                        WipeRandom(pSeed, Buffer + dwSlot * WIPE_BUFFER_SIZE, dwLength);
+                        Overlapped[dwSlot].Offset = (DWORD)Offset;
+                        Overlapped[dwSlot].OffsetHigh = (DWORD)(Offset >> 32);
+                        if (!WriteFile (hFile, Buffer + dwSlot * WIPE_BUFFER_SIZE, dwLength,
+                                        &dwWritten, &Overlapped[dwSlot]) &&
+                            GetLastError() != ERROR_IO_PENDING)
+                        {
+                                dwError = GetLastError();
+                                break;
+                        }
+                        dwIssued[dwSlot] = dwLength;
+                        dwSlot = (dwSlot + 1) % WIPE_IN_FLIGHT;
+
+                        if (GetTickCount() - dwTick >= WIPE_PROGRESS_MS)
+                        {
+                                dwTick = GetTickCount();
+                                if (CheckCtrlBreak(BREAK_INPUT))
+                                {
+                                        dwError = ERROR_CANCELLED;
+                                        break;
+                                }
+                                ConOutPrintf (_T("%I64d%% %s\r"), (Done * 100) / Total, szDeleteWipe);
+                        }
+                }
+
+                /* A pass has to be on the disk before the next one overwrites it */
+                for (dwSlot = 0; dwSlot < WIPE_IN_FLIGHT; dwSlot++)
+                {
+                        if (!WipeWait(hFile, &Overlapped[dwSlot], &dwIssued[dwSlot]) &&
+                            dwError == ERROR_SUCCESS)
+                                dwError = GetLastError();
+                }
+                dwSlot = 0;
+                if (dwError == ERROR_SUCCESS && !bUnbuffered)
+                        FlushFileBuffers (hFile);
+        }
+
+        /* Unbuffered writes go on to the end of their sector, this one's
+         * or those of an unbuffered attempt that failed before it */
+        if (dwError == ERROR_SUCCESS)
+        {
+                lHigh = FileSize.u.HighPart;
+                SetFilePointer (hFile, FileSize.u.LowPart, &lHigh, FILE_BEGIN);
+                SetEndOfFile (hFile);
+        }
+        return dwError;
+}
+
+/*
+ * Overwrites a file with random data dwWipePasses times. The data goes
+ * around the cache straight to the disk where the volume allows it,
+ * and through the cache with write-through where it does not.
+ */
+static BOOL
+WipeFile (LPTSTR lpFileName, WIN32_FIND_DATA* f)
+{
+        OVERLAPPED Overlapped[WIPE_IN_FLIGHT];
+        LARGE_INTEGER FileSize;
+        LARGE_INTEGER Counter;
+        ULONGLONG Seed;
+        DWORD dwSlot;
+        DWORD dwError = ERROR_SUCCESS;
+        BOOL bUnbuffered = TRUE;
+        LPBYTE Buffer;
+        HANDLE hFile;
+
+        FileSize.u.HighPart = f->nFileSizeHigh;
+        FileSize.u.LowPart = f->nFileSizeLow;
+
+        hFile = CreateFile (lpFileName, GENERIC_WRITE, 0, NULL, OPEN_EXISTING,
+                            FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH | FILE_FLAG_OVERLAPPED, NULL);
+        if (hFile == INVALID_HANDLE_VALUE)
+        {
+                /* Some file systems cannot do without the cache */
+                bUnbuffered = FALSE;
+                hFile = CreateFile (lpFileName, GENERIC_WRITE, 0, NULL, OPEN_EXISTING,
+                                    FILE_FLAG_WRITE_THROUGH | FILE_FLAG_OVERLAPPED, NULL);
+                if (hFile == INVALID_HANDLE_VALUE)
+                        return FALSE;
+        }
+
+        /* VirtualAlloc hands out page aligned memory, as unbuffered writes need */
+        Buffer = (LPBYTE)VirtualAlloc(NULL, WIPE_IN_FLIGHT * WIPE_BUFFER_SIZE, MEM_COMMIT, PAGE_READWRITE);
+        if (Buffer == NULL)
+        {
+                CloseHandle (hFile);
+                SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+                return FALSE;
+        }
+
+        ZeroMemory(Overlapped, sizeof(Overlapped));
+        for (dwSlot = 0; dwSlot < WIPE_IN_FLIGHT; dwSlot++)
+        {
+                Overlapped[dwSlot].hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+                if (Overlapped[dwSlot].hEvent == NULL)
+                        dwError = GetLastError();
+        }
+
+        QueryPerformanceCounter(&Counter);
+        Seed = (ULONGLONG)Counter.QuadPart ^ ((ULONGLONG)GetTickCount() << 32) ^ (ULONG_PTR)Buffer;
+        if (Seed == 0)
+                Seed = 1;
+
+        if (dwError == ERROR_SUCCESS)
+                dwError = WipePasses (hFile, bUnbuffered, Buffer, Overlapped, FileSize, &Seed);
+
+        if (bUnbuffered && dwError != ERROR_SUCCESS && dwError != ERROR_CANCELLED)
+        {
+                /* Some network and compressed volumes open unbuffered but
+                 * then fail the writes, start over through the cache */
+                CloseHandle (hFile);
+                hFile = CreateFile (lpFileName, GENERIC_WRITE, 0, NULL, OPEN_EXISTING,
+                                    FILE_FLAG_WRITE_THROUGH | FILE_FLAG_OVERLAPPED, NULL);
+                if (hFile == INVALID_HANDLE_VALUE)
+                        dwError = GetLastError();
+                else
+                        dwError = WipePasses (hFile, FALSE, Buffer, Overlapped, FileSize, &Seed);
+        }
+
+        for (dwSlot = 0; dwSlot < WIPE_IN_FLIGHT; dwSlot++)
+        {
+                if (Overlapped[dwSlot].hEvent != NULL)
+                        CloseHandle (Overlapped[dwSlot].hEvent);
+        }
+        VirtualFree (Buffer, 0, MEM_RELEASE);
+        if (hFile != INVALID_HANDLE_VALUE)
+                CloseHandle (hFile);
+
+        if (dwError != ERROR_SUCCESS)
+        {
+                ConOutPrintf (_T("\n"));
+                SetLastError(dwError);
+                return FALSE;
+        }
+
+        ConOutPrintf (_T("100%% %s\n"), szDeleteWipe);
+        return TRUE;
+}
+
 static BOOL
 RemoveFile (LPTSTR lpFileName, DWORD dwFlags, WIN32_FIND_DATA* f)
 {
@@ -113,41 +332,31 @@ RemoveFile (LPTSTR lpFileName, DWORD dwFlags, WIN32_FIND_DATA* f)
                 }
         }
 
-        if (dwFlags & DEL_WIPE)
-        {
-
-	        HANDLE file;
-	        DWORD temp;
-#define BufferSize 65536
-	        BYTE buffer[BufferSize];
-	        LONGLONG i;
-	        LARGE_INTEGER FileSize;
-
-	        FileSize.u.HighPart = f->nFileSizeHigh;
-                FileSize.u.LowPart = f->nFileSizeLow;
-
-	        for(i = 0; i < BufferSize; i++)
-	        {
-		        buffer[i]=rand() % 256;
-	        }
-	        file = CreateFile (lpFileName, GENERIC_WRITE, 0, NULL, OPEN_EXISTING,  FILE_FLAG_WRITE_THROUGH, NULL);
-                if (file != INVALID_HANDLE_VALUE)
-                {
-                        for(i = 0; i < (FileSize.QuadPart - BufferSize); i += BufferSize)
-		        {
-			        WriteFile (file, buffer, BufferSize, &temp, NULL);
-			        ConOutPrintf (_T("%I64d%% %s\r"),(i * (LONGLONG)100)/FileSize.QuadPart,szDeleteWipe);
-		        }
-		        WriteFile (file, buffer, (DWORD)(FileSize.QuadPart - i), &temp, NULL);
-		        ConOutPrintf (_T("100%% %s\n"),szDeleteWipe);
-		        CloseHandle (file);
-                }
-        }
+        /* A file that could not be wiped is not deleted either */
+        if ((dwFlags & DEL_WIPE) && !WipeFile (lpFileName, f))
+                return FALSE;
 
 	return DeleteFile (lpFileName);
 }
 
 
+/* Asks before everything in a directory goes, unless told not to */
+static BOOL
+ConfirmDeleteAll(DWORD* dwFlags)
+{
+        INT res;
+
+        if (!((*dwFlags & DEL_YES) || (*dwFlags & DEL_QUIET) || (*dwFlags & DEL_PROMPT)))
+        {
+                res = FilePromptYNA (STRING_DEL_HELP2);
+                if ((res == PROMPT_NO) || (res == PROMPT_BREAK))
+                        return FALSE;
+                if(res == PROMPT_ALL)
+                        *dwFlags |= DEL_YES;
+        }
+        return TRUE;
+}
+
 static DWORD
 DeleteFiles(LPTSTR FileName, DWORD* dwFlags, DWORD dwAttrFlags)
 {
@@ -178,15 +387,8 @@ DeleteFiles(LPTSTR FileName, DWORD* dwFlags, DWORD dwAttrFlags)
         {
                 /* well, the user wants to delete everything but if they didnt yes DEL_YES, DEL_QUIET, or DEL_PROMPT
 	           then we are going to want to make sure that in fact they want to do that.  */
-
-		if (!((*dwFlags & DEL_YES) || (*dwFlags & DEL_QUIET) || (*dwFlags & DEL_PROMPT)))
-	        {
-        	        res = FilePromptYNA (STRING_DEL_HELP2);
-		        if ((res == PROMPT_NO) || (res == PROMPT_BREAK))
-			        return 0x80000000;
-		        if(res == PROMPT_ALL)
-			        *dwFlags |= DEL_YES;
-	        }
+		if (!ConfirmDeleteAll(dwFlags))
+			return 0x80000000;
 	}
 
         GetFullPathName (szFileName,
@@ -280,6 +482,134 @@ DeleteFiles(LPTSTR FileName, DWORD* dwFlags, DWORD dwAttrFlags)
         return dwFiles;
 }
 
+static BOOL
+DeleteConfirm(PTREE_DELETE Delete, LPCTSTR pszFile, DWORD dwAttributes)
+{
+        DWORD* dwFlags = Delete->Context;
+        INT res;
+
+        TRACE("Full filename: %s\n", debugstr_aw(pszFile));
+
+        /* ask for deleting */
+        if (*dwFlags & DEL_PROMPT)
+        {
+                ConErrResPrintf(STRING_DEL_ERROR5, pszFile);
+
+                res = FilePromptYN (STRING_DEL_ERROR6);
+
+                if ((res == PROMPT_NO) || (res == PROMPT_BREAK))
+                {
+                        nErrorLevel = 0;
+                        return FALSE;
+                }
+        }
+
+        /*user cant ask it to be quiet and tell you what it did*/
+        if (!(*dwFlags & DEL_QUIET) && !(*dwFlags & DEL_TOTAL))
+        {
+                ConErrResPrintf(STRING_DEL_ERROR7, pszFile);
+        }
+
+        return !(*dwFlags & DEL_NOTHING);
+}
+
+/*
+ * With /S /Q this runs on the worker threads, one at a time, while the
+ * thread that started the delete waits for them.
+ */
+static BOOL
+DeleteFailed(PTREE_DELETE Delete, LPCTSTR pszFile, DWORD dwError)
+{
+        ErrorMessage (dwError, _T(""));
+        return TRUE;
+}
+
+/*
+ * Deletes the files FileName names, and with /S the files of that name
+ * in every subdirectory, listing each directory only once. Unless each
+ * file is shown or asked about, subdirectories are done by a few
+ * threads at the same time.
+ */
+static DWORD
+DeleteTreeFiles(LPTSTR FileName, DWORD* dwFlags, DWORD dwAttrFlags)
+{
+        TCHAR szFullPath[MAX_PATH];
+        TCHAR szDirectory[MAX_PATH];
+        LPTSTR pFilePart;
+        TREE_DELETE Delete;
+
+        ZeroMemory(&Delete, sizeof(Delete));
+
+        GetFullPathName (FileName,
+                         MAX_PATH,
+                         szFullPath,
+                         &pFilePart);
+        _tcscpy(szDirectory, szFullPath);
+
+        if(_tcschr (szFullPath, _T('*')) == NULL &&
+           IsExistingDirectory (szFullPath))
+        {
+                Delete.pszMask = _T("*");
+                if(szFullPath[_tcslen(szFullPath) -  1] != _T('\\'))
+                        _tcscat (szFullPath, _T("\\"));
+                _tcscat (szFullPath, _T("*"));
+        }
+        else if (pFilePart != NULL)
+        {
+                Delete.pszMask = pFilePart;
+                szDirectory[pFilePart - szFullPath] = _T('\0');
+        }
+        else
+        {
+                error_sfile_not_found(szFullPath);
+                return 0;
+        }
+
+        if (!_tcscmp (Delete.pszMask, _T("*")) || !_tcscmp (Delete.pszMask, _T("*.*")))
+        {
+                if (!ConfirmDeleteAll(dwFlags))
+                        return 0x80000000;
+        }
+
+        /* The /A switches select on the attributes the files must have or lack */
+        if (dwAttrFlags & (ATTR_ARCHIVE | ATTR_N_ARCHIVE))
+                Delete.dwAttrMask |= FILE_ATTRIBUTE_ARCHIVE;
+        if (dwAttrFlags & (ATTR_HIDDEN | ATTR_N_HIDDEN))
+                Delete.dwAttrMask |= FILE_ATTRIBUTE_HIDDEN;
+        if (dwAttrFlags & (ATTR_SYSTEM | ATTR_N_SYSTEM))
+                Delete.dwAttrMask |= FILE_ATTRIBUTE_SYSTEM;
+        if (dwAttrFlags & (ATTR_READ_ONLY | ATTR_N_READ_ONLY))
+                Delete.dwAttrMask |= FILE_ATTRIBUTE_READONLY;
+        if (dwAttrFlags & ATTR_ARCHIVE)
+                Delete.dwAttrValue |= FILE_ATTRIBUTE_ARCHIVE;
+        if (dwAttrFlags & ATTR_HIDDEN)
+                Delete.dwAttrValue |= FILE_ATTRIBUTE_HIDDEN;
+        if (dwAttrFlags & ATTR_SYSTEM)
+                Delete.dwAttrValue |= FILE_ATTRIBUTE_SYSTEM;
+        if (dwAttrFlags & ATTR_READ_ONLY)
+                Delete.dwAttrValue |= FILE_ATTRIBUTE_READONLY;
+
+        /* We cant delete ourselves */
+        Delete.pszKeep = CMDPath;
+        Delete.bSubDirs = (*dwFlags & DEL_SUBDIR) != 0;
+        Delete.bForce = (*dwFlags & (DEL_ATTRIBUTES | DEL_FORCE)) != 0;
+        Delete.Context = dwFlags;
+
+        if ((*dwFlags & (DEL_PROMPT | DEL_NOTHING)) || !(*dwFlags & (DEL_QUIET | DEL_TOTAL)))
+                Delete.Confirm = DeleteConfirm;
+        if (Delete.Confirm == NULL && Delete.bSubDirs)
+                Delete.dwThreads = JOB_POOL_DEFAULT_THREADS;
+        Delete.Failed = DeleteFailed;
+
+        DeleteTree(szDirectory, &Delete);
+        if (!Delete.bFound)
+                error_sfile_not_found(szFullPath);
+
+        if (Delete.bAbort)
+                return Delete.dwFiles | 0x80000000;
+        return Delete.dwFiles;
+}
+
 static DWORD
 ProcessDirectory(LPTSTR FileName, DWORD* dwFlags, DWORD dwAttrFlags)
 {
@@ -290,6 +620,10 @@ ProcessDirectory(LPTSTR FileName, DWORD* dwFlags, DWORD dwAttrFlags)
         WIN32_FIND_DATA f;
         DWORD dwFiles = 0;
 
+        /* Wiping writes over every file first, that is left to RemoveFile */
+        if (!(*dwFlags & DEL_WIPE) && IsTreeDeleteAvailable())
+                return DeleteTreeFiles(FileName, dwFlags, dwAttrFlags);
+
         GetFullPathName (FileName,
                          MAX_PATH,
                          szFullPath,
@@ -384,6 +718,7 @@ INT CommandDelete (LPTSTR param)
 	}
 
 	nErrorLevel = 0;
+	dwWipePasses = 1;
 
 	arg = split (param, &args, FALSE);
 
@@ -430,6 +765,17 @@ INT CommandDelete (LPTSTR param)
 				else if (ch == _T('W'))
 				{
 					dwFlags |= DEL_WIPE;
+					/* /W:n wipes n times */
+					if (arg[i][2] == _T(':'))
+					{
+						dwWipePasses = _ttoi (&arg[i][3]);
+						if ((INT)dwWipePasses < 1)
+						{
+							error_invalid_parameter_format(arg[i]);
+							freep (arg);
+							return 1;
+						}
+					}
 				}
 				else if (ch == _T('Y'))
 				{
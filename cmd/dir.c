@@ -190,11 +190,99 @@ typedef struct _DirSwitchesFlags
 } DIRSWITCHFLAGS, *LPDIRSWITCHFLAGS;
 
 
-typedef struct _DIRFINDLISTNODE
+/* Size of one block of a directory's arena */
+#define DIR_BLOCK_SIZE		0x10000
+
+/* Runs this short are sorted by insertion */
+#define DIR_SORT_RUN		16
+
+/* Maximum number of threads scanning ahead for DIR /S */
+#define DIR_SCAN_THREADS	8
+
+/* Maximum number of directories scanned ahead of the one being printed */
+#define DIR_SCAN_AHEAD		64
+
+/* A file found by the listing, the names are stored right behind it */
+typedef struct _DIR_ENTRY
+{
+	ULONGLONG u64Size;					/* The size of the file */
+	ULONGLONG u64Time;					/* The time field selected by /T */
+	LPTSTR pszKey;						/* Case folded name, when sorting by name or extension */
+	LPTSTR pszExtKey;					/* Case folded extension */
+	LPTSTR cAlternateFileName;			/* The short name, empty if there is none */
+	DWORD dwFileAttributes;
+	USHORT cbEntry;						/* Size of the record including the names */
+	TCHAR cFileName[];
+} DIR_ENTRY, *PDIR_ENTRY;
+
+/* A block of the arena the entries of one directory are kept in */
+typedef struct _DIR_BLOCK
+{
+	struct _DIR_BLOCK *ptrNext;
+	DWORD dwUsed;						/* Bytes handed out from Data */
+	ULONGLONG Data[DIR_BLOCK_SIZE / sizeof(ULONGLONG)];
+} DIR_BLOCK, *PDIR_BLOCK;
+
+/* Compares two entries by one of the /O criteria */
+typedef int (*PDIR_COMPARE)(PDIR_ENTRY, PDIR_ENTRY);
+
+/* The comparison selected by /O */
+typedef struct _DIR_SORT
 {
-  WIN32_FIND_DATA stFindInfo;
-  struct _DIRFINDLISTNODE *ptrNext;
-} DIRFINDLISTNODE, *PDIRFINDLISTNODE;
+	short sCount;
+	PDIR_COMPARE Compare[3];
+	BOOL bReverse[3];
+} DIR_SORT, *PDIR_SORT;
+
+/* Progress of a directory scan */
+enum EScanState
+{
+	SCAN_PENDING	= 0,	/* Waiting on the work stack */
+	SCAN_RUNNING	= 1,	/* Being enumerated */
+	SCAN_DONE		= 2		/* Results are ready to be printed */
+};
+
+/* The results of enumerating one directory */
+typedef struct _DIR_SCAN
+{
+	struct _DIR_SCAN *ptrNextQueued;	/* Link in the work stack */
+	struct _DIR_SCAN *ptrFirstChild;	/* Subdirectories, in enumeration order */
+	struct _DIR_SCAN *ptrNextSibling;
+	enum EScanState eState;
+	BOOL bPrefetched;					/* Scanned by a worker thread */
+	BOOL bFailed;						/* Ran out of memory while scanning */
+	BOOL fPoint;						/* Skip the names that have an extension */
+	BOOL bStream;						/* Print the entries as they are found */
+	BOOL bHeaderDone;					/* The streamed header has been handled */
+	BOOL bStreamQuit;					/* Paging was stopped at the header */
+	PDIR_BLOCK ptrFirstBlock;
+	PDIR_BLOCK ptrLastBlock;
+	DWORD dwCount;						/* A counter of files found in directory */
+	DWORD dwCountFiles;					/* Counter for files */
+	DWORD dwCountDirs;					/* Counter for directories */
+	ULONGLONG u64CountBytes;			/* Counter for bytes */
+	LPTSTR pszFilePart;					/* The pattern part of szFullPath */
+	TCHAR szFullPath[MAX_PATH];			/* The full path that we are listing */
+} DIR_SCAN, *PDIR_SCAN;
+
+/* The worker threads prefetching the directories of DIR /S */
+typedef struct _DIR_SCANNER
+{
+	LPDIRSWITCHFLAGS lpFlags;
+	CRITICAL_SECTION Lock;
+	HANDLE hWork;						/* Set when the workers may have something to do */
+	HANDLE hDone;						/* Set whenever a worker finishes a scan */
+	PDIR_SCAN ptrStack;					/* Directories waiting to be scanned */
+	DWORD dwAhead;						/* Prefetched scans not printed yet */
+	BOOL bStop;
+	DWORD dwThreads;
+	HANDLE hThreads[DIR_SCAN_THREADS];
+} DIR_SCANNER, *PDIR_SCANNER;
+
+/* The scans are built by the worker threads, so they come straight from the
+   process heap rather than from the unsynchronised debug allocator */
+#define DirScanAlloc(size)	HeapAlloc(GetProcessHeap(), 0, (size))
+#define DirScanFree(ptr)	HeapFree(GetProcessHeap(), 0, (ptr))
 
 
 typedef BOOL
@@ -611,33 +699,19 @@ PrintDirectoryHeader(LPTSTR szPath, LPDIRSWITCHFLAGS lpFlags)
 static VOID
 DirPrintFileDateTime(TCHAR *lpDate,
                      TCHAR *lpTime,
-                     LPWIN32_FIND_DATA lpFile,
+                     PDIR_ENTRY lpFile,
                      LPDIRSWITCHFLAGS lpFlags)
 {
+	FILETIME ftFile;
 	FILETIME ft;
 	SYSTEMTIME dt;
 
-	/* Select the right time field */
-	switch (lpFlags->stTimeField.eTimeField)
-	{
-		case TF_CREATIONDATE:
-			if (!FileTimeToLocalFileTime(&lpFile->ftCreationTime, &ft))
-				return;
-			FileTimeToSystemTime(&ft, &dt);
-			break;
-
-		case TF_LASTACCESSEDDATE :
-			if (!FileTimeToLocalFileTime(&lpFile->ftLastAccessTime, &ft))
-				return;
-			FileTimeToSystemTime(&ft, &dt);
-			break;
-
-		case TF_MODIFIEDDATE:
-			if (!FileTimeToLocalFileTime(&lpFile->ftLastWriteTime, &ft))
-				return;
-			FileTimeToSystemTime(&ft, &dt);
-			break;
-	}
+	/* The entry already holds the time field selected by /T */
+	ftFile.dwLowDateTime = (DWORD)lpFile->u64Time;
+	ftFile.dwHighDateTime = (DWORD)(lpFile->u64Time >> 32);
+	if (!FileTimeToLocalFileTime(&ftFile, &ft))
+		return;
+	FileTimeToSystemTime(&ft, &dt);
 
 	FormatDate(lpDate, &dt, lpFlags->b4Digit);
 	FormatTime(lpTime, &dt);
@@ -843,65 +917,56 @@ getName(const TCHAR* file, TCHAR * dest)
 
 
 /*
- *  DirPrintNewList
+ *  DirPrintNewEntry
  *
- * The function that prints in new style
+ * The function that prints a file in new style
  */
 static VOID
-DirPrintNewList(LPWIN32_FIND_DATA ptrFiles[],	/* [IN]Files' Info */
-		DWORD dwCount,			/* [IN] The quantity of files */
-		TCHAR *szCurPath,		/* [IN] Full path of current directory */
+DirPrintNewEntry(PDIR_ENTRY lpFile,		/* [IN] File's Info */
 		LPDIRSWITCHFLAGS lpFlags)	/* [IN] The flags used */
 {
-  DWORD i;
   TCHAR szSize[30];
   TCHAR szShortName[15];
   TCHAR szDate[20];
   TCHAR szTime[20];
   INT iSizeFormat;
-  ULARGE_INTEGER u64FileSize;
 
-  for (i = 0; i < dwCount && !bCtrlBreak; i++)
+  /* Calculate size */
+  if (lpFile->dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
   {
-    /* Calculate size */
-    if (ptrFiles[i]->dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
-    {
-      /* Junction */
-      iSizeFormat = -14;
-      _tcscpy(szSize, _T("<JUNCTION>"));
-    }
-    else if (ptrFiles[i]->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-    {
-      /* Directory */
-      iSizeFormat = -14;
-      _tcscpy(szSize, _T("<DIR>"));
-    }
-    else
-    {
-      /* File */
-      iSizeFormat = 14;
-      u64FileSize.HighPart = ptrFiles[i]->nFileSizeHigh;
-      u64FileSize.LowPart = ptrFiles[i]->nFileSizeLow;
-      ConvertULargeInteger(u64FileSize.QuadPart, szSize, 20, lpFlags->bTSeperator);
-    }
-
-    /* Calculate short name */
-    szShortName[0] = _T('\0');
-    if (lpFlags->bShortName)
-      _stprintf(szShortName, _T(" %-12s"), ptrFiles[i]->cAlternateFileName);
-
-    /* Format date and time */
-    DirPrintFileDateTime(szDate, szTime, ptrFiles[i], lpFlags);
-
-    /* Print the line */
-    DirPrintf(lpFlags, _T("%10s  %-6s    %*s%s %s\n"),
-							szDate,
-							szTime,
-							iSizeFormat,
-							szSize,
-							szShortName,
-							ptrFiles[i]->cFileName);
+    /* Junction */
+    iSizeFormat = -14;
+    _tcscpy(szSize, _T("<JUNCTION>"));
+  }
+  else if (lpFile->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+  {
+    /* Directory */
+    iSizeFormat = -14;
+    _tcscpy(szSize, _T("<DIR>"));
   }
+  else
+  {
+    /* File */
+    iSizeFormat = 14;
+    ConvertULargeInteger(lpFile->u64Size, szSize, 20, lpFlags->bTSeperator);
+  }
+
+  /* Calculate short name */
+  szShortName[0] = _T('\0');
+  if (lpFlags->bShortName)
+    _stprintf(szShortName, _T(" %-12s"), lpFile->cAlternateFileName);
+
+  /* Format date and time */
+  DirPrintFileDateTime(szDate, szTime, lpFile, lpFlags);
+
+  /* Print the line */
+  DirPrintf(lpFlags, _T("%10s  %-6s    %*s%s %s\n"),
+						szDate,
+						szTime,
+						iSizeFormat,
+						szSize,
+						szShortName,
+						lpFile->cFileName);
 }
 
 
@@ -911,7 +976,7 @@ DirPrintNewList(LPWIN32_FIND_DATA ptrFiles[],	/* [IN]Files' Info */
  * The function that prints in wide list
  */
 static VOID
-DirPrintWideList(LPWIN32_FIND_DATA ptrFiles[],	/* [IN] Files' Info */
+DirPrintWideList(PDIR_ENTRY ptrFiles[],	/* [IN] Files' Info */
 				 DWORD dwCount,			/* [IN] The quantity of files */
 				 TCHAR *szCurPath,		/* [IN] Full path of current directory */
 				 LPDIRSWITCHFLAGS lpFlags)	/* [IN] The flags used */
@@ -990,115 +1055,139 @@ DirPrintWideList(LPWIN32_FIND_DATA ptrFiles[],	/* [IN] Files' Info */
 
 
 /*
- *  DirPrintOldList
+ *  DirPrintOldEntry
  *
- * The function that prints in old style
+ * The function that prints a file in old style
  */
 static VOID
-DirPrintOldList(LPWIN32_FIND_DATA ptrFiles[],	/* [IN] Files' Info */
-				DWORD dwCount,					/* [IN] The quantity of files */
-				TCHAR * szCurPath,				/* [IN] Full path of current directory */
+DirPrintOldEntry(PDIR_ENTRY lpFile,				/* [IN] File's Info */
 				LPDIRSWITCHFLAGS lpFlags)		/* [IN] The flags used */
 {
-DWORD i;						/* An indexer for "for"s */
 TCHAR szName[10];				/* The name of file */
 TCHAR szExt[5];					/* The extension of file */
 TCHAR szDate[30],szTime[30];	/* Used to format time and date */
 TCHAR szSize[30];				/* The size of file */
 int iSizeFormat;				/* The format of size field */
-ULARGE_INTEGER u64FileSize;		/* The file size */
 
-	for (i = 0; i < dwCount && !bCtrlBreak; i++)
+	/* Broke 8.3 format */
+	if (*lpFile->cAlternateFileName )
 	{
-		/* Broke 8.3 format */
-		if (*ptrFiles[i]->cAlternateFileName )
-		{
-			/* If the file is long named then we read the alter name */
-			getName( ptrFiles[i]->cAlternateFileName, szName);
-			_tcscpy(szExt, getExt( ptrFiles[i]->cAlternateFileName));
-		}
-		else
-		{
-			/* If the file is not long name we read its original name */
-			getName( ptrFiles[i]->cFileName, szName);
-			_tcscpy(szExt, getExt( ptrFiles[i]->cFileName));
-		}
-
-		/* Calculate size */
-		if (ptrFiles[i]->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-		{
-			/* Directory, no size it's a directory*/
-			iSizeFormat = -17;
-			_tcscpy(szSize, _T("<DIR>"));
-		}
-		else
-		{
-			/* File */
-			iSizeFormat = 17;
-			u64FileSize.HighPart = ptrFiles[i]->nFileSizeHigh;
-			u64FileSize.LowPart = ptrFiles[i]->nFileSizeLow;
-			ConvertULargeInteger(u64FileSize.QuadPart, szSize, 20, lpFlags->bTSeperator);
-		}
+		/* If the file is long named then we read the alter name */
+		getName( lpFile->cAlternateFileName, szName);
+		_tcscpy(szExt, getExt( lpFile->cAlternateFileName));
+	}
+	else
+	{
+		/* If the file is not long name we read its original name */
+		getName( lpFile->cFileName, szName);
+		_tcscpy(szExt, getExt( lpFile->cFileName));
+	}
 
-		/* Format date and time */
-		DirPrintFileDateTime(szDate,szTime,ptrFiles[i],lpFlags);
-
-		/* Print the line */
-		DirPrintf(lpFlags, _T("%-8s %-3s  %*s %s  %s\n"),
-								szName,			/* The file's 8.3 name */
-								szExt,			/* The file's 8.3 extension */
-								iSizeFormat,	/* print format for size column */
-								szSize,			/* The size of file or "<DIR>" for dirs */
-								szDate,			/* The date of file/dir */
-								szTime);		/* The time of file/dir */
+	/* Calculate size */
+	if (lpFile->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+	{
+		/* Directory, no size it's a directory*/
+		iSizeFormat = -17;
+		_tcscpy(szSize, _T("<DIR>"));
 	}
+	else
+	{
+		/* File */
+		iSizeFormat = 17;
+		ConvertULargeInteger(lpFile->u64Size, szSize, 20, lpFlags->bTSeperator);
+	}
+
+	/* Format date and time */
+	DirPrintFileDateTime(szDate,szTime,lpFile,lpFlags);
+
+	/* Print the line */
+	DirPrintf(lpFlags, _T("%-8s %-3s  %*s %s  %s\n"),
+							szName,			/* The file's 8.3 name */
+							szExt,			/* The file's 8.3 extension */
+							iSizeFormat,	/* print format for size column */
+							szSize,			/* The size of file or "<DIR>" for dirs */
+							szDate,			/* The date of file/dir */
+							szTime);		/* The time of file/dir */
 }
 
 /*
- *  DirPrintBareList
+ *  DirPrintBareEntry
  *
- * The function that prints in bare format
+ * The function that prints a file in bare format
  */
 static VOID
-DirPrintBareList(LPWIN32_FIND_DATA ptrFiles[],	/* [IN] Files' Info */
-				 DWORD dwCount,			/* [IN] The number of files */
+DirPrintBareEntry(PDIR_ENTRY lpFile,		/* [IN] File's Info */
 				 LPTSTR lpCurPath,		/* [IN] Full path of current directory */
 				 LPDIRSWITCHFLAGS lpFlags)	/* [IN] The flags used */
 {
-	DWORD i;
-
-	for (i = 0; i < dwCount && !bCtrlBreak; i++)
+	if ((_tcscmp(lpFile->cFileName, _T(".")) == 0) ||
+	    (_tcscmp(lpFile->cFileName, _T("..")) == 0))
 	{
-		if ((_tcscmp(ptrFiles[i]->cFileName, _T(".")) == 0) ||
-		    (_tcscmp(ptrFiles[i]->cFileName, _T("..")) == 0))
-		{
-			/* at bare format we don't print "." and ".." folder */
-			continue;
-		}
-		if (lpFlags->bRecursive)
-		{
-			/* at recursive mode we print full path of file */
-			DirPrintf(lpFlags, _T("%s\\%s\n"), lpCurPath, ptrFiles[i]->cFileName);
-		}
-		else
-		{
-			/* if we are not in recursive mode we print the file names */
-			DirPrintf(lpFlags, _T("%s\n"), ptrFiles[i]->cFileName);
-		}
+		/* at bare format we don't print "." and ".." folder */
+		return;
+	}
+	if (lpFlags->bRecursive)
+	{
+		/* at recursive mode we print full path of file */
+		DirPrintf(lpFlags, _T("%s\\%s\n"), lpCurPath, lpFile->cFileName);
+	}
+	else
+	{
+		/* if we are not in recursive mode we print the file names */
+		DirPrintf(lpFlags, _T("%s\n"), lpFile->cFileName);
 	}
 }
 
 
 /*
- * DirPrintFiles
+ * DirUseWideList
  *
- * The functions that prints the files list
+ * Checks if the files are printed in columns, which needs all of them
+ */
+static BOOL
+DirUseWideList(LPDIRSWITCHFLAGS lpFlags)
+{
+	return !lpFlags->bBareFormat && !lpFlags->bShortName &&
+	       (lpFlags->bWideListColSort || lpFlags->bWideList);
+}
+
+
+/*
+ * DirPrintEntry
+ *
+ * The function that prints one file of a list that is not wide
  */
 static VOID
-DirPrintFiles(LPWIN32_FIND_DATA ptrFiles[],	/* [IN] Files' Info */
-			  DWORD dwCount,			/* [IN] The quantity of files */
+DirPrintEntry(PDIR_ENTRY lpFile,			/* [IN] File's Info */
 			  TCHAR *szCurPath,			/* [IN] Full path of current directory */
 			  LPDIRSWITCHFLAGS lpFlags)		/* [IN] The flags used */
+{
+	if (lpFlags->bBareFormat)
+	{
+		/* Bare format */
+		DirPrintBareEntry(lpFile, szCurPath, lpFlags);
+	}
+	else if (lpFlags->bShortName || lpFlags->bNewLongList)
+	{
+		/* New list style / Short names */
+		DirPrintNewEntry(lpFile, lpFlags);
+	}
+	else
+	{
+		/* If nothing is selected old list is the default */
+		DirPrintOldEntry(lpFile, lpFlags);
+	}
+}
+
+
+/*
+ * DirPrintHeader
+ *
+ * Prints the name of the directory that is listed
+ */
+static INT
+DirPrintHeader(TCHAR *szCurPath,		/* [IN] Full path of current directory */
+			   LPDIRSWITCHFLAGS lpFlags)	/* [IN] The flags used */
 {
 	TCHAR szMsg[RC_STRING_MAX_SIZE];
 	TCHAR szTemp[MAX_PATH];			/* A buffer to format the directory header */
@@ -1108,436 +1197,924 @@ DirPrintFiles(LPWIN32_FIND_DATA ptrFiles[],	/* [IN] Files' Info */
 	if (_tcslen(szTemp) == 2 && szTemp[1] == _T(':'))
 		_tcscat(szTemp, _T("\\"));
 
+	LoadString(CMD_ModuleHandle, STRING_DIR_HELP7, szMsg, RC_STRING_MAX_SIZE);
+	return DirPrintf(lpFlags, szMsg, szTemp);
+}
+
+
+/*
+ * DirPrintFiles
+ *
+ * The functions that prints the files list
+ */
+static VOID
+DirPrintFiles(PDIR_ENTRY ptrFiles[],	/* [IN] Files' Info */
+			  DWORD dwCount,			/* [IN] The quantity of files */
+			  TCHAR *szCurPath,			/* [IN] Full path of current directory */
+			  LPDIRSWITCHFLAGS lpFlags)		/* [IN] The flags used */
+{
+	DWORD i;
+
 	/* Condition to print header:
 	   We are not printing in bare format
 	   and if we are in recursive mode... we must have results */
 	if (!(lpFlags->bBareFormat ) && !((lpFlags->bRecursive) && (dwCount <= 0)))
 	{
-		LoadString(CMD_ModuleHandle, STRING_DIR_HELP7, szMsg, RC_STRING_MAX_SIZE);
-		if (DirPrintf(lpFlags, szMsg, szTemp))
+		if (DirPrintHeader(szCurPath, lpFlags))
 			return;
 	}
 
-	if (lpFlags->bBareFormat)
-	{
-		/* Bare format */
-		DirPrintBareList(ptrFiles, dwCount, szCurPath, lpFlags);
-	}
-	else if(lpFlags->bShortName)
-	{
-		/* New list style / Short names */
-		DirPrintNewList(ptrFiles, dwCount, szCurPath, lpFlags);
-	}
-	else if(lpFlags->bWideListColSort || lpFlags->bWideList)
+	if (DirUseWideList(lpFlags))
 	{
 		/* Wide list */
 		DirPrintWideList(ptrFiles, dwCount, szCurPath, lpFlags);
 	}
-	else if (lpFlags->bNewLongList )
-	{
-		/* New list style*/
-		DirPrintNewList(ptrFiles, dwCount, szCurPath, lpFlags);
-	}
 	else
 	{
-		/* If nothing is selected old list is the default */
-		DirPrintOldList(ptrFiles, dwCount, szCurPath, lpFlags);
+		for (i = 0; i < dwCount && !bCtrlBreak; i++)
+			DirPrintEntry(ptrFiles[i], szCurPath, lpFlags);
 	}
 }
 
 
 
 /*
- * CompareFiles
+ * DirCompareName, DirCompareExtension, DirCompareSize,
+ * DirCompareDirectory, DirCompareTime
  *
- * Compares 2 files based on the order criteria
+ * Compare 2 entries by one order criteria
  */
-static BOOL
-CompareFiles(LPWIN32_FIND_DATA lpFile1,	/* [IN] A pointer to WIN32_FIND_DATA of file 1 */
-			 LPWIN32_FIND_DATA lpFile2,	/* [IN] A pointer to WIN32_FIND_DATA of file 2 */
-			 LPDIRSWITCHFLAGS lpFlags)	/* [IN] The flags that we use to list */
+static int
+DirCompareName(PDIR_ENTRY lpFile1, PDIR_ENTRY lpFile2)
 {
-  ULARGE_INTEGER u64File1;
-  ULARGE_INTEGER u64File2;
-  int i;
-  long iComp = 0;					/* The comparison result */
+	return _tcscmp(lpFile1->pszKey, lpFile2->pszKey);
+}
 
-	/* Calculate critiries by order given from user */
-	for (i = 0;i < lpFlags->stOrderBy.sCriteriaCount;i++)
-	{
+static int
+DirCompareExtension(PDIR_ENTRY lpFile1, PDIR_ENTRY lpFile2)
+{
+	return _tcscmp(lpFile1->pszExtKey, lpFile2->pszExtKey);
+}
 
-		/* Calculate criteria */
-		switch(lpFlags->stOrderBy.eCriteria[i])
+static int
+DirCompareSize(PDIR_ENTRY lpFile1, PDIR_ENTRY lpFile2)
+{
+	if (lpFile1->u64Size < lpFile2->u64Size)
+		return -1;
+	return lpFile1->u64Size > lpFile2->u64Size;
+}
+
+static int
+DirCompareDirectory(PDIR_ENTRY lpFile1, PDIR_ENTRY lpFile2)
+{
+	/* Directories first */
+	return (int)(lpFile2->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) -
+	       (int)(lpFile1->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY);
+}
+
+static int
+DirCompareTime(PDIR_ENTRY lpFile1, PDIR_ENTRY lpFile2)
+{
+	if (lpFile1->u64Time < lpFile2->u64Time)
+		return -1;
+	return lpFile1->u64Time > lpFile2->u64Time;
+}
+
+/*
+ * DirSortInit
+ *
+ * Picks the comparison for each order criteria given from user
+ */
+static VOID
+DirSortInit(PDIR_SORT lpSort, LPDIRSWITCHFLAGS lpFlags)
+{
+	short i;
+
+	lpSort->sCount = lpFlags->stOrderBy.sCriteriaCount;
+	for (i = 0; i < lpSort->sCount; i++)
+	{
+		switch (lpFlags->stOrderBy.eCriteria[i])
 		{
 		case ORDER_SIZE:		/* Order by size /o:s */
-			/* concat the 32bit integers to a 64bit */
-			u64File1.LowPart = lpFile1->nFileSizeLow;
-			u64File1.HighPart = lpFile1->nFileSizeHigh;
-			u64File2.LowPart = lpFile2->nFileSizeLow;
-			u64File2.HighPart = lpFile2->nFileSizeHigh;
-
-			/* In case that differnce is too big for a long */
-			if (u64File1.QuadPart < u64File2.QuadPart)
-				iComp = -1;
-			else if (u64File1.QuadPart > u64File2.QuadPart)
-				iComp = 1;
-			else
-				iComp = 0;
+			lpSort->Compare[i] = DirCompareSize;
 			break;
-
 		case ORDER_DIRECTORY:	/* Order by directory attribute /o:g */
-			iComp = ((lpFile2->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)-
-				(lpFile1->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY));
+			lpSort->Compare[i] = DirCompareDirectory;
 			break;
-
 		case ORDER_EXTENSION:	/* Order by extension name /o:e */
-			iComp = _tcsicmp(getExt(lpFile1->cFileName),getExt(lpFile2->cFileName));
+			lpSort->Compare[i] = DirCompareExtension;
+			break;
+		case ORDER_TIME:		/* Order by file's time /o:t */
+			lpSort->Compare[i] = DirCompareTime;
 			break;
-
 		case ORDER_NAME:		/* Order by filename /o:n */
-			iComp = _tcsicmp(lpFile1->cFileName, lpFile2->cFileName);
+		default:
+			lpSort->Compare[i] = DirCompareName;
 			break;
+		}
+		lpSort->bReverse[i] = lpFlags->stOrderBy.bCriteriaRev[i];
+	}
+}
 
-		case ORDER_TIME:		/* Order by file's time /o:t */
-			/* We compare files based on the time field selected by /t */
-			switch(lpFlags->stTimeField.eTimeField)
-			{
-			case TF_CREATIONDATE:
-				/* concat the 32bit integers to a 64bit */
-				u64File1.LowPart = lpFile1->ftCreationTime.dwLowDateTime;
-				u64File1.HighPart = lpFile1->ftCreationTime.dwHighDateTime ;
-				u64File2.LowPart = lpFile2->ftCreationTime.dwLowDateTime;
-				u64File2.HighPart = lpFile2->ftCreationTime.dwHighDateTime ;
-				break;
-			case TF_LASTACCESSEDDATE :
-				/* concat the 32bit integers to a 64bit */
-				u64File1.LowPart = lpFile1->ftLastAccessTime.dwLowDateTime;
-				u64File1.HighPart = lpFile1->ftLastAccessTime.dwHighDateTime ;
-				u64File2.LowPart = lpFile2->ftLastAccessTime.dwLowDateTime;
-				u64File2.HighPart = lpFile2->ftLastAccessTime.dwHighDateTime ;
-				break;
-			case TF_MODIFIEDDATE:
-				/* concat the 32bit integers to a 64bit */
-				u64File1.LowPart = lpFile1->ftLastWriteTime.dwLowDateTime;
-				u64File1.HighPart = lpFile1->ftLastWriteTime.dwHighDateTime ;
-				u64File2.LowPart = lpFile2->ftLastWriteTime.dwLowDateTime;
-				u64File2.HighPart = lpFile2->ftLastWriteTime.dwHighDateTime ;
-				break;
-			}
+/*
+ * DirNeedSortKeys
+ *
+ * Checks if the entries need their case folded names for sorting
+ */
+static BOOL
+DirNeedSortKeys(LPDIRSWITCHFLAGS lpFlags)
+{
+	short i;
 
-			/* In case that differnce is too big for a long */
-			if (u64File1.QuadPart < u64File2.QuadPart)
-				iComp = -1;
-			else if (u64File1.QuadPart > u64File2.QuadPart)
-				iComp = 1;
-			else
-				iComp = 0;
-			break;
-		}
+	for (i = 0; i < lpFlags->stOrderBy.sCriteriaCount; i++)
+	{
+		if (lpFlags->stOrderBy.eCriteria[i] == ORDER_NAME ||
+		    lpFlags->stOrderBy.eCriteria[i] == ORDER_EXTENSION)
+			return TRUE;
+	}
+	return FALSE;
+}
 
-		/* Reverse if desired */
-		if (lpFlags->stOrderBy.bCriteriaRev[i])
-			iComp *= -1;
+/*
+ * CompareFiles
+ *
+ * Compares 2 files based on the order criteria
+ */
+static int
+CompareFiles(PDIR_ENTRY lpFile1,		/* [IN] The entry of file 1 */
+			 PDIR_ENTRY lpFile2,		/* [IN] The entry of file 2 */
+			 PDIR_SORT lpSort)			/* [IN] The comparison to use */
+{
+	short i;
+	int iComp;
+
+	for (i = 0; i < lpSort->sCount; i++)
+	{
+		iComp = lpSort->Compare[i](lpFile1, lpFile2);
 
 		/* If that criteria was enough for distinguishing
 		   the files/dirs,there is no need to calculate the others*/
-		if (iComp != 0) break;
+		if (iComp != 0)
+			return lpSort->bReverse[i] ? -iComp : iComp;
 	}
-
-	/* Translate the value of iComp to boolean */
-	return iComp > 0;
+	return 0;
 }
 
 /*
- * QsortFiles
+ * SortFiles
  *
- * Sort files by the order criterias using quicksort method
+ * Sorts files by the order criterias with a stable merge sort,
+ * ptrTemp must have room for half of the array
  */
 static VOID
-QsortFiles(LPWIN32_FIND_DATA ptrArray[],	/* [IN/OUT] The array with file info pointers */
-	   int i,				/* [IN]     The index of first item in array */
-	   int j,				/* [IN]     The index to last item in array */
-	   LPDIRSWITCHFLAGS lpFlags)		/* [IN]     The flags that we will use to sort */
+SortFiles(PDIR_ENTRY ptrArray[],	/* [IN/OUT] The array with the entries */
+		  PDIR_ENTRY ptrTemp[],		/* [IN]     Scratch space */
+		  DWORD dwCount,			/* [IN]     The quantity of entries */
+		  PDIR_SORT lpSort)			/* [IN]     The comparison to use */
 {
-	LPWIN32_FIND_DATA lpTemp;	/* A temporary pointer */
-	int First, Last, Temp;
-	BOOL Way;
+	PDIR_ENTRY lpEntry;
+	DWORD dwHalf;
+	DWORD i, j, k;
 
-	if (i < j)
+	if (dwCount <= DIR_SORT_RUN)
 	{
-		First = i;
-		Last = j;
-		Way = TRUE;
-		while (i != j)
+		for (i = 1; i < dwCount; i++)
 		{
-			if (Way == CompareFiles(ptrArray[i], ptrArray[j], lpFlags))
-			{
-				/* Swap the pointers of the array */
-				lpTemp = ptrArray[i];
-				ptrArray[i]= ptrArray[j];
-				ptrArray[j] = lpTemp;
-
-				/* Swap the indexes for inverting sorting */
-				Temp = i;
-				i = j;
-				j =Temp;
+			lpEntry = ptrArray[i];
+			for (j = i; j > 0 && CompareFiles(ptrArray[j - 1], lpEntry, lpSort) > 0; j--)
+				ptrArray[j] = ptrArray[j - 1];
+			ptrArray[j] = lpEntry;
+		}
+		return;
+	}
 
-				Way = !Way;
-			}
+	dwHalf = dwCount / 2;
+	SortFiles(ptrArray, ptrTemp, dwHalf, lpSort);
+	SortFiles(ptrArray + dwHalf, ptrTemp, dwCount - dwHalf, lpSort);
 
-			j += (!Way - Way);
-		}
+	/* The halves may already be in order */
+	if (CompareFiles(ptrArray[dwHalf - 1], ptrArray[dwHalf], lpSort) <= 0)
+		return;
 
-		QsortFiles(ptrArray,First, i-1, lpFlags);
-		QsortFiles(ptrArray,i+1,Last, lpFlags);
+	/* Merge the first half, moved aside, with the second one */
+	memcpy(ptrTemp, ptrArray, dwHalf * sizeof(PDIR_ENTRY));
+	i = 0;
+	j = dwHalf;
+	k = 0;
+	while (i < dwHalf && j < dwCount)
+	{
+		if (CompareFiles(ptrArray[j], ptrTemp[i], lpSort) < 0)
+			ptrArray[k++] = ptrArray[j++];
+		else
+			ptrArray[k++] = ptrTemp[i++];
 	}
+	while (i < dwHalf)
+		ptrArray[k++] = ptrTemp[i++];
 }
 
 
 
 /*
- * DirList
+ * DirScanCreate
  *
- * The functions that does everything except for printing results
+ * Allocates the scan of szPath, resolving it the way the listing does
  */
-static INT
-DirList(LPTSTR szPath,			/* [IN] The path that dir starts */
-		LPDIRSWITCHFLAGS lpFlags)	/* [IN] The flags of the listing */
-{	
-	BOOL fPoint;							/* If szPath is a file with extension fPoint will be True*/
-	HANDLE hSearch;							/* The handle of the search */
-	HANDLE hRecSearch;						/* The handle for searching recursivly */
-	WIN32_FIND_DATA wfdFileInfo;			/* The info of file that found */
-	LPWIN32_FIND_DATA * ptrFileArray;		/* An array of pointers with all the files */
-	PDIRFINDLISTNODE ptrStartNode;			/* The pointer to the first node */
-	PDIRFINDLISTNODE ptrNextNode;			/* A pointer used for relatives refernces */
-	TCHAR szFullPath[MAX_PATH];				/* The full path that we are listing with trailing \ */
-	TCHAR szSubPath[MAX_PATH];
-	LPTSTR pszFilePart;
-	DWORD dwCount;							/* A counter of files found in directory */
-	DWORD dwCountFiles;						/* Counter for files */
-	DWORD dwCountDirs;						/* Counter for directories */
-	ULONGLONG u64CountBytes;				/* Counter for bytes */
-	ULARGE_INTEGER u64Temp;					/* A temporary counter */
-
-	/* Initialize Variables */
-	ptrStartNode = NULL;
-	ptrNextNode = NULL;
-	dwCount = 0;
-	dwCountFiles = 0;
-	dwCountDirs = 0;
-	u64CountBytes = 0;
-	fPoint= FALSE;
+static PDIR_SCAN
+DirScanCreate(LPTSTR szPath)
+{
+	PDIR_SCAN Scan;
+
+	Scan = DirScanAlloc(sizeof(DIR_SCAN));
+	if (Scan == NULL)
+		return NULL;
+	ZeroMemory(Scan, FIELD_OFFSET(DIR_SCAN, szFullPath));
 
 	/* Create szFullPath */
-	if (GetFullPathName(szPath, sizeof(szFullPath) / sizeof(TCHAR), szFullPath, &pszFilePart) == 0)
+	if (GetFullPathName(szPath, sizeof(Scan->szFullPath) / sizeof(TCHAR), Scan->szFullPath, &Scan->pszFilePart) == 0)
 	{
-		_tcscpy (szFullPath, szPath);
-		pszFilePart = NULL;
+		_tcscpy (Scan->szFullPath, szPath);
+		Scan->pszFilePart = NULL;
 	}
 
 	/* If no wildcard or file was specified and this is a directory, then
 	   display all files in it */
-	if (pszFilePart == NULL || IsExistingDirectory(szFullPath))
+	if (Scan->pszFilePart == NULL || IsExistingDirectory(Scan->szFullPath))
 	{
-		pszFilePart = &szFullPath[_tcslen(szFullPath)];
-		if (pszFilePart[-1] != _T('\\'))
-			*pszFilePart++ = _T('\\');
-		_tcscpy(pszFilePart, _T("*"));
+		Scan->pszFilePart = &Scan->szFullPath[_tcslen(Scan->szFullPath)];
+		if (Scan->pszFilePart[-1] != _T('\\'))
+			*Scan->pszFilePart++ = _T('\\');
+		_tcscpy(Scan->pszFilePart, _T("*"));
 	}
 
-	/* Prepare the linked list, first node is allocated */
-	ptrStartNode = cmd_alloc(sizeof(DIRFINDLISTNODE));
-	if (ptrStartNode == NULL)
+	/*Checking ir szPath is a File with/wout extension*/
+	if (szPath[_tcslen(szPath) - 1] == _T('.'))
+		Scan->fPoint = TRUE;
+
+	return Scan;
+}
+
+/*
+ * DirScanFreeBlocks
+ *
+ * Releases the find records of a scan once they have been printed
+ */
+static VOID
+DirScanFreeBlocks(PDIR_SCAN Scan)
+{
+	PDIR_BLOCK ptrBlock;
+
+	while ((ptrBlock = Scan->ptrFirstBlock) != NULL)
 	{
-		WARN("DEBUG: Cannot allocate memory for ptrStartNode!\n");
-		return 1;	/* Error cannot allocate memory for 1st object */
+		Scan->ptrFirstBlock = ptrBlock->ptrNext;
+		DirScanFree(ptrBlock);
 	}
-	ptrNextNode = ptrStartNode;
+	Scan->ptrLastBlock = NULL;
+}
 
-	/*Checking ir szPath is a File with/wout extension*/
-	if (szPath[_tcslen(szPath) - 1] == _T('.'))
-		fPoint= TRUE;
+/*
+ * DirScanDestroy
+ *
+ * Frees a scan together with the scans of its subdirectories
+ */
+static VOID
+DirScanDestroy(PDIR_SCAN Scan)
+{
+	PDIR_SCAN Child;
+
+	while ((Child = Scan->ptrFirstChild) != NULL)
+	{
+		Scan->ptrFirstChild = Child->ptrNextSibling;
+		DirScanDestroy(Child);
+	}
+	DirScanFreeBlocks(Scan);
+	DirScanFree(Scan);
+}
+
+/*
+ * DirScanAddEntry
+ *
+ * Stores a found file as a compact entry in the arena of a scan
+ */
+static PDIR_ENTRY
+DirScanAddEntry(PDIR_SCAN Scan,
+				LPWIN32_FIND_DATA lpFindData,
+				LPDIRSWITCHFLAGS lpFlags,
+				BOOL bSortKeys)
+{
+	PDIR_BLOCK ptrBlock = Scan->ptrLastBlock;
+	PDIR_ENTRY lpEntry;
+	LPFILETIME lpTime;
+	SIZE_T cchName;
+	SIZE_T cchShort;
+	SIZE_T cbEntry;
+	LPTSTR p;
+
+	cchName = _tcslen(lpFindData->cFileName) + 1;
+	cchShort = _tcslen(lpFindData->cAlternateFileName) + 1;
+	cbEntry = FIELD_OFFSET(DIR_ENTRY, cFileName[cchName + cchShort + (bSortKeys ? cchName : 0)]);
+	cbEntry = (cbEntry + sizeof(ULONGLONG) - 1) & ~(sizeof(ULONGLONG) - 1);
+
+	if (ptrBlock == NULL || ptrBlock->dwUsed + cbEntry > sizeof(ptrBlock->Data))
+	{
+		ptrBlock = DirScanAlloc(sizeof(DIR_BLOCK));
+		if (ptrBlock == NULL)
+			return NULL;
+		ptrBlock->ptrNext = NULL;
+		ptrBlock->dwUsed = 0;
+
+		if (Scan->ptrLastBlock)
+			Scan->ptrLastBlock->ptrNext = ptrBlock;
+		else
+			Scan->ptrFirstBlock = ptrBlock;
+		Scan->ptrLastBlock = ptrBlock;
+	}
+
+	lpEntry = (PDIR_ENTRY)((PBYTE)ptrBlock->Data + ptrBlock->dwUsed);
+	ptrBlock->dwUsed += (DWORD)cbEntry;
+	lpEntry->cbEntry = (USHORT)cbEntry;
+	lpEntry->dwFileAttributes = lpFindData->dwFileAttributes;
+	lpEntry->u64Size = ((ULONGLONG)lpFindData->nFileSizeHigh << 32) | lpFindData->nFileSizeLow;
+
+	/* Only the time field selected by /t is ever displayed or sorted by */
+	switch (lpFlags->stTimeField.eTimeField)
+	{
+		case TF_CREATIONDATE:
+			lpTime = &lpFindData->ftCreationTime;
+			break;
+		case TF_LASTACCESSEDDATE:
+			lpTime = &lpFindData->ftLastAccessTime;
+			break;
+		case TF_MODIFIEDDATE:
+		default:
+			lpTime = &lpFindData->ftLastWriteTime;
+			break;
+	}
+	lpEntry->u64Time = ((ULONGLONG)lpTime->dwHighDateTime << 32) | lpTime->dwLowDateTime;
+
+	memcpy(lpEntry->cFileName, lpFindData->cFileName, cchName * sizeof(TCHAR));
+	lpEntry->cAlternateFileName = &lpEntry->cFileName[cchName];
+	memcpy(lpEntry->cAlternateFileName, lpFindData->cAlternateFileName, cchShort * sizeof(TCHAR));
+
+	/* If lower case is selected do it here */
+	if (lpFlags->bLowerCase)
+	{
+		_tcslwr(lpEntry->cAlternateFileName);
+		_tcslwr(lpEntry->cFileName);
+	}
+
+	/* Fold the name once here instead of in every comparison */
+	lpEntry->pszKey = NULL;
+	lpEntry->pszExtKey = NULL;
+	if (bSortKeys)
+	{
+		lpEntry->pszKey = &lpEntry->cAlternateFileName[cchShort];
+		for (p = lpEntry->cFileName; *p; p++)
+			lpEntry->pszKey[p - lpEntry->cFileName] = _totlower(*p);
+		lpEntry->pszKey[p - lpEntry->cFileName] = _T('\0');
+		lpEntry->pszExtKey = getExt(lpEntry->pszKey);
+	}
+
+	return lpEntry;
+}
+
+/*
+ * DirScanAddChild
+ *
+ * Appends the scan of subdirectory cFileName to the children of a scan
+ */
+static BOOL
+DirScanAddChild(PDIR_SCAN Scan, LPCTSTR cFileName, PDIR_SCAN **pptrLink)
+{
+	TCHAR szSubPath[MAX_PATH];
+	PDIR_SCAN Child;
+
+	/* We search for directories other than "." and ".." */
+	if (!_tcscmp(cFileName, _T(".")) || !_tcscmp(cFileName, _T("..")))
+		return TRUE;
+
+	/* Concat the path and the directory to do recursive */
+	memcpy(szSubPath, Scan->szFullPath, (Scan->pszFilePart - Scan->szFullPath) * sizeof(TCHAR));
+	_tcscpy(&szSubPath[Scan->pszFilePart - Scan->szFullPath], cFileName);
+	_tcscat(szSubPath, _T("\\"));
+	_tcscat(szSubPath, Scan->pszFilePart);
+
+	Child = DirScanCreate(szSubPath);
+	if (Child == NULL)
+		return FALSE;
+
+	**pptrLink = Child;
+	*pptrLink = &Child->ptrNextSibling;
+	return TRUE;
+}
+
+/*
+ * DirCanStream
+ *
+ * Checks if the entries can be printed as they are found, which is
+ * the case unless they are sorted or laid out in columns
+ */
+static BOOL
+DirCanStream(LPDIRSWITCHFLAGS lpFlags)
+{
+	return lpFlags->stOrderBy.sCriteriaCount == 0 && !DirUseWideList(lpFlags);
+}
+
+/*
+ * DirStreamHeader
+ *
+ * Prints the header of a streamed directory
+ */
+static VOID
+DirStreamHeader(PDIR_SCAN Scan, LPDIRSWITCHFLAGS lpFlags)
+{
+	Scan->bHeaderDone = TRUE;
+	if (lpFlags->bBareFormat)
+		return;
+
+	Scan->pszFilePart[-1] = _T('\0'); /* truncate to directory name only */
+	if (DirPrintHeader(Scan->szFullPath, lpFlags))
+		Scan->bStreamQuit = TRUE;
+	Scan->pszFilePart[-1] = _T('\\');
+}
+
+/*
+ * DirStreamEntry
+ *
+ * Prints an entry of a streamed directory as soon as it is found
+ */
+static VOID
+DirStreamEntry(PDIR_SCAN Scan, PDIR_ENTRY lpEntry, LPDIRSWITCHFLAGS lpFlags)
+{
+	/* In recursive mode the header is only printed if we have results */
+	if (!Scan->bHeaderDone)
+		DirStreamHeader(Scan, lpFlags);
+
+	if (!Scan->bStreamQuit && !bCtrlBreak)
+	{
+		Scan->pszFilePart[-1] = _T('\0');
+		DirPrintEntry(lpEntry, Scan->szFullPath, lpFlags);
+		Scan->pszFilePart[-1] = _T('\\');
+	}
+
+	/* Nothing is kept, the next entry reuses the same space */
+	Scan->ptrLastBlock->dwUsed = 0;
+}
+
+/*
+ * DirScanDirectory
+ *
+ * Collects the entries of one directory and, for /S, its subdirectories
+ */
+static VOID
+DirScanDirectory(PDIR_SCAN Scan, LPDIRSWITCHFLAGS lpFlags)
+{
+	HANDLE hSearch;							/* The handle of the search */
+	WIN32_FIND_DATA wfdFileInfo;			/* The info of file that found */
+	PDIR_ENTRY lpEntry;
+	TCHAR szSubPath[MAX_PATH];
+	PDIR_SCAN *pptrLink;
+	BOOL bSinglePass;
+	BOOL bSortKeys;
+
+	pptrLink = &Scan->ptrFirstChild;
+	bSortKeys = DirNeedSortKeys(lpFlags);
+
+	/* A "*" listing already sees every subdirectory, so the recursion can be
+	   collected from the same enumeration */
+	bSinglePass = lpFlags->bRecursive &&
+	              (!_tcscmp(Scan->pszFilePart, _T("*")) || !_tcscmp(Scan->pszFilePart, _T("*.*")));
 
 	/* Collect the results for the current folder */
-	hSearch = FindFirstFile(szFullPath, &wfdFileInfo);
+	hSearch = FindFirstFile(Scan->szFullPath, &wfdFileInfo);
 	if (hSearch != INVALID_HANDLE_VALUE)
 	{
 		do
 		{
+			/* The recursive is done on ALL (independent of their attribs)
+			   directories of the current one */
+			if (bSinglePass && (wfdFileInfo.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
+			    !DirScanAddChild(Scan, wfdFileInfo.cFileName, &pptrLink))
+				goto failed;
+
 			/*If retrieved FileName has extension,and szPath doesnt have extension then JUMP the retrieved FileName*/
-			if(_tcschr(wfdFileInfo.cFileName,_T('.'))&&(fPoint==TRUE))
-			{
+			if (_tcschr(wfdFileInfo.cFileName, _T('.')) && Scan->fPoint)
 				continue;
+
 			/* Here we filter all the specified attributes */
-			}else if ((wfdFileInfo.dwFileAttributes & lpFlags->stAttribs.dwAttribMask )
-					== (lpFlags->stAttribs.dwAttribMask & lpFlags->stAttribs.dwAttribVal ))
-				{
-					ptrNextNode->ptrNext = cmd_alloc(sizeof(DIRFINDLISTNODE));
-					if (ptrNextNode->ptrNext == NULL)
-					{
-						WARN("DEBUG: Cannot allocate memory for ptrNextNode->ptrNext!\n");
-						while (ptrStartNode)
-						{
-							ptrNextNode = ptrStartNode->ptrNext;
-							cmd_free(ptrStartNode);
-							ptrStartNode = ptrNextNode;
-							dwCount --;
-						}
-						FindClose(hSearch);
-						return 1;
-					}
-
-				/* If cmd_alloc fails we go to next file in hope it works,
-				   without braking the linked list! */
-					if (ptrNextNode->ptrNext)
-					{
-					/* Copy the info of search at linked list */
-						memcpy(&ptrNextNode->ptrNext->stFindInfo,
-								&wfdFileInfo,
-								sizeof(WIN32_FIND_DATA));
-
-					/* If lower case is selected do it here */
-						if (lpFlags->bLowerCase)
-						{
-						_tcslwr(ptrNextNode->ptrNext->stFindInfo.cAlternateFileName);
-						_tcslwr(ptrNextNode->ptrNext->stFindInfo.cFileName);
-						}
-
-					/* Continue at next node at linked list */
-						ptrNextNode = ptrNextNode->ptrNext;
-						dwCount ++;
-
-					/* Grab statistics */
-						if (wfdFileInfo.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-						{
-						/* Directory */
-							dwCountDirs++;
-						}
-						else
-							{
-						/* File */
-							dwCountFiles++;
-							u64Temp.HighPart = wfdFileInfo.nFileSizeHigh;
-							u64Temp.LowPart = wfdFileInfo.nFileSizeLow;
-							u64CountBytes += u64Temp.QuadPart;
-						}
-					}
-				}
-		} while (FindNextFile(hSearch, &wfdFileInfo));
+			if ((wfdFileInfo.dwFileAttributes & lpFlags->stAttribs.dwAttribMask)
+				!= (lpFlags->stAttribs.dwAttribMask & lpFlags->stAttribs.dwAttribVal))
+				continue;
+
+			lpEntry = DirScanAddEntry(Scan, &wfdFileInfo, lpFlags, bSortKeys);
+			if (lpEntry == NULL)
+				goto failed;
+			Scan->dwCount++;
+
+			/* Grab statistics */
+			if (wfdFileInfo.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			{
+				/* Directory */
+				Scan->dwCountDirs++;
+			}
+			else
+			{
+				/* File */
+				Scan->dwCountFiles++;
+				Scan->u64CountBytes += lpEntry->u64Size;
+			}
+
+			if (Scan->bStream)
+				DirStreamEntry(Scan, lpEntry, lpFlags);
+
+			/* A streamed listing stops at once on Ctrl-C */
+		} while (!(Scan->bStream && bCtrlBreak) && FindNextFile(hSearch, &wfdFileInfo));
 		FindClose(hSearch);
 	}
 
-	/* Terminate list */
-	ptrNextNode->ptrNext = NULL;
+	if (lpFlags->bRecursive && !bSinglePass)
+	{
+		/* The new search is involving any *.* file */
+		memcpy(szSubPath, Scan->szFullPath, (Scan->pszFilePart - Scan->szFullPath) * sizeof(TCHAR));
+		_tcscpy(&szSubPath[Scan->pszFilePart - Scan->szFullPath], _T("*.*"));
 
-	/* Calculate and allocate space need for making an array of pointers */
-	ptrFileArray = cmd_alloc(sizeof(LPWIN32_FIND_DATA) * dwCount);
-	if (ptrFileArray == NULL)
+		hSearch = FindFirstFile(szSubPath, &wfdFileInfo);
+		if (hSearch != INVALID_HANDLE_VALUE)
+		{
+			do
+			{
+				if ((wfdFileInfo.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
+				    !DirScanAddChild(Scan, wfdFileInfo.cFileName, &pptrLink))
+					goto failed;
+			} while (FindNextFile(hSearch, &wfdFileInfo));
+			FindClose(hSearch);
+		}
+	}
+
+	return;
+
+failed:
+	WARN("DEBUG: Cannot allocate memory while scanning %s!\n", debugstr_aw(Scan->szFullPath));
+	FindClose(hSearch);
+	Scan->bFailed = TRUE;
+}
+
+/*
+ * DirScanFinish
+ *
+ * Publishes a finished scan and queues its subdirectories
+ */
+static VOID
+DirScanFinish(PDIR_SCANNER Scanner, PDIR_SCAN Scan)
+{
+	PDIR_SCAN Child;
+
+	EnterCriticalSection(&Scanner->Lock);
+
+	/* Push the subdirectories so that the first one is scanned next, which
+	   keeps the workers close to the order the tree is printed in */
+	if (!Scan->bFailed && Scan->ptrFirstChild != NULL)
 	{
-		WARN("DEBUG: Cannot allocate memory for ptrFileArray!\n");
-		while (ptrStartNode)
+		for (Child = Scan->ptrFirstChild; Child->ptrNextSibling; Child = Child->ptrNextSibling)
+			Child->ptrNextQueued = Child->ptrNextSibling;
+		Child->ptrNextQueued = Scanner->ptrStack;
+		Scanner->ptrStack = Scan->ptrFirstChild;
+		SetEvent(Scanner->hWork);
+	}
+
+	Scan->eState = SCAN_DONE;
+	SetEvent(Scanner->hDone);
+	LeaveCriticalSection(&Scanner->Lock);
+}
+
+/*
+ * DirScanWorker
+ *
+ * Scans queued directories until the scanner is stopped
+ */
+static DWORD WINAPI
+DirScanWorker(LPVOID lpParameter)
+{
+	PDIR_SCANNER Scanner = lpParameter;
+	PDIR_SCAN Scan;
+
+	EnterCriticalSection(&Scanner->Lock);
+	while (!Scanner->bStop)
+	{
+		Scan = Scanner->ptrStack;
+		if (Scan == NULL || Scanner->dwAhead >= DIR_SCAN_AHEAD)
 		{
-			ptrNextNode = ptrStartNode->ptrNext;
-			cmd_free(ptrStartNode);
-			ptrStartNode = ptrNextNode;
-			dwCount --;
+			ResetEvent(Scanner->hWork);
+			LeaveCriticalSection(&Scanner->Lock);
+			WaitForSingleObject(Scanner->hWork, INFINITE);
+			EnterCriticalSection(&Scanner->Lock);
+			continue;
 		}
+
+		Scanner->ptrStack = Scan->ptrNextQueued;
+		Scan->eState = SCAN_RUNNING;
+		Scan->bPrefetched = TRUE;
+		Scanner->dwAhead++;
+		LeaveCriticalSection(&Scanner->Lock);
+
+		DirScanDirectory(Scan, Scanner->lpFlags);
+		DirScanFinish(Scanner, Scan);
+
+		EnterCriticalSection(&Scanner->Lock);
+	}
+	LeaveCriticalSection(&Scanner->Lock);
+
+	return 0;
+}
+
+/*
+ * DirScanStart
+ *
+ * Starts the worker threads; with none of them the listing scans inline
+ */
+static VOID
+DirScanStart(PDIR_SCANNER Scanner, LPDIRSWITCHFLAGS lpFlags)
+{
+	SYSTEM_INFO SystemInfo;
+	DWORD dwThreads;
+
+	ZeroMemory(Scanner, sizeof(DIR_SCANNER));
+	Scanner->lpFlags = lpFlags;
+	InitializeCriticalSection(&Scanner->Lock);
+	Scanner->hWork = CreateEvent(NULL, TRUE, FALSE, NULL);
+	Scanner->hDone = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (Scanner->hWork == NULL || Scanner->hDone == NULL)
+		return;
+
+	/* Enumerating is mostly waiting on the file system, so use at least two
+	   threads even on a single processor */
+	GetSystemInfo(&SystemInfo);
+	dwThreads = min(max(SystemInfo.dwNumberOfProcessors, 2), DIR_SCAN_THREADS);
+
+	while (Scanner->dwThreads < dwThreads)
+	{
+		Scanner->hThreads[Scanner->dwThreads] = CreateThread(NULL, 0, DirScanWorker, Scanner, 0, NULL);
+		if (Scanner->hThreads[Scanner->dwThreads] == NULL)
+			break;
+		Scanner->dwThreads++;
+	}
+	TRACE("DirScanStart: %lu worker threads\n", Scanner->dwThreads);
+}
+
+/*
+ * DirScanStop
+ *
+ * Stops the worker threads and releases the scanner
+ */
+static VOID
+DirScanStop(PDIR_SCANNER Scanner)
+{
+	DWORD i;
+
+	if (Scanner->dwThreads > 0)
+	{
+		EnterCriticalSection(&Scanner->Lock);
+		Scanner->bStop = TRUE;
+		SetEvent(Scanner->hWork);
+		LeaveCriticalSection(&Scanner->Lock);
+
+		WaitForMultipleObjects(Scanner->dwThreads, Scanner->hThreads, TRUE, INFINITE);
+		for (i = 0; i < Scanner->dwThreads; i++)
+			CloseHandle(Scanner->hThreads[i]);
+	}
+
+	if (Scanner->hWork)
+		CloseHandle(Scanner->hWork);
+	if (Scanner->hDone)
+		CloseHandle(Scanner->hDone);
+	DeleteCriticalSection(&Scanner->Lock);
+}
+
+/*
+ * DirScanWait
+ *
+ * Waits until the results of a scan are ready, scanning the directory
+ * right here if no worker has picked it up yet
+ */
+static VOID
+DirScanWait(PDIR_SCANNER Scanner, PDIR_SCAN Scan)
+{
+	PDIR_SCAN *pptrLink;
+
+	EnterCriticalSection(&Scanner->Lock);
+	while (Scan->eState == SCAN_RUNNING)
+	{
+		ResetEvent(Scanner->hDone);
+		LeaveCriticalSection(&Scanner->Lock);
+		WaitForSingleObject(Scanner->hDone, INFINITE);
+		EnterCriticalSection(&Scanner->Lock);
+	}
+
+	if (Scan->eState == SCAN_DONE)
+	{
+		LeaveCriticalSection(&Scanner->Lock);
+		return;
+	}
+
+	/* Take it off the work stack, it is usually at the top */
+	for (pptrLink = &Scanner->ptrStack; *pptrLink != NULL; pptrLink = &(*pptrLink)->ptrNextQueued)
+	{
+		if (*pptrLink == Scan)
+		{
+			*pptrLink = Scan->ptrNextQueued;
+			break;
+		}
+	}
+	Scan->eState = SCAN_RUNNING;
+	LeaveCriticalSection(&Scanner->Lock);
+
+	/* Scanned here, so it can be printed while it is enumerated */
+	Scan->bStream = DirCanStream(Scanner->lpFlags);
+	DirScanDirectory(Scan, Scanner->lpFlags);
+	DirScanFinish(Scanner, Scan);
+}
+
+/*
+ * DirPrintBuffered
+ *
+ * Sorts and prints the entries collected for one directory
+ */
+static INT
+DirPrintBuffered(PDIR_SCAN Scan,			/* [IN] The results of the directory */
+				 LPDIRSWITCHFLAGS lpFlags)	/* [IN] The flags of the listing */
+{
+	PDIR_ENTRY * ptrFileArray;				/* An array of pointers with all the files */
+	PDIR_BLOCK ptrBlock;
+	DIR_SORT stSort;
+	DWORD dwCount;
+	DWORD dwSlots;
+	DWORD i;
+
+	/* Calculate and allocate space need for making an array of pointers,
+	   sorting needs room for half as many again */
+	dwSlots = Scan->dwCount;
+	if (lpFlags->stOrderBy.sCriteriaCount > 0)
+		dwSlots += Scan->dwCount / 2;
+	ptrFileArray = cmd_alloc(sizeof(PDIR_ENTRY) * dwSlots);
+	if (ptrFileArray == NULL)
+	{
+		WARN("DEBUG: Cannot allocate memory for ptrFileArray!\n");
 		return 1;
 	}
 
 	/*
-	 * Create an array of pointers from the linked list
-	 * this will be used to sort and print data, rather than the list
+	 * Create an array of pointers from the arena
+	 * this will be used to sort and print data
 	 */
-	ptrNextNode = ptrStartNode;
 	dwCount = 0;
-	while (ptrNextNode->ptrNext)
+	for (ptrBlock = Scan->ptrFirstBlock; ptrBlock; ptrBlock = ptrBlock->ptrNext)
 	{
-		*(ptrFileArray + dwCount) = &ptrNextNode->ptrNext->stFindInfo;
-		ptrNextNode = ptrNextNode->ptrNext;
-		dwCount++;
+		for (i = 0; i < ptrBlock->dwUsed; i += ptrFileArray[dwCount - 1]->cbEntry)
+			ptrFileArray[dwCount++] = (PDIR_ENTRY)((PBYTE)ptrBlock->Data + i);
 	}
 
 	/* Sort Data if requested*/
 	if (lpFlags->stOrderBy.sCriteriaCount > 0)
-		QsortFiles(ptrFileArray, 0, dwCount-1, lpFlags);
+	{
+		DirSortInit(&stSort, lpFlags);
+		SortFiles(ptrFileArray, ptrFileArray + dwCount, dwCount, &stSort);
+	}
 
 	/* Print Data */
-	pszFilePart[-1] = _T('\0'); /* truncate to directory name only */
-	DirPrintFiles(ptrFileArray, dwCount, szFullPath, lpFlags);
-	pszFilePart[-1] = _T('\\');
+	Scan->pszFilePart[-1] = _T('\0'); /* truncate to directory name only */
+	DirPrintFiles(ptrFileArray, dwCount, Scan->szFullPath, lpFlags);
+	Scan->pszFilePart[-1] = _T('\\');
+
+	/* Free array */
+	cmd_free(ptrFileArray);
+
+	return 0;
+}
+
+/*
+ * DirPrintScan
+ *
+ * Prints the results of one directory
+ */
+static INT
+DirPrintScan(PDIR_SCAN Scan,			/* [IN] The results of the directory */
+			 LPDIRSWITCHFLAGS lpFlags)	/* [IN] The flags of the listing */
+{
+	if (Scan->bFailed)
+		return 1;
+
+	/* Streamed entries have been printed while scanning */
+	if (!Scan->bStream && DirPrintBuffered(Scan, lpFlags) != 0)
+		return 1;
 
 	if (lpFlags->bRecursive)
 	{
-		PrintSummary(szFullPath,
-			dwCountFiles,
-			dwCountDirs,
-			u64CountBytes,
+		PrintSummary(Scan->szFullPath,
+			Scan->dwCountFiles,
+			Scan->dwCountDirs,
+			Scan->u64CountBytes,
 			lpFlags,
 			FALSE);
 	}
 
-	/* Free array */
-	cmd_free(ptrFileArray);
-	/* Free linked list */
-	while (ptrStartNode)
-	{
-		ptrNextNode = ptrStartNode->ptrNext;
-		cmd_free(ptrStartNode);
-		ptrStartNode = ptrNextNode;
-		dwCount --;
-	}
-
 	if (CheckCtrlBreak(BREAK_INPUT))
 		return 1;
 
-
 	/* Add statistics to recursive statistics*/
-	recurse_dir_cnt += dwCountDirs;
-	recurse_file_cnt += dwCountFiles;
-	recurse_bytes += u64CountBytes;
+	recurse_dir_cnt += Scan->dwCountDirs;
+	recurse_file_cnt += Scan->dwCountFiles;
+	recurse_bytes += Scan->u64CountBytes;
 
-	/* Do the recursive job if requested
-	   the recursive is be done on ALL(indepent of their attribs)
-	   directoried of the current one.*/
-	if (lpFlags->bRecursive)
+	return 0;
+}
+
+/*
+ * DirListTree
+ *
+ * Prints a directory and then, depth first, its subdirectories
+ */
+static INT
+DirListTree(PDIR_SCANNER Scanner, PDIR_SCAN Scan, LPDIRSWITCHFLAGS lpFlags)
+{
+	PDIR_SCAN Child;
+	INT ret;
+
+	if (Scanner)
 	{
-		/* The new search is involving any *.* file */
-		memcpy(szSubPath, szFullPath, (pszFilePart - szFullPath) * sizeof(TCHAR));
-		_tcscpy(&szSubPath[pszFilePart - szFullPath], _T("*.*"));
+		DirScanWait(Scanner, Scan);
+	}
+	else
+	{
+		Scan->bStream = DirCanStream(lpFlags);
+		if (Scan->bStream && !lpFlags->bRecursive)
+			DirStreamHeader(Scan, lpFlags);
+		DirScanDirectory(Scan, lpFlags);
+	}
 
-		hRecSearch = FindFirstFile (szSubPath, &wfdFileInfo);
-		if (hRecSearch != INVALID_HANDLE_VALUE)
-		{
-			do
-			{
-				/* We search for directories other than "." and ".." */
-				if ((_tcsicmp(wfdFileInfo.cFileName, _T(".")) != 0) &&
-				    (_tcsicmp(wfdFileInfo.cFileName, _T("..")) != 0 ) &&
-				    (wfdFileInfo.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
-				{
-					/* Concat the path and the directory to do recursive */
-					memcpy(szSubPath, szFullPath, (pszFilePart - szFullPath) * sizeof(TCHAR));
-					_tcscpy(&szSubPath[pszFilePart - szFullPath], wfdFileInfo.cFileName);
-					_tcscat(szSubPath, _T("\\"));
-					_tcscat(szSubPath, pszFilePart);
-
-					/* We do the same for the folder */
-					if (DirList(szSubPath, lpFlags) != 0)
-					{
-						FindClose(hRecSearch);
-						return 1;
-					}
-				}
-			} while(FindNextFile(hRecSearch, &wfdFileInfo));
-		}
-		FindClose(hRecSearch);
+	ret = DirPrintScan(Scan, lpFlags);
+
+	/* The entries are not needed anymore, let the workers scan further */
+	DirScanFreeBlocks(Scan);
+	if (Scanner && Scan->bPrefetched)
+	{
+		EnterCriticalSection(&Scanner->Lock);
+		Scanner->dwAhead--;
+		SetEvent(Scanner->hWork);
+		LeaveCriticalSection(&Scanner->Lock);
+	}
+
+	if (ret != 0)
+		return ret;
+
+	/* We do the same for the folders */
+	while ((Child = Scan->ptrFirstChild) != NULL)
+	{
+		if (DirListTree(Scanner, Child, lpFlags) != 0)
+			return 1;
+		Scan->ptrFirstChild = Child->ptrNextSibling;
+		DirScanDestroy(Child);
 	}
 
 	return 0;
 }
 
+/*
+ * DirList
+ *
+ * The functions that does everything except for printing results
+ */
+static INT
+DirList(LPTSTR szPath,			/* [IN] The path that dir starts */
+		LPDIRSWITCHFLAGS lpFlags)	/* [IN] The flags of the listing */
+{
+	DIR_SCANNER Scanner;
+	PDIR_SCAN Scan;
+	INT ret;
+
+	Scan = DirScanCreate(szPath);
+	if (Scan == NULL)
+	{
+		WARN("DEBUG: Cannot allocate memory for the scan of %s!\n", debugstr_aw(szPath));
+		return 1;
+	}
+
+	if (!lpFlags->bRecursive)
+	{
+		ret = DirListTree(NULL, Scan, lpFlags);
+	}
+	else
+	{
+		/* Let worker threads enumerate the subdirectories ahead of the
+		   output, which is still produced here in depth first order.
+		   Directories reached before a worker got to them are streamed */
+		DirScanStart(&Scanner, lpFlags);
+		ret = DirListTree(&Scanner, Scan, lpFlags);
+		DirScanStop(&Scanner);
+	}
+
+	DirScanDestroy(Scan);
+	return ret;
+}
+
 
 
 /*
@@ -105,9 +105,13 @@ static LPTSTR ReadFileContents(FILE *InputFile, TCHAR *Buffer)
 		DWORD CharsRead = _tcslen(Buffer);
 		while (Len + CharsRead >= AllocLen)
 		{
-			Contents = cmd_realloc(Contents, (AllocLen *= 2) * sizeof(TCHAR));
-			if (!Contents)
+			LPTSTR NewContents = cmd_realloc(Contents, (AllocLen *= 2) * sizeof(TCHAR));
+			if (!NewContents)
+			{
+				cmd_free(Contents);
 				return NULL;
+			}
+			Contents = NewContents;
 		}
 		_tcscpy(&Contents[Len], Buffer);
 		Len += CharsRead;
@@ -117,6 +121,97 @@ static LPTSTR ReadFileContents(FILE *InputFile, TCHAR *Buffer)
 	return Contents;
 }
 
+/* Read the next line of a text file, without the newline. Lines that don't
+ * fit in Buffer are collected in *pLongLine, which grows as needed.
+ * Returns NULL at the end of the file, or sets *pError if out of memory. */
+static LPTSTR ReadForLine(FILE *InputFile, TCHAR *Buffer,
+                          LPTSTR *pLongLine, DWORD *pLongLineSize, BOOL *pError)
+{
+	LPTSTR Line = Buffer;
+	DWORD Len = 0, Size = CMDLINE_LENGTH;
+
+	for (;;)
+	{
+		DWORD CharsRead;
+
+		if (!_fgetts(&Line[Len], Size - Len, InputFile))
+			return Len ? Line : NULL;
+		CharsRead = _tcslen(&Line[Len]);
+		Len += CharsRead;
+		if (Len && Line[Len - 1] == _T('\n'))
+		{
+			Line[Len - 1] = _T('\0');
+			return Line;
+		}
+		if (Len < Size - 1)
+		{
+			/* Stopped short of a newline: either the end of the file, or
+			 * a nul character in the input, after which we carry on */
+			if (feof(InputFile))
+				return Line;
+			continue;
+		}
+
+		/* Line doesn't fit: move it to the long line buffer and enlarge that */
+		if (Line == Buffer && *pLongLineSize > Size)
+		{
+			memcpy(*pLongLine, Buffer, Len * sizeof(TCHAR));
+		}
+		else
+		{
+			LPTSTR NewLine = cmd_realloc(*pLongLine, Size * 2 * sizeof(TCHAR));
+			if (!NewLine)
+			{
+				*pError = TRUE;
+				return NULL;
+			}
+			if (Line == Buffer)
+				memcpy(NewLine, Buffer, Len * sizeof(TCHAR));
+			*pLongLine = NewLine;
+			*pLongLineSize = Size * 2;
+		}
+		Line = *pLongLine;
+		Size = *pLongLineSize;
+	}
+}
+
+/* Split one line of FOR /F input into tokens, and run the
+ * command if there are any. Returns FALSE if it didn't run. */
+static BOOL ForFLine(PARSED_COMMAND *Cmd, LPTSTR In, LPCTSTR Delims, TCHAR Eol,
+                     DWORD Tokens, LPTSTR *Variables, INT *Ret)
+{
+	DWORD RemainingTokens = Tokens;
+	LPTSTR *CurVar = Variables;
+
+	/* Ignore lines where the first token starts with the eol character */
+	In += _tcsspn(In, Delims);
+	if (*In == Eol)
+		return FALSE;
+
+	while ((RemainingTokens >>= 1) != 0)
+	{
+		/* Save pointer to this token in a variable if requested */
+		if (RemainingTokens & 1)
+			*CurVar++ = In;
+		/* Find end of token */
+		In += _tcscspn(In, Delims);
+		/* Nul-terminate it and advance to next token */
+		if (*In)
+		{
+			*In++ = _T('\0');
+			In += _tcsspn(In, Delims);
+		}
+	}
+	/* Save pointer to remainder of line */
+	*CurVar = In;
+
+	/* Don't run unless the line had enough tokens to fill at least one variable */
+	if (!*Variables[0])
+		return FALSE;
+	*Ret = RunInstance(Cmd);
+	return TRUE;
+}
+
 static INT ForF(PARSED_COMMAND *Cmd, LPTSTR List, TCHAR *Buffer)
 {
 	LPTSTR Delims = _T(" \t");
@@ -127,14 +222,20 @@ static INT ForF(PARSED_COMMAND *Cmd, LPTSTR List, TCHAR *Buffer)
 	TCHAR StringQuote = _T('"');
 	TCHAR CommandQuote = _T('\'');
 	LPTSTR Variables[32];
+	TCHAR Params[CMDLINE_LENGTH];
 	TCHAR *Start, *End;
+	LPTSTR LongLine = NULL;
+	DWORD LongLineSize = 0;
 	INT i;
 	INT Ret = 0;
 
 	if (Cmd->For.Params)
 	{
 		TCHAR Quote = 0;
-		TCHAR *Param = Cmd->For.Params;
+		TCHAR *Param = Params;
+
+		/* Work on a copy, the command may be executed again */
+		_tcscpy(Params, Cmd->For.Params);
 		if (*Param == _T('"') || *Param == _T('\''))
 			Quote = *Param++;
 
@@ -253,32 +354,54 @@ static INT ForF(PARSED_COMMAND *Cmd, LPTSTR List, TCHAR *Buffer)
 	while (GetNextElement(&Start, &End))
 	{
 		FILE *InputFile;
-		LPTSTR FullInput, In, NextLine;
+		BOOL Error;
+		LPTSTR In, NextLine;
 		INT Skip;
 	single_element:
+		Error = FALSE;
+		Skip = SkipLines;
 
 		if (*Start == StringQuote && End[-1] == StringQuote)
 		{
 			/* Input given directly as a string */
 			End[-1] = _T('\0');
-			FullInput = cmd_dup(Start + 1);
+			In = cmd_dup(Start + 1);
 		}
 		else if (*Start == CommandQuote && End[-1] == CommandQuote)
 		{
-			/* Read input from a command */
+			/* Read input from a command, and run the command for each
+			 * line as soon as it has been read rather than waiting for
+			 * the whole output */
 			End[-1] = _T('\0');
+			ConFlush();
 			InputFile = _tpopen(Start + 1, _T("r"));
 			if (!InputFile)
 			{
 				error_bad_command(Start + 1);
-				return 1;
+				Ret = 1;
+				break;
+			}
+
+			while (!Exiting(Cmd) &&
+			       (In = ReadForLine(InputFile, Buffer, &LongLine, &LongLineSize, &Error)) != NULL)
+			{
+				if (--Skip < 0)
+					ForFLine(Cmd, In, Delims, Eol, Tokens, Variables, &Ret);
 			}
-			FullInput = ReadFileContents(InputFile, Buffer);
 			_pclose(InputFile);
+
+			if (Error)
+			{
+				error_out_of_memory();
+				Ret = 1;
+				break;
+			}
+			continue;
 		}
 		else
 		{
-			/* Read input from a file */
+			/* Read input from a file. The whole file is read before the
+			 * loop runs, so the body may change the file it came from */
 			TCHAR Temp = *End;
 			*End = _T('\0');
 			StripQuotes(Start);
@@ -287,62 +410,35 @@ static INT ForF(PARSED_COMMAND *Cmd, LPTSTR List, TCHAR *Buffer)
 			if (!InputFile)
 			{
 				error_sfile_not_found(Start);
-				return 1;
+				Ret = 1;
+				break;
 			}
-			FullInput = ReadFileContents(InputFile, Buffer);
+			In = ReadFileContents(InputFile, Buffer);
 			fclose(InputFile);
 		}
 
-		if (!FullInput)
+		if (!In)
 		{
 			error_out_of_memory();
-			return 1;
+			Ret = 1;
+			break;
 		}
 
 		/* Loop over the input line by line */
-		In = FullInput;
-		Skip = SkipLines;
+		NextLine = In;
 		do
 		{
-			DWORD RemainingTokens = Tokens;
-			LPTSTR *CurVar = Variables;
-
-			NextLine = _tcschr(In, _T('\n'));
+			LPTSTR Line = NextLine;
+			NextLine = _tcschr(Line, _T('\n'));
 			if (NextLine)
 				*NextLine++ = _T('\0');
-
-			if (--Skip >= 0)
-				continue;
-
-			/* Ignore lines where the first token starts with the eol character */
-			In += _tcsspn(In, Delims);
-			if (*In == Eol)
-				continue;
-
-			while ((RemainingTokens >>= 1) != 0)
-			{
-				/* Save pointer to this token in a variable if requested */
-				if (RemainingTokens & 1)
-					*CurVar++ = In;
-				/* Find end of token */
-				In += _tcscspn(In, Delims);
-				/* Nul-terminate it and advance to next token */
-				if (*In)
-				{
-					*In++ = _T('\0');
-					In += _tcsspn(In, Delims);
-				}
-			}
-			/* Save pointer to remainder of line */
-			*CurVar = In;
-
-			/* Don't run unless the line had enough tokens to fill at least one variable */
-			if (*Variables[0])
-				Ret = RunInstance(Cmd);
-		} while (!Exiting(Cmd) && (In = NextLine) != NULL);
-		cmd_free(FullInput);
+			if (--Skip < 0)
+				ForFLine(Cmd, Line, Delims, Eol, Tokens, Variables, &Ret);
+		} while (!Exiting(Cmd) && NextLine != NULL);
+		cmd_free(In);
 	}
 
+	cmd_free(LongLine);
 	return Ret;
 }
 
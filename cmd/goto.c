@@ -29,6 +29,171 @@
 #include <precomp.h>
 
 
+static UINT LabelHash(LPCTSTR Name)
+{
+	UINT Hash = 0;
+	while (*Name)
+		Hash = Hash * 31 + _totupper(*Name++);
+	return Hash % LABEL_HASH_SIZE;
+}
+
+static BATCH_LABEL *LookupLabel(LABEL_INDEX *Index, LPCTSTR Name)
+{
+	BATCH_LABEL *Label;
+	for (Label = Index->Buckets[LabelHash(Name)]; Label; Label = Label->Next)
+		if (!_tcsicmp(Label->Name, Name))
+			return Label;
+	return NULL;
+}
+
+static VOID ClearLabelIndex(LABEL_INDEX *Index)
+{
+	BATCH_LABEL *Label;
+	INT i;
+
+	for (i = 0; i < LABEL_HASH_SIZE; i++)
+	{
+		while ((Label = Index->Buckets[i]))
+		{
+			Index->Buckets[i] = Label->Next;
+			cmd_free(Label);
+		}
+	}
+	Index->FileSize = bc->FileSize;
+	Index->ftLastWrite = bc->ftLastWrite;
+	Index->ScanPos = 0;
+	Index->bComplete = FALSE;
+}
+
+VOID ReleaseLabelIndex(LABEL_INDEX *Index)
+{
+	if (Index && --Index->RefCount == 0)
+	{
+		ClearLabelIndex(Index);
+		cmd_free(Index);
+	}
+}
+
+/*
+ * If the line is a label, return its name, else NULL.
+ * The line is modified in place.
+ */
+static LPTSTR ParseLabel(LPTSTR line)
+{
+	LPTSTR tmp;
+	int pos;
+	int size;
+
+	/* Strip out any trailing spaces or control chars */
+	tmp = line + _tcslen (line) - 1;
+
+	while (tmp >= line && (_istcntrl (*tmp) || _istspace (*tmp) ||  (*tmp == _T(':'))))
+		tmp--;
+	*(tmp + 1) = _T('\0');
+
+	/* Then leading spaces... */
+	tmp = line;
+	while (_istspace (*tmp))
+		tmp++;
+
+	/* All space after leading space terminate the string */
+	size = _tcslen(tmp) -1;
+	pos=0;
+	while (tmp+pos < tmp+size)
+	{
+		if (_istspace(tmp[pos]))
+			tmp[pos]=_T('\0');
+		pos++;
+	}
+
+	if (*tmp != _T(':'))
+		return NULL;
+	return tmp + 1;
+}
+
+/*
+ * Find the first label in the current batch file named either Name1 or
+ * Name2. The file is only scanned as far as needed; every label passed on
+ * the way is remembered, so later jumps are answered from the index.
+ */
+static BOOL FindLabel(LPCTSTR Name1, LPCTSTR Name2, LPDWORD lpOffset)
+{
+	LABEL_INDEX *Index;
+	BATCH_LABEL *Label, *Label2;
+	LPTSTR Name;
+
+	if (bc->Labels == NULL)
+	{
+		bc->Labels = cmd_alloc(sizeof(LABEL_INDEX));
+		if (bc->Labels == NULL)
+		{
+			error_out_of_memory();
+			return FALSE;
+		}
+		memset(bc->Labels, 0, sizeof(LABEL_INDEX));
+		bc->Labels->RefCount = 1;
+		ClearLabelIndex(bc->Labels);
+	}
+	Index = bc->Labels;
+
+	/* Start over if the file has been changed since it was indexed */
+	BatchCheckModified();
+	if (Index->FileSize != bc->FileSize ||
+	    CompareFileTime(&Index->ftLastWrite, &bc->ftLastWrite) != 0)
+	{
+		ClearLabelIndex(Index);
+	}
+
+	while (1)
+	{
+		/* Labels are indexed in file order and only the first of each
+		 * name is kept, so the earlier of the two matches wins */
+		Label = LookupLabel(Index, Name1);
+		Label2 = LookupLabel(Index, Name2);
+		if (Label2 && (!Label || Label2->Offset < Label->Offset))
+			Label = Label2;
+		if (Label)
+		{
+			*lpOffset = Label->Offset;
+			return TRUE;
+		}
+		if (Index->bComplete)
+			return FALSE;
+
+		/* Index the next line */
+		BatchSeek (Index->ScanPos);
+		if (!BatchGetString (textline, sizeof(textline) / sizeof(textline[0])))
+		{
+			Index->bComplete = TRUE;
+			continue;
+		}
+
+		if (Index->FileSize != bc->FileSize ||
+		    CompareFileTime(&Index->ftLastWrite, &bc->ftLastWrite) != 0)
+		{
+			ClearLabelIndex(Index);
+			continue;
+		}
+		Index->ScanPos = bc->FilePos;
+
+		Name = ParseLabel(textline);
+		if (Name && !LookupLabel(Index, Name))
+		{
+			Label = cmd_alloc(FIELD_OFFSET(BATCH_LABEL, Name[_tcslen(Name) + 1]));
+			if (Label == NULL)
+			{
+				error_out_of_memory();
+				return FALSE;
+			}
+			Label->Offset = Index->ScanPos;
+			_tcscpy(Label->Name, Name);
+			Label->Next = Index->Buckets[LabelHash(Name)];
+			Index->Buckets[LabelHash(Name)] = Label;
+		}
+	}
+}
+
+
 /*
  * Perform GOTO command.
  *
@@ -38,8 +203,8 @@
 
 INT cmd_goto (LPTSTR param)
 {
-	LPTSTR tmp, tmp2;
-	LONG   lNewPosHigh = 0;
+	LPTSTR tmp;
+	DWORD  dwOffset;
 
 	TRACE ("cmd_goto (\'%s\')\n", debugstr_aw(param));
 
@@ -68,51 +233,18 @@ INT cmd_goto (LPTSTR param)
 		tmp++;
 	*(tmp) = _T('\0');
 
-	/* set file pointer to the beginning of the batch file */
-	lNewPosHigh = 0;
-
 	/* jump to end of the file */
 	if ( _tcsicmp( param, _T(":eof"))==0)
 	{
-		SetFilePointer (bc->hBatchFile, 0, &lNewPosHigh, FILE_END);
+		BatchSeek (GetFileSize (bc->hBatchFile, NULL));
 		return 0;
 	}
 
-	/* jump to begin of the file */
-	SetFilePointer (bc->hBatchFile, 0, &lNewPosHigh, FILE_BEGIN);
-
-	while (FileGetString (bc->hBatchFile, textline, sizeof(textline) / sizeof(textline[0])))
+	/* use whole label name */
+	if (FindLabel (param, param + 1, &dwOffset))
 	{
-		int pos;
-		int size;
-
-		/* Strip out any trailing spaces or control chars */
-		tmp = textline + _tcslen (textline) - 1;
-
-		while (_istcntrl (*tmp) || _istspace (*tmp) ||  (*tmp == _T(':')))
-			tmp--;
-		*(tmp + 1) = _T('\0');
-
-		/* Then leading spaces... */
-		tmp = textline;
-		while (_istspace (*tmp))
-			tmp++;
-		
-		/* All space after leading space terminate the string */
-		size = _tcslen(tmp) -1;
-		pos=0;
-		while (tmp+pos < tmp+size)
-		{
-			if (_istspace(tmp[pos]))
-				tmp[pos]=_T('\0');
-			pos++;
-		}
-
-		tmp2 = param;
-		/* use whole label name */
-		if ((*tmp == _T(':')) && ((_tcsicmp (++tmp, param) == 0) || (_tcsicmp (tmp, ++tmp2) == 0)))
-			return 0;
-
+		BatchSeek (dwOffset);
+		return 0;
 	}
 
 	ConErrResPrintf(STRING_GOTO_ERROR2, param);
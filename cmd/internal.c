@@ -364,6 +364,19 @@ BOOL DeleteFolder(LPTSTR FileName)
 	TCHAR TempFileName[MAX_PATH];
 	HANDLE hFile;
     WIN32_FIND_DATA f;
+	TREE_DELETE Delete;
+
+	/* Open each directory once and remove whole subtrees side by side */
+	if (IsTreeDeleteAvailable())
+	{
+		ZeroMemory(&Delete, sizeof(Delete));
+		Delete.bSubDirs = TRUE;
+		Delete.bRemoveDirs = TRUE;
+		Delete.bForce = TRUE;
+		Delete.dwThreads = JOB_POOL_DEFAULT_THREADS;
+		return DeleteTree(FileName, &Delete);
+	}
+
 	_tcscpy(Base,FileName);
 	_tcscat(Base,_T("\\*"));
 	hFile = FindFirstFile(Base, &f);
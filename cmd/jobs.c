@@ -0,0 +1,240 @@
+/*
+ *  JOBS.C - worker threads for commands that handle many files.
+ *
+ *  Jobs are run on a small pool of threads and retired on the thread
+ *  that submitted them, in the order they were submitted, so anything
+ *  a command prints about its files comes out in source order.
+ */
+
+#include <precomp.h>
+
+/* Jobs that may be submitted but not retired per worker thread */
+#define JOBS_PER_THREAD 4
+
+struct _JOB_POOL
+{
+	CRITICAL_SECTION Lock;
+	HANDLE hWork;				/* Counts the queued jobs */
+	HANDLE hDone;				/* Set whenever a job finishes */
+	PFILE_JOB QueueHead;		/* Jobs waiting for a thread */
+	PFILE_JOB QueueTail;
+	PFILE_JOB RetireHead;		/* All jobs not retired yet, in submission order */
+	PFILE_JOB RetireTail;
+	DWORD dwPending;			/* Number of jobs on the retire list */
+	BOOL bStop;
+	DWORD dwThreads;
+	HANDLE hThreads[JOB_POOL_MAX_THREADS];
+};
+
+static DWORD WINAPI
+JobPoolWorker(LPVOID lpParameter)
+{
+	PJOB_POOL Pool = lpParameter;
+	PFILE_JOB Job;
+
+	for (;;)
+	{
+		WaitForSingleObject(Pool->hWork, INFINITE);
+
+		EnterCriticalSection(&Pool->Lock);
+		if (Pool->bStop)
+		{
+			LeaveCriticalSection(&Pool->Lock);
+			break;
+		}
+		Job = Pool->QueueHead;
+		Pool->QueueHead = Job->NextQueued;
+		if (Pool->QueueHead == NULL)
+			Pool->QueueTail = NULL;
+		LeaveCriticalSection(&Pool->Lock);
+
+		Job->Run(Job);
+
+		EnterCriticalSection(&Pool->Lock);
+		Job->bDone = TRUE;
+		SetEvent(Pool->hDone);
+		LeaveCriticalSection(&Pool->Lock);
+	}
+
+	return 0;
+}
+
+/*
+ * Starts a pool with the given number of threads. Returns NULL if not
+ * even one thread could be started, the caller then works sequentially.
+ */
+PJOB_POOL
+CreateJobPool(DWORD dwThreads)
+{
+	PJOB_POOL Pool;
+
+	if (dwThreads > JOB_POOL_MAX_THREADS)
+		dwThreads = JOB_POOL_MAX_THREADS;
+
+	Pool = cmd_alloc(sizeof(JOB_POOL));
+	if (Pool == NULL)
+		return NULL;
+	ZeroMemory(Pool, sizeof(JOB_POOL));
+
+	InitializeCriticalSection(&Pool->Lock);
+	Pool->hWork = CreateSemaphore(NULL, 0, MAXLONG, NULL);
+	Pool->hDone = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (Pool->hWork != NULL && Pool->hDone != NULL)
+	{
+		while (Pool->dwThreads < dwThreads)
+		{
+			Pool->hThreads[Pool->dwThreads] = CreateThread(NULL, 0, JobPoolWorker, Pool, 0, NULL);
+			if (Pool->hThreads[Pool->dwThreads] == NULL)
+				break;
+			Pool->dwThreads++;
+		}
+	}
+
+	if (Pool->dwThreads == 0)
+	{
+		WARN("Cannot start a job pool, error %lu\n", GetLastError());
+		DestroyJobPool(Pool);
+		return NULL;
+	}
+
+	TRACE("CreateJobPool: %lu threads\n", Pool->dwThreads);
+	return Pool;
+}
+
+/*
+ * Retires finished jobs from the head of the retire list. With bWait
+ * it waits for the oldest one, and for all of them with bAll.
+ */
+static VOID
+RetireJobs(PJOB_POOL Pool, BOOL bWait, BOOL bAll)
+{
+	PFILE_JOB Job;
+
+	for (;;)
+	{
+		EnterCriticalSection(&Pool->Lock);
+		Job = Pool->RetireHead;
+		if (Job == NULL)
+		{
+			LeaveCriticalSection(&Pool->Lock);
+			break;
+		}
+		if (!Job->bDone)
+		{
+			if (!bWait)
+			{
+				LeaveCriticalSection(&Pool->Lock);
+				break;
+			}
+			ResetEvent(Pool->hDone);
+			LeaveCriticalSection(&Pool->Lock);
+			WaitForSingleObject(Pool->hDone, INFINITE);
+			continue;
+		}
+
+		Pool->RetireHead = Job->Next;
+		if (Pool->RetireHead == NULL)
+			Pool->RetireTail = NULL;
+		Pool->dwPending--;
+		LeaveCriticalSection(&Pool->Lock);
+
+		Job->Retire(Job);
+		if (!bAll)
+			bWait = FALSE;
+	}
+}
+
+/*
+ * Queues a job. Whatever has finished by now is retired first, and if
+ * too many jobs are outstanding the oldest one is waited for.
+ */
+VOID
+SubmitJob(PJOB_POOL Pool, PFILE_JOB Job)
+{
+	RetireJobs(Pool, Pool->dwPending >= Pool->dwThreads * JOBS_PER_THREAD, FALSE);
+
+	Job->Next = NULL;
+	Job->NextQueued = NULL;
+	Job->bDone = FALSE;
+
+	EnterCriticalSection(&Pool->Lock);
+	if (Pool->RetireTail)
+		Pool->RetireTail->Next = Job;
+	else
+		Pool->RetireHead = Job;
+	Pool->RetireTail = Job;
+	Pool->dwPending++;
+
+	if (Pool->QueueTail)
+		Pool->QueueTail->NextQueued = Job;
+	else
+		Pool->QueueHead = Job;
+	Pool->QueueTail = Job;
+	LeaveCriticalSection(&Pool->Lock);
+
+	ReleaseSemaphore(Pool->hWork, 1, NULL);
+}
+
+/*
+ * Waits for every submitted job and retires them all. Commands call
+ * this before they prompt or print anything of their own.
+ */
+VOID
+DrainJobPool(PJOB_POOL Pool)
+{
+	if (Pool != NULL)
+		RetireJobs(Pool, TRUE, TRUE);
+}
+
+VOID
+DestroyJobPool(PJOB_POOL Pool)
+{
+	DWORD i;
+
+	if (Pool == NULL)
+		return;
+
+	DrainJobPool(Pool);
+
+	if (Pool->dwThreads > 0)
+	{
+		EnterCriticalSection(&Pool->Lock);
+		Pool->bStop = TRUE;
+		LeaveCriticalSection(&Pool->Lock);
+		ReleaseSemaphore(Pool->hWork, Pool->dwThreads, NULL);
+
+		WaitForMultipleObjects(Pool->dwThreads, Pool->hThreads, TRUE, INFINITE);
+		for (i = 0; i < Pool->dwThreads; i++)
+			CloseHandle(Pool->hThreads[i]);
+	}
+
+	if (Pool->hWork != NULL)
+		CloseHandle(Pool->hWork);
+	if (Pool->hDone != NULL)
+		CloseHandle(Pool->hDone);
+	DeleteCriticalSection(&Pool->Lock);
+	cmd_free(Pool);
+}
+
+/*
+ * Parses the thread count of a /MT[:n] switch, 0 if it is not one.
+ */
+DWORD
+ParseJobThreads(LPCTSTR pszSwitch)
+{
+	INT n;
+
+	if (_tcsnicmp(pszSwitch, _T("/MT"), 3) != 0)
+		return 0;
+	if (pszSwitch[3] == _T('\0') || _istspace(pszSwitch[3]))
+		return JOB_POOL_DEFAULT_THREADS;
+	if (pszSwitch[3] != _T(':'))
+		return 0;
+
+	n = _ttoi(&pszSwitch[4]);
+	if (n < 1)
+		return 0;
+	return min((DWORD)n, JOB_POOL_MAX_THREADS);
+}
+
+/* EOF */
@@ -45,6 +45,7 @@ cgetchar (VOID)
 	INPUT_RECORD irBuffer;
 	DWORD  dwRead;
 
+	ConFlush();
 	do
 	{
 		ReadConsoleInput (hInput, &irBuffer, 1, &dwRead);
@@ -138,6 +139,9 @@ BOOL CheckCtrlBreak (INT mode)
 	TCHAR options[4]; /* Yes, No, All */
 	TCHAR c;
 
+	if (bCtrlBreak)
+		ConFlush();
+
 	switch (mode)
 	{
 		case BREAK_OUTOFBATCH:
@@ -487,6 +491,70 @@ BOOL IsExistingDirectory (LPCTSTR pszPath)
 }
 
 
+/*
+ * Matches the first cchName characters of pszName against a wildcard
+ * the way FindFirstFile does: a '*' before a '.' stops at the last
+ * period of the name, a '.' before '*', '?' or the end also matches the
+ * end of the name, and '?' matches nothing at a period or the end. So
+ * "*.*" takes names without an extension too, and "*." takes only those.
+ */
+
+BOOL MatchWildcard (LPCTSTR pszPattern, LPCTSTR pszName, SIZE_T cchName)
+{
+	LPCTSTR pszEnd = pszName + cchName;
+	LPCTSTR pszStop;
+
+	for (;;)
+	{
+		switch (*pszPattern)
+		{
+			case _T('\0'):
+				return pszName == pszEnd;
+
+			case _T('*'):
+				pszStop = pszEnd;
+				if (pszPattern[1] == _T('.'))
+				{
+					while (pszStop > pszName && pszStop[-1] != _T('.'))
+						pszStop--;
+					if (pszStop-- == pszName)
+						pszStop = pszEnd;
+				}
+				pszPattern++;
+				for (;; pszName++)
+				{
+					if (MatchWildcard (pszPattern, pszName, pszEnd - pszName))
+						return TRUE;
+					if (pszName == pszStop)
+						return FALSE;
+				}
+
+			case _T('?'):
+				if (pszName != pszEnd && *pszName != _T('.'))
+					pszName++;
+				pszPattern++;
+				break;
+
+			case _T('.'):
+				if (pszName == pszEnd &&
+				    (pszPattern[1] == _T('*') || pszPattern[1] == _T('?') || pszPattern[1] == _T('\0')))
+				{
+					pszPattern++;
+					break;
+				}
+				/* fall through */
+
+			default:
+				if (pszName == pszEnd || _totupper (*pszPattern) != _totupper (*pszName))
+					return FALSE;
+				pszPattern++;
+				pszName++;
+				break;
+		}
+	}
+}
+
+
 BOOL FileGetString (HANDLE hFile, LPTSTR lpBuffer, INT nBufferLength)
 {
 	LPSTR lpString;
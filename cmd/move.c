@@ -52,6 +52,94 @@ enum
 	MOVE_PATHS_ON_DIF_VOL = 0x080 /* source and destination paths are on different volume */
 };
 
+/* One file of a MOVE /MT, moved on a worker of the job pool */
+typedef struct _MOVE_JOB
+{
+	FILE_JOB Job;
+	DWORD dwMoveFlags;
+	BOOL bSuccess;
+	TCHAR szSrcPath[MAX_PATH];
+	TCHAR szDestPath[MAX_PATH];
+} MOVE_JOB, *PMOVE_JOB;
+
+/* Least time between two progress lines of a directory move, in milliseconds */
+#define MOVE_PROGRESS_MS  250
+
+/* Files at least this big are copied so that an interrupted copy can go on */
+#define MOVE_RESTART_SIZE (64 * 1024 * 1024)
+
+/* Kept in a directory being moved to another volume until the source is gone,
+ * it holds the full name of the source */
+#define MOVE_MARKER       _T("MOVE$$$.TMP")
+
+/* A directory on its way to another volume */
+typedef struct _MOVE_TREE
+{
+	PJOB_POOL Pool;
+	LPCTSTR pszSrc;         /* As shown to the user */
+	LPCTSTR pszDest;
+	DWORD dwThreadId;       /* The thread walking the tree */
+	DWORD dwFiles;          /* Files on the destination so far */
+	ULONGLONG u64Bytes;     /* and their size */
+	ULONGLONG u64Current;   /* Copied of the file the walking thread is on */
+	DWORD dwTick;
+	INT nProgress;          /* Longest progress shown */
+	DWORD dwError;          /* First failure, 0 if none */
+	BOOL bFatTimes;         /* The destination keeps times to 2 seconds only */
+	volatile BOOL bAbort;
+	TCHAR szProgress[RC_STRING_MAX_SIZE];
+} MOVE_TREE, *PMOVE_TREE;
+
+/* One file of a directory move, copied on a worker of the job pool */
+typedef struct _MOVE_COPY_JOB
+{
+	FILE_JOB Job;
+	PMOVE_TREE Tree;
+	ULONGLONG u64Size;
+	DWORD dwError;
+	TCHAR szSrcPath[MAX_PATH];
+	TCHAR szDestPath[MAX_PATH];
+} MOVE_COPY_JOB, *PMOVE_COPY_JOB;
+
+static VOID MoveJobRun (PFILE_JOB Job)
+{
+	PMOVE_JOB MoveJob = (PMOVE_JOB)Job;
+
+	MoveJob->bSuccess = MoveFileEx (MoveJob->szSrcPath, MoveJob->szDestPath, MoveJob->dwMoveFlags);
+}
+
+static VOID MoveJobRetire (PFILE_JOB Job)
+{
+	PMOVE_JOB MoveJob = (PMOVE_JOB)Job;
+
+	ConOutPrintf (_T("%s => %s "), MoveJob->szSrcPath, MoveJob->szDestPath);
+	if (MoveJob->bSuccess)
+		ConOutResPrintf(STRING_MOVE_ERROR1);
+	else
+		ConOutResPrintf(STRING_MOVE_ERROR2);
+
+	cmd_free(MoveJob);
+}
+
+/* Returns FALSE if there was no memory for the job, the file is then moved in place */
+static BOOL MoveSubmit (PJOB_POOL Pool, LPCTSTR src, LPCTSTR dest, DWORD dwMoveFlags)
+{
+	PMOVE_JOB MoveJob;
+
+	MoveJob = cmd_alloc(sizeof(MOVE_JOB));
+	if (MoveJob == NULL)
+		return FALSE;
+
+	MoveJob->Job.Run = MoveJobRun;
+	MoveJob->Job.Retire = MoveJobRetire;
+	MoveJob->dwMoveFlags = dwMoveFlags;
+	_tcscpy(MoveJob->szSrcPath, src);
+	_tcscpy(MoveJob->szDestPath, dest);
+
+	SubmitJob(Pool, &MoveJob->Job);
+	return TRUE;
+}
+
 static INT MoveOverwrite (LPTSTR fn)
 {
 	/*ask the user if they want to override*/
@@ -82,6 +170,390 @@ void GetDirectory (LPTSTR wholepath, LPTSTR directory, BOOL CheckExisting)
 	}
 }
 
+/*
+ * Tells whether both paths are on the same volume, so a directory can
+ * simply be renamed. The destination does not have to exist yet.
+ */
+static BOOL MoveSameVolume (LPTSTR src, LPTSTR dest)
+{
+	TCHAR szDestDir[MAX_PATH];
+	TCHAR szSrcRoot[MAX_PATH];
+	TCHAR szDestRoot[MAX_PATH];
+	TCHAR szSrcVolume[MAX_PATH];
+	TCHAR szDestVolume[MAX_PATH];
+
+	GetDirectory(dest, szDestDir, TRUE);
+	if (!GetVolumePathName(src, szSrcRoot, MAX_PATH) ||
+		!GetVolumePathName(szDestDir, szDestRoot, MAX_PATH))
+		return _totupper(src[0]) == _totupper(dest[0]);
+
+	/* A volume can be reached by more than one root, its name is what counts */
+	if (GetVolumeNameForVolumeMountPoint(szSrcRoot, szSrcVolume, MAX_PATH) &&
+		GetVolumeNameForVolumeMountPoint(szDestRoot, szDestVolume, MAX_PATH))
+		return !_tcsicmp(szSrcVolume, szDestVolume);
+
+	return !_tcsicmp(szSrcRoot, szDestRoot);
+}
+
+static VOID MoveTreeProgress (PMOVE_TREE Tree, BOOL bLast)
+{
+	TCHAR szProgress[RC_STRING_MAX_SIZE];
+	INT nLength;
+
+	if (bLast)
+	{
+		/* Blank the progress out, the caller finishes the line */
+		if (Tree->nProgress > 0)
+			ConOutPrintf(_T("\r%s => %s %*s\r%s => %s "), Tree->pszSrc, Tree->pszDest,
+			             Tree->nProgress, _T(""), Tree->pszSrc, Tree->pszDest);
+		return;
+	}
+
+	if (GetTickCount() - Tree->dwTick < MOVE_PROGRESS_MS)
+		return;
+	Tree->dwTick = GetTickCount();
+
+	nLength = _stprintf(szProgress, Tree->szProgress, Tree->dwFiles,
+	                    (Tree->u64Bytes + Tree->u64Current) / 1024);
+	ConOutPrintf(_T("\r%s => %s %s"), Tree->pszSrc, Tree->pszDest, szProgress);
+	Tree->nProgress = max(Tree->nProgress, nLength);
+}
+
+/* Only the thread walking the tree asks about Ctrl-C, workers just look at the flag */
+static BOOL MoveTreeAborted (PMOVE_TREE Tree)
+{
+	if (!Tree->bAbort)
+	{
+		if (GetCurrentThreadId() == Tree->dwThreadId ? CheckCtrlBreak(BREAK_INPUT) : bCtrlBreak)
+			Tree->bAbort = TRUE;
+	}
+	return Tree->bAbort;
+}
+
+static DWORD CALLBACK
+MoveCopyProgress (LARGE_INTEGER TotalFileSize, LARGE_INTEGER TotalBytesTransferred,
+                  LARGE_INTEGER StreamSize, LARGE_INTEGER StreamBytesTransferred,
+                  DWORD dwStreamNumber, DWORD dwCallbackReason,
+                  HANDLE hSourceFile, HANDLE hDestinationFile, LPVOID lpData)
+{
+	PMOVE_TREE Tree = lpData;
+
+	if (GetCurrentThreadId() == Tree->dwThreadId)
+	{
+		Tree->u64Current = TotalBytesTransferred.QuadPart;
+		MoveTreeProgress(Tree, FALSE);
+	}
+
+	/* A stopped copy is kept, so the next MOVE goes on from there */
+	return MoveTreeAborted(Tree) ? PROGRESS_STOP : PROGRESS_CONTINUE;
+}
+
+static DWORD MoveCopyFile (PMOVE_TREE Tree, LPCTSTR src, LPCTSTR dest, ULONGLONG u64Size)
+{
+	DWORD dwCopyFlags = 0;
+
+	if (u64Size >= MOVE_RESTART_SIZE)
+		dwCopyFlags |= COPY_FILE_RESTARTABLE;
+
+	if (!CopyFileEx(src, dest, MoveCopyProgress, Tree, NULL, dwCopyFlags))
+		return GetLastError();
+	return ERROR_SUCCESS;
+}
+
+/* Counts a file that is on the destination now, or the first error */
+static VOID MoveCopied (PMOVE_TREE Tree, DWORD dwError, ULONGLONG u64Size)
+{
+	Tree->u64Current = 0;
+	if (dwError == ERROR_SUCCESS)
+	{
+		Tree->dwFiles++;
+		Tree->u64Bytes += u64Size;
+	}
+	else if (Tree->dwError == ERROR_SUCCESS)
+	{
+		Tree->dwError = dwError;
+	}
+	MoveTreeProgress(Tree, FALSE);
+}
+
+static VOID MoveCopyJobRun (PFILE_JOB Job)
+{
+	PMOVE_COPY_JOB CopyJob = (PMOVE_COPY_JOB)Job;
+
+	CopyJob->dwError = MoveCopyFile(CopyJob->Tree, CopyJob->szSrcPath, CopyJob->szDestPath, CopyJob->u64Size);
+}
+
+static VOID MoveCopyJobRetire (PFILE_JOB Job)
+{
+	PMOVE_COPY_JOB CopyJob = (PMOVE_COPY_JOB)Job;
+
+	MoveCopied(CopyJob->Tree, CopyJob->dwError, CopyJob->u64Size);
+	cmd_free(CopyJob);
+}
+
+/* Returns whether a directory is on a FAT volume, which keeps no finer
+ * times than 2 seconds */
+static BOOL MoveIsFatVolume (LPCTSTR dir)
+{
+	TCHAR szRoot[MAX_PATH];
+	TCHAR szFileSystem[MAX_PATH];
+
+	if (!GetVolumePathName(dir, szRoot, MAX_PATH) ||
+		!GetVolumeInformation(szRoot, NULL, 0, NULL, NULL, NULL, szFileSystem, MAX_PATH))
+		return FALSE;
+	return _tcsnicmp(szFileSystem, _T("FAT"), 3) == 0;
+}
+
+/* On FAT times within 2 seconds are the same, elsewhere they must match */
+static BOOL MoveSameTime (PMOVE_TREE Tree, const FILETIME *ft1, const FILETIME *ft2)
+{
+	ULARGE_INTEGER Time1, Time2;
+
+	if (!Tree->bFatTimes)
+		return CompareFileTime(ft1, ft2) == 0;
+
+	Time1.u.LowPart = ft1->dwLowDateTime;
+	Time1.u.HighPart = ft1->dwHighDateTime;
+	Time2.u.LowPart = ft2->dwLowDateTime;
+	Time2.u.HighPart = ft2->dwHighDateTime;
+	if (Time1.QuadPart > Time2.QuadPart)
+		return Time1.QuadPart - Time2.QuadPart < 20000000;
+	return Time2.QuadPart - Time1.QuadPart < 20000000;
+}
+
+static VOID MoveTreeFile (PMOVE_TREE Tree, LPCTSTR src, LPCTSTR dest, LPWIN32_FIND_DATA f)
+{
+	WIN32_FILE_ATTRIBUTE_DATA Dest;
+	PMOVE_COPY_JOB CopyJob;
+	ULONGLONG u64Size;
+
+	u64Size = ((ULONGLONG)f->nFileSizeHigh << 32) | f->nFileSizeLow;
+
+	if (GetFileAttributesEx(dest, GetFileExInfoStandard, &Dest) &&
+		!(Dest.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+	{
+		/* Copied by a MOVE that was interrupted, the source is still all there */
+		if (Dest.nFileSizeHigh == f->nFileSizeHigh &&
+			Dest.nFileSizeLow == f->nFileSizeLow &&
+			MoveSameTime(Tree, &Dest.ftLastWriteTime, &f->ftLastWriteTime))
+		{
+			MoveCopied(Tree, ERROR_SUCCESS, u64Size);
+			return;
+		}
+		if (Dest.dwFileAttributes & FILE_ATTRIBUTE_READONLY)
+			SetFileAttributes(dest, Dest.dwFileAttributes & ~FILE_ATTRIBUTE_READONLY);
+	}
+
+	if (Tree->Pool != NULL)
+	{
+		CopyJob = cmd_alloc(sizeof(MOVE_COPY_JOB));
+		if (CopyJob != NULL)
+		{
+			CopyJob->Job.Run = MoveCopyJobRun;
+			CopyJob->Job.Retire = MoveCopyJobRetire;
+			CopyJob->Tree = Tree;
+			CopyJob->u64Size = u64Size;
+			_tcscpy(CopyJob->szSrcPath, src);
+			_tcscpy(CopyJob->szDestPath, dest);
+			SubmitJob(Tree->Pool, &CopyJob->Job);
+			return;
+		}
+	}
+
+	MoveCopied(Tree, MoveCopyFile(Tree, src, dest, u64Size), u64Size);
+}
+
+/*
+ * Copies the directory src to dest. Both are MAX_PATH buffers, the
+ * names below are appended on the way down and cut off again.
+ */
+static VOID MoveTreeDirectory (PMOVE_TREE Tree, LPTSTR src, LPTSTR dest)
+{
+	WIN32_FIND_DATA f;
+	HANDLE hFind;
+	SIZE_T cchSrc = _tcslen(src);
+	SIZE_T cchDest = _tcslen(dest);
+	SIZE_T cchName;
+
+	/* Takes the attributes of the source, an existing one is from an earlier try */
+	if (!CreateDirectoryEx(src, dest, NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+	{
+		MoveCopied(Tree, GetLastError(), 0);
+		return;
+	}
+
+	if (cchSrc + 3 > MAX_PATH)
+	{
+		MoveCopied(Tree, ERROR_FILENAME_EXCED_RANGE, 0);
+		return;
+	}
+	_tcscpy(&src[cchSrc], _T("\\*"));
+	hFind = FindFirstFile(src, &f);
+	src[cchSrc] = _T('\0');
+	if (hFind == INVALID_HANDLE_VALUE)
+	{
+		MoveCopied(Tree, GetLastError(), 0);
+		return;
+	}
+
+	do
+	{
+		if (!_tcscmp(f.cFileName, _T(".")) || !_tcscmp(f.cFileName, _T("..")))
+			continue;
+
+		cchName = _tcslen(f.cFileName);
+		if (cchSrc + cchName + 2 > MAX_PATH || cchDest + cchName + 2 > MAX_PATH)
+		{
+			MoveCopied(Tree, ERROR_FILENAME_EXCED_RANGE, 0);
+			continue;
+		}
+		src[cchSrc] = _T('\\');
+		_tcscpy(&src[cchSrc + 1], f.cFileName);
+		dest[cchDest] = _T('\\');
+		_tcscpy(&dest[cchDest + 1], f.cFileName);
+
+		if (f.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			MoveTreeDirectory(Tree, src, dest);
+		else
+			MoveTreeFile(Tree, src, dest, &f);
+
+		src[cchSrc] = _T('\0');
+		dest[cchDest] = _T('\0');
+	}
+	while (!MoveTreeAborted(Tree) && FindNextFile(hFind, &f));
+
+	FindClose(hFind);
+}
+
+static BOOL MoveMarkerName (LPCTSTR dir, LPTSTR marker)
+{
+	SIZE_T cch = _tcslen(dir);
+
+	if (cch + _tcslen(MOVE_MARKER) + 2 > MAX_PATH)
+	{
+		SetLastError(ERROR_FILENAME_EXCED_RANGE);
+		return FALSE;
+	}
+	_tcscpy(marker, dir);
+	if (cch > 0 && marker[cch - 1] != _T('\\'))
+		_tcscat(marker, _T("\\"));
+	_tcscat(marker, MOVE_MARKER);
+	return TRUE;
+}
+
+static BOOL MoveWriteMarker (LPCTSTR src, LPCTSTR marker)
+{
+	HANDLE hFile;
+	DWORD dwWritten;
+	DWORD cb = _tcslen(src) * sizeof(TCHAR);
+	BOOL bWritten;
+
+	hFile = CreateFile(marker, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+	                   FILE_ATTRIBUTE_HIDDEN | FILE_FLAG_WRITE_THROUGH, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return FALSE;
+	bWritten = WriteFile(hFile, src, cb, &dwWritten, NULL) && dwWritten == cb;
+	CloseHandle(hFile);
+	return bWritten;
+}
+
+/*
+ * Tells whether the directory dir was left by an interrupted move of
+ * src, so that the move goes on in it rather than in a new directory
+ * below it.
+ */
+static BOOL MoveTreeResumes (LPCTSTR src, LPCTSTR dir)
+{
+	TCHAR szMarker[MAX_PATH];
+	TCHAR szSrc[MAX_PATH];
+	HANDLE hFile;
+	DWORD dwRead;
+	BOOL bResumes = FALSE;
+
+	if (!MoveMarkerName(dir, szMarker))
+		return FALSE;
+	hFile = CreateFile(szMarker, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return FALSE;
+	if (ReadFile(hFile, szSrc, sizeof(szSrc) - sizeof(TCHAR), &dwRead, NULL))
+	{
+		szSrc[dwRead / sizeof(TCHAR)] = _T('\0');
+		bResumes = !_tcsicmp(szSrc, src);
+	}
+	CloseHandle(hFile);
+	return bResumes;
+}
+
+/*
+ * Moves a directory to another volume. The files stream through
+ * CopyFileEx, on the job pool with /MT, while the tree is walked, and
+ * only when all of it is on the destination is the source removed in
+ * one go. The new root holds a marker naming the source until then, so
+ * an interrupted move leaves the source whole and running the same
+ * MOVE again goes on in that root, skipping what was copied already.
+ */
+static BOOL MoveTree (LPTSTR src, LPTSTR dest, DWORD dwThreads)
+{
+	MOVE_TREE Tree;
+	TCHAR szSrc[MAX_PATH];
+	TCHAR szDest[MAX_PATH];
+	TCHAR szMarker[MAX_PATH];
+	DWORD dwAttrib;
+	SIZE_T cch;
+
+	ZeroMemory(&Tree, sizeof(Tree));
+	Tree.pszSrc = src;
+	Tree.pszDest = dest;
+	Tree.dwThreadId = GetCurrentThreadId();
+	Tree.dwTick = GetTickCount();
+	LoadString(CMD_ModuleHandle, STRING_MOVE_PROGRESS, Tree.szProgress, RC_STRING_MAX_SIZE);
+
+	_tcscpy(szSrc, src);
+	_tcscpy(szDest, dest);
+	cch = _tcslen(szDest);
+	if (cch > 3 && szDest[cch - 1] == _T('\\'))
+		szDest[cch - 1] = _T('\0');
+
+	/* A file in the way of the new directory is replaced. If it can't
+	 * be, that is the error to report */
+	dwAttrib = GetFileAttributes(szDest);
+	if (dwAttrib != INVALID_FILE_ATTRIBUTES && !(dwAttrib & FILE_ATTRIBUTE_DIRECTORY))
+	{
+		if (dwAttrib & FILE_ATTRIBUTE_READONLY)
+			SetFileAttributes(szDest, dwAttrib & ~FILE_ATTRIBUTE_READONLY);
+		if (!DeleteFile(szDest))
+			return FALSE;
+	}
+
+	if ((!CreateDirectoryEx(szSrc, szDest, NULL) && GetLastError() != ERROR_ALREADY_EXISTS) ||
+		!MoveMarkerName(szDest, szMarker) ||
+		!MoveWriteMarker(szSrc, szMarker))
+		return FALSE;
+	Tree.bFatTimes = MoveIsFatVolume(szDest);
+
+	if (dwThreads != 0)
+		Tree.Pool = CreateJobPool(dwThreads);
+	MoveTreeDirectory(&Tree, szSrc, szDest);
+	DestroyJobPool(Tree.Pool);
+	MoveTreeProgress(&Tree, TRUE);
+
+	TRACE ("MoveTree: %lu files, error %lu\n", Tree.dwFiles, Tree.dwError);
+	if (Tree.dwError == ERROR_SUCCESS && Tree.bAbort)
+		Tree.dwError = ERROR_CANCELLED;
+	if (Tree.dwError != ERROR_SUCCESS)
+	{
+		SetLastError(Tree.dwError);
+		return FALSE;
+	}
+
+	if (!DeleteFolder(szSrc))
+		return FALSE;
+
+	/* Only now is the destination complete */
+	DeleteFile(szMarker);
+	return TRUE;
+}
+
 
 INT cmd_move (LPTSTR param)
 {
@@ -98,21 +570,15 @@ INT cmd_move (LPTSTR param)
 	WIN32_FIND_DATA findBuffer;
 	HANDLE hFile;
 	
-	/* used only when source and destination  directories are on different volume*/
-	HANDLE hDestFile;
-	WIN32_FIND_DATA findDestBuffer;
-	TCHAR szMoveDest[MAX_PATH];
-	TCHAR szMoveSrc[MAX_PATH];
-	LPTSTR pszDestDirPointer;
-	LPTSTR pszSrcDirPointer;
-	INT nDirLevel = 0;
-	
 	LPTSTR pszFile;
 	BOOL OnlyOneFile;
 	BOOL FoundFile;
 	BOOL MoveStatus;
 	DWORD dwMoveFlags = 0;
 	DWORD dwMoveStatusFlags = 0;
+	DWORD dwError;
+	DWORD dwThreads = 0;
+	PJOB_POOL Pool = NULL;
 
 
 	if (!_tcsncmp (param, _T("/?"), 2))
@@ -149,6 +615,8 @@ INT cmd_move (LPTSTR param)
 			dwFlags |= MOVE_OVER_YES;
 		else if (!_tcsicmp(arg[i], _T("/-Y")))
 			dwFlags |= MOVE_OVER_NO;
+		else if (ParseJobThreads(arg[i]) != 0)
+			dwThreads = ParseJobThreads(arg[i]);
 		else
 			break;
 	}
@@ -272,9 +740,14 @@ INT cmd_move (LPTSTR param)
 	}
 	
 	/* check if source and destination paths are on different volumes */
-	if (szSrcDirPath[0] != szDestPath[0])
+	if (!MoveSameVolume(szSrcDirPath, szDestPath))
 		dwMoveStatusFlags |= MOVE_PATHS_ON_DIF_VOL;
 	
+	/* with /MT the files are renamed on worker threads, directories are always moved here */
+	if (dwThreads != 0 && !OnlyOneFile && !(dwFlags & MOVE_NOTHING) &&
+		(dwMoveStatusFlags & MOVE_SOURCE_IS_FILE))
+		Pool = CreateJobPool(dwThreads);
+	
 	/* move it */
 	do
 	{
@@ -323,6 +796,15 @@ INT cmd_move (LPTSTR param)
 			if (IsExistingFile(szFullDestPath) || IsExistingDirectory(szFullDestPath))
 				dwMoveStatusFlags |= MOVE_DEST_EXISTS;
 			
+			/* the directory itself may be what an interrupted move of this source left */
+			if ((dwMoveStatusFlags & MOVE_SOURCE_IS_DIR) &&
+				MoveTreeResumes(szSrcPath, szDestPath))
+			{
+				TRACE ("Resuming move into: %s\n", debugstr_aw(szDestPath));
+				_tcscpy (szFullDestPath, szDestPath);
+				dwMoveStatusFlags &= ~MOVE_DEST_EXISTS;
+			}
+			
 			dwMoveFlags |= MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH | MOVEFILE_COPY_ALLOWED;
 			
 		}
@@ -345,6 +827,7 @@ INT cmd_move (LPTSTR param)
 			dwMoveStatusFlags & MOVE_SOURCE_HAS_WILD)
 		{
 			/* We are not allowed to have existing source and destination dir when there is wildcard in source */
+			DestroyJobPool(Pool);
 			error_syntax(NULL);
 			FindClose(hFile);
 			freep(arg);
@@ -366,6 +849,7 @@ INT cmd_move (LPTSTR param)
 			!OnlyOneFile)
 		{
 			/*source has many files but there is only one destination file*/
+			DestroyJobPool(Pool);
 			error_invalid_parameter_format(pszDest);
 			FindClose(hFile);
 			freep (arg);
@@ -378,12 +862,18 @@ INT cmd_move (LPTSTR param)
 			continue;
 		if(!(dwFlags & MOVE_OVER_YES) &&
 		    (dwMoveStatusFlags & MOVE_DEST_EXISTS))
+		{
+			/* the files before this one are reported before the prompt */
+			DrainJobPool(Pool);
 			nOverwrite = MoveOverwrite (szFullDestPath);
+		}
 		if (nOverwrite == PROMPT_NO || nOverwrite == PROMPT_BREAK)
 			continue;
 		if (nOverwrite == PROMPT_ALL)
 			dwFlags |= MOVE_OVER_YES;
 		
+		if (Pool != NULL && MoveSubmit (Pool, szSrcPath, szFullDestPath, dwMoveFlags))
+			continue;
 			
 		ConOutPrintf (_T("%s => %s "), szSrcPath, szFullDestPath);
 		
@@ -392,125 +882,36 @@ INT cmd_move (LPTSTR param)
 			continue;
 		
 		/*move the file*/
-		if (!(dwMoveStatusFlags & MOVE_SOURCE_IS_DIR &&
-			dwMoveStatusFlags & MOVE_PATHS_ON_DIF_VOL))
-			/* we aren't moving source folder to different drive */
+		if (!(dwMoveStatusFlags & MOVE_SOURCE_IS_DIR))
 			MoveStatus = MoveFileEx (szSrcPath, szFullDestPath, dwMoveFlags);
+		else if (!(dwMoveStatusFlags & MOVE_PATHS_ON_DIF_VOL))
+		{
+			/* on the same volume the whole tree goes with a single rename */
+			MoveStatus = MoveFileEx (szSrcPath, szFullDestPath, MOVEFILE_WRITE_THROUGH);
+			if (!MoveStatus && GetLastError() == ERROR_NOT_SAME_DEVICE)
+				MoveStatus = MoveTree (szSrcPath, szFullDestPath, dwThreads);
+		}
 		else
-		{	/* we are moving source folder to different drive */
-			_tcscpy(szMoveDest, szFullDestPath);
-			_tcscpy(szMoveSrc, szSrcPath);
-			DeleteFile(szMoveDest);
-			MoveStatus = CreateDirectory(szMoveDest, NULL); /* we use default security settings */
-			if (MoveStatus)
-			{
-				_tcscat(szMoveDest,_T("\\"));
-				_tcscat(szMoveSrc,_T("\\"));
-				nDirLevel = 0;
-				pszDestDirPointer = szMoveDest + _tcslen(szMoveDest);
-				pszSrcDirPointer = szMoveSrc + _tcslen(szMoveSrc);
-				_tcscpy(pszSrcDirPointer,_T("*.*"));
-				hDestFile = FindFirstFile(szMoveSrc, &findDestBuffer);
-				if (hDestFile == INVALID_HANDLE_VALUE)
-					MoveStatus = FALSE;
-				else
-				{
-					BOOL FirstTime = TRUE;
-					FoundFile = TRUE;
-					MoveStatus = FALSE;
-					while(FoundFile)
-					{
-						if (FirstTime)
-							FirstTime = FALSE;
-						else
-							FoundFile = FindNextFile (hDestFile, &findDestBuffer);
-						
-						if (!FoundFile)
-						{	/* Nothing to do in this folder so we stop working on it */
-							FindClose(hDestFile);
-							(pszSrcDirPointer)--;
-							(pszDestDirPointer)--;
-							_tcscpy(pszSrcDirPointer,_T(""));
-							_tcscpy(pszDestDirPointer,_T(""));
-							if (nDirLevel > 0)
-							{
-								TCHAR szTempPath[MAX_PATH];
-								INT nDiff;
-
-								FoundFile = TRUE; /* we need to continue our seek for files */
-								nDirLevel--;
-								RemoveDirectory(szMoveSrc);
-								GetDirectory(szMoveSrc,szTempPath,0);
-								nDiff = _tcslen(szMoveSrc) - _tcslen(szTempPath);
-								pszSrcDirPointer = pszSrcDirPointer - nDiff;
-								_tcscpy(pszSrcDirPointer,_T(""));
-								GetDirectory(szMoveDest,szTempPath,0);
-								nDiff = _tcslen(szMoveDest) - _tcslen(szTempPath);
-								pszDestDirPointer = pszDestDirPointer - nDiff;
-								_tcscpy(pszDestDirPointer,_T(""));
-								if(szMoveSrc[_tcslen(szMoveSrc) -  1] != _T('\\'))
-									_tcscat (szMoveSrc, _T("\\"));
-								if(szMoveDest[_tcslen(szMoveDest) -  1] != _T('\\'))
-									_tcscat (szMoveDest, _T("\\"));
-								pszDestDirPointer = szMoveDest + _tcslen(szMoveDest);
-								pszSrcDirPointer = szMoveSrc + _tcslen(szMoveSrc);
-								_tcscpy(pszSrcDirPointer,_T("*.*"));
-								hDestFile = FindFirstFile(szMoveSrc, &findDestBuffer);
-								if (hDestFile == INVALID_HANDLE_VALUE)
-									continue;
-								FirstTime = TRUE;
-							}
-							else
-							{
-								MoveStatus = TRUE; /* we moved everything so lets tell user about it */
-								RemoveDirectory(szMoveSrc);
-							}
-							continue;
-						}
-						
-						/* if we find "." or ".." we'll skip them */
-						if (_tcscmp(findDestBuffer.cFileName,_T(".")) == 0 ||
-							_tcscmp(findDestBuffer.cFileName,_T("..")) == 0)
-							continue;
-					
-						_tcscpy(pszSrcDirPointer, findDestBuffer.cFileName);
-						_tcscpy(pszDestDirPointer, findDestBuffer.cFileName);
-						if (IsExistingFile(szMoveSrc))
-						{
-							FoundFile = CopyFile(szMoveSrc, szMoveDest, FALSE);
-							if (!FoundFile) continue;
-							DeleteFile(szMoveSrc);
-						}
-						else
-						{
-							FindClose(hDestFile);
-							CreateDirectory(szMoveDest, NULL);
-							_tcscat(szMoveDest,_T("\\"));
-							_tcscat(szMoveSrc,_T("\\"));
-							nDirLevel++;
-							pszDestDirPointer = szMoveDest + _tcslen(szMoveDest);
-							pszSrcDirPointer = szMoveSrc + _tcslen(szMoveSrc);
-							_tcscpy(pszSrcDirPointer,_T("*.*"));
-							hDestFile = FindFirstFile(szMoveSrc, &findDestBuffer);
-							if (hDestFile == INVALID_HANDLE_VALUE)
-							{
-								FoundFile = FALSE;
-								continue;
-							}
-							FirstTime = TRUE;
-						}
-					}
-				}
-			}
+		{
+			/* we are moving source folder to different drive */
+			MoveStatus = MoveTree (szSrcPath, szFullDestPath, dwThreads);
 		}
 		if (MoveStatus)
 			ConOutResPrintf(STRING_MOVE_ERROR1);
+		else if (dwMoveStatusFlags & MOVE_SOURCE_IS_DIR)
+		{
+			/* say why, a directory may have been moved only in part */
+			dwError = GetLastError();
+			ConOutResPrintf(STRING_MOVE_ERROR2);
+			ErrorMessage (dwError, _T("%s"), szSrcPath);
+		}
 		else
 			ConOutResPrintf(STRING_MOVE_ERROR2);
 	}
 	while ((!OnlyOneFile || dwMoveStatusFlags & MOVE_SRC_CURRENT_IS_DIR ) &&
 			!(dwMoveStatusFlags & MOVE_SOURCE_IS_DIR) &&
 			FindNextFile (hFile, &findBuffer));
+	DestroyJobPool(Pool);
 	FindClose (hFile);
 	
 	freep (arg);
@@ -48,6 +48,200 @@ static TCHAR CurrentToken[CMDLINE_LENGTH];
 static int CurrentTokenType;
 static int InsideBlock;
 
+/* Parse trees of batch file lines are cached, so that lines run over and
+ * over by GOTO loops are not parsed again every time. Only lines whose
+ * text is not changed by %-expansion (other than %% escapes) are kept. */
+#define CMD_CACHE_BUCKETS 256
+#define CMD_CACHE_MAX     1024
+
+typedef struct _CMD_CACHE_ENTRY
+{
+	struct _CMD_CACHE_ENTRY *Next;       /* Hash chain */
+	struct _CMD_CACHE_ENTRY *NextActive; /* Entries being executed */
+	PARSED_COMMAND *Cmd;
+	LPTSTR Line;         /* Text of the first line, before expansion */
+	DWORD  Offset;       /* File offset of the first line */
+	DWORD  EndPos;       /* File offset after the last line parsed */
+	DWORD  FileSize;     /* Size and time of the file the line came from */
+	FILETIME ftLastWrite;
+	UINT   Hash;
+	BOOL   bActive;      /* Handed out by ParseCommand and not released yet */
+	BOOL   bCached;      /* Still reachable from the hash table */
+	TCHAR  Path[];
+} CMD_CACHE_ENTRY;
+
+static CMD_CACHE_ENTRY *CmdCache[CMD_CACHE_BUCKETS];
+static CMD_CACHE_ENTRY *ActiveEntries;
+static UINT CmdCacheCount;
+static BOOL bCacheLine;
+
+ULONG CmdCacheHits = 0;
+ULONG CmdCacheMisses = 0;
+
+/* A line can be cached if the only expansions in it are %% escapes */
+static BOOL IsCacheableLine(LPCTSTR Line)
+{
+	while ((Line = _tcschr(Line, _T('%'))) != NULL)
+	{
+		if (Line[1] != _T('%'))
+			return FALSE;
+		Line += 2;
+	}
+	return TRUE;
+}
+
+static UINT HashLine(LPCTSTR Line, DWORD Offset)
+{
+	UINT Hash = Offset;
+	while (*Line)
+		Hash = Hash * 31 + *Line++;
+	return Hash;
+}
+
+static VOID FreeCacheEntry(CMD_CACHE_ENTRY *Entry)
+{
+	if (Entry->Cmd)
+		FreeCommand(Entry->Cmd);
+	cmd_free(Entry->Line);
+	cmd_free(Entry);
+}
+
+/* Remove an entry from the hash table. If it is being executed,
+ * it is freed when the command is released. */
+static VOID UnlinkCacheEntry(CMD_CACHE_ENTRY **Prev)
+{
+	CMD_CACHE_ENTRY *Entry = *Prev;
+
+	*Prev = Entry->Next;
+	Entry->bCached = FALSE;
+	CmdCacheCount--;
+	if (!Entry->bActive)
+		FreeCacheEntry(Entry);
+}
+
+VOID FreeCommandCache(VOID)
+{
+	INT i;
+
+	for (i = 0; i < CMD_CACHE_BUCKETS; i++)
+	{
+		while (CmdCache[i])
+			UnlinkCacheEntry(&CmdCache[i]);
+	}
+}
+
+static VOID ActivateCacheEntry(CMD_CACHE_ENTRY *Entry)
+{
+	if (Entry->Cmd)
+	{
+		Entry->bActive = TRUE;
+		Entry->NextActive = ActiveEntries;
+		ActiveEntries = Entry;
+	}
+}
+
+static CMD_CACHE_ENTRY *LookupCachedCommand(DWORD Offset, LPCTSTR Line)
+{
+	UINT Hash = HashLine(Line, Offset);
+	CMD_CACHE_ENTRY **Prev, *Entry;
+
+	for (Prev = &CmdCache[Hash % CMD_CACHE_BUCKETS]; (Entry = *Prev); Prev = &Entry->Next)
+	{
+		if (Entry->Hash != Hash || Entry->Offset != Offset ||
+		    _tcscmp(Entry->Line, Line) || _tcsicmp(Entry->Path, bc->BatchFilePath))
+		{
+			continue;
+		}
+
+		if (Entry->FileSize != bc->FileSize ||
+		    CompareFileTime(&Entry->ftLastWrite, &bc->ftLastWrite) != 0)
+		{
+			/* Left over from an older version of the file */
+			UnlinkCacheEntry(Prev);
+			return NULL;
+		}
+
+		/* A command that is still executing (e.g. a recursive CALL)
+		 * can't be reused, it keeps redirection state in the tree */
+		if (Entry->bActive)
+			return NULL;
+
+		ActivateCacheEntry(Entry);
+		return Entry;
+	}
+	return NULL;
+}
+
+static VOID CacheCommand(PARSED_COMMAND *Cmd, LPTSTR Line, DWORD Offset)
+{
+	CMD_CACHE_ENTRY *Entry;
+	UINT Hash = HashLine(Line, Offset);
+
+	if (CmdCacheCount >= CMD_CACHE_MAX)
+		FreeCommandCache();
+
+	Entry = cmd_alloc(FIELD_OFFSET(CMD_CACHE_ENTRY, Path[_tcslen(bc->BatchFilePath) + 1]));
+	if (Entry == NULL)
+	{
+		cmd_free(Line);
+		return;
+	}
+	Entry->Cmd = Cmd;
+	Entry->Line = Line;
+	Entry->Offset = Offset;
+	Entry->EndPos = bc->FilePos;
+	Entry->FileSize = bc->FileSize;
+	Entry->ftLastWrite = bc->ftLastWrite;
+	Entry->Hash = Hash;
+	Entry->bActive = FALSE;
+	Entry->bCached = TRUE;
+	_tcscpy(Entry->Path, bc->BatchFilePath);
+
+	Entry->Next = CmdCache[Hash % CMD_CACHE_BUCKETS];
+	CmdCache[Hash % CMD_CACHE_BUCKETS] = Entry;
+	CmdCacheCount++;
+	ActivateCacheEntry(Entry);
+}
+
+/* Called when a command from ParseCommand has finished executing */
+VOID
+ReleaseCommand(PARSED_COMMAND *Cmd)
+{
+	CMD_CACHE_ENTRY **Prev, *Entry;
+
+	for (Prev = &ActiveEntries; (Entry = *Prev); Prev = &Entry->NextActive)
+	{
+		if (Entry->Cmd == Cmd)
+		{
+			*Prev = Entry->NextActive;
+			Entry->bActive = FALSE;
+			if (!Entry->bCached)
+				FreeCacheEntry(Entry);
+			return;
+		}
+	}
+	FreeCommand(Cmd);
+}
+
+/* Make sure a command that is being executed won't be reused,
+ * because it is about to be modified */
+VOID
+UncacheCommand(PARSED_COMMAND *Cmd)
+{
+	CMD_CACHE_ENTRY **Prev, *Entry;
+
+	for (Entry = ActiveEntries; Entry; Entry = Entry->NextActive)
+	{
+		if (Entry->Cmd == Cmd && Entry->bCached)
+		{
+			for (Prev = &CmdCache[Entry->Hash % CMD_CACHE_BUCKETS]; *Prev != Entry; Prev = &(*Prev)->Next)
+				;
+			UnlinkCacheEntry(Prev);
+			return;
+		}
+	}
+}
+
 static TCHAR ParseChar()
 {
 	TCHAR Char;
@@ -75,6 +269,8 @@ restart:
 			}
 			else if (*(ParsePos = ParseLine))
 			{
+				if (bCacheLine && !IsCacheableLine(textline))
+					bCacheLine = FALSE;
 				goto restart;
 			}
 		}
@@ -591,6 +787,12 @@ static DECLSPEC_NOINLINE PARSED_COMMAND *ParseCommandPart(REDIRECTION *RedirList
 	Cmd->Redirections = RedirList;
 	memcpy(Cmd->Command.First, ParsedLine, (Pos - ParsedLine) * sizeof(TCHAR));
 	Cmd->Command.Rest = Cmd->Command.First + TailOffset;
+	/* Remember which parts need expanding when the command is executed */
+	Cmd->Command.Expand = 0;
+	if (_tcspbrk(Cmd->Command.First, _T("%!")))
+		Cmd->Command.Expand |= CMDEXPAND_FIRST;
+	if (_tcspbrk(Cmd->Command.Rest, _T("%!")))
+		Cmd->Command.Expand |= CMDEXPAND_REST;
 	return Cmd;
 }
 
@@ -693,7 +895,14 @@ PARSED_COMMAND *
 ParseCommand(LPTSTR Line)
 {
 	PARSED_COMMAND *Cmd;
-
+	LPBATCH_CONTEXT Ctx = bc;
+	CMD_CACHE_ENTRY *Entry;
+	LPTSTR CacheLine = NULL;
+	DWORD Offset = 0;
+	DWORD FileSize = 0;
+	FILETIME ftLastWrite = { 0, 0 };
+
+	bCacheLine = FALSE;
 	if (Line)
 	{
 		if (!SubstituteVars(Line, ParseLine, _T('%')))
@@ -702,9 +911,28 @@ ParseCommand(LPTSTR Line)
 	}
 	else
 	{
+		if (Ctx)
+			Offset = Ctx->FilePos;
 		if (!ReadLine(ParseLine, FALSE))
 			return NULL;
 		bLineContinuations = TRUE;
+
+		if (Ctx && Ctx == bc && IsCacheableLine(textline))
+		{
+			Entry = LookupCachedCommand(Offset, textline);
+			if (Entry)
+			{
+				CmdCacheHits++;
+				BatchSeek(Entry->EndPos);
+				bIgnoreEcho = (Entry->Cmd == NULL);
+				return Entry->Cmd;
+			}
+			CmdCacheMisses++;
+			CacheLine = cmd_dup(textline);
+			bCacheLine = (CacheLine != NULL);
+			FileSize = bc->FileSize;
+			ftLastWrite = bc->ftLastWrite;
+		}
 	}
 	bParseError = FALSE;
 	ParsePos = ParseLine;
@@ -726,6 +954,21 @@ ParseCommand(LPTSTR Line)
 	{
 		bIgnoreEcho = TRUE;
 	}
+
+	if (CacheLine)
+	{
+		if (bCacheLine && !bParseError && bc == Ctx &&
+		    bc->FileSize == FileSize &&
+		    CompareFileTime(&bc->ftLastWrite, &ftLastWrite) == 0)
+		{
+			CacheCommand(Cmd, CacheLine, Offset);
+		}
+		else
+		{
+			cmd_free(CacheLine);
+		}
+		bCacheLine = FALSE;
+	}
 	return Cmd;
 }
 
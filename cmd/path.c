@@ -74,7 +74,7 @@ INT cmd_path (LPTSTR param)
 		param++;
 
 	/* set PATH environment variable */
-	if (!SetEnvironmentVariable (_T("PATH"), param))
+	if (!SetEnvVar (_T("PATH"), param))
 	{
 		nErrorLevel = 1;
 		return 1;
@@ -209,14 +209,14 @@ INT cmd_prompt (LPTSTR param)
 	/* set PROMPT environment variable */
 	if (param[0] != _T('\0'))
 	{
-		if (!SetEnvironmentVariable (_T("PROMPT"), param))
+		if (!SetEnvVar (_T("PROMPT"), param))
 		return 1;
 	}
 	else
 	{
 		TCHAR szParam[5];
 		_tcscpy(szParam,_T("$P$G"));
-		if (!SetEnvironmentVariable (_T("PROMPT"),szParam))
+		if (!SetEnvVar (_T("PROMPT"),szParam))
 		return 1;
 	}
 
@@ -44,6 +44,8 @@ static HANDLE GetHandle(UINT Number)
 
 static VOID SetHandle(UINT Number, HANDLE Handle)
 {
+	/* Write out what was buffered for the old handle */
+	ConFlush();
 	if (Number < 3)
 		SetStdHandle(STD_INPUT_HANDLE - Number, Handle);
 	else
@@ -136,6 +138,7 @@ UndoRedirection(REDIRECTION *Redir, REDIRECTION *End)
 {
 	for (; Redir != End; Redir = Redir->Next)
 	{
+		ConFlush();
 		CloseHandle(GetHandle(Redir->Number));
 		SetHandle(Redir->Number, Redir->OldHandle);
 		Redir->OldHandle = INVALID_HANDLE_VALUE;
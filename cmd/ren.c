@@ -45,6 +45,603 @@ enum
 };
 
 
+/* Up to this many renames each new name is looked up on its own,
+ * more than that and the directory is listed once */
+#define REN_PROBE_MAX 64
+
+/* One step of a compiled destination template */
+typedef struct _REN_OP
+{
+  TCHAR chOp;   /* '*', '?', or 0 to put ch in */
+  TCHAR ch;     /* A '*' copies the old name up to this character */
+} REN_OP;
+
+enum
+{
+  REN_STATE_NEW,
+  REN_STATE_ON_PATH,
+  REN_STATE_PLANNED,
+  REN_STATE_FAILED
+};
+
+/* A rename to do; names are offsets into REN_PLAN.pszPool */
+typedef struct _REN_ENTRY
+{
+  SIZE_T nSrc;
+  SIZE_T nDst;
+  INT    nBlocker;  /* Entry whose old name is our new one, -1 if none */
+  INT    nState;
+  UINT   uError;    /* Why it cannot be done, 0 if it can */
+} REN_ENTRY;
+
+typedef struct _REN_PLAN
+{
+  LPTSTR     pszPool;
+  SIZE_T     cchPool;
+  SIZE_T     cchPoolMax;
+  REN_ENTRY *Entries;
+  INT        nEntries;
+  INT        nEntriesMax;
+  SIZE_T    *pNames;      /* Every name in the directory, short ones too */
+  INT        nNames;
+  INT        nNamesMax;
+  INT       *pSrcHash;    /* Entries by old name */
+  INT       *pDstHash;    /* Entries by new name, the first to claim it */
+  INT       *pNameHash;   /* pNames by name */
+  INT        nHash;
+  INT       *pOrder;      /* Entries in the order they are done */
+  INT        nOrder;
+  LPCTSTR    pszDir;      /* Where the files are, empty or ending in a backslash */
+  BOOL       bProbe;      /* pNames was not filled, ask the file system */
+} REN_PLAN;
+
+enum
+{
+  REN_HASH_SRC,
+  REN_HASH_DST,
+  REN_HASH_NAME
+};
+
+
+/*
+ * Compiles the '*' and '?' of a destination name once, so working it out
+ * for each file is a straight run over the steps.
+ */
+static INT
+RenCompileTemplate (LPCTSTR pszTemplate, REN_OP *Ops)
+{
+  INT n = 0;
+
+  for (; *pszTemplate; pszTemplate++, n++)
+    {
+      if (*pszTemplate == _T('*'))
+        {
+          Ops[n].chOp = _T('*');
+          Ops[n].ch = pszTemplate[1];
+        }
+      else if (*pszTemplate == _T('?'))
+        {
+          Ops[n].chOp = _T('?');
+          Ops[n].ch = 0;
+        }
+      else
+        {
+          /* A character of its own also steps over one of the old name */
+          Ops[n].chOp = 0;
+          Ops[n].ch = *pszTemplate;
+        }
+    }
+  return n;
+}
+
+static BOOL
+RenApplyTemplate (REN_OP *Ops, INT nOps, LPCTSTR pszName, LPTSTR pszOut, SIZE_T cchOut)
+{
+  SIZE_T n = 0;
+  INT i;
+
+  for (i = 0; i < nOps; i++)
+    {
+      if (Ops[i].chOp == _T('*'))
+        {
+          while (*pszName != 0 && *pszName != Ops[i].ch)
+            {
+              if (n + 1 >= cchOut)
+                return FALSE;
+              pszOut[n++] = *pszName++;
+            }
+        }
+      else if (Ops[i].chOp == _T('?'))
+        {
+          if (*pszName != 0)
+            {
+              if (n + 1 >= cchOut)
+                return FALSE;
+              pszOut[n++] = *pszName++;
+            }
+        }
+      else
+        {
+          if (n + 1 >= cchOut)
+            return FALSE;
+          pszOut[n++] = Ops[i].ch;
+          if (*pszName != 0)
+            pszName++;
+        }
+    }
+  pszOut[n] = 0;
+  return TRUE;
+}
+
+static BOOL
+RenAddName (REN_PLAN *Plan, LPCTSTR pszName, SIZE_T *pnOffset)
+{
+  SIZE_T cch = _tcslen (pszName) + 1;
+  LPTSTR pszNew;
+
+  if (Plan->cchPool + cch > Plan->cchPoolMax)
+    {
+      Plan->cchPoolMax = max (Plan->cchPoolMax * 2, Plan->cchPool + cch + 4096);
+      pszNew = cmd_realloc (Plan->pszPool, Plan->cchPoolMax * sizeof(TCHAR));
+      if (pszNew == NULL)
+        return FALSE;
+      Plan->pszPool = pszNew;
+    }
+
+  _tcscpy (&Plan->pszPool[Plan->cchPool], pszName);
+  *pnOffset = Plan->cchPool;
+  Plan->cchPool += cch;
+  return TRUE;
+}
+
+/* Makes room for one more element in an array grown by doubling */
+static BOOL
+RenGrow (PVOID *ppArray, INT nCount, INT *pnMax, SIZE_T cbElement)
+{
+  PVOID pNew;
+
+  if (nCount < *pnMax)
+    return TRUE;
+  pNew = cmd_realloc (*ppArray, max (*pnMax * 2, 256) * cbElement);
+  if (pNew == NULL)
+    return FALSE;
+  *ppArray = pNew;
+  *pnMax = max (*pnMax * 2, 256);
+  return TRUE;
+}
+
+static ULONG
+RenHashName (LPCTSTR pszName)
+{
+  ULONG uHash = 2166136261U;
+
+  for (; *pszName; pszName++)
+    uHash = (uHash ^ (ULONG)_totupper (*pszName)) * 16777619U;
+  return uHash;
+}
+
+static LPCTSTR
+RenHashKey (REN_PLAN *Plan, INT nKind, INT nValue)
+{
+  if (nKind == REN_HASH_SRC)
+    return &Plan->pszPool[Plan->Entries[nValue].nSrc];
+  if (nKind == REN_HASH_DST)
+    return &Plan->pszPool[Plan->Entries[nValue].nDst];
+  return &Plan->pszPool[Plan->pNames[nValue]];
+}
+
+/* Returns what the table has under the name, -1 if nothing */
+static INT
+RenHashFind (REN_PLAN *Plan, INT *pHash, INT nKind, LPCTSTR pszName)
+{
+  INT i;
+
+  for (i = RenHashName (pszName) & (Plan->nHash - 1);
+       pHash[i] != -1;
+       i = (i + 1) & (Plan->nHash - 1))
+    {
+      if (!_tcsicmp (RenHashKey (Plan, nKind, pHash[i]), pszName))
+        return pHash[i];
+    }
+  return -1;
+}
+
+static VOID
+RenHashInsert (REN_PLAN *Plan, INT *pHash, INT nKind, INT nValue)
+{
+  INT i;
+
+  for (i = RenHashName (RenHashKey (Plan, nKind, nValue)) & (Plan->nHash - 1);
+       pHash[i] != -1;
+       i = (i + 1) & (Plan->nHash - 1))
+    ;
+  pHash[i] = nValue;
+}
+
+static BOOL
+RenBuildHashes (REN_PLAN *Plan)
+{
+  INT i;
+
+  Plan->nHash = 16;
+  while (Plan->nHash < 2 * max (Plan->nEntries, Plan->nNames))
+    Plan->nHash *= 2;
+
+  Plan->pSrcHash = cmd_alloc (Plan->nHash * sizeof(INT));
+  Plan->pDstHash = cmd_alloc (Plan->nHash * sizeof(INT));
+  Plan->pNameHash = cmd_alloc (Plan->nHash * sizeof(INT));
+  if (Plan->pSrcHash == NULL || Plan->pDstHash == NULL || Plan->pNameHash == NULL)
+    return FALSE;
+  memset (Plan->pSrcHash, 0xFF, Plan->nHash * sizeof(INT));
+  memset (Plan->pDstHash, 0xFF, Plan->nHash * sizeof(INT));
+  memset (Plan->pNameHash, 0xFF, Plan->nHash * sizeof(INT));
+
+  for (i = 0; i < Plan->nEntries; i++)
+    RenHashInsert (Plan, Plan->pSrcHash, REN_HASH_SRC, i);
+  for (i = 0; i < Plan->nNames; i++)
+    RenHashInsert (Plan, Plan->pNameHash, REN_HASH_NAME, i);
+  return TRUE;
+}
+
+/*
+ * Decides the order of the renames before any is done. A rename whose new
+ * name is the old name of another one goes after it. A new name that is
+ * taken by a file staying where it is, or by an earlier rename, fails, and
+ * so do renames that go round in a circle.
+ */
+static BOOL
+RenNameTaken (REN_PLAN *Plan, LPCTSTR pszName)
+{
+  TCHAR szPath[MAX_PATH];
+
+  if (!Plan->bProbe)
+    return RenHashFind (Plan, Plan->pNameHash, REN_HASH_NAME, pszName) != -1;
+
+  if (_tcslen (Plan->pszDir) + _tcslen (pszName) >= MAX_PATH)
+    return FALSE;
+  _tcscpy (szPath, Plan->pszDir);
+  _tcscat (szPath, pszName);
+  return GetFileAttributes (szPath) != INVALID_FILE_ATTRIBUTES;
+}
+
+static BOOL
+RenPlanOrder (REN_PLAN *Plan)
+{
+  REN_ENTRY *Entry;
+  REN_ENTRY *Blocker;
+  INT *pPath;
+  INT nPath;
+  INT i, j, k;
+  LPCTSTR pszSrc;
+  LPCTSTR pszDst;
+
+  Plan->pOrder = cmd_alloc (max (Plan->nEntries, 1) * sizeof(INT));
+  pPath = cmd_alloc (max (Plan->nEntries, 1) * sizeof(INT));
+  if (Plan->pOrder == NULL || pPath == NULL)
+    {
+      if (pPath != NULL)
+        cmd_free (pPath);
+      return FALSE;
+    }
+
+  for (i = 0; i < Plan->nEntries; i++)
+    {
+      Entry = &Plan->Entries[i];
+      pszSrc = &Plan->pszPool[Entry->nSrc];
+      pszDst = &Plan->pszPool[Entry->nDst];
+
+      Entry->nBlocker = -1;
+      if (!_tcsicmp (pszSrc, pszDst))
+        continue;
+
+      Entry->nBlocker = RenHashFind (Plan, Plan->pSrcHash, REN_HASH_SRC, pszDst);
+      if (Entry->nBlocker == -1)
+        {
+          if (RenNameTaken (Plan, pszDst))
+            Entry->uError = STRING_REN_ERROR2;
+        }
+      else
+        {
+          /* A file that keeps its name, only maybe its case, stays in the way */
+          Blocker = &Plan->Entries[Entry->nBlocker];
+          if (!_tcsicmp (&Plan->pszPool[Blocker->nSrc], &Plan->pszPool[Blocker->nDst]))
+            Entry->uError = STRING_REN_ERROR2;
+        }
+
+      /* Two old names going to the same new one: the first has it */
+      if (Entry->uError == 0)
+        {
+          if (RenHashFind (Plan, Plan->pDstHash, REN_HASH_DST, pszDst) != -1)
+            Entry->uError = STRING_REN_ERROR2;
+          else
+            RenHashInsert (Plan, Plan->pDstHash, REN_HASH_DST, i);
+        }
+    }
+
+  for (i = 0; i < Plan->nEntries; i++)
+    {
+      /* Follow the renames that have to be done before this one */
+      nPath = 0;
+      j = i;
+      while (j != -1 && Plan->Entries[j].nState == REN_STATE_NEW)
+        {
+          Plan->Entries[j].nState = REN_STATE_ON_PATH;
+          pPath[nPath++] = j;
+          if (Plan->Entries[j].uError != 0)
+            {
+              j = -1;
+              break;
+            }
+          j = Plan->Entries[j].nBlocker;
+        }
+
+      if (j != -1 && Plan->Entries[j].nState == REN_STATE_ON_PATH)
+        {
+          /* Back at a rename on the path, all from there on are a circle */
+          for (k = nPath - 1; k >= 0; k--)
+            {
+              Plan->Entries[pPath[k]].uError = STRING_REN_ERROR3;
+              if (pPath[k] == j)
+                break;
+            }
+        }
+
+      /* Done from the end, so whatever is in the way has been decided */
+      for (k = nPath - 1; k >= 0; k--)
+        {
+          Entry = &Plan->Entries[pPath[k]];
+          if (Entry->uError == 0 && Entry->nBlocker != -1 &&
+              Plan->Entries[Entry->nBlocker].nState == REN_STATE_FAILED)
+            Entry->uError = STRING_REN_ERROR2;
+          Entry->nState = Entry->uError ? REN_STATE_FAILED : REN_STATE_PLANNED;
+          Plan->pOrder[Plan->nOrder++] = pPath[k];
+        }
+    }
+
+  cmd_free (pPath);
+  return TRUE;
+}
+
+static VOID
+RenFreePlan (REN_PLAN *Plan)
+{
+  if (Plan->pszPool != NULL)
+    cmd_free (Plan->pszPool);
+  if (Plan->Entries != NULL)
+    cmd_free (Plan->Entries);
+  if (Plan->pNames != NULL)
+    cmd_free (Plan->pNames);
+  if (Plan->pSrcHash != NULL)
+    cmd_free (Plan->pSrcHash);
+  if (Plan->pDstHash != NULL)
+    cmd_free (Plan->pDstHash);
+  if (Plan->pNameHash != NULL)
+    cmd_free (Plan->pNameHash);
+  if (Plan->pOrder != NULL)
+    cmd_free (Plan->pOrder);
+}
+
+#ifdef _UNICODE
+/*
+ * Renames a file of the directory hDir is open on to another name in it,
+ * without either name being looked up from the root again.
+ */
+static DWORD
+RenRelative (HANDLE hDir, LPCTSTR pszSrc, LPCTSTR pszDst)
+{
+  ULONG_PTR Buffer[(sizeof(FILE_RENAME_INFORMATION) + MAX_PATH * sizeof(WCHAR)) / sizeof(ULONG_PTR) + 1];
+  PFILE_RENAME_INFORMATION Rename = (PFILE_RENAME_INFORMATION)Buffer;
+  UNICODE_STRING Name;
+  OBJECT_ATTRIBUTES Attributes;
+  IO_STATUS_BLOCK Iosb;
+  HANDLE hFile;
+  NTSTATUS Status;
+
+  Name.Buffer = (PWSTR)pszSrc;
+  Name.Length = Name.MaximumLength = (USHORT)(_tcslen (pszSrc) * sizeof(WCHAR));
+  InitializeObjectAttributes (&Attributes, &Name, OBJ_CASE_INSENSITIVE, hDir, NULL);
+
+  Status = NtOpenFilePtr (&hFile, DELETE | SYNCHRONIZE, &Attributes, &Iosb,
+                          FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                          FILE_SYNCHRONOUS_IO_NONALERT | FILE_OPEN_FOR_BACKUP_INTENT |
+                          FILE_OPEN_REPARSE_POINT);
+  if (NT_SUCCESS (Status))
+    {
+      Rename->ReplaceIfExists = FALSE;
+      Rename->RootDirectory = hDir;
+      Rename->FileNameLength = (ULONG)(_tcslen (pszDst) * sizeof(WCHAR));
+      memcpy (Rename->FileName, pszDst, Rename->FileNameLength);
+      Status = NtSetInformationFilePtr (hFile, &Iosb, Rename,
+                                        FIELD_OFFSET(FILE_RENAME_INFORMATION, FileName) +
+                                        Rename->FileNameLength,
+                                        FileRenameInformation);
+      NtClosePtr (hFile);
+    }
+
+  return NT_SUCCESS (Status) ? ERROR_SUCCESS : RtlNtStatusToDosErrorPtr (Status);
+}
+#endif
+
+/*
+ * Renames whatever srcPattern matches in srcPath (empty for the current
+ * directory) after the dstFILE template. Everything is planned first;
+ * with /N only the plan is shown.
+ */
+static DWORD
+RenameFiles (LPTSTR srcPattern, LPTSTR srcPath, LPTSTR dstFILE, DWORD dwFlags)
+{
+  REN_PLAN Plan;
+  REN_ENTRY *Entry;
+  REN_OP *Ops;
+  INT nOps;
+  INT i;
+  BOOL bDstWildcard;
+  BOOL bShow;
+  DWORD dwFiles = 0;
+  DWORD dwError;
+  HANDLE hFile;
+  HANDLE hDir = INVALID_HANDLE_VALUE;
+  WIN32_FIND_DATA f;
+  LPTSTR pszSrc;
+  LPTSTR pszDst;
+  TCHAR dstLast[MAX_PATH];
+  TCHAR srcFinal[MAX_PATH];
+  TCHAR dstFinal[MAX_PATH];
+
+  ZeroMemory (&Plan, sizeof(Plan));
+
+  bDstWildcard = _tcschr (dstFILE, _T('*')) || _tcschr (dstFILE, _T('?'));
+  bShow = (dwFlags & REN_NOTHING) || (!(dwFlags & REN_QUIET) && !(dwFlags & REN_TOTAL));
+
+  Ops = cmd_alloc ((_tcslen (dstFILE) + 1) * sizeof(REN_OP));
+  if (Ops == NULL)
+    {
+      error_out_of_memory ();
+      return 0;
+    }
+  nOps = RenCompileTemplate (dstFILE, Ops);
+
+  hFile = FindFirstFile (srcPattern, &f);
+  if (hFile == INVALID_HANDLE_VALUE)
+    {
+      if (!(dwFlags & REN_ERROR))
+        error_file_not_found ();
+      cmd_free (Ops);
+      return 0;
+    }
+
+  do
+    {
+      /* ignore "." and ".." */
+      if (!_tcscmp (f.cFileName, _T(".")) ||
+          !_tcscmp (f.cFileName, _T("..")))
+        continue;
+
+      /* do not rename hidden or system files */
+      if (f.dwFileAttributes & (FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM))
+        continue;
+
+      /* do not rename directories when the destination pattern contains
+       * wildcards, unless option /S is used */
+      if ((f.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+          && bDstWildcard
+          && !(dwFlags & REN_SUBDIR))
+        continue;
+
+      TRACE("Found source name: %s\n", debugstr_aw(f.cFileName));
+
+      if (!RenApplyTemplate (Ops, nOps, f.cFileName, dstLast, MAX_PATH) ||
+          !RenGrow ((PVOID *)&Plan.Entries, Plan.nEntries, &Plan.nEntriesMax, sizeof(REN_ENTRY)))
+        continue;
+
+      Entry = &Plan.Entries[Plan.nEntries];
+      ZeroMemory (Entry, sizeof(REN_ENTRY));
+      if (!RenAddName (&Plan, f.cFileName, &Entry->nSrc) ||
+          !RenAddName (&Plan, dstLast, &Entry->nDst))
+        {
+          error_out_of_memory ();
+          break;
+        }
+      Plan.nEntries++;
+    }
+  while (FindNextFile (hFile, &f));
+  FindClose (hFile);
+  cmd_free (Ops);
+
+  /* For a large plan, everything already in the directory, to see
+   * which new names are taken; a few renames just ask for each name */
+  Plan.pszDir = srcPath;
+  Plan.bProbe = Plan.nEntries <= REN_PROBE_MAX;
+  _tcscpy (srcFinal, srcPath);
+  _tcscat (srcFinal, _T("*"));
+  hFile = Plan.bProbe ? INVALID_HANDLE_VALUE : FindFirstFile (srcFinal, &f);
+  if (hFile != INVALID_HANDLE_VALUE)
+    {
+      do
+        {
+          if (!RenGrow ((PVOID *)&Plan.pNames, Plan.nNames + 1, &Plan.nNamesMax, sizeof(SIZE_T)) ||
+              !RenAddName (&Plan, f.cFileName, &Plan.pNames[Plan.nNames]))
+            break;
+          Plan.nNames++;
+          if (f.cAlternateFileName[0] &&
+              RenAddName (&Plan, f.cAlternateFileName, &Plan.pNames[Plan.nNames]))
+            Plan.nNames++;
+        }
+      while (FindNextFile (hFile, &f));
+      FindClose (hFile);
+    }
+
+  if (!RenBuildHashes (&Plan) || !RenPlanOrder (&Plan))
+    {
+      error_out_of_memory ();
+      RenFreePlan (&Plan);
+      return 0;
+    }
+
+#ifdef _UNICODE
+  if (!(dwFlags & REN_NOTHING) && NtOpenFilePtr != NULL && NtSetInformationFilePtr != NULL &&
+      NtClosePtr != NULL && RtlNtStatusToDosErrorPtr != NULL)
+    {
+      hDir = CreateFile (*srcPath ? srcPath : _T("."), FILE_LIST_DIRECTORY | SYNCHRONIZE,
+                         FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                         OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    }
+#endif
+
+  for (i = 0; i < Plan.nOrder && !CheckCtrlBreak (BREAK_INPUT); i++)
+    {
+      Entry = &Plan.Entries[Plan.pOrder[i]];
+      pszSrc = &Plan.pszPool[Entry->nSrc];
+      pszDst = &Plan.pszPool[Entry->nDst];
+
+      _tcscpy (srcFinal, srcPath);
+      _tcscat (srcFinal, pszSrc);
+      _tcscpy (dstFinal, srcPath);
+      _tcscat (dstFinal, pszDst);
+
+      TRACE("DestinationPath: %s\n", debugstr_aw(dstFinal));
+
+      if (bShow)
+        ConOutPrintf (_T("%s -> %s\n"), srcFinal, dstFinal);
+
+      if (Entry->uError != 0)
+        {
+          if (!(dwFlags & REN_ERROR))
+            ConErrResPrintf (Entry->uError, srcFinal, pszDst);
+          nErrorLevel = 1;
+          continue;
+        }
+
+      /* Rename the file */
+      if (dwFlags & REN_NOTHING)
+        continue;
+
+      if (!_tcscmp (pszSrc, pszDst))
+        dwError = ERROR_SUCCESS;
+#ifdef _UNICODE
+      else if (hDir != INVALID_HANDLE_VALUE)
+        dwError = RenRelative (hDir, pszSrc, pszDst);
+#endif
+      else
+        dwError = MoveFile (srcFinal, dstFinal) ? ERROR_SUCCESS : GetLastError ();
+
+      if (dwError == ERROR_SUCCESS)
+        {
+          dwFiles++;
+        }
+      else if (!(dwFlags & REN_ERROR))
+        {
+          ConErrResPrintf (STRING_REN_ERROR1, dwError);
+        }
+    }
+
+  if (hDir != INVALID_HANDLE_VALUE)
+    CloseHandle (hDir);
+  RenFreePlan (&Plan);
+  return dwFiles;
+}
+
+
 /*
  *  file rename internal command.
  *
@@ -63,28 +660,21 @@ INT cmd_rename (LPTSTR param)
   LPTSTR srcPattern = NULL; /* Source Argument*/
   TCHAR srcPath[MAX_PATH]; /*Source Path Directories*/
   LPTSTR srcFILE = NULL;  /*Contains the files name(s)*/
-  TCHAR srcFinal[MAX_PATH]; 
   
  
   LPTSTR dstPattern = NULL; /*Destiny Argument*/
   TCHAR dstPath[MAX_PATH]; /*Source Path Directories*/
   LPTSTR dstFILE = NULL; /*Contains the files name(s)*/
 
-  TCHAR dstLast[MAX_PATH]; /*It saves the File name after unmasked with wildcarts*/
-  TCHAR dstFinal[MAX_PATH]; /*It saves the Final destiny Path*/
-
-  BOOL bDstWildcard = FALSE;
-  BOOL bPath = FALSE;
   
  
   
  
   
   
-  LPTSTR p,q,r;
+  srcPath[0] = _T('\0');
+  dstPath[0] = _T('\0');
 
-  HANDLE hFile;
-  WIN32_FIND_DATA f;
  /*If the PARAM=/? then show the help*/
   if (!_tcsncmp(param, _T("/?"), 2))
   {
@@ -176,8 +766,6 @@ INT cmd_rename (LPTSTR param)
 
   if (_tcschr(srcPattern, _T('\\')))  //Checking if the Source (srcPattern) is a Path to the file
 	{	
-		
-		bPath= TRUE;
 
         //Splitting srcPath and srcFile.
 
@@ -190,6 +778,7 @@ INT cmd_rename (LPTSTR param)
 			if(!_tcschr(srcFILE, _T('\\'))) break;
 			}
 		_tcsncpy(srcPath,srcPattern,_tcslen(srcPattern)-_tcslen(srcFILE));
+		srcPath[_tcslen(srcPattern)-_tcslen(srcFILE)] = _T('\0');
 		
 	
 			
@@ -204,6 +793,7 @@ INT cmd_rename (LPTSTR param)
 						if(!_tcschr(dstFILE, _T('\\'))) break;
 						}
 				_tcsncpy(dstPath,dstPattern,_tcslen(dstPattern)-_tcslen(dstFILE));
+				dstPath[_tcslen(dstPattern)-_tcslen(dstFILE)] = _T('\0');
 				
 				if((_tcslen(dstPath)!=_tcslen(srcPath))||(_tcsncmp(srcPath,dstPath,_tcslen(srcPath))!=0)) //If it has a Path,then MUST be equal than srcPath
 						{
@@ -235,131 +825,11 @@ INT cmd_rename (LPTSTR param)
 				}else dstFILE=dstPattern;
   }
  
- //Checking Wildcards.
-  if (_tcschr(dstFILE, _T('*')) || _tcschr(dstFILE, _T('?')))
-		bDstWildcard = TRUE;
-  
-  
-  
   TRACE("\n\nSourcePattern: %s SourcePath: %s SourceFile: %s", debugstr_aw(srcPattern),debugstr_aw(srcPath),debugstr_aw(srcFILE));
   TRACE("\n\nDestinationPattern: %s Destination Path:%s Destination File: %s\n", debugstr_aw(dstPattern),debugstr_aw(dstPath),debugstr_aw(dstFILE));
  
-      hFile = FindFirstFile(srcPattern, &f);
-	  
-      if (hFile == INVALID_HANDLE_VALUE)
-		{
-		 if (!(dwFlags & REN_ERROR))
-				error_file_not_found();
-				
-		}
-      do
-		{
-	  /* ignore "." and ".." */
-		 if (!_tcscmp (f.cFileName, _T(".")) ||
-			  !_tcscmp (f.cFileName, _T("..")))
-		 continue;
-
-	  /* do not rename hidden or system files */
-		 if (f.dwFileAttributes & (FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM))
-			continue;
-
-	  /* do not rename directories when the destination pattern contains
-	   * wildcards, unless option /S is used */
-		  if ((f.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-			 && bDstWildcard
-			 && !(dwFlags & REN_SUBDIR))
-			continue;
-
-		 TRACE("Found source name: %s\n", debugstr_aw(f.cFileName));
-	  /* So here we have splitted the dstFILE and we have find a f.cFileName(thanks to srcPattern) 
-	   * Now we have to use the mask (dstFILE) (which can have Wildcards) with f.cFileName to find destination file name(dstLast) */
-		 p = f.cFileName;
-		 q = dstFILE;
-		 r = dstLast;
-		 while(*q != 0)
-			{
-				if (*q == '*')
-					{
-						q++;
-						while (*p != 0 && *p != *q)
-							{
-							*r = *p;
-							p++;
-							r++;
-							}
-					}
-					else if (*q == '?')
-								{
-								q++;
-								if (*p != 0)
-									 {
-									*r = *p;
-									p++;
-									r++;
-									 }
-								}
-								else
-									{
-									*r = *q;
-									if (*p != 0)
-											p++;
-									q++;
-									r++;
-									}
-			}
-		*r = 0;
-		//Well we have splitted the Paths,so now we have to paste them again(if needed),thanks bPath.
-		if(	bPath == TRUE)
-			{	
-				
-				_tcscpy(srcFinal,srcPath);
-				
-				_tcscat(srcFinal,f.cFileName);
-				 
-				_tcscpy(dstFinal,dstPath);
-				_tcscat(dstFinal,dstLast);
-				 
-								
-		}else{
-				_tcscpy(srcFinal,f.cFileName);
-				_tcscpy(dstFinal,dstLast);
-
-				}
-		
-
-
-		TRACE("DestinationPath: %s\n", debugstr_aw(dstFinal));
-		
-		
-		if (!(dwFlags & REN_QUIET) && !(dwFlags & REN_TOTAL))
-	  
-			 ConOutPrintf(_T("%s -> %s\n"),srcFinal , dstFinal);
-
-	  /* Rename the file */
-		 if (!(dwFlags & REN_NOTHING))
-		 {	 
-				
-				
-	      
-				if (MoveFile(srcFinal, dstFinal))
-			{
-			dwFiles++;
-			}
-			else
-				{
-				 if (!(dwFlags & REN_ERROR))
-						{
-						ConErrResPrintf(STRING_REN_ERROR1, GetLastError());
-						}
-				}
-		 }
-	  }
-	   
-      while (FindNextFile(hFile, &f));
-//Closing and Printing errors.
-	
-      FindClose(hFile);
-   
+  /* Plan all the renames first, then carry them out in a safe order */
+  dwFiles = RenameFiles(srcPattern, srcPath, dstFILE, dwFlags);
 
   if (!(dwFlags & REN_QUIET))
   {
@@ -71,6 +71,8 @@
 #define STRING_REPLACE_ERROR6              356
 #define STRING_REPLACE_ERROR7              357
 #define STRING_ASSOC_ERROR                 358
+#define STRING_REN_ERROR2                  359
+#define STRING_REN_ERROR3                  360
 
 #define STRING_ATTRIB_HELP                 600
 #define STRING_ALIAS_HELP                  601
@@ -251,6 +253,7 @@
 
 #define STRING_MORE                        741
 #define STRING_CANCEL_BATCH_FILE           742
+#define STRING_MOVE_PROGRESS               743
 
 /* These strings are language independent (cmd.rc) */
 #define STRING_FREEDOS_DEV                 800
@@ -0,0 +1,770 @@
+/*
+ *  RMTREE.C - removes files and whole directory trees.
+ *
+ *  Every directory is opened once and listed through its handle; its
+ *  files and subdirectories are opened relative to that handle and
+ *  deleted by setting their disposition, so no path is ever resolved
+ *  twice. Subtrees are handed to a few worker threads unless the caller
+ *  wants to see each file, and a directory that is to be removed goes
+ *  as soon as its last subdirectory has gone.
+ */
+
+#include <precomp.h>
+
+/* Size of the buffer each thread lists directories into */
+#define TREE_BUFFER_SIZE 65536
+
+/* Longest path handed to the Confirm and Failed routines */
+#define TREE_PATH_MAX    32768
+
+#ifndef DOS_STAR
+#define DOS_STAR         (L'<')
+#define DOS_QM           (L'>')
+#define DOS_DOT          (L'"')
+#endif
+
+typedef struct _TREE_DIR
+{
+	struct _TREE_DIR *Parent;
+	struct _TREE_DIR *Next;		/* Work stack, or the children still to walk */
+	HANDLE hDir;				/* NULL until the directory is walked */
+	ULONG cbName;				/* Length of its name at the end of szPath */
+	LONG lRefs;					/* One for the listing, one per live subdirectory */
+	BOOL bRemove;				/* Opened for DELETE, remove it once empty */
+	BOOL bReadOnly;
+	TCHAR szPath[1];
+} TREE_DIR, *PTREE_DIR;
+
+typedef struct _TREE_WALK
+{
+	PTREE_DELETE Delete;
+	UNICODE_STRING Mask;		/* Upcased DOS expression, empty matches everything */
+	LPCTSTR pszKeepName;
+	SIZE_T cchKeepDir;
+	LONG lFiles;
+	LONG lError;
+	BOOL bAbort;
+	BOOL bThreads;
+	CRITICAL_SECTION Lock;
+	HANDLE hWork;				/* Counts the directories on the stack */
+	HANDLE hDone;				/* Set once the root has gone */
+	PTREE_DIR Stack;
+	BOOL bStop;
+} TREE_WALK, *PTREE_WALK;
+
+/* What each walking thread works with */
+typedef struct _TREE_THREAD
+{
+	PTREE_WALK Walk;
+	PVOID pBuffer;
+	TCHAR szPath[TREE_PATH_MAX];
+} TREE_THREAD, *PTREE_THREAD;
+
+/*
+ * Cmd does not link against ntdll.dll (see Initialize in cmd.c), so the
+ * handle based walk is only there when it found these at run time.
+ */
+BOOL
+IsTreeDeleteAvailable(VOID)
+{
+#ifdef _UNICODE
+	return NtOpenFilePtr != NULL && NtQueryDirectoryFilePtr != NULL &&
+	       NtSetInformationFilePtr != NULL && NtClosePtr != NULL &&
+	       RtlNtStatusToDosErrorPtr != NULL;
+#else
+	return FALSE;
+#endif
+}
+
+#ifdef _UNICODE
+
+/*
+ * Turns a DOS wildcard into the expression FindFirstFile hands to the
+ * file system, for NtQueryDirectoryFile to filter the names with. "*",
+ * "*.*" and no mask at all match everything.
+ */
+static BOOL
+TreeCompileMask(PTREE_WALK Walk, LPCTSTR pszMask)
+{
+	SIZE_T cch, i;
+	PWCHAR p;
+
+	if (pszMask == NULL || !_tcscmp(pszMask, _T("*")) || !_tcscmp(pszMask, _T("*.*")))
+		return TRUE;
+
+	cch = _tcslen(pszMask);
+	p = HeapAlloc(GetProcessHeap(), 0, (cch + 1) * sizeof(WCHAR));
+	if (p == NULL)
+		return FALSE;
+
+	for (i = 0; i < cch; i++)
+	{
+		if (pszMask[i] == L'?')
+			p[i] = DOS_QM;
+		else if (pszMask[i] == L'.' &&
+		         (pszMask[i + 1] == L'?' || pszMask[i + 1] == L'*' || pszMask[i + 1] == L'\0'))
+			p[i] = DOS_DOT;
+		else if (pszMask[i] == L'*' && pszMask[i + 1] == L'.')
+			p[i] = DOS_STAR;
+		else
+			p[i] = towupper(pszMask[i]);
+	}
+	p[cch] = L'\0';
+
+	Walk->Mask.Buffer = p;
+	Walk->Mask.Length = (USHORT)(cch * sizeof(WCHAR));
+	Walk->Mask.MaximumLength = Walk->Mask.Length + sizeof(WCHAR);
+	return TRUE;
+}
+
+static BOOL
+TreeMatch(PTREE_WALK Walk, PFILE_BOTH_DIR_INFORMATION Info)
+{
+	if (Walk->Mask.Length == 0)
+		return TRUE;
+
+	if (MatchWildcard(Walk->Delete->pszMask, Info->FileName, Info->FileNameLength / sizeof(WCHAR)))
+		return TRUE;
+
+	return Info->ShortNameLength != 0 &&
+	       MatchWildcard(Walk->Delete->pszMask, Info->ShortName, Info->ShortNameLength / sizeof(WCHAR));
+}
+
+static BOOL
+TreeIsDots(PFILE_BOTH_DIR_INFORMATION Info)
+{
+	return Info->FileName[0] == L'.' &&
+	       (Info->FileNameLength == sizeof(WCHAR) ||
+	        (Info->FileNameLength == 2 * sizeof(WCHAR) && Info->FileName[1] == L'.'));
+}
+
+/*
+ * Builds the full name of an entry of Dir in the thread's buffer.
+ */
+static LPCTSTR
+TreeEntryPath(PTREE_THREAD Thread, PTREE_DIR Dir, PCWSTR pName, ULONG cbName)
+{
+	SIZE_T cchDir = _tcslen(Dir->szPath);
+	SIZE_T cchName = cbName / sizeof(WCHAR);
+
+	if (cchDir + cchName + 2 > TREE_PATH_MAX)
+		return Dir->szPath;
+
+	memcpy(Thread->szPath, Dir->szPath, cchDir * sizeof(TCHAR));
+	if (cchDir > 0 && Thread->szPath[cchDir - 1] != _T('\\'))
+		Thread->szPath[cchDir++] = _T('\\');
+	memcpy(&Thread->szPath[cchDir], pName, cchName * sizeof(TCHAR));
+	Thread->szPath[cchDir + cchName] = _T('\0');
+	return Thread->szPath;
+}
+
+/*
+ * Records an error. On a walk with worker threads they take turns at
+ * the Failed routine while the thread that started the walk waits.
+ */
+static VOID
+TreeFailed(PTREE_THREAD Thread, PTREE_DIR Dir, PCWSTR pName, ULONG cbName, NTSTATUS Status)
+{
+	PTREE_WALK Walk = Thread->Walk;
+	DWORD dwError = RtlNtStatusToDosErrorPtr(Status);
+
+	WARN("DeleteTree: %s, status %08x\n", debugstr_aw(Dir->szPath), Status);
+	InterlockedCompareExchange(&Walk->lError, (LONG)dwError, 0);
+
+	if (Walk->Delete->Failed != NULL)
+	{
+		if (Walk->bThreads)
+			EnterCriticalSection(&Walk->Lock);
+		if (!Walk->Delete->Failed(Walk->Delete,
+		                          pName ? TreeEntryPath(Thread, Dir, pName, cbName) : Dir->szPath,
+		                          dwError))
+			Walk->bAbort = TRUE;
+		if (Walk->bThreads)
+			LeaveCriticalSection(&Walk->Lock);
+	}
+}
+
+static NTSTATUS
+TreeOpen(HANDLE hParent, PCWSTR pName, ULONG cbName, ACCESS_MASK Access, ULONG Options, PHANDLE phFile)
+{
+	UNICODE_STRING Name;
+	OBJECT_ATTRIBUTES Attributes;
+	IO_STATUS_BLOCK Iosb;
+
+	Name.Buffer = (PWSTR)pName;
+	Name.Length = Name.MaximumLength = (USHORT)cbName;
+	InitializeObjectAttributes(&Attributes, &Name, OBJ_CASE_INSENSITIVE, hParent, NULL);
+
+	return NtOpenFilePtr(phFile, Access | SYNCHRONIZE, &Attributes, &Iosb,
+	                     FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+	                     Options | FILE_SYNCHRONOUS_IO_NONALERT | FILE_OPEN_FOR_BACKUP_INTENT |
+	                     FILE_OPEN_REPARSE_POINT);
+}
+
+/*
+ * Marks an open file or directory for deletion, clearing its read-only
+ * attribute first if asked to (the handle then has FILE_WRITE_ATTRIBUTES).
+ */
+static NTSTATUS
+TreeDispose(HANDLE hFile, BOOL bReadOnly)
+{
+	FILE_BASIC_INFORMATION Basic;
+	FILE_DISPOSITION_INFORMATION Disposition;
+	IO_STATUS_BLOCK Iosb;
+
+	if (bReadOnly)
+	{
+		ZeroMemory(&Basic, sizeof(Basic));
+		Basic.FileAttributes = FILE_ATTRIBUTE_NORMAL;
+		NtSetInformationFilePtr(hFile, &Iosb, &Basic, sizeof(Basic), FileBasicInformation);
+	}
+
+	Disposition.DeleteFile = TRUE;
+	return NtSetInformationFilePtr(hFile, &Iosb, &Disposition, sizeof(Disposition),
+	                               FileDispositionInformation);
+}
+
+static NTSTATUS
+TreeDeleteEntry(PTREE_DIR Dir, PFILE_BOTH_DIR_INFORMATION Info, BOOL bForce, ULONG Options)
+{
+	BOOL bReadOnly = bForce && (Info->FileAttributes & FILE_ATTRIBUTE_READONLY);
+	HANDLE hFile;
+	NTSTATUS Status;
+
+	Status = TreeOpen(Dir->hDir, Info->FileName, Info->FileNameLength,
+	                  DELETE | (bReadOnly ? FILE_WRITE_ATTRIBUTES : 0), Options, &hFile);
+	if (!NT_SUCCESS(Status))
+		return Status;
+
+	Status = TreeDispose(hFile, bReadOnly);
+	NtClosePtr(hFile);
+	return Status;
+}
+
+static PTREE_DIR
+TreeNewDir(PTREE_DIR Parent, LPCTSTR pszPath, PCWSTR pName, ULONG cbName)
+{
+	SIZE_T cchPath = _tcslen(pszPath);
+	SIZE_T cchName = cbName / sizeof(WCHAR);
+	PTREE_DIR Dir;
+
+	Dir = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
+	                sizeof(TREE_DIR) + (cchPath + cchName + 1) * sizeof(TCHAR));
+	if (Dir == NULL)
+		return NULL;
+
+	Dir->Parent = Parent;
+	Dir->lRefs = 1;
+	memcpy(Dir->szPath, pszPath, cchPath * sizeof(TCHAR));
+
+	/* Keep the backslash of a root only, like the names made below */
+	while (Parent == NULL && cchPath > 1 &&
+	       Dir->szPath[cchPath - 1] == _T('\\') && Dir->szPath[cchPath - 2] != _T(':'))
+		cchPath--;
+	if (cchName > 0)
+	{
+		if (cchPath > 0 && Dir->szPath[cchPath - 1] != _T('\\'))
+			Dir->szPath[cchPath++] = _T('\\');
+		memcpy(&Dir->szPath[cchPath], pName, cchName * sizeof(TCHAR));
+	}
+	Dir->szPath[cchPath + cchName] = _T('\0');
+	return Dir;
+}
+
+/*
+ * Drops a reference to a directory. The last one removes the directory
+ * if that was asked for and lets go of its parent in turn.
+ */
+static VOID
+TreeRelease(PTREE_THREAD Thread, PTREE_DIR Dir)
+{
+	PTREE_WALK Walk = Thread->Walk;
+	PTREE_DIR Parent;
+	NTSTATUS Status;
+
+	while (Dir != NULL && InterlockedDecrement(&Dir->lRefs) == 0)
+	{
+		Parent = Dir->Parent;
+
+		if (Dir->bRemove && !Walk->bAbort)
+		{
+			Status = TreeDispose(Dir->hDir, Dir->bReadOnly);
+			if (!NT_SUCCESS(Status))
+				TreeFailed(Thread, Dir, NULL, 0, Status);
+		}
+		if (Dir->hDir != NULL)
+			NtClosePtr(Dir->hDir);
+		HeapFree(GetProcessHeap(), 0, Dir);
+
+		if (Parent == NULL && Walk->bThreads)
+			SetEvent(Walk->hDone);
+		Dir = Parent;
+	}
+}
+
+/*
+ * Queues a subdirectory found while listing Parent. It is only opened
+ * when its turn comes, so a wide directory does not hold a handle to
+ * every one of its subdirectories at once.
+ */
+static PTREE_DIR
+TreeNewChild(PTREE_THREAD Thread, PTREE_DIR Parent, PFILE_BOTH_DIR_INFORMATION Info)
+{
+	PTREE_DELETE Delete = Thread->Walk->Delete;
+	PTREE_DIR Dir;
+
+	Dir = TreeNewDir(Parent, Parent->szPath, Info->FileName, Info->FileNameLength);
+	if (Dir == NULL)
+	{
+		TreeFailed(Thread, Parent, Info->FileName, Info->FileNameLength, STATUS_NO_MEMORY);
+		return NULL;
+	}
+	Dir->cbName = Info->FileNameLength;
+	Dir->bReadOnly = Delete->bRemoveDirs && (Info->FileAttributes & FILE_ATTRIBUTE_READONLY);
+	InterlockedIncrement(&Parent->lRefs);
+	return Dir;
+}
+
+/*
+ * Opens a queued subdirectory relative to its parent, for DELETE if the
+ * walk removes directories. A directory another process sits in cannot
+ * be opened that way; it is then still emptied and its removal fails.
+ */
+static BOOL
+TreeOpenDir(PTREE_THREAD Thread, PTREE_DIR Dir)
+{
+	PTREE_DELETE Delete = Thread->Walk->Delete;
+	PCWSTR pName = &Dir->szPath[_tcslen(Dir->szPath) - Dir->cbName / sizeof(WCHAR)];
+	ACCESS_MASK Access = FILE_LIST_DIRECTORY;
+	NTSTATUS Status;
+	HANDLE hDir;
+
+	if (Delete->bRemoveDirs)
+		Access |= DELETE | (Dir->bReadOnly ? FILE_WRITE_ATTRIBUTES : 0);
+
+	Status = TreeOpen(Dir->Parent->hDir, pName, Dir->cbName,
+	                  Access, FILE_DIRECTORY_FILE, &hDir);
+	if (Status == STATUS_SHARING_VIOLATION && Delete->bRemoveDirs)
+	{
+		TreeFailed(Thread, Dir, NULL, 0, Status);
+		Access = FILE_LIST_DIRECTORY;
+		Status = TreeOpen(Dir->Parent->hDir, pName, Dir->cbName,
+		                  Access, FILE_DIRECTORY_FILE, &hDir);
+	}
+	if (!NT_SUCCESS(Status))
+	{
+		TreeFailed(Thread, Dir, NULL, 0, Status);
+		return FALSE;
+	}
+
+	Dir->hDir = hDir;
+	Dir->bRemove = (Access & DELETE) != 0;
+	return TRUE;
+}
+
+static BOOL
+TreeAborted(PTREE_WALK Walk)
+{
+	if (!Walk->bAbort)
+	{
+		if (Walk->bThreads ? bCtrlBreak : CheckCtrlBreak(BREAK_INPUT))
+			Walk->bAbort = TRUE;
+	}
+	return Walk->bAbort;
+}
+
+static VOID
+TreeFile(PTREE_THREAD Thread, PTREE_DIR Dir, PFILE_BOTH_DIR_INFORMATION Info)
+{
+	PTREE_WALK Walk = Thread->Walk;
+	PTREE_DELETE Delete = Walk->Delete;
+	NTSTATUS Status;
+
+	if ((Info->FileAttributes & Delete->dwAttrMask) != Delete->dwAttrValue)
+		return;
+
+	/* We cannot delete ourselves */
+	if (Walk->pszKeepName != NULL &&
+	    _tcslen(Dir->szPath) == Walk->cchKeepDir &&
+	    !_tcsnicmp(Dir->szPath, Delete->pszKeep, Walk->cchKeepDir) &&
+	    _tcslen(Walk->pszKeepName) == Info->FileNameLength / sizeof(WCHAR) &&
+	    !_tcsnicmp(Walk->pszKeepName, Info->FileName, Info->FileNameLength / sizeof(WCHAR)))
+		return;
+
+	if (Delete->Confirm != NULL &&
+	    !Delete->Confirm(Delete, TreeEntryPath(Thread, Dir, Info->FileName, Info->FileNameLength),
+	                     Info->FileAttributes))
+		return;
+
+	Status = TreeDeleteEntry(Dir, Info, Delete->bForce, FILE_NON_DIRECTORY_FILE);
+	if (NT_SUCCESS(Status))
+		InterlockedIncrement(&Walk->lFiles);
+	else
+		TreeFailed(Thread, Dir, Info->FileName, Info->FileNameLength, Status);
+}
+
+/*
+ * Lists a directory and deletes the files in it. Subdirectories go on
+ * the shared stack, or onto *pChildren for a walk without threads.
+ * Without them only the names matching the mask are asked for, so the
+ * file system can look up a single name without listing the rest.
+ */
+static VOID
+TreeListDirectory(PTREE_THREAD Thread, PTREE_DIR Dir, PTREE_DIR *pChildren)
+{
+	PTREE_WALK Walk = Thread->Walk;
+	PTREE_DELETE Delete = Walk->Delete;
+	PFILE_BOTH_DIR_INFORMATION Info;
+	IO_STATUS_BLOCK Iosb;
+	BOOLEAN bRestart = TRUE;
+	PTREE_DIR Child;
+	PTREE_DIR *pTail = pChildren;
+	PUNICODE_STRING pMask = NULL;
+	NTSTATUS Status;
+
+	if (!Delete->bSubDirs && Walk->Mask.Length != 0)
+		pMask = &Walk->Mask;
+
+	while (!TreeAborted(Walk))
+	{
+		Status = NtQueryDirectoryFilePtr(Dir->hDir, NULL, NULL, NULL, &Iosb,
+		                                 Thread->pBuffer, TREE_BUFFER_SIZE,
+		                                 FileBothDirectoryInformation, FALSE, pMask, bRestart);
+		bRestart = FALSE;
+		if (Status == STATUS_NO_MORE_FILES || Status == STATUS_NO_SUCH_FILE)
+			break;
+		if (!NT_SUCCESS(Status))
+		{
+			TreeFailed(Thread, Dir, NULL, 0, Status);
+			break;
+		}
+
+		Info = Thread->pBuffer;
+		for (;;)
+		{
+			if (!TreeIsDots(Info))
+			{
+				if (!Delete->bFound && TreeMatch(Walk, Info))
+					Delete->bFound = TRUE;
+
+				if (!(Info->FileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+				{
+					if (TreeMatch(Walk, Info))
+						TreeFile(Thread, Dir, Info);
+				}
+				else if (Info->FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
+				{
+					/* Junctions and links are removed, never followed */
+					if (Delete->bRemoveDirs)
+					{
+						Status = TreeDeleteEntry(Dir, Info, Delete->bForce, FILE_DIRECTORY_FILE);
+						if (!NT_SUCCESS(Status))
+							TreeFailed(Thread, Dir, Info->FileName, Info->FileNameLength, Status);
+					}
+				}
+				else if (Delete->bSubDirs)
+				{
+					Child = TreeNewChild(Thread, Dir, Info);
+					if (Child != NULL && Walk->bThreads)
+					{
+						EnterCriticalSection(&Walk->Lock);
+						Child->Next = Walk->Stack;
+						Walk->Stack = Child;
+						LeaveCriticalSection(&Walk->Lock);
+						ReleaseSemaphore(Walk->hWork, 1, NULL);
+					}
+					else if (Child != NULL)
+					{
+						*pTail = Child;
+						pTail = &Child->Next;
+					}
+				}
+			}
+
+			if (Info->NextEntryOffset == 0 || TreeAborted(Walk))
+				break;
+			Info = (PFILE_BOTH_DIR_INFORMATION)((PBYTE)Info + Info->NextEntryOffset);
+		}
+	}
+}
+
+/*
+ * Walks a tree on the calling thread in the order DIR /S lists it: the
+ * files of a directory first, then each of its subdirectories in turn.
+ */
+static VOID
+TreeWalkSequential(PTREE_THREAD Thread, PTREE_DIR Dir)
+{
+	PTREE_DIR Children = NULL;
+	PTREE_DIR Next;
+
+	if (Dir->hDir != NULL || TreeOpenDir(Thread, Dir))
+		TreeListDirectory(Thread, Dir, &Children);
+	while (Children != NULL)
+	{
+		Next = Children->Next;
+		if (Thread->Walk->bAbort)
+			TreeRelease(Thread, Children);
+		else
+			TreeWalkSequential(Thread, Children);
+		Children = Next;
+	}
+	TreeRelease(Thread, Dir);
+}
+
+static PTREE_THREAD
+TreeNewThread(PTREE_WALK Walk)
+{
+	PTREE_THREAD Thread;
+
+	Thread = HeapAlloc(GetProcessHeap(), 0, sizeof(TREE_THREAD));
+	if (Thread == NULL)
+		return NULL;
+	Thread->pBuffer = HeapAlloc(GetProcessHeap(), 0, TREE_BUFFER_SIZE);
+	if (Thread->pBuffer == NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, Thread);
+		return NULL;
+	}
+	Thread->Walk = Walk;
+	return Thread;
+}
+
+static VOID
+TreeFreeThread(PTREE_THREAD Thread)
+{
+	HeapFree(GetProcessHeap(), 0, Thread->pBuffer);
+	HeapFree(GetProcessHeap(), 0, Thread);
+}
+
+static DWORD WINAPI
+TreeWorker(LPVOID lpParameter)
+{
+	PTREE_THREAD Thread = lpParameter;
+	PTREE_WALK Walk = Thread->Walk;
+	PTREE_DIR Dir;
+
+	for (;;)
+	{
+		WaitForSingleObject(Walk->hWork, INFINITE);
+
+		EnterCriticalSection(&Walk->Lock);
+		if (Walk->bStop)
+		{
+			LeaveCriticalSection(&Walk->Lock);
+			break;
+		}
+		/* Newest first, so the walk stays close to depth first */
+		Dir = Walk->Stack;
+		Walk->Stack = Dir->Next;
+		LeaveCriticalSection(&Walk->Lock);
+
+		if (!TreeAborted(Walk) && (Dir->hDir != NULL || TreeOpenDir(Thread, Dir)))
+			TreeListDirectory(Thread, Dir, NULL);
+		TreeRelease(Thread, Dir);
+	}
+
+	TreeFreeThread(Thread);
+	return 0;
+}
+
+/*
+ * Runs the walk of Root on up to dwThreads workers. Returns FALSE if
+ * none could be started; the caller then walks it itself.
+ */
+static BOOL
+TreeWalkThreaded(PTREE_WALK Walk, PTREE_DIR Root, DWORD dwThreads)
+{
+	HANDLE hThreads[JOB_POOL_MAX_THREADS];
+	PTREE_THREAD Thread;
+	DWORD dwStarted = 0;
+	DWORD i;
+
+	if (dwThreads > JOB_POOL_MAX_THREADS)
+		dwThreads = JOB_POOL_MAX_THREADS;
+
+	InitializeCriticalSection(&Walk->Lock);
+	Walk->hWork = CreateSemaphore(NULL, 0, MAXLONG, NULL);
+	Walk->hDone = CreateEvent(NULL, TRUE, FALSE, NULL);
+	Walk->bThreads = TRUE;
+
+	while (Walk->hWork != NULL && Walk->hDone != NULL && dwStarted < dwThreads)
+	{
+		Thread = TreeNewThread(Walk);
+		if (Thread == NULL)
+			break;
+		hThreads[dwStarted] = CreateThread(NULL, 0, TreeWorker, Thread, 0, NULL);
+		if (hThreads[dwStarted] == NULL)
+		{
+			TreeFreeThread(Thread);
+			break;
+		}
+		dwStarted++;
+	}
+
+	if (dwStarted > 0)
+	{
+		TRACE("DeleteTree: %lu threads\n", dwStarted);
+
+		EnterCriticalSection(&Walk->Lock);
+		Walk->Stack = Root;
+		LeaveCriticalSection(&Walk->Lock);
+		ReleaseSemaphore(Walk->hWork, 1, NULL);
+
+		WaitForSingleObject(Walk->hDone, INFINITE);
+
+		EnterCriticalSection(&Walk->Lock);
+		Walk->bStop = TRUE;
+		LeaveCriticalSection(&Walk->Lock);
+		ReleaseSemaphore(Walk->hWork, dwStarted, NULL);
+
+		WaitForMultipleObjects(dwStarted, hThreads, TRUE, INFINITE);
+		for (i = 0; i < dwStarted; i++)
+			CloseHandle(hThreads[i]);
+	}
+
+	if (Walk->hWork != NULL)
+		CloseHandle(Walk->hWork);
+	if (Walk->hDone != NULL)
+		CloseHandle(Walk->hDone);
+	DeleteCriticalSection(&Walk->Lock);
+	Walk->bThreads = FALSE;
+	return dwStarted > 0;
+}
+
+#endif /* _UNICODE */
+
+/*
+ * Deletes the files in pszPath that Delete asks for, and with bSubDirs
+ * those in all its subdirectories. With bRemoveDirs pszPath and every
+ * directory under it are removed as well (RD /S). Returns FALSE if
+ * anything could not be deleted, with the first error as last error.
+ * Check IsTreeDeleteAvailable first.
+ */
+BOOL
+DeleteTree(LPCTSTR pszPath, PTREE_DELETE Delete)
+{
+#ifdef _UNICODE
+	TREE_WALK Walk;
+	BY_HANDLE_FILE_INFORMATION Info;
+	PTREE_THREAD Thread;
+	PTREE_DIR Root;
+	LPCTSTR p;
+	HANDLE hDir;
+	DWORD dwAccess = FILE_LIST_DIRECTORY | SYNCHRONIZE;
+	DWORD dwError;
+
+	Delete->dwFiles = 0;
+	Delete->dwError = 0;
+	Delete->bFound = FALSE;
+	Delete->bAbort = FALSE;
+
+	ZeroMemory(&Walk, sizeof(Walk));
+	Walk.Delete = Delete;
+	if (Delete->pszKeep != NULL)
+	{
+		p = _tcsrchr(Delete->pszKeep, _T('\\'));
+		if (p != NULL)
+		{
+			Walk.pszKeepName = p + 1;
+			/* Directory paths only keep the backslash of a root */
+			Walk.cchKeepDir = p - Delete->pszKeep;
+			if (Walk.cchKeepDir == 0 || Delete->pszKeep[Walk.cchKeepDir - 1] == _T(':'))
+				Walk.cchKeepDir++;
+		}
+	}
+
+	if (!TreeCompileMask(&Walk, Delete->pszMask))
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		return FALSE;
+	}
+	if (Walk.Mask.Length == 0)
+		Delete->bFound = TRUE;
+
+	/* As below, a directory someone sits in is still emptied */
+	hDir = INVALID_HANDLE_VALUE;
+	if (Delete->bRemoveDirs)
+	{
+		hDir = CreateFile(pszPath, dwAccess | DELETE,
+		                  FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+		                  FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT, NULL);
+		if (hDir != INVALID_HANDLE_VALUE)
+			dwAccess |= DELETE;
+		else if (GetLastError() == ERROR_SHARING_VIOLATION)
+			Walk.lError = ERROR_SHARING_VIOLATION;
+	}
+	if (hDir == INVALID_HANDLE_VALUE)
+	{
+		hDir = CreateFile(pszPath, dwAccess,
+		                  FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+		                  FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT, NULL);
+	}
+
+	dwError = ERROR_SUCCESS;
+	if (hDir == INVALID_HANDLE_VALUE)
+		dwError = GetLastError();
+	else if (!GetFileInformationByHandle(hDir, &Info))
+		dwError = GetLastError();
+	else if (!(Info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+		dwError = ERROR_DIRECTORY;
+	if (dwError != ERROR_SUCCESS)
+	{
+		if (hDir != INVALID_HANDLE_VALUE)
+			CloseHandle(hDir);
+		HeapFree(GetProcessHeap(), 0, Walk.Mask.Buffer);
+		Delete->dwError = dwError;
+		Delete->bFound = FALSE;
+		SetLastError(dwError);
+		return FALSE;
+	}
+
+	Thread = TreeNewThread(&Walk);
+	Root = TreeNewDir(NULL, pszPath, NULL, 0);
+	if (Thread == NULL || Root == NULL)
+	{
+		CloseHandle(hDir);
+		if (Thread != NULL)
+			TreeFreeThread(Thread);
+		HeapFree(GetProcessHeap(), 0, Root);
+		HeapFree(GetProcessHeap(), 0, Walk.Mask.Buffer);
+		SetLastError(Delete->dwError = ERROR_NOT_ENOUGH_MEMORY);
+		return FALSE;
+	}
+	Root->hDir = hDir;
+	Root->bRemove = (dwAccess & DELETE) != 0;
+
+	/* Confirm prompts, so it keeps everything on this thread */
+	if (Delete->dwThreads == 0 || Delete->Confirm != NULL ||
+	    !TreeWalkThreaded(&Walk, Root, Delete->dwThreads))
+	{
+		TreeWalkSequential(Thread, Root);
+	}
+	TreeFreeThread(Thread);
+	HeapFree(GetProcessHeap(), 0, Walk.Mask.Buffer);
+
+	/* Ctrl-C hit a worker thread, let the user see it */
+	if (Walk.bAbort && bCtrlBreak)
+		CheckCtrlBreak(BREAK_INPUT);
+
+	Delete->dwFiles = (DWORD)Walk.lFiles;
+	Delete->dwError = (DWORD)Walk.lError;
+	Delete->bAbort = Walk.bAbort;
+	if (Delete->dwError != 0)
+	{
+		SetLastError(Delete->dwError);
+		return FALSE;
+	}
+	if (Delete->bAbort)
+	{
+		SetLastError(ERROR_CANCELLED);
+		return FALSE;
+	}
+	return TRUE;
+#else
+	SetLastError(ERROR_CALL_NOT_IMPLEMENTED);
+	return FALSE;
+#endif
+}
+
+/* EOF */
@@ -133,7 +133,7 @@ INT cmd_set (LPTSTR param)
 		ConOutPrintf(_T("%s"), GetQuotedString(p));
 		ConInString(value, 1023);
 
-		if (!*value || !SetEnvironmentVariable(param, value))
+		if (!*value || !SetEnvVar(param, value))
 		{
 			nErrorLevel = 1;
 			return 1;
@@ -156,7 +156,7 @@ INT cmd_set (LPTSTR param)
 		}
 
 		*p++ = _T('\0');
-		if (!SetEnvironmentVariable(param, *p ? p : NULL))
+		if (!SetEnvVar(param, *p ? p : NULL))
 		{
 			nErrorLevel = 1;
 			return 1;
@@ -484,7 +484,7 @@ seta_assignment ( LPCTSTR* p_, INT* result )
 		}
 		buf = (LPTSTR)alloca ( 32 * sizeof(TCHAR) );
 		_sntprintf ( buf, 32, _T("%i"), identval );
-		SetEnvironmentVariable ( ident, buf ); // TODO FIXME - check return value
+		SetEnvVar ( ident, buf ); // TODO FIXME - check return value
 		exprval = identval;
 	}
 	else
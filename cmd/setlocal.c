@@ -9,12 +9,89 @@
 
 #include <precomp.h>
 
+/*
+ * A SETLOCAL frame doesn't keep a copy of the whole environment. Instead,
+ * the first time a variable is changed while the frame is the innermost
+ * one, its previous value is saved in the frame, and ENDLOCAL puts back
+ * just those variables.
+ */
+#define SETLOCAL_HASH_SIZE 32
+
+typedef struct _SAVED_VAR {
+	struct _SAVED_VAR *Next;
+	LPTSTR OldValue;        /* NULL if the variable was not defined */
+	TCHAR Name[];
+} SAVED_VAR;
+
 typedef struct _SETLOCAL {
 	struct _SETLOCAL *Prev;
 	BOOL DelayedExpansion;
-	LPTSTR Environment;
+	UINT Depth;
+	UINT SavedCount;
+	SIZE_T SavedSize;
+	SAVED_VAR *Saved[SETLOCAL_HASH_SIZE];
 } SETLOCAL;
 
+static BOOL bRestoringEnvironment = FALSE;
+
+static UINT
+HashSavedName(LPCTSTR Name)
+{
+	UINT Hash = 0;
+	while (*Name)
+		Hash = Hash * 31 + (TCHAR)_totupper(*Name++);
+	return Hash % SETLOCAL_HASH_SIZE;
+}
+
+/* Called by SetEnvVar before a variable is changed */
+VOID
+SaveSetlocalVar(LPCTSTR Name)
+{
+	LPBATCH_CONTEXT Ctx;
+	SETLOCAL *Frame;
+	SAVED_VAR *Var;
+	LPCTSTR OldValue;
+	SIZE_T NameLen, ValueLen, Size;
+	UINT Hash;
+
+	if (bRestoringEnvironment)
+		return;
+
+	/* The innermost frame may belong to a batch file that called this one */
+	for (Ctx = bc; Ctx && !Ctx->setlocal; Ctx = Ctx->prev)
+		;
+	if (!Ctx)
+		return;
+	Frame = Ctx->setlocal;
+
+	Hash = HashSavedName(Name);
+	for (Var = Frame->Saved[Hash]; Var; Var = Var->Next)
+		if (!_tcsicmp(Var->Name, Name))
+			return;
+
+	OldValue = GetEnvVar(Name);
+	NameLen = _tcslen(Name) + 1;
+	ValueLen = OldValue ? _tcslen(OldValue) + 1 : 0;
+	Size = FIELD_OFFSET(SAVED_VAR, Name[NameLen + ValueLen]);
+	Var = cmd_alloc(Size);
+	if (!Var)
+	{
+		WARN("Cannot save %s for ENDLOCAL\n", debugstr_aw(Name));
+		return;
+	}
+	memcpy(Var->Name, Name, NameLen * sizeof(TCHAR));
+	Var->OldValue = NULL;
+	if (OldValue)
+	{
+		Var->OldValue = &Var->Name[NameLen];
+		memcpy(Var->OldValue, OldValue, ValueLen * sizeof(TCHAR));
+	}
+	Var->Next = Frame->Saved[Hash];
+	Frame->Saved[Hash] = Var;
+	Frame->SavedCount++;
+	Frame->SavedSize += Size;
+}
+
 /* Create a copy of the current environment */
 LPTSTR
 DuplicateEnvironment(VOID)
@@ -48,17 +125,14 @@ INT cmd_setlocal(LPTSTR param)
 		error_out_of_memory();
 		return 1;
 	}
+	memset(Saved, 0, sizeof(SETLOCAL));
 	Saved->Prev = bc->setlocal;
 	Saved->DelayedExpansion = bDelayedExpansion;
-	Saved->Environment = DuplicateEnvironment();
-	if (!Saved->Environment)
-	{
-		error_out_of_memory();
-		cmd_free(Saved);
-		return 1;
-	}
+	Saved->Depth = Saved->Prev ? Saved->Prev->Depth + 1 : 1;
 	bc->setlocal = Saved;
 
+	TRACE("setlocal: entering frame, depth %u\n", Saved->Depth);
+
 	nErrorLevel = 0;
 
 	arg = splitspace(param, &argc);
@@ -86,8 +160,9 @@ INT cmd_setlocal(LPTSTR param)
 /* endlocal doesn't take any params */
 INT cmd_endlocal(LPTSTR param)
 {
-	LPTSTR Environ, Name, Value;
 	SETLOCAL *Saved;
+	SAVED_VAR *Var;
+	UINT i;
 
 	/* Pop a SETLOCAL struct off of this batch file's stack */
 	if (!bc || !(Saved = bc->setlocal))
@@ -96,34 +171,23 @@ INT cmd_endlocal(LPTSTR param)
 
 	bDelayedExpansion = Saved->DelayedExpansion;
 
-	/* First, clear out the environment. Since making any changes to the
-	 * environment invalidates pointers obtained from GetEnvironmentStrings(),
-	 * we must make a copy of it and get the variable names from that */
-	Environ = DuplicateEnvironment();
-	if (Environ)
+	TRACE("endlocal: leaving frame, depth %u, restoring %u variables (%lu bytes)\n",
+	      Saved->Depth, Saved->SavedCount, (ULONG)Saved->SavedSize);
+
+	/* Put back the variables changed in this frame. They were not changed
+	 * in the enclosing frame since, so that frame needn't record them */
+	bRestoringEnvironment = TRUE;
+	for (i = 0; i < SETLOCAL_HASH_SIZE; i++)
 	{
-		for (Name = Environ; *Name; Name += _tcslen(Name) + 1)
+		while ((Var = Saved->Saved[i]) != NULL)
 		{
-			if (!(Value = _tcschr(Name + 1, _T('='))))
-				continue;
-			*Value++ = _T('\0');
-			SetEnvironmentVariable(Name, NULL);
-			Name = Value;
+			Saved->Saved[i] = Var->Next;
+			SetEnvVar(Var->Name, Var->OldValue);
+			cmd_free(Var);
 		}
-		cmd_free(Environ);
-	}
-
-	/* Now, restore variables from the copy saved by cmd_setlocal */
-	for (Name = Saved->Environment; *Name; Name += _tcslen(Name) + 1)
-	{
-		if (!(Value = _tcschr(Name + 1, _T('='))))
-			continue;
-		*Value++ = _T('\0');
-		SetEnvironmentVariable(Name, Value);
-		Name = Value;
 	}
+	bRestoringEnvironment = FALSE;
 
-	cmd_free(Saved->Environment);
 	cmd_free(Saved);
 	return 0;
 }
@@ -263,6 +263,7 @@ INT cmd_start (LPTSTR Rest)
 		stui.lpTitle = lpTitle;
 		stui.wShowWindow = wShowWindow;
 
+		ConFlush();
 		bCreate = CreateProcess(bBat ? comspec : szFullName,
 		                        szFullCmdLine, NULL, NULL, TRUE, dwCreationFlags,
 		                        lpEnvironment, lpDirectory, &stui, &prci);
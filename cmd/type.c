@@ -115,6 +115,7 @@ INT cmd_type (LPTSTR param)
 		}
 		else
 		{
+			ConFlush();
 			while (ReadFile(hFile, buff, sizeof(buff), &dwRet, NULL) && dwRet > 0)
 			{
 				WriteFile(hConsoleOut, buff, dwRet, &dwRet, NULL);
@@ -138,74 +138,316 @@ SearchForExecutableSingle (LPCTSTR pFileName, LPTSTR pFullName, LPTSTR pPathExt,
 }
 
 
-BOOL
-SearchForExecutable (LPCTSTR pFileName, LPTSTR pFullName)
+/*
+ * Resolved command names are cached. The cache belongs to the PATH,
+ * PATHEXT and current directory it was filled with, and it is flushed
+ * whenever a file is created, deleted or renamed in the current directory
+ * or in one of the PATH directories. A PATH directory that can't be
+ * watched (it may not exist yet) could gain any name at any time, so
+ * after it only names found ahead of it in PATH are cached.
+ */
+#define EXEC_CACHE_SIZE 64
+
+typedef struct _EXEC_CACHE_ENTRY
 {
-	static TCHAR pszDefaultPathExt[] = _T(".com;.exe;.bat;.cmd");
-	LPTSTR pszPathExt, pszPath;
-	LPTSTR pCh;
-	DWORD  dwBuffer;
-	TRACE ("SearchForExecutable: \'%s\'\n", debugstr_aw(pFileName));
+	struct _EXEC_CACHE_ENTRY *Next;
+	LPTSTR FullName;     /* NULL if the name was not found */
+	TCHAR  Name[];
+} EXEC_CACHE_ENTRY;
 
-	/* load environment varable PATHEXT */
-	pszPathExt = (LPTSTR)cmd_alloc (ENV_BUFFER_SIZE * sizeof(TCHAR));
-	dwBuffer = GetEnvironmentVariable (_T("PATHEXT"), pszPathExt, ENV_BUFFER_SIZE);
-	if (dwBuffer > ENV_BUFFER_SIZE)
+static EXEC_CACHE_ENTRY *ExecCache[EXEC_CACHE_SIZE];
+static BOOL   bExecCacheUsable = FALSE;
+static LPTSTR pszCachedPath = NULL;
+static LPTSTR pszCachedPathExt = NULL;
+static TCHAR  szCachedDirectory[MAX_PATH];
+static HANDLE hDirNotify[MAXIMUM_WAIT_OBJECTS];
+static DWORD  nDirNotify = 0;
+static SIZE_T cchWatchedPath = 0;	/* Leading part of PATH that is watched */
+
+/* PATH and PATHEXT are read into these buffers, which are kept between calls */
+static LPTSTR pszPath = NULL;
+static DWORD  dwPathSize = 0;
+static LPTSTR pszPathExt = NULL;
+static DWORD  dwPathExtSize = 0;
+
+
+static UINT
+HashExecName (LPCTSTR pName)
+{
+	UINT Hash = 0;
+	while (*pName)
+		Hash = Hash * 31 + _totlower(*pName++);
+	return Hash % EXEC_CACHE_SIZE;
+}
+
+static VOID
+FlushExecCache (VOID)
+{
+	EXEC_CACHE_ENTRY *Entry;
+	INT i;
+
+	for (i = 0; i < EXEC_CACHE_SIZE; i++)
 	{
-		pszPathExt = (LPTSTR)cmd_realloc (pszPathExt, dwBuffer * sizeof (TCHAR));
-		GetEnvironmentVariable (_T("PATHEXT"), pszPathExt, dwBuffer);
-		_tcslwr(pszPathExt);
+		while ((Entry = ExecCache[i]) != NULL)
+		{
+			ExecCache[i] = Entry->Next;
+			cmd_free(Entry->FullName);
+			cmd_free(Entry);
+		}
 	}
-	else if (0 == dwBuffer)
+}
+
+static VOID
+CloseDirNotifications (VOID)
+{
+	while (nDirNotify)
+		FindCloseChangeNotification(hDirNotify[--nDirNotify]);
+}
+
+/* Returns FALSE if the directory can't be watched */
+static BOOL
+WatchDirectory (LPCTSTR pDirectory)
+{
+	HANDLE hNotify;
+
+	if (nDirNotify == MAXIMUM_WAIT_OBJECTS)
+		return FALSE;
+
+	hNotify = FindFirstChangeNotification(pDirectory, FALSE, FILE_NOTIFY_CHANGE_FILE_NAME);
+	if (hNotify == INVALID_HANDLE_VALUE)
+		return FALSE;
+	hDirNotify[nDirNotify++] = hNotify;
+	return TRUE;
+}
+
+/* Read an environment variable into a buffer that grows as needed */
+static BOOL
+LoadEnvVar (LPCTSTR pName, LPTSTR *ppBuffer, LPDWORD pdwSize)
+{
+	LPTSTR pValue = GetEnvVar (pName);
+	DWORD dwLength = pValue ? _tcslen (pValue) + 1 : 1;
+
+	if (*ppBuffer == NULL || dwLength > *pdwSize)
 	{
-		_tcscpy(pszPathExt, pszDefaultPathExt);
+		DWORD dwSize = max (dwLength, ENV_BUFFER_SIZE);
+		LPTSTR pNew = (LPTSTR)cmd_realloc (*ppBuffer, dwSize * sizeof(TCHAR));
+		if (pNew == NULL)
+			return FALSE;
+		*ppBuffer = pNew;
+		*pdwSize = dwSize;
 	}
+
+	if (pValue)
+		_tcscpy (*ppBuffer, pValue);
 	else
+		**ppBuffer = _T('\0');
+	return TRUE;
+}
+
+/*
+ * Load PATH and PATHEXT, and throw away the cache if they or the
+ * current directory changed, or if one of the watched directories
+ * has been modified since the cache was filled.
+ */
+static BOOL
+LoadSearchEnvironment (VOID)
+{
+	static TCHAR pszDefaultPathExt[] = _T(".com;.exe;.bat;.cmd");
+	TCHAR szDirectory[MAX_PATH];
+	TCHAR szDir[CMDLINE_LENGTH];
+	LPTSTR s, f;
+	DWORD dwWait;
+
+	if (!LoadEnvVar (_T("PATHEXT"), &pszPathExt, &dwPathExtSize) ||
+	    !LoadEnvVar (_T("PATH"), &pszPath, &dwPathSize))
 	{
-		_tcslwr(pszPathExt);
+		return FALSE;
 	}
 
-	/* Check if valid directly on specified path */
-	if (SearchForExecutableSingle(pFileName, pFullName, pszPathExt, NULL))
+	if (*pszPathExt == _T('\0'))
+		_tcscpy(pszPathExt, pszDefaultPathExt);
+	else
+		_tcslwr(pszPathExt);
+
+	if (!GetCurrentDirectory (MAX_PATH, szDirectory))
+		szDirectory[0] = _T('\0');
+
+	if (pszCachedPath && pszCachedPathExt &&
+	    !_tcscmp(pszCachedPath, pszPath) &&
+	    !_tcscmp(pszCachedPathExt, pszPathExt) &&
+	    !_tcsicmp(szCachedDirectory, szDirectory))
 	{
-		cmd_free(pszPathExt);
+		/* Same search environment; check if any directory has changed */
+		while (bExecCacheUsable && nDirNotify &&
+		       (dwWait = WaitForMultipleObjects (nDirNotify, hDirNotify, FALSE, 0)) < WAIT_OBJECT_0 + nDirNotify)
+		{
+			FlushExecCache();
+			if (!FindNextChangeNotification (hDirNotify[dwWait - WAIT_OBJECT_0]))
+			{
+				/* Can't watch it anymore, so don't cache until the next reset */
+				CloseDirNotifications();
+				bExecCacheUsable = FALSE;
+			}
+		}
 		return TRUE;
 	}
 
-	/* If an explicit directory was given, stop here - no need to search PATH. */
-	if (pFileName[1] == _T(':') || _tcschr(pFileName, _T('\\')))
+	TRACE ("LoadSearchEnvironment: search environment changed, resetting cache\n");
+
+	FlushExecCache();
+	CloseDirNotifications();
+	cmd_free(pszCachedPath);
+	cmd_free(pszCachedPathExt);
+	pszCachedPath = cmd_dup(pszPath);
+	pszCachedPathExt = cmd_dup(pszPathExt);
+	_tcscpy(szCachedDirectory, szDirectory);
+
+	bExecCacheUsable = (pszCachedPath && pszCachedPathExt && WatchDirectory (szDirectory));
+	for (s = pszPath; bExecCacheUsable && *s; s = f)
 	{
-		cmd_free(pszPathExt);
-		return FALSE;
+		f = s + _tcscspn (s, _T(";"));
+		if (f != s && (f - s) < CMDLINE_LENGTH)
+		{
+			memcpy (szDir, s, (f - s) * sizeof(TCHAR));
+			szDir[f - s] = _T('\0');
+			if (!WatchDirectory (szDir))
+				break;
+		}
+		if (*f)
+			f++;
 	}
+	cchWatchedPath = s - pszPath;
+	if (!bExecCacheUsable)
+		CloseDirNotifications();
+	return TRUE;
+}
+
+static EXEC_CACHE_ENTRY *
+LookupExecCache (LPCTSTR pFileName)
+{
+	EXEC_CACHE_ENTRY *Entry;
+
+	for (Entry = ExecCache[HashExecName(pFileName)]; Entry; Entry = Entry->Next)
+		if (!_tcsicmp (Entry->Name, pFileName))
+			return Entry;
+	return NULL;
+}
 
-	/* load environment varable PATH into buffer */
-	pszPath = (LPTSTR)cmd_alloc (ENV_BUFFER_SIZE * sizeof(TCHAR));
-	dwBuffer = GetEnvironmentVariable (_T("PATH"), pszPath, ENV_BUFFER_SIZE);
-	if (dwBuffer > ENV_BUFFER_SIZE)
+static VOID
+AddExecCache (LPCTSTR pFileName, LPCTSTR pFullName)
+{
+	EXEC_CACHE_ENTRY *Entry;
+	UINT Hash = HashExecName(pFileName);
+
+	Entry = cmd_alloc (FIELD_OFFSET(EXEC_CACHE_ENTRY, Name[_tcslen(pFileName) + 1]));
+	if (Entry == NULL)
+		return;
+	_tcscpy (Entry->Name, pFileName);
+	Entry->FullName = NULL;
+	if (pFullName && (Entry->FullName = cmd_dup (pFullName)) == NULL)
 	{
-		pszPath = (LPTSTR)cmd_realloc (pszPath, dwBuffer * sizeof (TCHAR));
-		GetEnvironmentVariable (_T("PATH"), pszPath, dwBuffer);
+		cmd_free (Entry);
+		return;
 	}
+	Entry->Next = ExecCache[Hash];
+	ExecCache[Hash] = Entry;
+}
+
+VOID
+FreeExecCache (VOID)
+{
+	FlushExecCache();
+	CloseDirNotifications();
+	cmd_free(pszCachedPath);
+	cmd_free(pszCachedPathExt);
+	cmd_free(pszPath);
+	cmd_free(pszPathExt);
+	pszCachedPath = pszCachedPathExt = pszPath = pszPathExt = NULL;
+	dwPathSize = dwPathExtSize = 0;
+	bExecCacheUsable = FALSE;
+}
+
+
+/* *ppDir is set to the PATH entry the file was found in, or NULL */
+static BOOL
+SearchPathForExecutable (LPCTSTR pFileName, LPTSTR pFullName, LPCTSTR *ppDir)
+{
+	TCHAR szDir[CMDLINE_LENGTH];
+	LPTSTR s, f;
+
+	*ppDir = NULL;
+
+	/* Check if valid directly on specified path */
+	if (SearchForExecutableSingle(pFileName, pFullName, pszPathExt, NULL))
+		return TRUE;
+
+	/* If an explicit directory was given, stop here - no need to search PATH. */
+	if (pFileName[1] == _T(':') || _tcschr(pFileName, _T('\\')))
+		return FALSE;
 
 	TRACE ("SearchForExecutable(): Loaded PATH: %s\n", debugstr_aw(pszPath));
 
 	/* search in PATH */
-	pCh = _tcstok(pszPath, _T(";"));
-	while (pCh)
+	for (s = pszPath; *s; s = f)
 	{
-		if (SearchForExecutableSingle(pFileName, pFullName, pszPathExt, pCh))
+		f = s + _tcscspn (s, _T(";"));
+		if (f != s && (f - s) < CMDLINE_LENGTH)
 		{
-			cmd_free(pszPath);
-			cmd_free(pszPathExt);
-			return TRUE;
+			memcpy (szDir, s, (f - s) * sizeof(TCHAR));
+			szDir[f - s] = _T('\0');
+			if (SearchForExecutableSingle(pFileName, pFullName, pszPathExt, szDir))
+			{
+				*ppDir = s;
+				return TRUE;
+			}
 		}
-		pCh = _tcstok(NULL, _T(";"));
+		if (*f)
+			f++;
 	}
 
-	cmd_free(pszPath);
-	cmd_free(pszPathExt);
 	return FALSE;
 }
 
+
+BOOL
+SearchForExecutable (LPCTSTR pFileName, LPTSTR pFullName)
+{
+	EXEC_CACHE_ENTRY *Entry;
+	LPCTSTR pDir;
+	BOOL bCacheable;
+	BOOL bFound;
+
+	TRACE ("SearchForExecutable: \'%s\'\n", debugstr_aw(pFileName));
+
+	if (!LoadSearchEnvironment())
+	{
+		error_out_of_memory();
+		return FALSE;
+	}
+
+	/* Names with a drive or directory are not looked up in the watched
+	 * directories, so they are always searched for */
+	bCacheable = bExecCacheUsable && *pFileName &&
+	             pFileName[1] != _T(':') && !_tcschr(pFileName, _T('\\'));
+
+	if (bCacheable && (Entry = LookupExecCache (pFileName)) != NULL)
+	{
+		if (!Entry->FullName)
+			return FALSE;
+		_tcscpy (pFullName, Entry->FullName);
+		return TRUE;
+	}
+
+	bFound = SearchPathForExecutable (pFileName, pFullName, &pDir);
+
+	/* Only keep what no unwatched directory of PATH could change */
+	if (bCacheable &&
+	    (bFound ? (pDir == NULL || pDir < pszPath + cchWatchedPath)
+	            : pszPath[cchWatchedPath] == _T('\0')))
+	{
+		AddExecCache (pFileName, bFound ? pFullName : NULL);
+	}
+	return bFound;
+}
+
 /* EOF */
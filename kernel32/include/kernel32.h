@@ -112,6 +112,8 @@ HANDLE WINAPI OpenConsoleW (LPCWSTR wsName,
 
 BOOL WINAPI SetConsoleInputExeNameW(LPCWSTR lpInputExeName);
 
+VOID WINAPI BasepFlushConsoleOutput(VOID);
+
 PTEB GetTeb(VOID);
 
 HANDLE FASTCALL TranslateStdHandle(HANDLE hHandle);
@@ -1566,6 +1566,75 @@ SetStdHandle(DWORD nStdHandle,
 }
 
 
+/*
+ * Console output is collected in ConsoleOutputBuffer and shown with a
+ * single NtDisplayString at the end of each line, when the buffer is
+ * full, and before waiting for keyboard input. ANSI text is converted
+ * into ConsoleAnsiBuffer, which is kept for the next write.
+ * Both are protected by ConsoleLock.
+ */
+#define CONSOLE_OUTPUT_BUFFER_SIZE 1024
+
+static WCHAR ConsoleOutputBuffer[CONSOLE_OUTPUT_BUFFER_SIZE + 1];
+static ULONG ConsoleOutputLength = 0;
+static PWCHAR ConsoleAnsiBuffer = NULL;
+static ULONG ConsoleAnsiBufferSize = 0;
+
+static
+VOID
+IntFlushConsoleOutput(VOID)
+{
+    UNICODE_STRING us;
+
+    if (ConsoleOutputLength == 0) return;
+    ConsoleOutputBuffer[ConsoleOutputLength] = 0;
+    us.Buffer = ConsoleOutputBuffer;
+    us.Length = (USHORT)(ConsoleOutputLength * sizeof(WCHAR));
+    us.MaximumLength = us.Length + sizeof(WCHAR);
+    NtDisplayString(&us);
+    ConsoleOutputLength = 0;
+}
+
+/* Called at process detach, when no other threads are left */
+VOID
+WINAPI
+BasepFlushConsoleOutput(VOID)
+{
+    IntFlushConsoleOutput();
+    if (ConsoleAnsiBuffer)
+    {
+        RtlFreeHeap(RtlGetProcessHeap(), 0, ConsoleAnsiBuffer);
+        ConsoleAnsiBuffer = NULL;
+        ConsoleAnsiBufferSize = 0;
+    }
+}
+
+static
+VOID
+IntAppendConsoleOutput(PCWSTR Text, ULONG Length)
+{
+    BOOL bEndOfLine = FALSE;
+    ULONG Chunk, i;
+
+    while (Length)
+    {
+        Chunk = min(Length, CONSOLE_OUTPUT_BUFFER_SIZE - ConsoleOutputLength);
+        for (i = 0; i < Chunk; i++)
+        {
+            if (Text[i] == L'\n' || Text[i] == L'\r') bEndOfLine = TRUE;
+            ConsoleOutputBuffer[ConsoleOutputLength + i] = Text[i];
+        }
+        ConsoleOutputLength += Chunk;
+        Text += Chunk;
+        Length -= Chunk;
+        if (ConsoleOutputLength == CONSOLE_OUTPUT_BUFFER_SIZE)
+            IntFlushConsoleOutput();
+    }
+
+    if (bEndOfLine)
+        IntFlushConsoleOutput();
+}
+
 static
 BOOL
 IntWriteConsole(HANDLE hConsoleOutput,
@@ -1579,39 +1648,51 @@ IntWriteConsole(HANDLE hConsoleOutput,
 //    ULONG CsrRequest;
     NTSTATUS Status;
     USHORT nChars;
-    ULONG SizeBytes, CharSize;
+    ULONG SizeBytes;
     DWORD Written = 0;
-    LPVOID Buf;
-    ANSI_STRING as;
-    UNICODE_STRING us;
+    ULONG Length;
     if (!IsConsoleHandle(hConsoleOutput)) return FALSE;
-    CharSize = (bUnicode ? sizeof(WCHAR) : sizeof(CHAR));
-    Buf = RtlAllocateHeap(RtlGetProcessHeap(),
-                          0,
-                          (nNumberOfCharsToWrite + 1) * CharSize);
+
+    RtlEnterCriticalSection(&ConsoleLock);
     if(!bUnicode)
     {
-        strncpy(Buf, lpBuffer, nNumberOfCharsToWrite);
-        ((LPSTR)Buf)[nNumberOfCharsToWrite] = 0;
-        RtlInitAnsiString (&as,
-                   (LPSTR)Buf);
-        RtlAnsiStringToUnicodeString (&us,
-                              &as,
-                              TRUE);
-        NtDisplayString (&us);
-        RtlFreeHeap(RtlGetProcessHeap(), 0, Buf);
-        RtlFreeUnicodeString(&us);
+        /* The text ends at a nul character, if there is one */
+        Length = 0;
+        while (Length < nNumberOfCharsToWrite && ((LPSTR)lpBuffer)[Length])
+            Length++;
 
+        if (Length > ConsoleAnsiBufferSize)
+        {
+            PWCHAR NewBuffer = RtlAllocateHeap(RtlGetProcessHeap(),
+                                               0,
+                                               Length * sizeof(WCHAR));
+            if (NewBuffer == NULL)
+            {
+                RtlLeaveCriticalSection(&ConsoleLock);
+                SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+                return FALSE;
+            }
+            if (ConsoleAnsiBuffer)
+                RtlFreeHeap(RtlGetProcessHeap(), 0, ConsoleAnsiBuffer);
+            ConsoleAnsiBuffer = NewBuffer;
+            ConsoleAnsiBufferSize = Length;
+        }
+        RtlMultiByteToUnicodeN(ConsoleAnsiBuffer,
+                               ConsoleAnsiBufferSize * sizeof(WCHAR),
+                               &SizeBytes,
+                               lpBuffer,
+                               Length);
+        IntAppendConsoleOutput(ConsoleAnsiBuffer, SizeBytes / sizeof(WCHAR));
     }
     else
     {
-        wcsncpy(Buf, lpBuffer , nNumberOfCharsToWrite);
-        ((LPWSTR)Buf)[nNumberOfCharsToWrite] = 0;
-        RtlInitUnicodeString (&us,
-                              (LPWSTR)Buf);
-        NtDisplayString (&us);
-        RtlFreeHeap(RtlGetProcessHeap(), 0, Buf);
+        Length = 0;
+        while (Length < nNumberOfCharsToWrite && ((LPWSTR)lpBuffer)[Length])
+            Length++;
+        IntAppendConsoleOutput(lpBuffer, Length);
     }
+    RtlLeaveCriticalSection(&ConsoleLock);
+
     *lpNumberOfCharsWritten = nNumberOfCharsToWrite;
     return TRUE;
 
@@ -1739,21 +1820,25 @@ IntReadConsole(HANDLE hConsoleInput,
     CHAR ch;
     DWORD po = 0;
     LPSTR lpBuff = lpBuffer;
-    WCHAR buff[2] = L" ";
-    UNICODE_STRING us = {2, 2, buff};
+    WCHAR echo[2];
+    ULONG echoLen;
     DPRINT("IntReadConsole: %d\n", nNumberOfCharsToRead);
     while (TRUE)
     {
+        /* Echoed keys are shown when we wait for the next one */
         IntReadConsoleInput(hConsoleInput, &ir, 1, &read, bUnicode);
         if (!ir.Event.KeyEvent.bKeyDown) continue;
         ch = ir.Event.KeyEvent.uChar.AsciiChar;
+        echoLen = 0;
         switch(ch)
         {
             case '\b':
                 if (po)
                 {
-                    us.Buffer[0] = ch;
-                    NtDisplayString(&us);
+                    echo[0] = ch;
+                    RtlEnterCriticalSection(&ConsoleLock);
+                    IntAppendConsoleOutput(echo, 1);
+                    RtlLeaveCriticalSection(&ConsoleLock);
                     po--;
                 }
                 lpBuff[po] = '\0';
@@ -1761,13 +1846,17 @@ IntReadConsole(HANDLE hConsoleInput,
             case -1:
                 continue;
             case '\r':
-                us.Buffer[0] = ch;
-                NtDisplayString(&us);
+                /* Echo "\r\n" in one piece */
+                echo[echoLen++] = L'\r';
                 ch = '\n';
             default:
                 lpBuff[po] = ch;
-                us.Buffer[0] = ch;
-                NtDisplayString(&us);
+                echo[echoLen++] = ch;
+                RtlEnterCriticalSection(&ConsoleLock);
+                IntAppendConsoleOutput(echo, echoLen);
+                if(nNumberOfCharsToRead == po + 1)
+                    IntFlushConsoleOutput();
+                RtlLeaveCriticalSection(&ConsoleLock);
                 po++;
                 if(nNumberOfCharsToRead == po || ch == '\n')
                 {
@@ -2305,6 +2394,11 @@ IntReadConsoleInput(HANDLE hConsoleInput,
 	KEYBOARD_INPUT_DATA InputData;
 	NTSTATUS Status;
 
+	/* Show pending output before waiting for a key */
+	RtlEnterCriticalSection(&ConsoleLock);
+	IntFlushConsoleOutput();
+	RtlLeaveCriticalSection(&ConsoleLock);
+
 	Offset.QuadPart = 0;
 	Status = NtReadFile(
 		StdInput,
@@ -428,6 +428,8 @@ DllMain(HANDLE hDll,
                 /* Delete DLL critical section */
                 if (ConsoleInitialized == TRUE)
                 {
+                    /* Show any console output that is still pending */
+                    BasepFlushConsoleOutput();
                     ConsoleInitialized = FALSE;
                     RtlDeleteCriticalSection (&ConsoleLock);
                 }
@@ -61,26 +61,147 @@ static int XCOPY_DoCopy(WCHAR *srcstem, WCHAR *srcspec,
 static BOOL XCOPY_CreateDirectory(const WCHAR* path);
 static BOOL XCOPY_ProcessExcludeList(WCHAR* parms);
 static BOOL XCOPY_ProcessExcludeFile(WCHAR* filename, WCHAR* endOfName);
+static BOOL XCOPY_AddExclude(const WCHAR *pattern);
+static BOOL XCOPY_CompileExcludes(void);
+static BOOL XCOPY_IsExcluded(const WCHAR *path);
+static void XCOPY_FreeExcludes(void);
 static WCHAR *XCOPY_LoadMessage(UINT id);
 static void XCOPY_FailMessage(DWORD err);
 static int XCOPY_wprintf(const WCHAR *format, ...);
 
 /* Typedefs */
-typedef struct _EXCLUDELIST
+/* A node of the exclude automaton: a trie of the uppercased patterns
+   with Aho-Corasick failure links. Node 0 is the root               */
+typedef struct _EXCLUDENODE
 {
-  struct _EXCLUDELIST *next;
-  WCHAR               *name;
-} EXCLUDELIST;
+  DWORD                child;       /* First child, 0 if none             */
+  DWORD                sibling;
+  DWORD                fail;        /* Longest proper suffix in the trie  */
+  WCHAR                ch;          /* Character leading to this node     */
+  BOOL                 match;       /* A pattern ends here or at the fail
+                                       chain                              */
+} EXCLUDENODE;
+
+/* A trie edge in the hash table used while matching */
+typedef struct _EXCLUDEEDGE
+{
+  DWORD                node;
+  DWORD                target;      /* 0 for a free slot */
+  WCHAR                ch;
+} EXCLUDEEDGE;
+
+/* A file or directory found by the enumerator */
+typedef struct _XCOPY_ENTRY
+{
+  DWORD                attribs;
+  FILETIME             writeTime;
+  ULARGE_INTEGER       size;
+  DWORD                name;        /* Offsets into the list's names */
+  DWORD                altName;
+} XCOPY_ENTRY;
+
+typedef struct _XCOPY_LIST
+{
+  XCOPY_ENTRY         *entries;
+  DWORD                count;
+  DWORD                maxCount;
+  WCHAR               *names;
+  DWORD                namesUsed;
+  DWORD                namesMax;
+  DWORD               *hash;        /* Entry index + 1 by name, 0 if free */
+  DWORD                hashSize;    /* Power of two                       */
+} XCOPY_LIST;
+
+/* A source directory, queued by the enumerator for the decide stage */
+typedef struct _XCOPY_DIR
+{
+  struct _XCOPY_DIR   *next;
+  int                  depth;
+  DWORD                error;       /* Set if the listing ran out of memory */
+  BOOL                 indexed;     /* All files up to date by the saved
+                                       index, the destination not listed   */
+  WCHAR                srcstem[MAX_PATH];
+  WCHAR                deststem[MAX_PATH];
+  XCOPY_LIST           files;       /* Files matching the source spec       */
+  XCOPY_LIST           dest;        /* All of the destination directory     */
+} XCOPY_DIR;
+
+/* What the enumerator thread walks */
+typedef struct _XCOPY_ENUM
+{
+  WCHAR               *srcstem;
+  WCHAR               *srcspec;
+  WCHAR               *deststem;
+  WCHAR               *destspec;
+  DWORD                flags;
+} XCOPY_ENUM;
+
+/* A file handed to the copy threads */
+typedef struct _XCOPY_JOB
+{
+  struct _XCOPY_JOB   *next;        /* Submission order */
+  struct _XCOPY_JOB   *nextQueued;
+  DWORD                flags;
+  DWORD                srcAttribs;
+  DWORD                destAttribs;
+  DWORD                error;       /* Result of CopyFileW, 0 on success */
+  BOOL                 cancelled;   /* Not copied after a failure        */
+  BOOL                 done;
+  ULARGE_INTEGER       size;        /* Of the source, for the index      */
+  FILETIME             writeTime;
+  WCHAR                copyFrom[MAX_PATH];
+  WCHAR                copyTo[MAX_PATH];
+} XCOPY_JOB;
 
 
 /* Global variables */
 static ULONG filesCopied           = 0;              /* Number of files copied  */
-static EXCLUDELIST *excludeList    = NULL;           /* Excluded strings list   */
+static EXCLUDENODE *excludeNodes   = NULL;           /* Exclude automaton       */
+static DWORD excludeCount          = 0;
+static DWORD excludeMax            = 0;
+static EXCLUDEEDGE *excludeEdges   = NULL;           /* Its edges by node, char */
+static DWORD excludeEdgeSize       = 0;
 static FILETIME dateRange;                           /* Date range to copy after*/
 static const WCHAR wchr_slash[]   = {'\\', 0};
 static const WCHAR wchr_star[]    = {'*', 0};
 static const WCHAR wchr_dot[]     = {'.', 0};
 static const WCHAR wchr_dotdot[]  = {'.', '.', 0};
+static const WCHAR wchr_stardotstar[] = {'*', '.', '*', 0};
+static const WCHAR wchr_empty[]   = {0};
+
+/* Copy threads */
+static DWORD copyThreads           = 1;              /* Set with /MT:n          */
+static DWORD jobThreads            = 0;              /* Copy threads running    */
+static HANDLE jobThread[XCOPY_MAX_THREADS];
+static CRITICAL_SECTION jobLock;
+static HANDLE jobWork;                               /* Counts queued jobs      */
+static HANDLE jobDone;                               /* Set as each job ends    */
+static XCOPY_JOB *jobQueueHead     = NULL;           /* Jobs not started yet    */
+static XCOPY_JOB *jobQueueTail     = NULL;
+static XCOPY_JOB *jobRetireHead    = NULL;           /* Jobs not reported yet   */
+static XCOPY_JOB *jobRetireTail    = NULL;
+static DWORD jobPending            = 0;
+static BOOL jobStop                = FALSE;
+static volatile BOOL copyAbort     = FALSE;          /* A copy failed, no /C    */
+
+/* Enumerator thread */
+static CRITICAL_SECTION dirLock;
+static HANDLE dirReady;                              /* Counts queued dirs + end*/
+static HANDLE dirRoom;                               /* Counts free queue slots */
+static XCOPY_DIR *dirHead          = NULL;
+static XCOPY_DIR *dirTail          = NULL;
+static BOOL dirEnd                 = FALSE;          /* Enumerator is finished  */
+static BOOL dirInline              = FALSE;          /* No thread, no waiting   */
+static volatile BOOL dirStop       = FALSE;          /* Decide stage gave up    */
+static DWORD enumError             = 0;
+
+/* Destination index, keyed by the path below the destination stem */
+static XCOPY_LIST savedIndex;                        /* As loaded, read only    */
+static XCOPY_LIST newIndex;                          /* Files now up to date    */
+static DWORD destRootLen           = 0;
+static BOOL destFatTimes           = FALSE;          /* Times kept to 2 seconds */
+static const WCHAR indexName[]     = {'x', 'c', 'o', 'p', 'y', '.', 'i', 'd', 'x', 0};
+static const WCHAR indexTmpName[]  = {'x', 'c', 'o', 'p', 'y', '.', 'i', 'd', '$', 0};
 
 /* Constants (Mostly for widechars) */
 
@@ -173,12 +294,7 @@ int __cdecl main (int argc, char *argv[])
                 flags);
 
     /* Clear up exclude list allocated memory */
-    while (excludeList) {
-        EXCLUDELIST *pos = excludeList;
-        excludeList = excludeList -> next;
-        HeapFree(GetProcessHeap(), 0, pos->name);
-        HeapFree(GetProcessHeap(), 0, pos);
-    }
+    XCOPY_FreeExcludes();
 
     /* Finished - print trailer and exit */
     if (flags & OPT_SIMULATE) {
@@ -249,6 +365,8 @@ static int XCOPY_ParseCommandLine(WCHAR *suppliedsource,
                                   WCHAR *supplieddestination, DWORD *pflags)
 {
     const WCHAR EXCLUDE[]  = {'E', 'X', 'C', 'L', 'U', 'D', 'E', ':', 0};
+    const WCHAR INCR[]     = {'I', 'N', 'C', 'R', 0};
+    const WCHAR INCRINDEX[] = {'I', 'N', 'C', 'R', ':', 'I', 'N', 'D', 'E', 'X', 0};
     DWORD flags = *pflags;
     WCHAR *cmdline, *word, *end, *next;
     int rc = RC_INITERROR;
@@ -290,7 +408,13 @@ static int XCOPY_ParseCommandLine(WCHAR *suppliedsource,
                        but tests show it is done for each src file
                        regardless of the destination                   */
             switch (toupper(word[1])) {
-            case 'I': flags |= OPT_ASSUMEDIR;     break;
+            /* I can be /I, /INCR or /INCR:INDEX */
+            case 'I': if (lstrcmpiW(&word[1], INCR) == 0)
+                          flags |= OPT_INCREMENTAL;
+                      else if (lstrcmpiW(&word[1], INCRINDEX) == 0)
+                          flags |= OPT_INCREMENTAL | OPT_SAVEINDEX;
+                      else flags |= OPT_ASSUMEDIR;
+                      break;
             case 'S': flags |= OPT_RECURSIVE;     break;
             case 'Q': flags |= OPT_QUIET;         break;
             case 'F': flags |= OPT_FULL;          break;
@@ -305,8 +429,18 @@ static int XCOPY_ParseCommandLine(WCHAR *suppliedsource,
             case 'C': flags |= OPT_IGNOREERRORS;  break;
             case 'P': flags |= OPT_SRCPROMPT;     break;
             case 'A': flags |= OPT_ARCHIVEONLY;   break;
-            case 'M': flags |= OPT_ARCHIVEONLY |
-                               OPT_REMOVEARCH;    break;
+            case 'M': if (toupper(word[2]) == 'T') {
+                          /* /MT or /MT:n, the number of copy threads */
+                          copyThreads = XCOPY_THREADS;
+                          if (word[3] == ':') copyThreads = _wtol(&word[4]);
+                          if (copyThreads < 1 || copyThreads > XCOPY_MAX_THREADS ||
+                              (word[3] && word[3] != ':')) {
+                              XCOPY_wprintf(XCOPY_LoadMessage(STRING_INVPARM), word);
+                              goto out;
+                          }
+                      } else flags |= OPT_ARCHIVEONLY |
+                                      OPT_REMOVEARCH;
+                      break;
 
             /* E can be /E or /EXCLUDE */
             case 'E': if (CompareStringW(LOCALE_USER_DEFAULT,
@@ -578,308 +712,1100 @@ static int XCOPY_ProcessDestParm(WCHAR *supplieddestination, WCHAR *stem, WCHAR
 }
 
 /* =========================================================================
-   XCOPY_DoCopy - Recursive function to copy files based on input parms
-     of a stem and a spec
+   XCOPY_DoCopy - Copies the files of a stem and a spec, and with /S or /E
+     the same spec in all directories below the stem
+
+      The work is done by three stages running side by side:
+       - An enumerator thread walks the source tree depth first. For each
+         directory it collects the matching files (one FindFirstFile pass
+         when the spec is * or *.*) and one listing of the destination
+         directory, and queues them, at most XCOPY_DIRS_AHEAD ahead.
+       - This thread takes the directories in order and decides what to
+         copy from the collected find data, prompting where needed.
+       - The copy threads run the CopyFileW calls. Results are reported
+         by this thread in the order the files were decided, so the output
+         is the same as a sequential copy.
+   ========================================================================= */
 
-      This works by using FindFirstFile supplying the source stem and spec.
-      If results are found, any non-directory ones are processed
-      Then, if /S or /E is supplied, another search is made just for
-      directories, and this function is called again for that directory
+/* Returns whether the name is . or .. */
+static BOOL XCOPY_IsDots(const WCHAR *name)
+{
+    return lstrcmpW(name, wchr_dot) == 0 || lstrcmpW(name, wchr_dotdot) == 0;
+}
 
-   ========================================================================= */
-static int XCOPY_DoCopy(WCHAR *srcstem, WCHAR *srcspec,
-                        WCHAR *deststem, WCHAR *destspec,
-                        DWORD flags)
+static DWORD XCOPY_HashName(const WCHAR *name)
 {
-    WIN32_FIND_DATAW *finddata;
-    HANDLE          h;
-    BOOL            findres = TRUE;
-    WCHAR           *inputpath, *outputpath;
-    BOOL            copiedFile = FALSE;
-    DWORD           destAttribs, srcAttribs;
-    BOOL            skipFile;
-    int             ret = 0;
+    DWORD hash = 2166136261U;
 
-    /* Allocate some working memory on heap to minimize footprint */
-    finddata = HeapAlloc(GetProcessHeap(), 0, sizeof(WIN32_FIND_DATAW));
-    inputpath = HeapAlloc(GetProcessHeap(), 0, MAX_PATH * sizeof(WCHAR));
-    outputpath = HeapAlloc(GetProcessHeap(), 0, MAX_PATH * sizeof(WCHAR));
+    while (*name) {
+        hash ^= toupperW(*name++);
+        hash *= 16777619;
+    }
+    return hash;
+}
 
-    /* Build the search info into a single parm */
-    lstrcpyW(inputpath, srcstem);
-    lstrcatW(inputpath, srcspec);
+/* Appends a name to the list's name buffer, returning its offset or -1 */
+static DWORD XCOPY_AddName(XCOPY_LIST *list, const WCHAR *name)
+{
+    DWORD len = lstrlenW(name) + 1;
+    DWORD offset;
 
-    /* Search 1 - Look for matching files */
-    h = FindFirstFileW(inputpath, finddata);
-    while (h != INVALID_HANDLE_VALUE && findres) {
+    if (list->namesUsed + len > list->namesMax) {
+        DWORD newMax = max(list->namesMax * 2, list->namesUsed + len + 1024);
+        WCHAR *newNames;
 
-        skipFile = FALSE;
+        if (list->names)
+            newNames = HeapReAlloc(GetProcessHeap(), 0, list->names, newMax * sizeof(WCHAR));
+        else
+            newNames = HeapAlloc(GetProcessHeap(), 0, newMax * sizeof(WCHAR));
+        if (!newNames) return (DWORD)-1;
+        list->names = newNames;
+        list->namesMax = newMax;
+    }
 
-        /* Ignore . and .. */
-        if (lstrcmpW(finddata->cFileName, wchr_dot)==0 ||
-            lstrcmpW(finddata->cFileName, wchr_dotdot)==0 ||
-            finddata->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+    offset = list->namesUsed;
+    memcpy(list->names + offset, name, len * sizeof(WCHAR));
+    list->namesUsed += len;
+    return offset;
+}
 
-            WINE_TRACE("Skipping directory, . or .. (%s)\n", wine_dbgstr_w(finddata->cFileName));
-        } else {
+/* Adds one file or directory to a list */
+static BOOL XCOPY_AddRecord(XCOPY_LIST *list, const WCHAR *name, const WCHAR *altName,
+                            DWORD attribs, FILETIME writeTime, ULARGE_INTEGER size)
+{
+    XCOPY_ENTRY *entry;
 
-            /* Get the filename information */
-            lstrcpyW(copyFrom, srcstem);
-            if (flags & OPT_SHORTNAME) {
-              lstrcatW(copyFrom, finddata->cAlternateFileName);
-            } else {
-              lstrcatW(copyFrom, finddata->cFileName);
-            }
+    if (list->count == list->maxCount) {
+        DWORD newMax = list->maxCount ? list->maxCount * 2 : 64;
+        XCOPY_ENTRY *newEntries;
 
-            lstrcpyW(copyTo, deststem);
-            if (*destspec == 0x00) {
-                if (flags & OPT_SHORTNAME) {
-                    lstrcatW(copyTo, finddata->cAlternateFileName);
-                } else {
-                    lstrcatW(copyTo, finddata->cFileName);
-                }
-            } else {
-                lstrcatW(copyTo, destspec);
-            }
+        if (list->entries)
+            newEntries = HeapReAlloc(GetProcessHeap(), 0, list->entries,
+                                     newMax * sizeof(XCOPY_ENTRY));
+        else
+            newEntries = HeapAlloc(GetProcessHeap(), 0, newMax * sizeof(XCOPY_ENTRY));
+        if (!newEntries) return FALSE;
+        list->entries = newEntries;
+        list->maxCount = newMax;
+    }
 
-            /* Do the copy */
-            WINE_TRACE("ACTION: Copy '%s' -> '%s'\n", wine_dbgstr_w(copyFrom),
-                                                      wine_dbgstr_w(copyTo));
-            if (!copiedFile && !(flags & OPT_SIMULATE)) XCOPY_CreateDirectory(deststem);
+    entry = &list->entries[list->count];
+    entry->attribs = attribs;
+    entry->writeTime = writeTime;
+    entry->size = size;
+    entry->name = XCOPY_AddName(list, name);
+    entry->altName = XCOPY_AddName(list, altName);
+    if (entry->name == (DWORD)-1 || entry->altName == (DWORD)-1) return FALSE;
 
-            /* See if allowed to copy it */
-            srcAttribs = GetFileAttributesW(copyFrom);
-            WINE_TRACE("Source attribs: %d\n", srcAttribs);
+    list->count++;
+    return TRUE;
+}
 
-            if ((srcAttribs & FILE_ATTRIBUTE_HIDDEN) ||
-                (srcAttribs & FILE_ATTRIBUTE_SYSTEM)) {
+/* Adds the find data of one file or directory to a list */
+static BOOL XCOPY_AddEntry(XCOPY_LIST *list, const WIN32_FIND_DATAW *finddata)
+{
+    ULARGE_INTEGER size;
 
-                if (!(flags & OPT_COPYHIDSYS)) {
-                    skipFile = TRUE;
-                }
-            }
+    size.u.LowPart = finddata->nFileSizeLow;
+    size.u.HighPart = finddata->nFileSizeHigh;
+    return XCOPY_AddRecord(list, finddata->cFileName, finddata->cAlternateFileName,
+                           finddata->dwFileAttributes, finddata->ftLastWriteTime, size);
+}
 
-            if (!(srcAttribs & FILE_ATTRIBUTE_ARCHIVE) &&
-                (flags & OPT_ARCHIVEONLY)) {
-                skipFile = TRUE;
-            }
+static void XCOPY_HashInsert(XCOPY_LIST *list, const WCHAR *name, DWORD index)
+{
+    DWORD slot = XCOPY_HashName(name) & (list->hashSize - 1);
 
-            /* See if file exists */
-            destAttribs = GetFileAttributesW(copyTo);
-            WINE_TRACE("Dest attribs: %d\n", srcAttribs);
+    while (list->hash[slot] != 0)
+        slot = (slot + 1) & (list->hashSize - 1);
+    list->hash[slot] = index + 1;
+}
 
-            /* Check date ranges if a destination file already exists */
-            if (!skipFile && (flags & OPT_DATERANGE) &&
-                (CompareFileTime(&finddata->ftLastWriteTime, &dateRange) < 0)) {
-                WINE_TRACE("Skipping file as modified date too old\n");
-                skipFile = TRUE;
-            }
+/* Builds the lookup by name. Short names are entered as well, since
+   GetFileAttributesW on a short name would have found the file too  */
+static BOOL XCOPY_IndexList(XCOPY_LIST *list)
+{
+    DWORD i;
 
-            /* If just /D supplied, only overwrite if src newer than dest */
-            if (!skipFile && (flags & OPT_DATENEWER) &&
-               (destAttribs != INVALID_FILE_ATTRIBUTES)) {
-                HANDLE h = CreateFileW(copyTo, GENERIC_READ, FILE_SHARE_READ,
-                                      NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
-                                      NULL);
-                if (h != INVALID_HANDLE_VALUE) {
-                    FILETIME writeTime;
-                    GetFileTime(h, NULL, NULL, &writeTime);
-
-                    if (CompareFileTime(&finddata->ftLastWriteTime, &writeTime) <= 0) {
-                        WINE_TRACE("Skipping file as dest newer or same date\n");
-                        skipFile = TRUE;
-                    }
-                    CloseHandle(h);
-                }
-            }
+    if (list->count == 0) return TRUE;
 
-            /* See if exclude list provided. Note since filenames are case
-               insensitive, need to uppercase the filename before doing
-               strstr                                                     */
-            if (!skipFile && (flags & OPT_EXCLUDELIST)) {
-                EXCLUDELIST *pos = excludeList;
-                WCHAR copyFromUpper[MAX_PATH];
-
-                /* Uppercase source filename */
-                lstrcpyW(copyFromUpper, copyFrom);
-                CharUpperBuffW(copyFromUpper, lstrlenW(copyFromUpper));
-
-                /* Loop through testing each exclude line */
-                while (pos) {
-                    if (wcsstr(copyFromUpper, pos->name) != NULL) {
-                        WINE_TRACE("Skipping file as matches exclude '%s'\n",
-                                   wine_dbgstr_w(pos->name));
-                        skipFile = TRUE;
-                        pos = NULL;
-                    } else {
-                        pos = pos->next;
-                    }
-                }
-            }
+    list->hashSize = 16;
+    while (list->hashSize < list->count * 4)
+        list->hashSize *= 2;
+    list->hash = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, list->hashSize * sizeof(DWORD));
+    if (!list->hash) return FALSE;
+
+    for (i = 0; i < list->count; i++) {
+        XCOPY_HashInsert(list, list->names + list->entries[i].name, i);
+        if (list->names[list->entries[i].altName])
+            XCOPY_HashInsert(list, list->names + list->entries[i].altName, i);
+    }
+    return TRUE;
+}
+
+static XCOPY_ENTRY *XCOPY_FindEntry(XCOPY_LIST *list, const WCHAR *name)
+{
+    DWORD slot;
+
+    if (list->hash == NULL) return NULL;
+
+    slot = XCOPY_HashName(name) & (list->hashSize - 1);
+    while (list->hash[slot] != 0) {
+        XCOPY_ENTRY *entry = &list->entries[list->hash[slot] - 1];
+        if (strcmpiW(list->names + entry->name, name) == 0 ||
+            strcmpiW(list->names + entry->altName, name) == 0)
+            return entry;
+        slot = (slot + 1) & (list->hashSize - 1);
+    }
+    return NULL;
+}
+
+static void XCOPY_FreeList(XCOPY_LIST *list)
+{
+    HeapFree(GetProcessHeap(), 0, list->entries);
+    HeapFree(GetProcessHeap(), 0, list->names);
+    HeapFree(GetProcessHeap(), 0, list->hash);
+    memset(list, 0, sizeof(*list));
+}
+
+/* Returns whether the volume a path is on is FAT, which keeps write
+   times to 2 seconds only                                           */
+static BOOL XCOPY_IsFatVolume(const WCHAR *path)
+{
+    static const WCHAR fatW[] = {'F', 'A', 'T', 0};
+    WCHAR root[MAX_PATH];
+    WCHAR fsName[MAX_PATH];
+
+    if (!GetVolumePathNameW(path, root, MAX_PATH) ||
+        !GetVolumeInformationW(root, NULL, 0, NULL, NULL, NULL, fsName, MAX_PATH))
+        return FALSE;
+    return strncmpiW(fsName, fatW, 3) == 0;
+}
+
+/* Returns whether a destination of the given size and time is a copy of
+   the source entry. On a FAT destination times within 2 seconds are the
+   same, as FAT keeps no finer times                                     */
+static BOOL XCOPY_SameFile(const XCOPY_ENTRY *entry, ULARGE_INTEGER size, FILETIME time)
+{
+    ULARGE_INTEGER srcTime, destTime;
+
+    if (entry->size.QuadPart != size.QuadPart) return FALSE;
+    if (!destFatTimes) return CompareFileTime(&entry->writeTime, &time) == 0;
+
+    srcTime.u.LowPart = entry->writeTime.dwLowDateTime;
+    srcTime.u.HighPart = entry->writeTime.dwHighDateTime;
+    destTime.u.LowPart = time.dwLowDateTime;
+    destTime.u.HighPart = time.dwHighDateTime;
+    if (srcTime.QuadPart > destTime.QuadPart)
+        return srcTime.QuadPart - destTime.QuadPart < 20000000;
+    return destTime.QuadPart - srcTime.QuadPart < 20000000;
+}
+
+/* Looks a destination up in the saved index, by its path below the
+   destination stem                                                 */
+static XCOPY_ENTRY *XCOPY_FindIndexed(const WCHAR *reldir, const WCHAR *name)
+{
+    WCHAR key[MAX_PATH];
+
+    if (lstrlenW(reldir) + lstrlenW(name) >= MAX_PATH) return NULL;
+    lstrcpyW(key, reldir);
+    lstrcatW(key, name);
+    return XCOPY_FindEntry(&savedIndex, key);
+}
+
+/* Returns whether the saved index shows every file of a directory as
+   up to date, so that its destination need not be listed            */
+static BOOL XCOPY_AllIndexed(XCOPY_DIR *dir, DWORD flags)
+{
+    DWORD i;
+
+    for (i = 0; i < dir->files.count; i++) {
+        XCOPY_ENTRY *entry = &dir->files.entries[i];
+        XCOPY_ENTRY *indexed;
+
+        indexed = XCOPY_FindIndexed(dir->deststem + destRootLen,
+                                    dir->files.names + ((flags & OPT_SHORTNAME) ?
+                                                        entry->altName : entry->name));
+        if (!indexed || !XCOPY_SameFile(entry, indexed->size, indexed->writeTime))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* Loads the index an earlier /INCR:INDEX left in the destination stem.
+   A missing or damaged index is simply not used                       */
+static void XCOPY_LoadIndex(const WCHAR *deststem)
+{
+    WCHAR  path[MAX_PATH];
+    WCHAR  key[MAX_PATH];
+    BYTE  *buffer, *pos, *end;
+    SIZE_T left;
+    DWORD  fileSize, count, header[3], len, i;
+    HANDLE h;
+    BOOL   ok;
+
+    if (lstrlenW(deststem) + lstrlenW(indexName) >= MAX_PATH) return;
+    lstrcpyW(path, deststem);
+    lstrcatW(path, indexName);
+
+    h = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                    FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (h == INVALID_HANDLE_VALUE) return;
+
+    fileSize = GetFileSize(h, NULL);
+    buffer = NULL;
+    ok = fileSize != INVALID_FILE_SIZE && fileSize >= sizeof(header);
+    if (ok) {
+        buffer = HeapAlloc(GetProcessHeap(), 0, fileSize);
+        ok = buffer && ReadFile(h, buffer, fileSize, &count, NULL) && count == fileSize;
+    }
+    CloseHandle(h);
+
+    if (ok) {
+        memcpy(header, buffer, sizeof(header));
+        ok = header[0] == XCOPY_INDEX_MAGIC && header[1] == XCOPY_INDEX_VERSION;
+    }
+
+    pos = buffer + sizeof(header);
+    end = buffer + fileSize;
+    for (i = 0; ok && i < header[2]; i++) {
+        ULARGE_INTEGER size;
+        FILETIME       time;
+
+        /* Size, time, name length, name without the terminator. pos
+           never goes past end                                       */
+        left = (SIZE_T)(end - pos);
+        if (left < sizeof(size) + sizeof(time) + sizeof(len)) {
+            ok = FALSE;
+            break;
+        }
+        left -= sizeof(size) + sizeof(time) + sizeof(len);
+        memcpy(&size, pos, sizeof(size));
+        pos += sizeof(size);
+        memcpy(&time, pos, sizeof(time));
+        pos += sizeof(time);
+        memcpy(&len, pos, sizeof(len));
+        pos += sizeof(len);
+
+        if (len >= MAX_PATH || left < len * sizeof(WCHAR)) {
+            ok = FALSE;
+            break;
+        }
+        memcpy(key, pos, len * sizeof(WCHAR));
+        key[len] = 0;
+        pos += len * sizeof(WCHAR);
+
+        ok = XCOPY_AddRecord(&savedIndex, key, wchr_empty, 0, time, size);
+    }
 
-            /* Prompt each file if necessary */
-            if (!skipFile && (flags & OPT_SRCPROMPT)) {
-                DWORD count;
-                char  answer[10];
-                BOOL  answered = FALSE;
-                WCHAR yesChar[2];
-                WCHAR noChar[2];
-
-                /* Read the Y and N characters from the resource file */
-                wcscpy(yesChar, XCOPY_LoadMessage(STRING_YES_CHAR));
-                wcscpy(noChar, XCOPY_LoadMessage(STRING_NO_CHAR));
-
-                while (!answered) {
-                    XCOPY_wprintf(XCOPY_LoadMessage(STRING_SRCPROMPT), copyFrom);
-                    ReadFile (GetStdHandle(STD_INPUT_HANDLE), answer, sizeof(answer),
-                              &count, NULL);
-
-                    answered = TRUE;
-                    if (toupper(answer[0]) == noChar[0])
-                        skipFile = TRUE;
-                    else if (toupper(answer[0]) != yesChar[0])
-                        answered = FALSE;
-                }
+    if (ok) ok = XCOPY_IndexList(&savedIndex);
+    if (!ok) {
+        WINE_TRACE("Ignoring index %s\n", wine_dbgstr_w(path));
+        XCOPY_FreeList(&savedIndex);
+    } else {
+        WINE_TRACE("Loaded %d entries from %s\n", savedIndex.count, wine_dbgstr_w(path));
+    }
+    HeapFree(GetProcessHeap(), 0, buffer);
+}
+
+/* Writes the files found up to date or copied by this run as the index
+   for the next one. It is written aside and then moved into place      */
+static void XCOPY_SaveIndex(const WCHAR *deststem)
+{
+    WCHAR  path[MAX_PATH];
+    WCHAR  tmpPath[MAX_PATH];
+    BYTE  *buffer;
+    DWORD  header[3], used, written, i;
+    HANDLE h;
+    BOOL   ok;
+
+    if (lstrlenW(deststem) + lstrlenW(indexName) >= MAX_PATH) return;
+    lstrcpyW(path, deststem);
+    lstrcatW(path, indexName);
+    lstrcpyW(tmpPath, deststem);
+    lstrcatW(tmpPath, indexTmpName);
+
+    buffer = HeapAlloc(GetProcessHeap(), 0, XCOPY_INDEX_BUFFER);
+    if (!buffer) return;
+    h = CreateFileW(tmpPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                    FILE_ATTRIBUTE_HIDDEN, NULL);
+    if (h == INVALID_HANDLE_VALUE) {
+        WINE_TRACE("Cannot write index %s (%d)\n", wine_dbgstr_w(tmpPath), GetLastError());
+        HeapFree(GetProcessHeap(), 0, buffer);
+        return;
+    }
+
+    header[0] = XCOPY_INDEX_MAGIC;
+    header[1] = XCOPY_INDEX_VERSION;
+    header[2] = newIndex.count;
+    memcpy(buffer, header, sizeof(header));
+    used = sizeof(header);
+
+    ok = TRUE;
+    for (i = 0; ok && i < newIndex.count; i++) {
+        XCOPY_ENTRY *entry = &newIndex.entries[i];
+        const WCHAR *name = newIndex.names + entry->name;
+        DWORD        len = lstrlenW(name);
+        DWORD        recordSize = sizeof(entry->size) + sizeof(entry->writeTime) +
+                                  sizeof(len) + len * sizeof(WCHAR);
+
+        if (used + recordSize > XCOPY_INDEX_BUFFER) {
+            ok = WriteFile(h, buffer, used, &written, NULL) && written == used;
+            used = 0;
+        }
+        memcpy(buffer + used, &entry->size, sizeof(entry->size));
+        used += sizeof(entry->size);
+        memcpy(buffer + used, &entry->writeTime, sizeof(entry->writeTime));
+        used += sizeof(entry->writeTime);
+        memcpy(buffer + used, &len, sizeof(len));
+        used += sizeof(len);
+        memcpy(buffer + used, name, len * sizeof(WCHAR));
+        used += len * sizeof(WCHAR);
+    }
+    if (ok && used)
+        ok = WriteFile(h, buffer, used, &written, NULL) && written == used;
+    CloseHandle(h);
+    HeapFree(GetProcessHeap(), 0, buffer);
+
+    if (!ok || !MoveFileExW(tmpPath, path, MOVEFILE_REPLACE_EXISTING)) {
+        WINE_TRACE("Cannot write index %s (%d)\n", wine_dbgstr_w(path), GetLastError());
+        DeleteFileW(tmpPath);
+    }
+}
+
+/* Adds the files and/or the directories a search finds to a list,
+   skipping . and ..                                               */
+static BOOL XCOPY_ListDir(XCOPY_LIST *list, const WCHAR *stem, const WCHAR *spec,
+                          BOOL files, BOOL dirs)
+{
+    WIN32_FIND_DATAW finddata;
+    WCHAR  path[MAX_PATH];
+    HANDLE h;
+    BOOL   ok = TRUE;
+
+    if (lstrlenW(stem) + lstrlenW(spec) >= MAX_PATH) return TRUE;
+    lstrcpyW(path, stem);
+    lstrcatW(path, spec);
+
+    h = FindFirstFileW(path, &finddata);
+    if (h == INVALID_HANDLE_VALUE) return TRUE;
+    do {
+        BOOL isDir = (finddata.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+
+        if ((isDir ? dirs : files) && !XCOPY_IsDots(finddata.cFileName))
+            ok = XCOPY_AddEntry(list, &finddata);
+    } while (ok && FindNextFileW(h, &finddata));
+    FindClose(h);
+    return ok;
+}
+
+/* Drops the files whose source path matches an exclude pattern */
+static void XCOPY_ExcludeFiles(XCOPY_DIR *dir, DWORD flags)
+{
+    WCHAR path[MAX_PATH];
+    DWORD stemLen = lstrlenW(dir->srcstem);
+    DWORD i, kept = 0;
+
+    lstrcpyW(path, dir->srcstem);
+    for (i = 0; i < dir->files.count; i++) {
+        XCOPY_ENTRY *entry = &dir->files.entries[i];
+        const WCHAR *name = dir->files.names + ((flags & OPT_SHORTNAME) ?
+                                                entry->altName : entry->name);
+
+        if (stemLen + lstrlenW(name) < MAX_PATH) {
+            lstrcpyW(path + stemLen, name);
+            if (XCOPY_IsExcluded(path)) {
+                WINE_TRACE("Skipping file as matches exclude (%s)\n", wine_dbgstr_w(path));
+                continue;
             }
+        }
+        dir->files.entries[kept++] = *entry;
+    }
+    dir->files.count = kept;
+}
+
+/* Hands a directory to the decide stage, waiting while it is too far behind */
+static void XCOPY_QueueDir(XCOPY_DIR *dir)
+{
+    if (!dirInline) WaitForSingleObject(dirRoom, INFINITE);
+
+    EnterCriticalSection(&dirLock);
+    if (dirTail) dirTail->next = dir;
+    else dirHead = dir;
+    dirTail = dir;
+    LeaveCriticalSection(&dirLock);
+
+    ReleaseSemaphore(dirReady, 1, NULL);
+}
+
+/* Enumerates a source directory and, below it, its subdirectories */
+static BOOL XCOPY_Enumerate(XCOPY_ENUM *en, const WCHAR *srcstem,
+                            const WCHAR *deststem, int depth)
+{
+    XCOPY_DIR  *dir;
+    XCOPY_LIST  subdirs;
+    WCHAR       childsrc[MAX_PATH];
+    WCHAR       childdest[MAX_PATH];
+    BOOL        allFiles, excluded, ok;
+    DWORD       i;
+
+    if (dirStop) return FALSE;
+
+    /* The path of everything below a directory that matches an exclude
+       pattern matches too, so none of it is copied. Only /E still has
+       to walk it, to create the subdirectories                        */
+    excluded = (en->flags & OPT_EXCLUDELIST) && XCOPY_IsExcluded(srcstem);
+    if (excluded && !(en->flags & OPT_EMPTYDIR)) {
+        WINE_TRACE("Skipping dir as matches exclude (%s)\n", wine_dbgstr_w(srcstem));
+        return TRUE;
+    }
+
+    dir = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(XCOPY_DIR));
+    if (!dir) {
+        enumError = ERROR_NOT_ENOUGH_MEMORY;
+        return FALSE;
+    }
+    dir->depth = depth;
+    lstrcpyW(dir->srcstem, srcstem);
+    lstrcpyW(dir->deststem, deststem);
+    memset(&subdirs, 0, sizeof(subdirs));
+
+    /* A spec of * or *.* matches every name, so one search finds both the
+       files and the subdirectories                                       */
+    allFiles = lstrcmpW(en->srcspec, wchr_star) == 0 ||
+               lstrcmpW(en->srcspec, wchr_stardotstar) == 0;
+    if (allFiles && (en->flags & OPT_RECURSIVE)) {
+        WIN32_FIND_DATAW finddata;
+        WCHAR  path[MAX_PATH];
+        HANDLE h;
+
+        ok = TRUE;
+        lstrcpyW(path, srcstem);
+        lstrcatW(path, wchr_star);
+        h = FindFirstFileW(path, &finddata);
+        if (h != INVALID_HANDLE_VALUE) {
+            do {
+                if (!(finddata.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+                    if (!excluded) ok = XCOPY_AddEntry(&dir->files, &finddata);
+                } else if (!XCOPY_IsDots(finddata.cFileName))
+                    ok = XCOPY_AddEntry(&subdirs, &finddata);
+            } while (ok && FindNextFileW(h, &finddata));
+            FindClose(h);
+        }
+    } else {
+        ok = excluded || XCOPY_ListDir(&dir->files, srcstem, en->srcspec, TRUE, FALSE);
+        if (ok && (en->flags & OPT_RECURSIVE))
+            ok = XCOPY_ListDir(&subdirs, srcstem, wchr_star, FALSE, TRUE);
+    }
+
+    if (ok && !excluded && (en->flags & OPT_EXCLUDELIST))
+        XCOPY_ExcludeFiles(dir, en->flags);
+
+    /* A directory whose files all match the saved index needs no
+       listing of the destination                                 */
+    if (ok && dir->files.count && *en->destspec == 0x00 && savedIndex.count)
+        dir->indexed = XCOPY_AllIndexed(dir, en->flags);
+
+    /* One listing of the destination replaces a lookup for every file */
+    if (ok && dir->files.count && *en->destspec == 0x00 && !dir->indexed) {
+        ok = XCOPY_ListDir(&dir->dest, deststem, wchr_star, TRUE, TRUE) &&
+             XCOPY_IndexList(&dir->dest);
+    }
+
+    if (!ok) dir->error = ERROR_NOT_ENOUGH_MEMORY;
+    XCOPY_QueueDir(dir);
+
+    for (i = 0; ok && i < subdirs.count; i++) {
+        const WCHAR *name = subdirs.names + subdirs.entries[i].name;
+
+        if (lstrlenW(srcstem) + lstrlenW(name) + 2 > MAX_PATH ||
+            lstrlenW(deststem) + lstrlenW(name) + 2 > MAX_PATH) {
+            WINE_TRACE("Skipping subdir with too long a path: %s\n", wine_dbgstr_w(name));
+            continue;
+        }
+
+        /* Make up recursive information */
+        lstrcpyW(childsrc, srcstem);
+        lstrcatW(childsrc, name);
+        lstrcatW(childsrc, wchr_slash);
+
+        lstrcpyW(childdest, deststem);
+        if (*en->destspec == 0x00) {
+            lstrcatW(childdest, name);
+            lstrcatW(childdest, wchr_slash);
+        }
+
+        ok = XCOPY_Enumerate(en, childsrc, childdest, depth + 1);
+    }
+
+    XCOPY_FreeList(&subdirs);
+    return ok;
+}
+
+static DWORD WINAPI XCOPY_EnumThread(LPVOID param)
+{
+    XCOPY_ENUM *en = param;
+
+    XCOPY_Enumerate(en, en->srcstem, en->deststem, 0);
+
+    /* Tell the decide stage there is nothing more to come */
+    EnterCriticalSection(&dirLock);
+    dirEnd = TRUE;
+    LeaveCriticalSection(&dirLock);
+    ReleaseSemaphore(dirReady, 1, NULL);
+    return 0;
+}
+
+/* Returns the next directory in depth first order, NULL after the last */
+static XCOPY_DIR *XCOPY_NextDir(void)
+{
+    XCOPY_DIR *dir;
+    BOOL      end;
+
+    for (;;) {
+        WaitForSingleObject(dirReady, INFINITE);
+
+        EnterCriticalSection(&dirLock);
+        dir = dirHead;
+        if (dir) {
+            dirHead = dir->next;
+            if (!dirHead) dirTail = NULL;
+        }
+        end = dirEnd;
+        LeaveCriticalSection(&dirLock);
+
+        if (dir) {
+            if (!dirInline) ReleaseSemaphore(dirRoom, 1, NULL);
+            return dir;
+        }
+        if (end) return NULL;
+    }
+}
+
+static void XCOPY_FreeDir(XCOPY_DIR *dir)
+{
+    XCOPY_FreeList(&dir->files);
+    XCOPY_FreeList(&dir->dest);
+    HeapFree(GetProcessHeap(), 0, dir);
+}
+
+/* Prints the status message for a file */
+static void XCOPY_PrintCopy(const WCHAR *from, const WCHAR *to, DWORD flags)
+{
+    if (flags & OPT_QUIET) {
+        /* Skip message */
+    } else if (flags & OPT_FULL) {
+        const WCHAR infostr[]   = {'%', 's', ' ', '-', '>', ' ',
+                                   '%', 's', '\n', 0};
+
+        XCOPY_wprintf(infostr, from, to);
+    } else {
+        const WCHAR infostr[] = {'%', 's', '\n', 0};
+        XCOPY_wprintf(infostr, from);
+    }
+}
+
+/* Copies the file of a job, on a copy thread or inline */
+static void XCOPY_CopyFile(XCOPY_JOB *job)
+{
+    /* If allowing overwriting of read only files, remove any
+       write protection                                       */
+    if (job->destAttribs != INVALID_FILE_ATTRIBUTES &&
+        (job->destAttribs & FILE_ATTRIBUTE_READONLY) &&
+        (job->flags & OPT_REPLACEREAD)) {
+        SetFileAttributesW(job->copyTo, job->destAttribs & ~FILE_ATTRIBUTE_READONLY);
+    }
+
+    if (CopyFileW(job->copyFrom, job->copyTo, FALSE) == 0) {
+        job->error = GetLastError();
+        return;
+    }
+    job->error = 0;
+
+    /* If /M supplied, remove the archive bit after successful copy */
+    if ((job->srcAttribs & FILE_ATTRIBUTE_ARCHIVE) &&
+        (job->flags & OPT_REMOVEARCH)) {
+        SetFileAttributesW(job->copyFrom, (job->srcAttribs & ~FILE_ATTRIBUTE_ARCHIVE));
+    }
+}
+
+/* Reports the result of a job and frees it. A failure without /C stops
+   the copy: jobs that have not started yet are cancelled              */
+static void XCOPY_RetireJob(XCOPY_JOB *job)
+{
+    if (!job->cancelled) {
+        XCOPY_PrintCopy(job->copyFrom, job->copyTo, job->flags);
+
+        if (job->error) {
+            XCOPY_wprintf(XCOPY_LoadMessage(STRING_COPYFAIL),
+                   job->copyFrom, job->copyTo, job->error);
+            XCOPY_FailMessage(job->error);
+
+            if (!(job->flags & OPT_IGNOREERRORS))
+                copyAbort = TRUE;
+        } else {
+            filesCopied++;
 
-            if (!skipFile &&
-                destAttribs != INVALID_FILE_ATTRIBUTES && !(flags & OPT_NOPROMPT)) {
-                DWORD count;
-                char  answer[10];
-                BOOL  answered = FALSE;
-                WCHAR yesChar[2];
-                WCHAR allChar[2];
-                WCHAR noChar[2];
-
-                /* Read the A,Y and N characters from the resource file */
-                wcscpy(yesChar, XCOPY_LoadMessage(STRING_YES_CHAR));
-                wcscpy(allChar, XCOPY_LoadMessage(STRING_ALL_CHAR));
-                wcscpy(noChar, XCOPY_LoadMessage(STRING_NO_CHAR));
-
-                while (!answered) {
-                    XCOPY_wprintf(XCOPY_LoadMessage(STRING_OVERWRITE), copyTo);
-                    ReadFile (GetStdHandle(STD_INPUT_HANDLE), answer, sizeof(answer),
-                              &count, NULL);
-
-                    answered = TRUE;
-                    if (toupper(answer[0]) == allChar[0])
-                        flags |= OPT_NOPROMPT;
-                    else if (toupper(answer[0]) == noChar[0])
-                        skipFile = TRUE;
-                    else if (toupper(answer[0]) != yesChar[0])
-                        answered = FALSE;
-                }
+            /* The destination is now a copy of the source */
+            if (job->flags & OPT_SAVEINDEX)
+                XCOPY_AddRecord(&newIndex, job->copyTo + destRootLen, wchr_empty, 0,
+                                job->writeTime, job->size);
+        }
+    }
+    HeapFree(GetProcessHeap(), 0, job);
+}
+
+static DWORD WINAPI XCOPY_CopyThread(LPVOID param)
+{
+    XCOPY_JOB *job;
+
+    for (;;) {
+        WaitForSingleObject(jobWork, INFINITE);
+
+        EnterCriticalSection(&jobLock);
+        if (jobStop) {
+            LeaveCriticalSection(&jobLock);
+            break;
+        }
+        job = jobQueueHead;
+        jobQueueHead = job->nextQueued;
+        if (!jobQueueHead) jobQueueTail = NULL;
+        LeaveCriticalSection(&jobLock);
+
+        if (copyAbort) job->cancelled = TRUE;
+        else XCOPY_CopyFile(job);
+
+        EnterCriticalSection(&jobLock);
+        job->done = TRUE;
+        SetEvent(jobDone);
+        LeaveCriticalSection(&jobLock);
+    }
+    return 0;
+}
+
+/* Retires finished jobs in submission order. With wait it waits for the
+   oldest job, and for every job with all                               */
+static void XCOPY_RetireJobs(BOOL wait, BOOL all)
+{
+    XCOPY_JOB *job;
+
+    for (;;) {
+        EnterCriticalSection(&jobLock);
+        job = jobRetireHead;
+        if (!job) {
+            LeaveCriticalSection(&jobLock);
+            break;
+        }
+        if (!job->done) {
+            if (!wait) {
+                LeaveCriticalSection(&jobLock);
+                break;
             }
+            ResetEvent(jobDone);
+            LeaveCriticalSection(&jobLock);
+            WaitForSingleObject(jobDone, INFINITE);
+            continue;
+        }
+
+        jobRetireHead = job->next;
+        if (!jobRetireHead) jobRetireTail = NULL;
+        jobPending--;
+        LeaveCriticalSection(&jobLock);
+
+        XCOPY_RetireJob(job);
+        if (!all) wait = FALSE;
+    }
+}
+
+/* Waits for all copies so far, done before prompting or stopping */
+static void XCOPY_DrainJobs(void)
+{
+    if (jobThreads) XCOPY_RetireJobs(TRUE, TRUE);
+}
+
+static void XCOPY_SubmitJob(XCOPY_JOB *job)
+{
+    /* Without copy threads the file is copied right away */
+    if (jobThreads == 0) {
+        XCOPY_CopyFile(job);
+        XCOPY_RetireJob(job);
+        return;
+    }
+
+    XCOPY_RetireJobs(jobPending >= jobThreads * XCOPY_JOBS_PER_THREAD, FALSE);
+
+    job->next = NULL;
+    job->nextQueued = NULL;
+    job->done = FALSE;
+
+    EnterCriticalSection(&jobLock);
+    if (jobRetireTail) jobRetireTail->next = job;
+    else jobRetireHead = job;
+    jobRetireTail = job;
+    jobPending++;
+
+    if (jobQueueTail) jobQueueTail->nextQueued = job;
+    else jobQueueHead = job;
+    jobQueueTail = job;
+    LeaveCriticalSection(&jobLock);
+
+    ReleaseSemaphore(jobWork, 1, NULL);
+}
+
+static void XCOPY_StartJobs(DWORD threads)
+{
+    InitializeCriticalSection(&jobLock);
+    jobWork = CreateSemaphoreW(NULL, 0, MAXLONG, NULL);
+    jobDone = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (!jobWork || !jobDone || threads < 2) return;
+
+    while (jobThreads < threads) {
+        jobThread[jobThreads] = CreateThread(NULL, 0, XCOPY_CopyThread, NULL, 0, NULL);
+        if (!jobThread[jobThreads]) break;
+        jobThreads++;
+    }
+    WINE_TRACE("Copying with %d threads\n", jobThreads);
+}
+
+static void XCOPY_StopJobs(void)
+{
+    DWORD i;
+
+    XCOPY_DrainJobs();
+
+    if (jobThreads) {
+        EnterCriticalSection(&jobLock);
+        jobStop = TRUE;
+        LeaveCriticalSection(&jobLock);
+        ReleaseSemaphore(jobWork, jobThreads, NULL);
+
+        WaitForMultipleObjects(jobThreads, jobThread, TRUE, INFINITE);
+        for (i = 0; i < jobThreads; i++)
+            CloseHandle(jobThread[i]);
+        jobThreads = 0;
+    }
+
+    if (jobWork) CloseHandle(jobWork);
+    if (jobDone) CloseHandle(jobDone);
+    DeleteCriticalSection(&jobLock);
+}
+
+/* =========================================================================
+   XCOPY_CopyEntry - Decides whether to copy one source file, and if so
+     hands it to the copy threads
+   ========================================================================= */
+static int XCOPY_CopyEntry(XCOPY_DIR *dir, XCOPY_ENTRY *entry, WCHAR *destspec,
+                           DWORD *pflags, BOOL *dirCreated)
+{
+    DWORD           flags = *pflags;
+    const WCHAR     *name = dir->files.names + entry->name;
+    const WCHAR     *altName = dir->files.names + entry->altName;
+    DWORD           destAttribs, srcAttribs;
+    FILETIME        destTime;
+    ULARGE_INTEGER  destSize;
+    BOOL            skipFile = FALSE;
+    BOOL            upToDate = FALSE;
+    XCOPY_JOB       *job;
+
+    /* Get the filename information */
+    lstrcpyW(copyFrom, dir->srcstem);
+    if (flags & OPT_SHORTNAME) {
+      lstrcatW(copyFrom, altName);
+    } else {
+      lstrcatW(copyFrom, name);
+    }
+
+    lstrcpyW(copyTo, dir->deststem);
+    if (*destspec == 0x00) {
+        if (flags & OPT_SHORTNAME) {
+            lstrcatW(copyTo, altName);
+        } else {
+            lstrcatW(copyTo, name);
+        }
+    } else {
+        lstrcatW(copyTo, destspec);
+    }
+
+    /* Do the copy */
+    WINE_TRACE("ACTION: Copy '%s' -> '%s'\n", wine_dbgstr_w(copyFrom),
+                                              wine_dbgstr_w(copyTo));
+    if (!*dirCreated && !(flags & OPT_SIMULATE)) {
+        XCOPY_CreateDirectory(dir->deststem);
+        *dirCreated = TRUE;
+    }
+
+    /* See if allowed to copy it */
+    srcAttribs = entry->attribs;
+    WINE_TRACE("Source attribs: %d\n", srcAttribs);
+
+    if ((srcAttribs & FILE_ATTRIBUTE_HIDDEN) ||
+        (srcAttribs & FILE_ATTRIBUTE_SYSTEM)) {
+
+        if (!(flags & OPT_COPYHIDSYS)) {
+            skipFile = TRUE;
+        }
+    }
+
+    if (!(srcAttribs & FILE_ATTRIBUTE_ARCHIVE) &&
+        (flags & OPT_ARCHIVEONLY)) {
+        skipFile = TRUE;
+    }
+
+    /* See if file exists, from the listing of the destination directory
+       when the name is the source name                                  */
+    destAttribs = INVALID_FILE_ATTRIBUTES;
+    destTime.dwLowDateTime = destTime.dwHighDateTime = 0;
+    destSize.QuadPart = 0;
+    if (*destspec == 0x00) {
+        XCOPY_ENTRY *destEntry = XCOPY_FindEntry(&dir->dest, copyTo + lstrlenW(dir->deststem));
+        if (destEntry) {
+            destAttribs = destEntry->attribs;
+            destTime = destEntry->writeTime;
+            destSize = destEntry->size;
+        }
+    } else {
+        WIN32_FILE_ATTRIBUTE_DATA info;
+        if (GetFileAttributesExW(copyTo, GetFileExInfoStandard, &info)) {
+            destAttribs = info.dwFileAttributes;
+            destTime = info.ftLastWriteTime;
+            destSize.u.LowPart = info.nFileSizeLow;
+            destSize.u.HighPart = info.nFileSizeHigh;
+        }
+    }
+    WINE_TRACE("Dest attribs: %d\n", destAttribs);
+
+    /* With /INCR a destination of the same size and time is up to date.
+       The destination of a directory the saved index covers was not
+       listed, the index stands in for it                               */
+    if (flags & OPT_INCREMENTAL) {
+        if (dir->indexed) {
+            XCOPY_ENTRY *indexed = XCOPY_FindIndexed(dir->deststem + destRootLen,
+                                                     copyTo + lstrlenW(dir->deststem));
+            upToDate = indexed && XCOPY_SameFile(entry, indexed->size, indexed->writeTime);
+        } else if (destAttribs != INVALID_FILE_ATTRIBUTES &&
+                   !(destAttribs & FILE_ATTRIBUTE_DIRECTORY)) {
+            upToDate = XCOPY_SameFile(entry, destSize, destTime);
+        }
+
+        if (upToDate && (flags & OPT_SAVEINDEX))
+            XCOPY_AddRecord(&newIndex, copyTo + destRootLen, wchr_empty, 0,
+                            entry->writeTime, entry->size);
+    }
+
+    if (!skipFile && upToDate) {
+        WINE_TRACE("Skipping file as dest is up to date\n");
+        skipFile = TRUE;
+    }
+
+    /* Check date ranges if a destination file already exists */
+    if (!skipFile && (flags & OPT_DATERANGE) &&
+        (CompareFileTime(&entry->writeTime, &dateRange) < 0)) {
+        WINE_TRACE("Skipping file as modified date too old\n");
+        skipFile = TRUE;
+    }
+
+    /* If just /D supplied, only overwrite if src newer than dest */
+    if (!skipFile && (flags & OPT_DATENEWER) &&
+       (destAttribs != INVALID_FILE_ATTRIBUTES)) {
+        if (CompareFileTime(&entry->writeTime, &destTime) <= 0) {
+            WINE_TRACE("Skipping file as dest newer or same date\n");
+            skipFile = TRUE;
+        }
+    }
+
+    /* Prompt each file if necessary */
+    if (!skipFile && (flags & OPT_SRCPROMPT)) {
+        DWORD count;
+        char  answer[10];
+        BOOL  answered = FALSE;
+        WCHAR yesChar[2];
+        WCHAR noChar[2];
+
+        /* Let the copies so far report first */
+        XCOPY_DrainJobs();
 
-            /* See if it has to exist! */
-            if (destAttribs == INVALID_FILE_ATTRIBUTES && (flags & OPT_MUSTEXIST)) {
+        /* Read the Y and N characters from the resource file */
+        wcscpy(yesChar, XCOPY_LoadMessage(STRING_YES_CHAR));
+        wcscpy(noChar, XCOPY_LoadMessage(STRING_NO_CHAR));
+
+        while (!answered) {
+            XCOPY_wprintf(XCOPY_LoadMessage(STRING_SRCPROMPT), copyFrom);
+            ReadFile (GetStdHandle(STD_INPUT_HANDLE), answer, sizeof(answer),
+                      &count, NULL);
+
+            answered = TRUE;
+            if (toupper(answer[0]) == noChar[0])
                 skipFile = TRUE;
-            }
+            else if (toupper(answer[0]) != yesChar[0])
+                answered = FALSE;
+        }
+    }
 
-            /* Output a status message */
-            if (!skipFile) {
-                if (flags & OPT_QUIET) {
-                    /* Skip message */
-                } else if (flags & OPT_FULL) {
-                    const WCHAR infostr[]   = {'%', 's', ' ', '-', '>', ' ',
-                                               '%', 's', '\n', 0};
-
-                    XCOPY_wprintf(infostr, copyFrom, copyTo);
-                } else {
-                    const WCHAR infostr[] = {'%', 's', '\n', 0};
-                    XCOPY_wprintf(infostr, copyFrom);
-                }
-
-                /* If allowing overwriting of read only files, remove any
-                   write protection                                       */
-                if ((destAttribs & FILE_ATTRIBUTE_READONLY) &&
-                    (flags & OPT_REPLACEREAD)) {
-                    SetFileAttributesW(copyTo, destAttribs & ~FILE_ATTRIBUTE_READONLY);
-                }
-
-                copiedFile = TRUE;
-                if (flags & OPT_SIMULATE || flags & OPT_NOCOPY) {
-                    /* Skip copy */
-                } else if (CopyFileW(copyFrom, copyTo, FALSE) == 0) {
-
-                    DWORD error = GetLastError();
-                    XCOPY_wprintf(XCOPY_LoadMessage(STRING_COPYFAIL),
-                           copyFrom, copyTo, error);
-                    XCOPY_FailMessage(error);
-
-                    if (flags & OPT_IGNOREERRORS) {
-                        skipFile = TRUE;
-                    } else {
-                        ret = RC_WRITEERROR;
-                        goto cleanup;
-                    }
-                }
-
-                /* If /M supplied, remove the archive bit after successful copy */
-                if (!skipFile) {
-                    if ((srcAttribs & FILE_ATTRIBUTE_ARCHIVE) &&
-                        (flags & OPT_REMOVEARCH)) {
-                        SetFileAttributesW(copyFrom, (srcAttribs & ~FILE_ATTRIBUTE_ARCHIVE));
-                    }
-                    filesCopied++;
-                }
-            }
+    if (!skipFile &&
+        destAttribs != INVALID_FILE_ATTRIBUTES && !(flags & OPT_NOPROMPT)) {
+        DWORD count;
+        char  answer[10];
+        BOOL  answered = FALSE;
+        WCHAR yesChar[2];
+        WCHAR allChar[2];
+        WCHAR noChar[2];
+
+        XCOPY_DrainJobs();
+
+        /* Read the A,Y and N characters from the resource file */
+        wcscpy(yesChar, XCOPY_LoadMessage(STRING_YES_CHAR));
+        wcscpy(allChar, XCOPY_LoadMessage(STRING_ALL_CHAR));
+        wcscpy(noChar, XCOPY_LoadMessage(STRING_NO_CHAR));
+
+        while (!answered) {
+            XCOPY_wprintf(XCOPY_LoadMessage(STRING_OVERWRITE), copyTo);
+            ReadFile (GetStdHandle(STD_INPUT_HANDLE), answer, sizeof(answer),
+                      &count, NULL);
+
+            answered = TRUE;
+            if (toupper(answer[0]) == allChar[0])
+                *pflags |= OPT_NOPROMPT;
+            else if (toupper(answer[0]) == noChar[0])
+                skipFile = TRUE;
+            else if (toupper(answer[0]) != yesChar[0])
+                answered = FALSE;
         }
+    }
 
-        /* Find next file */
-        findres = FindNextFileW(h, finddata);
+    /* See if it has to exist! */
+    if (destAttribs == INVALID_FILE_ATTRIBUTES && (flags & OPT_MUSTEXIST)) {
+        skipFile = TRUE;
     }
-    FindClose(h);
 
-    /* Search 2 - do subdirs */
-    if (flags & OPT_RECURSIVE) {
-        lstrcpyW(inputpath, srcstem);
-        lstrcatW(inputpath, wchr_star);
-        findres = TRUE;
-        WINE_TRACE("Processing subdirs with spec: %s\n", wine_dbgstr_w(inputpath));
+    if (skipFile) return RC_OK;
 
-        h = FindFirstFileW(inputpath, finddata);
-        while (h != INVALID_HANDLE_VALUE && findres) {
+    if (flags & OPT_SIMULATE || flags & OPT_NOCOPY) {
+        /* Skip copy */
+        XCOPY_PrintCopy(copyFrom, copyTo, flags);
+        filesCopied++;
+        return RC_OK;
+    }
 
-            /* Only looking for dirs */
-            if ((finddata->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
-                (lstrcmpW(finddata->cFileName, wchr_dot) != 0) &&
-                (lstrcmpW(finddata->cFileName, wchr_dotdot) != 0)) {
+    job = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(XCOPY_JOB));
+    if (!job) {
+        XCOPY_DrainJobs();
+        XCOPY_PrintCopy(copyFrom, copyTo, flags);
+        XCOPY_wprintf(XCOPY_LoadMessage(STRING_COPYFAIL),
+               copyFrom, copyTo, ERROR_NOT_ENOUGH_MEMORY);
+        XCOPY_FailMessage(ERROR_NOT_ENOUGH_MEMORY);
+        return (flags & OPT_IGNOREERRORS) ? RC_OK : RC_WRITEERROR;
+    }
 
-                WINE_TRACE("Handling subdir: %s\n", wine_dbgstr_w(finddata->cFileName));
+    job->srcAttribs = srcAttribs;
+    job->destAttribs = destAttribs;
+    job->flags = flags;
+    job->size = entry->size;
+    job->writeTime = entry->writeTime;
+    lstrcpyW(job->copyFrom, copyFrom);
+    lstrcpyW(job->copyTo, copyTo);
+    XCOPY_SubmitJob(job);
+    return RC_OK;
+}
 
-                /* Make up recursive information */
-                lstrcpyW(inputpath, srcstem);
-                lstrcatW(inputpath, finddata->cFileName);
-                lstrcatW(inputpath, wchr_slash);
+static int XCOPY_DoCopy(WCHAR *srcstem, WCHAR *srcspec,
+                        WCHAR *deststem, WCHAR *destspec,
+                        DWORD flags)
+{
+    XCOPY_ENUM      en;
+    XCOPY_DIR       *dir;
+    HANDLE          enumThread;
+    DWORD           i;
+    int             ret = RC_OK;
+
+    /* Copies run on threads unless nothing is copied, or all files go to
+       the one destination file                                          */
+    XCOPY_StartJobs((flags & (OPT_SIMULATE | OPT_NOCOPY)) || *destspec != 0x00 ?
+                    0 : copyThreads);
+
+    destFatTimes = XCOPY_IsFatVolume(deststem);
+
+    /* The index of /INCR:INDEX describes a destination directory tree,
+       it is of no use when everything goes to one destination file    */
+    if (*destspec != 0x00) flags &= ~OPT_SAVEINDEX;
+    if (flags & OPT_SAVEINDEX) {
+        destRootLen = lstrlenW(deststem);
+        XCOPY_LoadIndex(deststem);
+    }
 
-                lstrcpyW(outputpath, deststem);
-                if (*destspec == 0x00) {
-                    lstrcatW(outputpath, finddata->cFileName);
+    InitializeCriticalSection(&dirLock);
+    dirReady = CreateSemaphoreW(NULL, 0, MAXLONG, NULL);
+    dirRoom = CreateSemaphoreW(NULL, XCOPY_DIRS_AHEAD, XCOPY_DIRS_AHEAD, NULL);
+
+    en.srcstem = srcstem;
+    en.srcspec = srcspec;
+    en.deststem = deststem;
+    en.destspec = destspec;
+    en.flags = flags;
+
+    enumThread = NULL;
+    if (dirReady && dirRoom)
+        enumThread = CreateThread(NULL, 0, XCOPY_EnumThread, &en, 0, NULL);
+    if (!enumThread) {
+        /* Enumerate the whole tree up front instead */
+        WINE_TRACE("No enumerator thread, error %d\n", GetLastError());
+        dirInline = TRUE;
+        if (!dirReady) dirReady = CreateSemaphoreW(NULL, 0, MAXLONG, NULL);
+        if (!dirReady) {
+            XCOPY_FailMessage(GetLastError());
+            ret = RC_INITERROR;
+        } else {
+            XCOPY_EnumThread(&en);
+        }
+    }
 
-                    /* If /E is supplied, create the directory now */
-                    if ((flags & OPT_EMPTYDIR) &&
-                        !(flags & OPT_SIMULATE))
-                        XCOPY_CreateDirectory(outputpath);
+    /* Every directory is taken off the queue, even after a failure, so
+       the enumerator is never left waiting                             */
+    while (dirReady && (dir = XCOPY_NextDir()) != NULL) {
+        BOOL dirCreated = FALSE;
 
-                    lstrcatW(outputpath, wchr_slash);
-                }
+        if (ret == RC_OK && !copyAbort && dir->error) {
+            XCOPY_DrainJobs();
+            XCOPY_FailMessage(dir->error);
+            ret = RC_INITERROR;
+        }
 
-                XCOPY_DoCopy(inputpath, srcspec, outputpath, destspec, flags);
-            }
+        if (ret == RC_OK && !copyAbort) {
+            /* If /E is supplied, create the directory now */
+            if (dir->depth > 0 && *destspec == 0x00 &&
+                (flags & OPT_EMPTYDIR) && !(flags & OPT_SIMULATE))
+                XCOPY_CreateDirectory(dir->deststem);
 
-            /* Find next one */
-            findres = FindNextFileW(h, finddata);
+            for (i = 0; ret == RC_OK && !copyAbort && i < dir->files.count; i++)
+                ret = XCOPY_CopyEntry(dir, &dir->files.entries[i], destspec,
+                                      &flags, &dirCreated);
         }
+
+        /* Let the enumerator finish early once the copy has failed */
+        if (ret != RC_OK || copyAbort) dirStop = TRUE;
+
+        XCOPY_FreeDir(dir);
     }
 
-cleanup:
+    if (enumThread) {
+        WaitForSingleObject(enumThread, INFINITE);
+        CloseHandle(enumThread);
+    }
+    XCOPY_StopJobs();
 
-    /* free up memory */
-    HeapFree(GetProcessHeap(), 0, finddata);
-    HeapFree(GetProcessHeap(), 0, inputpath);
-    HeapFree(GetProcessHeap(), 0, outputpath);
+    if (ret == RC_OK && enumError) {
+        XCOPY_FailMessage(enumError);
+        ret = RC_INITERROR;
+    }
+    if (ret == RC_OK && copyAbort) ret = RC_WRITEERROR;
 
+    if ((flags & OPT_SAVEINDEX) && !(flags & (OPT_SIMULATE | OPT_NOCOPY)))
+        XCOPY_SaveIndex(deststem);
+    XCOPY_FreeList(&savedIndex);
+    XCOPY_FreeList(&newIndex);
+
+    if (dirRoom) CloseHandle(dirRoom);
+    if (dirReady) CloseHandle(dirReady);
+    DeleteCriticalSection(&dirLock);
     return ret;
 }
 
@@ -942,7 +1868,6 @@ static BOOL XCOPY_ProcessExcludeList(WCHAR* parms) {
     WCHAR *filenameStart = parms;
 
     WINE_TRACE("/EXCLUDE parms: '%s'\n", wine_dbgstr_w(parms));
-    excludeList = NULL;
 
     while (*parms && *parms != ' ' && *parms != '/') {
 
@@ -962,7 +1887,7 @@ static BOOL XCOPY_ProcessExcludeList(WCHAR* parms) {
         }
     }
 
-    return FALSE;
+    return !XCOPY_CompileExcludes();
 }
 
 /* =========================================================================
@@ -991,7 +1916,6 @@ static BOOL XCOPY_ProcessExcludeFile(WCHAR* filename, WCHAR* endOfName) {
 
     /* Process line by line */
     while (fgetws(buffer, sizeof(buffer)/sizeof(WCHAR), inFile) != NULL) {
-        EXCLUDELIST *thisEntry;
         int length = lstrlenW(buffer);
 
         /* Strip CRLF */
@@ -999,14 +1923,14 @@ static BOOL XCOPY_ProcessExcludeFile(WCHAR* filename, WCHAR* endOfName) {
 
         /* If more than CRLF */
         if (length > 1) {
-          thisEntry = HeapAlloc(GetProcessHeap(), 0, sizeof(EXCLUDELIST));
-          thisEntry->next = excludeList;
-          excludeList = thisEntry;
-          thisEntry->name = HeapAlloc(GetProcessHeap(), 0,
-                                      (length * sizeof(WCHAR))+1);
-          lstrcpyW(thisEntry->name, buffer);
-          CharUpperBuffW(thisEntry->name, length);
-          WINE_TRACE("Read line : '%s'\n", wine_dbgstr_w(thisEntry->name));
+          CharUpperBuffW(buffer, length);
+          WINE_TRACE("Read line : '%s'\n", wine_dbgstr_w(buffer));
+          if (!XCOPY_AddExclude(buffer)) {
+              XCOPY_FailMessage(ERROR_NOT_ENOUGH_MEMORY);
+              fclose(inFile);
+              *endOfName = endChar;
+              return TRUE;
+          }
         }
     }
 
@@ -1023,6 +1947,189 @@ static BOOL XCOPY_ProcessExcludeFile(WCHAR* filename, WCHAR* endOfName) {
     return FALSE;
 }
 
+/* =========================================================================
+ * The exclude patterns are matched as substrings of the uppercased source
+ * path. They are put into a trie as they are read, and the trie is then
+ * made into an Aho-Corasick automaton, which finds whether any pattern
+ * occurs in one pass over the path, however many patterns there are.
+ * ========================================================================= */
+static DWORD XCOPY_EdgeSlot(DWORD node, WCHAR ch)
+{
+    return ((node * 65599) ^ ch) * 2654435761U & (excludeEdgeSize - 1);
+}
+
+/* Returns the node reached from node by ch, 0 if there is no such edge */
+static DWORD XCOPY_ExcludeGoto(DWORD node, WCHAR ch)
+{
+    DWORD slot = XCOPY_EdgeSlot(node, ch);
+
+    while (excludeEdges[slot].target != 0) {
+        if (excludeEdges[slot].node == node && excludeEdges[slot].ch == ch)
+            return excludeEdges[slot].target;
+        slot = (slot + 1) & (excludeEdgeSize - 1);
+    }
+    return 0;
+}
+
+/* Returns the child of node for ch in the trie, 0 if none */
+static DWORD XCOPY_ExcludeChild(DWORD node, WCHAR ch)
+{
+    DWORD child;
+
+    for (child = excludeNodes[node].child; child; child = excludeNodes[child].sibling) {
+        if (excludeNodes[child].ch == ch) return child;
+    }
+    return 0;
+}
+
+static DWORD XCOPY_NewExcludeNode(DWORD parent, WCHAR ch)
+{
+    DWORD node;
+
+    if (excludeCount == excludeMax) {
+        DWORD newMax = excludeMax ? excludeMax * 2 : 256;
+        EXCLUDENODE *newNodes;
+
+        if (excludeNodes)
+            newNodes = HeapReAlloc(GetProcessHeap(), 0, excludeNodes,
+                                   newMax * sizeof(EXCLUDENODE));
+        else
+            newNodes = HeapAlloc(GetProcessHeap(), 0, newMax * sizeof(EXCLUDENODE));
+        if (!newNodes) return 0;
+        excludeNodes = newNodes;
+        excludeMax = newMax;
+    }
+
+    node = excludeCount++;
+    memset(&excludeNodes[node], 0, sizeof(EXCLUDENODE));
+    excludeNodes[node].ch = ch;
+    if (node != 0) {
+        excludeNodes[node].sibling = excludeNodes[parent].child;
+        excludeNodes[parent].child = node;
+    }
+    return node;
+}
+
+/* Adds an uppercased pattern to the trie. Returns FALSE if out of memory */
+static BOOL XCOPY_AddExclude(const WCHAR *pattern)
+{
+    DWORD node = 0;
+
+    /* The root comes first */
+    if (excludeCount == 0) {
+        XCOPY_NewExcludeNode(0, 0);
+        if (excludeCount == 0) return FALSE;
+    }
+
+    for (; *pattern; pattern++) {
+        DWORD child = XCOPY_ExcludeChild(node, *pattern);
+
+        if (!child) {
+            child = XCOPY_NewExcludeNode(node, *pattern);
+            if (!child) return FALSE;
+        }
+        node = child;
+    }
+    excludeNodes[node].match = TRUE;
+    return TRUE;
+}
+
+/* Sets the failure links, breadth first, and builds the edge table.
+   Returns FALSE if out of memory                                    */
+static BOOL XCOPY_CompileExcludes(void)
+{
+    DWORD *queue;
+    DWORD head, tail, node, child, i;
+
+    if (excludeCount == 0) return TRUE;
+
+    /* A second /EXCLUDE: added to the trie, the edges are built again */
+    HeapFree(GetProcessHeap(), 0, excludeEdges);
+    excludeEdges = NULL;
+
+    excludeEdgeSize = 16;
+    while (excludeEdgeSize < excludeCount * 2)
+        excludeEdgeSize *= 2;
+    excludeEdges = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
+                             excludeEdgeSize * sizeof(EXCLUDEEDGE));
+    queue = HeapAlloc(GetProcessHeap(), 0, excludeCount * sizeof(DWORD));
+    if (!excludeEdges || !queue) {
+        HeapFree(GetProcessHeap(), 0, queue);
+        XCOPY_FailMessage(ERROR_NOT_ENOUGH_MEMORY);
+        return FALSE;
+    }
+
+    head = tail = 0;
+    for (child = excludeNodes[0].child; child; child = excludeNodes[child].sibling) {
+        excludeNodes[child].fail = 0;
+        queue[tail++] = child;
+    }
+
+    while (head < tail) {
+        node = queue[head++];
+        for (child = excludeNodes[node].child; child; child = excludeNodes[child].sibling) {
+            DWORD fail = excludeNodes[node].fail;
+            DWORD next;
+
+            while ((next = XCOPY_ExcludeChild(fail, excludeNodes[child].ch)) == 0 && fail != 0)
+                fail = excludeNodes[fail].fail;
+            excludeNodes[child].fail = next;
+            if (excludeNodes[next].match) excludeNodes[child].match = TRUE;
+            queue[tail++] = child;
+        }
+    }
+    HeapFree(GetProcessHeap(), 0, queue);
+
+    /* Every node but the root has one edge leading to it */
+    for (node = 0; node < excludeCount; node++) {
+        for (child = excludeNodes[node].child; child; child = excludeNodes[child].sibling) {
+            i = XCOPY_EdgeSlot(node, excludeNodes[child].ch);
+            while (excludeEdges[i].target != 0)
+                i = (i + 1) & (excludeEdgeSize - 1);
+            excludeEdges[i].node = node;
+            excludeEdges[i].ch = excludeNodes[child].ch;
+            excludeEdges[i].target = child;
+        }
+    }
+
+    WINE_TRACE("Exclude automaton has %d nodes\n", excludeCount);
+    return TRUE;
+}
+
+/* Returns whether any exclude pattern occurs in the path. Filenames are
+   case insensitive, so the path is uppercased like the patterns were  */
+static BOOL XCOPY_IsExcluded(const WCHAR *path)
+{
+    WCHAR upper[MAX_PATH];
+    DWORD state = 0;
+    int   len, i;
+
+    if (!excludeEdges) return FALSE;
+
+    len = min(lstrlenW(path), MAX_PATH - 1);
+    memcpy(upper, path, len * sizeof(WCHAR));
+    CharUpperBuffW(upper, len);
+
+    for (i = 0; i < len; i++) {
+        DWORD next;
+
+        while ((next = XCOPY_ExcludeGoto(state, upper[i])) == 0 && state != 0)
+            state = excludeNodes[state].fail;
+        state = next;
+        if (excludeNodes[state].match) return TRUE;
+    }
+    return FALSE;
+}
+
+static void XCOPY_FreeExcludes(void)
+{
+    HeapFree(GetProcessHeap(), 0, excludeNodes);
+    HeapFree(GetProcessHeap(), 0, excludeEdges);
+    excludeNodes = NULL;
+    excludeEdges = NULL;
+    excludeCount = excludeMax = excludeEdgeSize = 0;
+}
+
 /* =========================================================================
  * Load a string from the resource file, handling any error
  * Returns string retrieved from resource file
@@ -48,9 +48,22 @@
 #define OPT_EXCLUDELIST  0x00020000
 #define OPT_DATERANGE    0x00040000
 #define OPT_DATENEWER    0x00080000
+#define OPT_INCREMENTAL  0x00100000
+#define OPT_SAVEINDEX    0x00200000
 
 #define MAXSTRING 8192
 
+/* Copy pipeline */
+#define XCOPY_THREADS         4     /* Copy threads of /MT without a number       */
+#define XCOPY_MAX_THREADS     16
+#define XCOPY_JOBS_PER_THREAD 4     /* Copies queued ahead of each copy thread    */
+#define XCOPY_DIRS_AHEAD      64    /* Directories the enumerator may run ahead   */
+
+/* Destination index of /INCR:INDEX */
+#define XCOPY_INDEX_MAGIC     0x58444958  /* "XIDX" */
+#define XCOPY_INDEX_VERSION   1
+#define XCOPY_INDEX_BUFFER    0x10000
+
 /* Translation ids */
 #define STRING_INVPARMS         101
 #define STRING_INVPARM          102